@@ -99,6 +99,21 @@
 #define SD_OW1   (&SD1)
 #define SD_OW2   (&SD2)
 
+/*
+ * Temperature probe and relay channels. The application sizes its sensor,
+ * controller and output tables from these, so expansion boards only need to
+ * extend the lists.
+ */
+#define BOARD_NUM_SENSOR_CHANNELS 2
+#define BOARD_SENSOR_CHANNELS { \
+    SD_OW1, \
+    SD_OW2 }
+
+#define BOARD_NUM_RELAY_CHANNELS 2
+#define BOARD_RELAY_CHANNELS { \
+    { PORT_RELAY1, PAD_RELAY1, PORT_RELAY1_TEST, PAD_RELAY1_TEST }, \
+    { PORT_RELAY2, PAD_RELAY2, PORT_RELAY2_TEST, PAD_RELAY2_TEST } }
+
 /*
  * SPI bus assignments.
  */
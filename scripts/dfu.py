@@ -9,6 +9,13 @@ from optparse import OptionParser
 
 DEFAULT_DEVICE="0x0483:0xdf11"
 
+# Elements of targets with this name are compressed with the heatshrink LZSS
+# bitstream, and start with their uncompressed size. The bootloader
+# decompresses them while flashing (see src/common/dfuse.c).
+HS_TARGET_NAME="heatshrink w10 l4"
+HS_WINDOW_BITS=10
+HS_LOOKAHEAD_BITS=4
+
 def named(tuple,names):
   return dict(zip(names.split(),tuple))
 def consume(fmt,data,names):
@@ -19,6 +26,82 @@ def cstring(string):
 def compute_crc(data):
   return 0xFFFFFFFF & -zlib.crc32(data) -1
 
+class BitWriter:
+  def __init__(self):
+    self.data = bytearray()
+    self.acc = 0
+    self.bits = 0
+  def put(self,value,bits):
+    for i in range(bits-1,-1,-1):
+      self.acc = (self.acc << 1) | ((value >> i) & 1)
+      self.bits += 1
+      if self.bits == 8:
+        self.data.append(self.acc)
+        self.acc = 0
+        self.bits = 0
+  def finish(self):
+    if self.bits:
+      self.data.append(self.acc << (8 - self.bits))
+    return bytes(self.data)
+
+def compress(data):
+  data = bytearray(data)
+  window = 1 << HS_WINDOW_BITS
+  max_len = 1 << HS_LOOKAHEAD_BITS
+  out = BitWriter()
+  chains = {}
+  pos = 0
+  while pos < len(data):
+    best_len, best_dist = 0, 0
+    key = bytes(data[pos:pos+2])
+    for cand in reversed(chains.get(key, [])[-64:]):
+      dist = pos - cand
+      if dist > window:
+        break
+      n = 0
+      while n < max_len and pos+n < len(data) and data[cand+n] == data[pos+n]:
+        n += 1
+      if n > best_len:
+        best_len, best_dist = n, dist
+        if n == max_len:
+          break
+    # A back reference costs more than a single literal
+    if best_len >= 2:
+      out.put(0, 1)
+      out.put(best_dist-1, HS_WINDOW_BITS)
+      out.put(best_len-1, HS_LOOKAHEAD_BITS)
+      step = best_len
+    else:
+      out.put(1, 1)
+      out.put(data[pos], 8)
+      step = 1
+    for p in range(pos, pos+step):
+      chains.setdefault(bytes(data[p:p+2]), []).append(p)
+    pos += step
+  return struct.pack('<I',len(data)) + out.finish()
+
+def decompress(data):
+  size = struct.unpack('<I',data[:4])[0]
+  bits = []
+  for b in bytearray(data[4:]):
+    bits.extend((b >> i) & 1 for i in range(7,-1,-1))
+  bits.reverse()
+  def take(n):
+    v = 0
+    for i in range(n):
+      v = (v << 1) | bits.pop()
+    return v
+  out = bytearray()
+  while len(out) < size:
+    if take(1):
+      out.append(take(8))
+    else:
+      dist = take(HS_WINDOW_BITS)+1
+      count = take(HS_LOOKAHEAD_BITS)+1
+      for i in range(count):
+        out.append(out[-dist])
+  return bytes(out)
+
 def parse(file,dump_images=False):
   print 'File: "%s"' % file
   data = open(file,'rb').read()
@@ -35,12 +118,16 @@ def parse(file,dump_images=False):
     print '%(signature)s %(num)d, alt setting: %(altsetting)s, name: "%(name)s", size: %(size)d, elements: %(elements)d' % tprefix
     tsize = tprefix['size']
     target, data = data[:tsize], data[tsize:]
+    compressed = (tprefix['name'] == HS_TARGET_NAME)
     for e in range(tprefix['elements']):
       eprefix, target = consume('<2I',target,'address size')
       eprefix['num'] = e
       print '  %(num)d, address: 0x%(address)08x, size: %(size)d' % eprefix
       esize = eprefix['size']
       image, target = target[:esize], target[esize:]
+      if compressed:
+        image = decompress(image)
+        print '    compressed, uncompressed size: %d' % len(image)
       if dump_images:
         out = '%s.target%d.image%d.bin' % (file,t,e)
         open(out,'wb').write(image)
@@ -55,13 +142,20 @@ def parse(file,dump_images=False):
   if data:
     print "PARSE ERROR"
 
-def build(file,targets,device=DEFAULT_DEVICE):
+def build(file,targets,device=DEFAULT_DEVICE,compressed=False):
   data = ''
   for t,target in enumerate(targets):
     tdata = ''
     for image in target:
-      tdata += struct.pack('<2I',image['address'],len(image['data']))+image['data']
-    tdata = struct.pack('<6sBI255s2I','Target',0,1,'ST...',len(tdata),len(target)) + tdata
+      idata = image['data']
+      if compressed:
+        idata = compress(idata)
+        if decompress(idata) != image['data']:
+          print "Compression check failed for image at 0x%08x" % image['address']
+          sys.exit(1)
+      tdata += struct.pack('<2I',image['address'],len(idata))+idata
+    name = HS_TARGET_NAME if compressed else 'ST...'
+    tdata = struct.pack('<6sBI255s2I','Target',0,1,name,len(tdata),len(target)) + tdata
     data += tdata
   data  = struct.pack('<5sBIB','DfuSe',1,len(data)+11,len(targets)) + data
   v,d=map(lambda x: int(x,0) & 0xFFFF, device.split(':',1))
@@ -73,7 +167,7 @@ def build(file,targets,device=DEFAULT_DEVICE):
 if __name__=="__main__":
   usage = """
 %prog [-d|--dump] infile.dfu
-%prog {-b|--build} address:file.bin [-b address:file.bin ...] [{-D|--device}=vendor:device] outfile.dfu"""
+%prog {-b|--build} address:file.bin [-b address:file.bin ...] [{-D|--device}=vendor:device] [-z] outfile.dfu"""
   parser = OptionParser(usage=usage)
   parser.add_option("-b", "--build", action="append", dest="binfiles",
     help="build a DFU file from given BINFILES", metavar="BINFILES")
@@ -81,6 +175,8 @@ if __name__=="__main__":
     help="build for DEVICE, defaults to %s" % DEFAULT_DEVICE, metavar="DEVICE")
   parser.add_option("-d", "--dump", action="store_true", dest="dump_images",
     default=False, help="dump contained images to current directory")
+  parser.add_option("-z", "--compress", action="store_true", dest="compress",
+    default=False, help="compress images for the bootloader, not loadable by ST DFU tools")
   (options, args) = parser.parse_args()
 
   if options.binfiles and len(args)==1:
@@ -109,7 +205,7 @@ if __name__=="__main__":
     except:
       print "Invalid device '%s'." % device
       sys.exit(1)
-    build(outfile,[target],device)
+    build(outfile,[target],device,options.compress)
   elif len(args)==1:
     infile = args[0]
     if not os.path.isfile(infile):
@@ -0,0 +1,377 @@
+
+#include "ch.h"
+#include "api_msg.h"
+#include "temp_profile.h"
+#include "temp_profile_lib.h"
+#include "common.h"
+#include "wifi/socket.h"
+
+#include <pb_encode.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static void
+populate_output_status(ControllerReport* pr, sensor_id_t controller, output_id_t output);
+
+static void
+store_temp_profile(const TempProfile* tpm);
+
+static bool
+tx_write(pb_ostream_t* stream, const uint8_t* buf, size_t count);
+
+static bool
+tx_flush(msg_writer_t* w);
+
+
+void
+api_msg_fill_controller_report(ControllerReport* pr, temp_controller_id_t controller, float sensor_reading)
+{
+  int i;
+
+  pr->controller_index = controller;
+  pr->sensor_reading = sensor_reading;
+  pr->setpoint = temp_control_get_current_setpoint(controller);
+
+  for (i = 0; i < NUM_OUTPUTS; ++i)
+    populate_output_status(pr, (sensor_id_t)controller, i);
+}
+
+void
+api_msg_fill_controller_settings(ControllerSettings* ss, temp_controller_id_t controller)
+{
+  int i;
+  const controller_settings_t* ssl = app_cfg_get_controller_settings(controller);
+
+  memset(ss, 0, sizeof(ControllerSettings));
+
+  ss->has_session_action = true;
+  ss->session_action = ssl->session_action;
+
+  ss->sensor_index = controller;
+  switch (ssl->setpoint_type) {
+    case SP_STATIC:
+      ss->setpoint_type = ControllerSettings_SetpointType_STATIC;
+      ss->has_static_setpoint = true;
+      ss->static_setpoint = ssl->static_setpoint.value;
+      break;
+
+    case SP_TEMP_PROFILE:
+      ss->setpoint_type = ControllerSettings_SetpointType_TEMP_PROFILE;
+      ss->has_temp_profile_id = true;
+      ss->temp_profile_id = ssl->temp_profile_id;
+      ss->has_temp_profile_completion_action = true;
+      ss->temp_profile_completion_action = ControllerSettings_CompletionAction_HOLD_LAST;
+      ss->has_temp_profile_start_point = true;
+      ss->temp_profile_start_point = 0;
+      break;
+
+    default:
+      printf("Invalid setpoint type: %d\r\n", ssl->setpoint_type);
+      break;
+  }
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    const output_settings_t* osl = &ssl->output_settings[i];
+    if (osl->enabled) {
+      OutputSettings* os = &ss->output_settings[ss->output_settings_count];
+      ss->output_settings_count++;
+
+      os->index = i;
+      os->function = osl->function;
+      os->cycle_delay = osl->cycle_delay.value;
+    }
+  }
+}
+
+bool
+api_msg_parse_controller_settings(const ControllerSettings* settings, controller_settings_t* csl)
+{
+  int i;
+  temp_profile_lib_entry_t lib_entry;
+
+  if (settings->sensor_index >= NUM_CONTROLLERS) {
+    printf("Invalid controller index: %d\r\n", (int)settings->sensor_index);
+    return false;
+  }
+
+  memcpy(csl, app_cfg_get_controller_settings(settings->sensor_index), sizeof(controller_settings_t));
+
+  csl->controller = settings->sensor_index;
+
+  printf("  got %d temp profiles\r\n", settings->temp_profiles_count);
+  printf("  got %d output settings\r\n", settings->output_settings_count);
+  for (i = 0; i < NUM_OUTPUTS; ++i)
+    csl->output_settings[i].enabled = false;
+
+  for (i = 0; i < (int)settings->output_settings_count; ++i) {
+    const OutputSettings* osm = &settings->output_settings[i];
+    if (osm->index >= NUM_OUTPUTS)
+      continue;
+
+    output_settings_t* os = &csl->output_settings[osm->index];
+
+    os->cycle_delay.value = osm->cycle_delay;
+    os->cycle_delay.unit = UNIT_TIME_MIN;
+    os->function = osm->function;
+    os->enabled = true;
+
+    printf("    output %d\r\n", i);
+    printf("      delay %f\r\n", os->cycle_delay.value);
+    printf("      function %d\r\n", os->function);
+  }
+
+  printf("  got sensor settings\r\n");
+
+  switch (settings->setpoint_type) {
+    case ControllerSettings_SetpointType_STATIC:
+      if (!settings->has_static_setpoint)
+        printf("Sensor settings specified static setpoint, but none provided!\r\n");
+      else {
+        csl->setpoint_type = SP_STATIC;
+        csl->static_setpoint.value = settings->static_setpoint;
+        csl->static_setpoint.unit = UNIT_TEMP_DEG_F;
+      }
+      break;
+
+    case ControllerSettings_SetpointType_TEMP_PROFILE:
+      if (!settings->has_temp_profile_id)
+        printf("Sensor settings specified temp profile, but no provided!\r\n");
+      else {
+        csl->setpoint_type = SP_TEMP_PROFILE;
+
+        csl->temp_profile_id = settings->temp_profile_id;
+        csl->temp_profile_start_point = settings->temp_profile_start_point;
+        csl->temp_profile_completion_action = settings->temp_profile_completion_action;
+
+        printf("      start point %d\r\n", csl->temp_profile_start_point);
+        printf("      completion action %d\r\n", csl->temp_profile_completion_action);
+
+        /* Profiles sent with their steps are added to the on-device library.
+         * Otherwise the id selects a profile that is already in the library.
+         */
+        if (settings->temp_profiles_count > 0)
+          store_temp_profile(&settings->temp_profiles[0]);
+        else if (!temp_profile_lib_find(csl->temp_profile_id, &lib_entry))
+          printf("Temp profile %d not in library!\r\n", (int)csl->temp_profile_id);
+      }
+      break;
+
+    default:
+      printf("Invalid setpoint type: %d\r\n", settings->setpoint_type);
+      break;
+  }
+
+  printf("    sensor %d\r\n", csl->controller);
+  printf("      setpoint_type %d\r\n", csl->setpoint_type);
+  printf("      static %f\r\n", csl->static_setpoint.value);
+  printf("      temp profile %d\r\n", (int)csl->temp_profile_id);
+
+  return true;
+}
+
+void
+api_msg_reset_parser(msg_parser_t* p)
+{
+  p->state = RECV_LEN;
+  p->bytes_remaining = 4;
+  p->recv_buf = (uint8_t*)&p->data_len;
+}
+
+msg_poll_result_t
+api_msg_socket_poll(msg_parser_t* p, int sd)
+{
+  int ret = recv(sd, p->recv_buf, p->bytes_remaining, 0);
+  if (ret < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return MSG_POLL_ERROR;
+    return MSG_POLL_NONE;
+  }
+
+  p->bytes_remaining -= ret;
+  p->recv_buf += ret;
+
+  if (p->bytes_remaining > 0)
+    return (ret > 0) ? MSG_POLL_PARTIAL : MSG_POLL_NONE;
+
+  switch (p->state) {
+    case RECV_LEN:
+      p->data_len = ntohl(p->data_len);
+      if (p->data_len > sizeof(p->data_buf)) {
+        /* There is no way to resync with the stream after this */
+        printf("API message too long %u\r\n", (unsigned)p->data_len);
+        return MSG_POLL_TOO_LONG;
+      }
+
+      if (p->data_len > 0) {
+        p->state = RECV_DATA;
+        p->bytes_remaining = p->data_len;
+        p->recv_buf = p->data_buf;
+      }
+      else {
+        api_msg_reset_parser(p);
+      }
+      return MSG_POLL_PARTIAL;
+
+    case RECV_DATA:
+      /* The message stays in data_buf until the next poll */
+      api_msg_reset_parser(p);
+      return MSG_POLL_MSG;
+  }
+
+  return MSG_POLL_NONE;
+}
+
+bool
+api_msg_send(msg_writer_t* w, const ApiMessage* msg)
+{
+  uint32_t msg_len;
+
+  /* A first pass without a callback only counts the bytes, so the length
+   * prefix can be sent ahead of the body without buffering all of it.
+   */
+  pb_ostream_t sizing = {0};
+  sizing.max_size = SIZE_MAX;
+  if (!pb_encode(&sizing, ApiMessage_fields, msg)) {
+    printf("API message encode failed\r\n");
+    return false;
+  }
+
+  if ((w->begin != NULL) &&
+      !w->begin(w->arg, sizeof(msg_len) + sizing.bytes_written))
+    return false;
+
+  pb_ostream_t stream = {
+      .callback = tx_write,
+      .state = w,
+      .max_size = sizing.bytes_written
+  };
+
+  msg_len = htonl(sizing.bytes_written);
+  memcpy(w->buf, &msg_len, sizeof(msg_len));
+  w->len = sizeof(msg_len);
+
+  if (!pb_encode(&stream, ApiMessage_fields, msg) || !tx_flush(w)) {
+    w->len = 0;
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+tx_write(pb_ostream_t* stream, const uint8_t* buf, size_t count)
+{
+  msg_writer_t* w = stream->state;
+
+  while (count > 0) {
+    uint32_t n = MIN(count, w->buf_size - w->len);
+
+    memcpy(w->buf + w->len, buf, n);
+    w->len += n;
+    buf += n;
+    count -= n;
+
+    if ((w->len == w->buf_size) && !tx_flush(w))
+      return false;
+  }
+
+  return true;
+}
+
+static bool
+tx_flush(msg_writer_t* w)
+{
+  uint32_t len = w->len;
+
+  w->len = 0;
+
+  if (len == 0)
+    return true;
+
+  return w->flush(w->arg, w->buf, len);
+}
+
+static void
+populate_output_status(ControllerReport* pr, sensor_id_t controller, output_id_t output)
+{
+  const controller_settings_t* controller_settings = app_cfg_get_controller_settings(controller);
+
+  if (controller_settings->output_settings[output].enabled) {
+    output_ctrl_t control_mode = app_cfg_get_control_mode();
+    temp_control_status_t output_status = temp_control_get_status(controller, output);
+
+    pr->output_status[pr->output_status_count].output_index = output;
+    pr->output_status[pr->output_status_count].has_output_index = true;
+
+    pr->output_status[pr->output_status_count].status = output_status.output_enabled;
+    pr->output_status[pr->output_status_count].has_status = true;
+
+    if (control_mode == PID) {
+      pr->output_status[pr->output_status_count].kp = output_status.kp;
+      pr->output_status[pr->output_status_count].has_kp = true;
+
+      pr->output_status[pr->output_status_count].ki = output_status.ki;
+      pr->output_status[pr->output_status_count].has_ki = true;
+
+      pr->output_status[pr->output_status_count].kd = output_status.kd;
+      pr->output_status[pr->output_status_count].has_kd = true;
+    }
+    pr->output_status_count++;
+  }
+}
+
+static void
+store_temp_profile(const TempProfile* tpm)
+{
+  int i;
+  temp_profile_t tp = {
+      .id = tpm->id,
+      .num_steps = tpm->steps_count,
+      .start_value = {
+          .value = tpm->start_value,
+          .unit = UNIT_TEMP_DEG_F
+      }
+  };
+  strncpy(tp.name, tpm->name, sizeof(tp.name));
+
+  printf("    profile '%s' (%d)\r\n", tp.name, (int)tp.id);
+  printf("      steps %d\r\n", (int)tp.num_steps);
+  printf("      start temp %f\r\n", tp.start_value.value);
+
+  /* Stream the steps out to the library rather than holding them in the
+   * config. The controller runs the profile straight from there.
+   */
+  bool added = temp_profile_lib_add_begin(&tp);
+  for (i = 0; i < (int)tpm->steps_count; ++i) {
+    temp_profile_step_t step;
+    const TempProfileStep* stepm = &tpm->steps[i];
+
+    step.duration = stepm->duration;
+    step.value.value = stepm->value;
+    step.value.unit = UNIT_TEMP_DEG_F;
+    switch(stepm->type) {
+      case TempProfileStep_TempProfileStepType_HOLD:
+        step.type = STEP_HOLD;
+        break;
+
+      case TempProfileStep_TempProfileStepType_RAMP:
+        step.type = STEP_RAMP;
+        break;
+
+      default:
+        printf("Invalid step type: %d\r\n", stepm->type);
+        step.type = STEP_HOLD;
+        break;
+    }
+
+    if (added)
+      added = temp_profile_lib_add_step(i, &step);
+  }
+
+  if (added)
+    added = temp_profile_lib_add_end();
+
+  if (!added)
+    printf("Temp profile library add failed!\r\n");
+}
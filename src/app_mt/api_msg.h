@@ -0,0 +1,78 @@
+
+#ifndef API_MSG_H
+#define API_MSG_H
+
+#include "bbmt.pb.h"
+#include "app_cfg.h"
+#include "temp_control.h"
+#include <stdbool.h>
+
+
+/* Conversions between the device's own structures and the API messages,
+ * and the framing they travel in, shared by the cloud connection and the LAN
+ * server. Each message goes on the wire as a big-endian 32 bit length
+ * followed by the encoded ApiMessage.
+ */
+
+typedef enum {
+  RECV_LEN,
+  RECV_DATA
+} parser_state_t;
+
+typedef struct {
+  parser_state_t state;
+
+  uint8_t* recv_buf;
+  uint32_t bytes_remaining;
+
+  uint32_t data_len;
+  uint8_t data_buf[ApiMessage_size];
+} msg_parser_t;
+
+typedef enum {
+  MSG_POLL_NONE,      /* Nothing was read */
+  MSG_POLL_PARTIAL,   /* Some of a message was read */
+  MSG_POLL_MSG,       /* A whole message is in data_buf */
+  MSG_POLL_TOO_LONG,  /* The stream can't be followed past this message */
+  MSG_POLL_ERROR      /* The socket failed */
+} msg_poll_result_t;
+
+/* Flushes are where the bytes actually go. begin is told the size of each
+ * message, prefix included, before any of it is flushed, and may refuse it.
+ */
+typedef struct {
+  bool (*begin)(void* arg, uint32_t frame_len);
+  bool (*flush)(void* arg, const uint8_t* buf, uint32_t len);
+  void* arg;
+
+  uint8_t* buf;
+  uint32_t buf_size;
+  uint32_t len;
+} msg_writer_t;
+
+void
+api_msg_fill_controller_report(ControllerReport* pr, temp_controller_id_t controller, float sensor_reading);
+
+void
+api_msg_fill_controller_settings(ControllerSettings* ss, temp_controller_id_t controller);
+
+/* Fills csl from the message, starting from the controller's current
+ * settings. Temp profiles carried in the message are stored on the way.
+ */
+bool
+api_msg_parse_controller_settings(const ControllerSettings* settings, controller_settings_t* csl);
+
+void
+api_msg_reset_parser(msg_parser_t* p);
+
+/* Reads whatever the socket has towards the next message without blocking */
+msg_poll_result_t
+api_msg_socket_poll(msg_parser_t* p, int sd);
+
+/* Encodes msg behind its length prefix, in pieces no bigger than the
+ * writer's buffer.
+ */
+bool
+api_msg_send(msg_writer_t* w, const ApiMessage* msg);
+
+#endif
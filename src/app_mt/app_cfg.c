@@ -7,9 +7,12 @@
 #include "crc/crc32.h"
 #include "touch.h"
 #include "types.h"
+#include "kv_store.h"
+#include "temp_profile_lib.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 
 
 typedef struct {
@@ -22,21 +25,96 @@ typedef struct {
   matrix_t touch_calib;
   controller_settings_t controller_settings[NUM_CONTROLLERS];
   temp_profile_checkpoint_t temp_profile_checkpoints[NUM_CONTROLLERS];
+  pid_gains_t pid_gains[NUM_CONTROLLERS][NUM_OUTPUTS];
   ota_update_checkpoint_t ota_update_checkpoint;
   char auth_token[64];
   net_settings_t net_settings;
   fault_data_t fault;
 } app_cfg_data_t;
 
+/* Bump whenever app_cfg_data_t changes and teach app_cfg_migrate() how to
+ * carry the previous layout forward.
+ */
+#define APP_CFG_VERSION 1
+
 typedef struct {
+  uint32_t version;
   app_cfg_data_t data;
   uint32_t crc;
 } app_cfg_rec_t;
 
+/* Unversioned layout written by older firmware, which had two controllers
+ * with two outputs each and embedded the temp profile in the settings.
+ */
+#define V0_NUM_CONTROLLERS 2
+#define V0_NUM_OUTPUTS     2
+#define V0_MAX_STEPS       32
+
+typedef struct {
+  bool enabled;
+  output_function_t function;
+  quantity_t cycle_delay;
+} output_settings_v0_t;
+
+typedef struct {
+  uint32_t id;
+  char name[100];
+  uint32_t num_steps;
+  quantity_t start_value;
+  temp_profile_step_t steps[V0_MAX_STEPS];
+  int start_point;
+  temp_profile_completion_action_t completion_action;
+} temp_profile_v0_t;
+
+typedef struct {
+  temp_controller_id_t controller;
+  setpoint_type_t setpoint_type;
+  quantity_t static_setpoint;
+  temp_profile_v0_t temp_profile;
+  output_settings_v0_t output_settings[V0_NUM_OUTPUTS];
+  session_action_t session_action;
+} controller_settings_v0_t;
+
+typedef struct {
+  uint32_t reset_count;
+  unit_t temp_unit;
+  output_ctrl_t control_mode;
+  quantity_t hysteresis;
+  quantity_t screen_saver;
+  sensor_config_t sensor_configs[MAX_NUM_SENSOR_CONFIGS];
+  matrix_t touch_calib;
+  controller_settings_v0_t controller_settings[V0_NUM_CONTROLLERS];
+  temp_profile_checkpoint_t temp_profile_checkpoints[V0_NUM_CONTROLLERS];
+  ota_update_checkpoint_t ota_update_checkpoint;
+  char auth_token[64];
+  net_settings_t net_settings;
+  fault_data_t fault;
+} app_cfg_data_v0_t;
+
+typedef struct {
+  app_cfg_data_v0_t data;
+  uint32_t crc;
+} app_cfg_rec_v0_t;
+
+typedef struct {
+  sensor_serial_t sensor_serial;
+  quantity_t offset;
+} probe_offset_rec_t;
+
+/* Settings added since the last layout change live in the KV store, where a
+ * missing key reads as the default.
+ */
+#define LAN_API_ENABLED_KEY KV_KEY(KV_NS_SETTINGS, 1)
+
 
 static msg_t app_cfg_thread(void* arg);
 static app_cfg_rec_t* app_cfg_load(sxfs_part_id_t* loaded_from);
 static app_cfg_rec_t* app_cfg_load_from(sxfs_part_id_t part);
+static void app_cfg_set_defaults(void);
+static bool app_cfg_migrate(void);
+static void app_cfg_migrate_v0(const app_cfg_data_v0_t* v0);
+static uint32_t app_cfg_rec_crc(const app_cfg_rec_t* rec);
+static uint32_t probe_offset_key(sensor_serial_t sensor_serial);
 
 
 /* Local RAM copy of app_cfg */
@@ -55,7 +133,7 @@ app_cfg_init()
     app_cfg_local.data.reset_count++;
     free(app_cfg);
   }
-  else {
+  else if (!app_cfg_migrate()) {
     app_cfg_reset();
   }
 
@@ -79,7 +157,18 @@ app_cfg_thread(void* arg)
 void
 app_cfg_reset()
 {
-  memset(&app_cfg_local.data, 0, sizeof(app_cfg_local.data));
+  app_cfg_set_defaults();
+  app_cfg_flush();
+}
+
+static void
+app_cfg_set_defaults()
+{
+  int c, o;
+
+  memset(&app_cfg_local, 0, sizeof(app_cfg_local));
+
+  app_cfg_local.version = APP_CFG_VERSION;
 
   app_cfg_local.data.reset_count = 0;
 
@@ -102,38 +191,129 @@ app_cfg_reset()
 
   touch_calib_reset();
 
-  app_cfg_local.data.controller_settings[CONTROLLER_1].controller = CONTROLLER_1;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].setpoint_type = SP_STATIC;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].static_setpoint.value = 68;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].static_setpoint.unit = UNIT_TEMP_DEG_F;
-
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].enabled = false;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].function = OUTPUT_FUNC_COOLING;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].cycle_delay.unit = UNIT_TIME_MIN;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].cycle_delay.value = 3;
-
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].enabled = false;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].function = OUTPUT_FUNC_HEATING;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].cycle_delay.unit = UNIT_TIME_MIN;
-  app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].cycle_delay.value = 3;
-
-  app_cfg_local.data.controller_settings[CONTROLLER_2].controller = CONTROLLER_2;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].setpoint_type = SP_STATIC;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].static_setpoint.value = 68;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].static_setpoint.unit = UNIT_TEMP_DEG_F;
-
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].enabled = false;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].function = OUTPUT_FUNC_COOLING;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].cycle_delay.unit = UNIT_TIME_MIN;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].cycle_delay.value = 3;
-
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].enabled = false;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].function = OUTPUT_FUNC_HEATING;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].cycle_delay.unit = UNIT_TIME_MIN;
-  app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].cycle_delay.value = 3;
-
-  app_cfg_local.crc = crc32_block(0, &app_cfg_local.data, sizeof(app_cfg_data_t));
-  app_cfg_flush();
+  for (c = 0; c < NUM_CONTROLLERS; ++c) {
+    controller_settings_t* cs = &app_cfg_local.data.controller_settings[c];
+
+    cs->controller = c;
+    cs->setpoint_type = SP_STATIC;
+    cs->static_setpoint.value = 68;
+    cs->static_setpoint.unit = UNIT_TEMP_DEG_F;
+
+    /* The first output defaults to cooling, the rest to heating */
+    for (o = 0; o < NUM_OUTPUTS; ++o) {
+      output_settings_t* os = &cs->output_settings[o];
+
+      os->enabled = false;
+      os->function = (o == OUTPUT_1) ? OUTPUT_FUNC_COOLING : OUTPUT_FUNC_HEATING;
+      os->cycle_delay.unit = UNIT_TIME_MIN;
+      os->cycle_delay.value = 3;
+      os->window.unit = UNIT_TIME_SEC;
+      os->window.value = (o == OUTPUT_1) ? 600 : 300;
+    }
+  }
+}
+
+/* Looks for settings saved in an older layout and carries them forward.
+ * Nothing is flushed until the old record has been read, so a failed
+ * migration leaves it in place for the next attempt.
+ */
+static bool
+app_cfg_migrate()
+{
+  sxfs_part_id_t parts[] = { SP_APP_CFG_1, SP_APP_CFG_2 };
+  app_cfg_rec_v0_t* v0 = malloc(sizeof(app_cfg_rec_v0_t));
+  bool ret = false;
+  uint32_t i;
+
+  if (v0 == NULL)
+    return false;
+
+  for (i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i) {
+    if (sxfs_read(parts[i], 0, (uint8_t*)v0, sizeof(app_cfg_rec_v0_t)) &&
+        crc32_block(0, &v0->data, sizeof(app_cfg_data_v0_t)) == v0->crc) {
+      app_cfg_migrate_v0(&v0->data);
+      ret = true;
+      break;
+    }
+  }
+
+  free(v0);
+
+  if (ret) {
+    printf("Migrated app cfg to version %d\r\n", APP_CFG_VERSION);
+    app_cfg_flush();
+  }
+
+  return ret;
+}
+
+static void
+app_cfg_migrate_v0(const app_cfg_data_v0_t* v0)
+{
+  int c, o;
+  uint32_t s;
+
+  app_cfg_set_defaults();
+
+  app_cfg_local.data.reset_count = v0->reset_count + 1;
+  app_cfg_local.data.temp_unit = v0->temp_unit;
+  app_cfg_local.data.control_mode = v0->control_mode;
+  app_cfg_local.data.hysteresis = v0->hysteresis;
+  app_cfg_local.data.screen_saver = v0->screen_saver;
+  memcpy(app_cfg_local.data.sensor_configs, v0->sensor_configs, sizeof(v0->sensor_configs));
+  app_cfg_local.data.touch_calib = v0->touch_calib;
+  app_cfg_local.data.ota_update_checkpoint = v0->ota_update_checkpoint;
+  memcpy(app_cfg_local.data.auth_token, v0->auth_token, sizeof(v0->auth_token));
+  app_cfg_local.data.net_settings = v0->net_settings;
+  app_cfg_local.data.fault = v0->fault;
+
+  for (c = 0; c < MIN(V0_NUM_CONTROLLERS, NUM_CONTROLLERS); ++c) {
+    const controller_settings_v0_t* old_cs = &v0->controller_settings[c];
+    const temp_profile_v0_t* old_tp = &old_cs->temp_profile;
+    controller_settings_t* cs = &app_cfg_local.data.controller_settings[c];
+
+    cs->controller = c;
+    cs->setpoint_type = old_cs->setpoint_type;
+    cs->static_setpoint = old_cs->static_setpoint;
+    cs->temp_profile_id = old_tp->id;
+    cs->temp_profile_start_point = old_tp->start_point;
+    cs->temp_profile_completion_action = old_tp->completion_action;
+    cs->session_action = old_cs->session_action;
+
+    /* New outputs and the window keep their defaults */
+    for (o = 0; o < MIN(V0_NUM_OUTPUTS, NUM_OUTPUTS); ++o) {
+      cs->output_settings[o].enabled = old_cs->output_settings[o].enabled;
+      cs->output_settings[o].function = old_cs->output_settings[o].function;
+      cs->output_settings[o].cycle_delay = old_cs->output_settings[o].cycle_delay;
+    }
+
+    app_cfg_local.data.temp_profile_checkpoints[c] = v0->temp_profile_checkpoints[c];
+
+    /* The embedded profile moves into the profile library */
+    if (old_tp->num_steps > 0 && old_tp->num_steps <= V0_MAX_STEPS) {
+      temp_profile_t tp = {
+          .id = old_tp->id,
+          .num_steps = old_tp->num_steps,
+          .start_value = old_tp->start_value
+      };
+      memcpy(tp.name, old_tp->name, sizeof(tp.name));
+
+      bool added = temp_profile_lib_add_begin(&tp);
+      for (s = 0; added && s < tp.num_steps; ++s)
+        added = temp_profile_lib_add_step(s, &old_tp->steps[s]);
+      if (added)
+        added = temp_profile_lib_add_end();
+
+      if (!added)
+        printf("Temp profile %d migration failed!\r\n", (int)tp.id);
+    }
+  }
+}
+
+static uint32_t
+app_cfg_rec_crc(const app_cfg_rec_t* rec)
+{
+  return crc32_block(0, (void*)rec, offsetof(app_cfg_rec_t, crc));
 }
 
 static app_cfg_rec_t*
@@ -170,8 +350,8 @@ app_cfg_load_from(sxfs_part_id_t part)
     return NULL;
   }
 
-  uint32_t calc_crc = crc32_block(0, &app_cfg->data, sizeof(app_cfg_data_t));
-  if (calc_crc != app_cfg->crc) {
+  if (app_cfg->version != APP_CFG_VERSION ||
+      app_cfg_rec_crc(app_cfg) != app_cfg->crc) {
     free(app_cfg);
     return NULL;
   }
@@ -269,10 +449,18 @@ app_cfg_get_probe_offset(sensor_serial_t sensor_serial)
 {
   uint8_t i;
   quantity_t offset;
+  probe_offset_rec_t rec;
+  uint32_t len;
+
+  if (kv_get(probe_offset_key(sensor_serial), &rec, sizeof(rec), &len) &&
+      len == sizeof(rec) &&
+      memcmp(rec.sensor_serial, sensor_serial, sizeof(sensor_serial_t)) == 0)
+    return rec.offset;
 
   offset.unit = UNIT_TEMP_DEG_F;
   offset.value = 0;
 
+  /* Offsets saved before they moved to the KV store */
   for (i = 0; i < MAX_NUM_SENSOR_CONFIGS; i++) {
     if (memcmp(sensor_serial, app_cfg_local.data.sensor_configs[i].sensor_serial, sizeof(sensor_serial_t)) == 0)
       return app_cfg_local.data.sensor_configs[i].offset;
@@ -284,40 +472,27 @@ app_cfg_get_probe_offset(sensor_serial_t sensor_serial)
 void
 app_cfg_set_probe_offset(quantity_t probe_offset, sensor_serial_t sensor_serial)
 {
-  uint8_t i;
-  int idx, next_idx;
-
-  idx = next_idx = -1;
-
-  for(i = 0; i < MAX_NUM_SENSOR_CONFIGS; i++) {
-    sensor_serial_t* sensor_sn = &app_cfg_local.data.sensor_configs[i].sensor_serial;
-    if(memcmp(sensor_serial, sensor_sn, sizeof(sensor_serial_t)) == 0) {
-      idx = i;
-      break;
-    }
-    /* super cryptic non-zero check */
-    else if (((*sensor_sn)[0] == 0) &&
-             (memcmp(*sensor_sn, *(sensor_sn + 1), 5) == 0)) {
-      next_idx = i;
-      break;
-    }
-  }
-
-  if (idx < 0)
-    idx = next_idx;
-
-  if (idx < 0)
-    return;
+  probe_offset_rec_t rec;
 
   if (probe_offset.unit == UNIT_TEMP_DEG_C) {
     probe_offset.value *= (9.0f / 5.0f);
     probe_offset.unit = UNIT_TEMP_DEG_F;
   }
 
-  chMtxLock(&app_cfg_mtx);
-  memcpy(app_cfg_local.data.sensor_configs[idx].sensor_serial, sensor_serial, sizeof(sensor_serial_t));
-  app_cfg_local.data.sensor_configs[idx].offset = probe_offset;
-  chMtxUnlock();
+  memcpy(rec.sensor_serial, sensor_serial, sizeof(sensor_serial_t));
+  rec.offset = probe_offset;
+
+  if (!kv_put(probe_offset_key(sensor_serial), &rec, sizeof(rec)))
+    printf("probe offset save failed!\r\n");
+}
+
+/* The key is a hash of the serial, so the serial is stored with the offset
+ * to rule out collisions.
+ */
+static uint32_t
+probe_offset_key(sensor_serial_t sensor_serial)
+{
+  return KV_KEY(KV_NS_PROBE_OFFSET, crc32_block(0, sensor_serial, sizeof(sensor_serial_t)));
 }
 
 const matrix_t*
@@ -391,6 +566,26 @@ app_cfg_set_temp_profile_checkpoint(temp_controller_id_t controller, temp_profil
   }
 }
 
+const pid_gains_t*
+app_cfg_get_pid_gains(temp_controller_id_t controller, output_id_t output)
+{
+  if (controller >= NUM_CONTROLLERS || output >= NUM_OUTPUTS)
+    return NULL;
+
+  return &app_cfg_local.data.pid_gains[controller][output];
+}
+
+void
+app_cfg_set_pid_gains(temp_controller_id_t controller, output_id_t output, const pid_gains_t* gains)
+{
+  if (controller >= NUM_CONTROLLERS || output >= NUM_OUTPUTS)
+    return;
+
+  chMtxLock(&app_cfg_mtx);
+  app_cfg_local.data.pid_gains[controller][output] = *gains;
+  chMtxUnlock();
+}
+
 const char*
 app_cfg_get_auth_token()
 {
@@ -407,6 +602,36 @@ app_cfg_set_auth_token(const char* auth_token)
   chMtxUnlock();
 }
 
+/* Off until the user turns it on, since it lets anything on the LAN that
+ * knows the auth token change the controller settings.
+ */
+bool
+app_cfg_get_lan_api_enabled()
+{
+  bool enabled;
+  uint32_t len;
+
+  if (kv_get(LAN_API_ENABLED_KEY, &enabled, sizeof(enabled), &len) &&
+      len == sizeof(enabled))
+    return enabled;
+
+  return false;
+}
+
+void
+app_cfg_set_lan_api_enabled(bool enabled)
+{
+  if (enabled == app_cfg_get_lan_api_enabled())
+    return;
+
+  if (!kv_put(LAN_API_ENABLED_KEY, &enabled, sizeof(enabled))) {
+    printf("LAN API setting save failed!\r\n");
+    return;
+  }
+
+  msg_send(MSG_LAN_API_ENABLED, &enabled);
+}
+
 const net_settings_t*
 app_cfg_get_net_settings()
 {
@@ -475,7 +700,7 @@ app_cfg_flush()
   sxfs_part_id_t used_app_cfg_part = SP_APP_CFG_1;
   app_cfg_rec_t* app_cfg = app_cfg_load(&used_app_cfg_part);
 
-  app_cfg_local.crc = crc32_block(0, &app_cfg_local.data, sizeof(app_cfg_data_t));
+  app_cfg_local.crc = app_cfg_rec_crc(&app_cfg_local);
 
   if (app_cfg == NULL || memcmp(&app_cfg_local, app_cfg, sizeof(app_cfg_rec_t)) != 0) {
     bool ret;
@@ -486,7 +711,7 @@ app_cfg_flush()
     if (ret) {
       ret = sxfs_write(unused_app_cfg_part, 0, (uint8_t*)&app_cfg_local, sizeof(app_cfg_local));
       if (ret) {
-        ret = sxfs_erase_all(used_app_cfg_part);
+        ret = sxfs_erase_all_async(used_app_cfg_part);
         if (!ret)
           printf("used app cfg erase failed! %d\r\n", used_app_cfg_part);
       }
@@ -12,6 +12,7 @@
 #include "offset.h"
 #include "sensor.h"
 #include "ota_update.h"
+#include "pid.h"
 
 
 typedef enum {
@@ -77,6 +78,12 @@ app_cfg_get_temp_profile_checkpoint(temp_controller_id_t controller);
 void
 app_cfg_set_temp_profile_checkpoint(temp_controller_id_t controller, temp_profile_checkpoint_t* checkpoint);
 
+const pid_gains_t*
+app_cfg_get_pid_gains(temp_controller_id_t controller, output_id_t output);
+
+void
+app_cfg_set_pid_gains(temp_controller_id_t controller, output_id_t output, const pid_gains_t* gains);
+
 const output_settings_t*
 app_cfg_get_output_settings(output_id_t output);
 
@@ -89,6 +96,12 @@ app_cfg_get_auth_token(void);
 void
 app_cfg_set_auth_token(const char* auth_token);
 
+bool
+app_cfg_get_lan_api_enabled(void);
+
+void
+app_cfg_set_lan_api_enabled(bool enabled);
+
 const net_settings_t*
 app_cfg_get_net_settings(void);
 
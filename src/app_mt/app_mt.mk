@@ -9,6 +9,11 @@ WEB_API_PORT = 31337
 
 BOARD = II-MT-CONTROLLER
 
+# Set to TRUE to build the PID loop in Q16.16 fixed point
+PID_FIXED_POINT ?= FALSE
+
+PROJECT_DEFS = -DPID_FIXED_POINT=$(PID_FIXED_POINT)
+
 DEPS = NANOPB
 
 PROJECT_INCDIR = \
@@ -24,12 +29,18 @@ PROJECT_AUTOGEN_CSRC = \
        bbmt.pb.c
 
 PROJECT_CSRC = \
+       api_msg.c \
        app_cfg.c \
        app_hdr.c \
+       diagnostics.c \
        fault.c \
        font.c \
        gfx.c \
+       heap_stats.c \
        image.c \
+       kv_store.c \
+       lan_api.c \
+       latency_trace.c \
        lcd.c \
        main.c \
        message.c \
@@ -42,6 +53,7 @@ PROJECT_CSRC = \
        sensor.c \
        temp_control.c \
        temp_profile.c \
+       temp_profile_lib.c \
        thread_watchdog.c \
        touch.c \
        touch_calib.c \
@@ -91,6 +103,7 @@ PROJECT_CSRC = \
        gui/controls/scatter_plot.c \
        gui/controls/widget.c \
        util/linked_list.c \
+       util/scratch_arena.c \
        ../common/bootloader_api.c \
        ../common/crc/crc8.c \
        ../common/crc/crc16.c \
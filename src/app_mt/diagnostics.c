@@ -0,0 +1,130 @@
+
+#include "ch.h"
+#include "diagnostics.h"
+#include "message.h"
+#include "latency_trace.h"
+#include "heap_stats.h"
+#include "net.h"
+#include "web_api.h"
+#include "xflash.h"
+#include "core/cc3000_spi.h"
+
+#include <stdio.h>
+
+
+/* Time between dumps, in milliseconds */
+#define DIAGNOSTICS_REPORT_INTERVAL (5 * 60 * 1000)
+
+
+static void diagnostics_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void print_spi_rates(void);
+static uint32_t per_second(uint32_t count, uint32_t elapsed_ms);
+
+
+static Mutex diag_mtx;
+static spi_stats_t last_spi_stats;
+static systime_t last_spi_stats_time;
+
+
+void
+diagnostics_init()
+{
+  chMtxInit(&diag_mtx);
+
+  /* No subscriptions, so the listener only ever wakes on its idle timeout */
+  msg_listener_t* l = msg_listener_create("diagnostics", 1024, diagnostics_dispatch, NULL);
+  msg_listener_set_idle_timeout(l, DIAGNOSTICS_REPORT_INTERVAL);
+}
+
+static void
+diagnostics_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  (void)msg_data;
+  (void)listener_data;
+  (void)sub_data;
+
+  if (id == MSG_IDLE)
+    diagnostics_print();
+}
+
+void
+diagnostics_print()
+{
+  const api_status_t* api_status = web_api_get_status();
+  api_scratch_stats_t scratch_stats;
+  xflash_erase_stats_t erase_stats;
+  xflash_cache_stats_t cache_stats;
+  xflash_power_stats_t power_stats;
+
+  chMtxLock(&diag_mtx);
+
+  latency_trace_print();
+  net_recovery_print();
+
+  printf("web api connect: %u tries, %u failed, %u dns lookups, %u cached\r\n",
+      (unsigned)api_status->connect_stats.attempts,
+      (unsigned)api_status->connect_stats.failures,
+      (unsigned)api_status->connect_stats.dns_lookups,
+      (unsigned)api_status->connect_stats.dns_cache_hits);
+
+  heap_stats_print();
+
+  web_api_get_scratch_stats(&scratch_stats);
+  printf("web api scratch: %u of %u bytes max, %u failed\r\n",
+      (unsigned)scratch_stats.high_water,
+      (unsigned)scratch_stats.size,
+      (unsigned)scratch_stats.failures);
+
+  xflash_get_erase_stats(&erase_stats);
+  printf("xflash erase: %u sectors, %u errors, %u queued, %u blocked (%u ms total, %u ms max)\r\n",
+      (unsigned)erase_stats.sectors_erased,
+      (unsigned)erase_stats.errors,
+      (unsigned)erase_stats.queue_len,
+      (unsigned)erase_stats.blocked_count,
+      (unsigned)erase_stats.blocked_total_ms,
+      (unsigned)erase_stats.blocked_max_ms);
+
+  xflash_get_cache_stats(&cache_stats);
+  printf("xflash cache: %u hits, %u misses\r\n",
+      (unsigned)cache_stats.hits,
+      (unsigned)cache_stats.misses);
+
+  xflash_get_power_stats(&power_stats);
+  printf("xflash power: %u power downs, %u wakes (%u us total, %u us max)\r\n",
+      (unsigned)power_stats.power_downs,
+      (unsigned)power_stats.wakes,
+      (unsigned)power_stats.wake_total_us,
+      (unsigned)power_stats.wake_max_us);
+
+  print_spi_rates();
+
+  chMtxUnlock();
+}
+
+static void
+print_spi_rates()
+{
+  spi_stats_t spi_stats;
+
+  /* Rates are averaged since the last time they were printed */
+  spi_get_stats(&spi_stats);
+  systime_t now = chTimeNow();
+  uint32_t elapsed_ms = (now - last_spi_stats_time) * 1000 / CH_FREQUENCY;
+  printf("wlan spi: rx %u pkt/s %u B/s (%u B direct), tx %u pkt/s %u B/s\r\n",
+      (unsigned)per_second(spi_stats.rx_packets - last_spi_stats.rx_packets, elapsed_ms),
+      (unsigned)per_second(spi_stats.rx_bytes - last_spi_stats.rx_bytes, elapsed_ms),
+      (unsigned)(spi_stats.rx_direct_bytes - last_spi_stats.rx_direct_bytes),
+      (unsigned)per_second(spi_stats.tx_packets - last_spi_stats.tx_packets, elapsed_ms),
+      (unsigned)per_second(spi_stats.tx_bytes - last_spi_stats.tx_bytes, elapsed_ms));
+  last_spi_stats = spi_stats;
+  last_spi_stats_time = now;
+}
+
+static uint32_t
+per_second(uint32_t count, uint32_t elapsed_ms)
+{
+  if (elapsed_ms == 0)
+    return 0;
+
+  return (uint32_t)(((uint64_t)count * 1000) / elapsed_ms);
+}
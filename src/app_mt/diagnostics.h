@@ -0,0 +1,14 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+
+/* Periodically dumps latency, network, heap, flash and wlan statistics to
+ * the console. None of these have fields in the API messages.
+ */
+void
+diagnostics_init(void);
+
+void
+diagnostics_print(void);
+
+#endif
@@ -7,6 +7,7 @@
 #include "gui.h"
 #include "temp_control.h"
 #include "app_cfg.h"
+#include "temp_profile_lib.h"
 #include "gui/quantity_select.h"
 #include "gui/button_list.h"
 #include "gui/output_settings.h"
@@ -23,14 +24,11 @@
 #define MIN_TEMP_F (-58)
 
 
-typedef enum {
-  SELECT_NONE,
-  SELECT_1,
-  SELECT_2,
-  SELECT_1_2,
+/* Output selections are bitmasks of enabled outputs, cycled in numeric order */
+#define NUM_OUTPUT_SELECTIONS (1 << NUM_OUTPUTS)
+#define SELECT_NONE           0
 
-  NUM_OUTPUT_SELECTIONS
-} output_selection_t;
+_Static_assert(NUM_OUTPUTS <= 8, "output selection mask must fit in uint8_t");
 
 
 typedef struct {
@@ -41,7 +39,7 @@ typedef struct {
   controller_settings_t settings;
 
   uint8_t output_selection;
-  output_selection_t output_selection_valid[NUM_OUTPUT_SELECTIONS];
+  uint8_t claimed_outputs;
 } controller_settings_screen_t;
 
 
@@ -67,47 +65,39 @@ controller_settings_screen_create(temp_controller_id_t controller)
   s->screen = widget_create(NULL, &controller_settings_widget_class, s, display_rect);
   widget_set_background(s->screen, BLACK);
 
-  char* title;
-  temp_controller_id_t other_controller;
-  if (controller == CONTROLLER_1) {
-    title = "Controller 1 Setup";
-    other_controller = CONTROLLER_2;
-  }
-  else {
-    title = "Controller 2 Setup";
-    other_controller = CONTROLLER_1;
-  }
+  char title[32];
+  snprintf(title, sizeof(title), "Controller %d Setup", controller + 1);
   s->button_list = button_list_screen_create(s->screen, title, back_button_clicked, s);
 
   s->controller = controller;
   s->settings = *app_cfg_get_controller_settings(controller);
 
-  /* Convert enabled flags to selection enum */
-  if (s->settings.output_settings[OUTPUT_1].enabled &&
-      s->settings.output_settings[OUTPUT_2].enabled)
-    s->output_selection = SELECT_1_2;
-  else if (s->settings.output_settings[OUTPUT_1].enabled)
-    s->output_selection = SELECT_1;
-  else if (s->settings.output_settings[OUTPUT_2].enabled)
-    s->output_selection = SELECT_2;
-  else
-    s->output_selection = SELECT_NONE;
+  /* Convert enabled flags to selection mask */
+  int i;
+  s->output_selection = SELECT_NONE;
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (s->settings.output_settings[i].enabled)
+      s->output_selection |= (1 << i);
+  }
 
   /* Figure out which output selections are allowed by checking which outputs are currently
-   * being controlled by the other controller.
+   * being controlled by the other controllers.
    */
-  const controller_settings_t* other_controller_settings = app_cfg_get_controller_settings(other_controller);
-  s->output_selection_valid[SELECT_NONE] = true;
-  if (!other_controller_settings->output_settings[OUTPUT_1].enabled)
-    s->output_selection_valid[SELECT_1] = true;
-  if (!other_controller_settings->output_settings[OUTPUT_2].enabled)
-    s->output_selection_valid[SELECT_2] = true;
-  if (!other_controller_settings->output_settings[OUTPUT_1].enabled &&
-      !other_controller_settings->output_settings[OUTPUT_2].enabled)
-    s->output_selection_valid[SELECT_1_2] = true;
+  s->claimed_outputs = 0;
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (i == controller)
+      continue;
+
+    const controller_settings_t* other_controller_settings = app_cfg_get_controller_settings(i);
+    int j;
+    for (j = 0; j < NUM_OUTPUTS; ++j) {
+      if (other_controller_settings->output_settings[j].enabled)
+        s->claimed_outputs |= (1 << j);
+    }
+  }
 
   /* If the current output selection is not valid, set it to none */
-  if (!s->output_selection_valid[s->output_selection])
+  if (s->output_selection & s->claimed_outputs)
     s->output_selection = SELECT_NONE;
 
   set_controller_settings(s);
@@ -127,6 +117,10 @@ set_controller_settings(controller_settings_screen_t* s)
 {
   uint32_t num_buttons = 0;
   button_spec_t buttons[16];
+  char output_subtext[64];
+  char output_titles[NUM_OUTPUTS][32];
+  char output_subtexts[NUM_OUTPUTS][32];
+  int i;
 
   char* subtext;
   char* setpoint_subtext;
@@ -169,9 +163,9 @@ set_controller_settings(controller_settings_screen_t* s)
 
     case SP_TEMP_PROFILE:
     {
-      const temp_profile_t* tp = &s->settings.temp_profile;
-      if (strlen(tp->name) > 0)
-        snprintf(setpoint_subtext, 128, "Selected profile: '%s'", tp->name);
+      temp_profile_t tp;
+      if (temp_profile_lib_load(s->settings.temp_profile_id, &tp))
+        snprintf(setpoint_subtext, 128, "Selected profile: '%s'", tp.name);
       else
         snprintf(setpoint_subtext, 128, "Selected profile: No profiles uploaded from the web!");
 
@@ -184,35 +178,37 @@ set_controller_settings(controller_settings_screen_t* s)
       break;
   }
 
-  switch (s->output_selection) {
-    case SELECT_1:
-      subtext = "Use Output #1";
-      break;
-
-    case SELECT_2:
-      subtext = "Use Output #2";
-      break;
-
-    case SELECT_1_2:
-      subtext = "Use Output #1 & #2";
-      break;
-
-    default:
-    case SELECT_NONE:
-      subtext = "No output";
-      break;
+  if (s->output_selection == SELECT_NONE) {
+    snprintf(output_subtext, sizeof(output_subtext), "No output");
+  }
+  else {
+    /* "Use Output #1", "Use Output #1 & #2", "Use Output #1, #2 & #3", ... */
+    int remaining = __builtin_popcount(s->output_selection);
+    int len = snprintf(output_subtext, sizeof(output_subtext), "Use Output");
+    for (i = 0; i < NUM_OUTPUTS; ++i) {
+      if ((s->output_selection & (1 << i)) == 0)
+        continue;
+
+      const char* sep = " ";
+      if (len > 10)
+        sep = (remaining == 1) ? " & " : ", ";
+      len += snprintf(output_subtext + len, sizeof(output_subtext) - len, "%s#%d", sep, i + 1);
+      remaining--;
+    }
   }
 
   add_button_spec(buttons, &num_buttons, output_selection_button_clicked, img_plug, CYAN,
-      "Output Selection", subtext, s);
+      "Output Selection", output_subtext, s);
 
-  if (s->settings.output_settings[OUTPUT_1].enabled)
-    add_button_spec(buttons, &num_buttons, output_settings_button_clicked, img_plug, CYAN,
-        "Output 1 Settings", "Set settings for output 1", &s->settings.output_settings[OUTPUT_1]);
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (!s->settings.output_settings[i].enabled)
+      continue;
 
-  if (s->settings.output_settings[OUTPUT_2].enabled)
+    snprintf(output_titles[i], sizeof(output_titles[i]), "Output %d Settings", i + 1);
+    snprintf(output_subtexts[i], sizeof(output_subtexts[i]), "Set settings for output %d", i + 1);
     add_button_spec(buttons, &num_buttons, output_settings_button_clicked, img_plug, CYAN,
-        "Output 2 Settings", "Set settings for output 2", &s->settings.output_settings[OUTPUT_2]);
+        output_titles[i], output_subtexts[i], &s->settings.output_settings[i]);
+  }
 
   button_list_set_buttons(s->button_list, buttons, num_buttons);
   free(setpoint_subtext);
@@ -227,32 +223,13 @@ output_selection_button_clicked(button_event_t* event)
     /* Find the next valid output selection */
     do {
       if (++s->output_selection >= NUM_OUTPUT_SELECTIONS)
-        s->output_selection = 0;
-    } while (!s->output_selection_valid[s->output_selection]);
+        s->output_selection = SELECT_NONE;
+    } while (s->output_selection & s->claimed_outputs);
 
     /* Set output enabled flags accordingly */
-    switch (s->output_selection) {
-      case SELECT_1:
-        s->settings.output_settings[OUTPUT_1].enabled = true;
-        s->settings.output_settings[OUTPUT_2].enabled = false;
-        break;
-
-      case SELECT_2:
-        s->settings.output_settings[OUTPUT_1].enabled = false;
-        s->settings.output_settings[OUTPUT_2].enabled = true;
-        break;
-
-      case SELECT_1_2:
-        s->settings.output_settings[OUTPUT_1].enabled = true;
-        s->settings.output_settings[OUTPUT_2].enabled = true;
-        break;
-
-      default:
-      case SELECT_NONE:
-        s->settings.output_settings[OUTPUT_1].enabled = false;
-        s->settings.output_settings[OUTPUT_2].enabled = false;
-        break;
-    }
+    int i;
+    for (i = 0; i < NUM_OUTPUTS; ++i)
+      s->settings.output_settings[i].enabled = (s->output_selection & (1 << i)) != 0;
 
     set_controller_settings(s);
   }
@@ -267,10 +244,17 @@ setpoint_type_button_clicked(button_event_t* event)
     setpoint_type_t new_sp_type = SP_STATIC;
     switch (s->settings.setpoint_type) {
       case SP_STATIC:
-        if (strlen(s->settings.temp_profile.name) > 0) {
+      {
+        temp_profile_lib_entry_t entry;
+        if (temp_profile_lib_find(s->settings.temp_profile_id, &entry)) {
+          new_sp_type = SP_TEMP_PROFILE;
+        }
+        else if (temp_profile_lib_get_entry(0, &entry)) {
+          s->settings.temp_profile_id = entry.id;
           new_sp_type = SP_TEMP_PROFILE;
         }
         break;
+      }
 
       case SP_TEMP_PROFILE:
         new_sp_type = SP_STATIC;
@@ -288,7 +272,31 @@ setpoint_type_button_clicked(button_event_t* event)
 static void
 temp_profile_button_clicked(button_event_t* event)
 {
-  (void)event;
+  if (event->id != EVT_BUTTON_CLICK)
+    return;
+
+  controller_settings_screen_t* s = widget_get_user_data(event->widget);
+  uint32_t num_profiles = temp_profile_lib_get_count();
+  uint32_t i;
+
+  if (num_profiles == 0)
+    return;
+
+  /* Select the next profile in the on-device library */
+  for (i = 0; i < num_profiles; ++i) {
+    temp_profile_lib_entry_t entry;
+    if (temp_profile_lib_get_entry(i, &entry) &&
+        entry.id == s->settings.temp_profile_id)
+      break;
+  }
+
+  temp_profile_lib_entry_t next;
+  uint32_t next_idx = (i < num_profiles) ? ((i + 1) % num_profiles) : 0;
+  if (temp_profile_lib_get_entry(next_idx, &next)) {
+    s->settings.temp_profile_id = next.id;
+    s->settings.temp_profile_start_point = 0;
+    set_controller_settings(s);
+  }
 }
 
 static void
@@ -303,11 +311,8 @@ static_setpoint_button_clicked(button_event_t* event)
   float min;
   float max;
 
-  char* title;
-  if (s->controller == CONTROLLER_1)
-    title = "Controller 1 Setpoint";
-  else
-    title = "Controller 2 Setpoint";
+  char title[32];
+  snprintf(title, sizeof(title), "Controller %d Setpoint", s->controller + 1);
 
   float velocity_steps[] = {
       0.1f, 0.5f, 1.0f
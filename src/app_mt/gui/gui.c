@@ -4,6 +4,8 @@
 #include "touch.h"
 #include "message.h"
 #include "screen_saver.h"
+#include "sensor.h"
+#include "latency_trace.h"
 
 
 typedef struct widget_stack_elem_s {
@@ -94,6 +96,10 @@ gui_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
   (void)listener_data;
 
   if (sub_data != NULL) {
+    if (id == MSG_SENSOR_SAMPLE) {
+      sensor_msg_t* sample = msg_data;
+      latency_trace_record(LT_DISPATCH_GUI, sample->sensor, sample->timestamp);
+    }
     dispatch_msg_to_widget(sub_data, id, msg_data);
   }
   else {
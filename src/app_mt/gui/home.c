@@ -29,6 +29,9 @@
 #define TILE_X(pos) (TILE_POS(pos) + 1)
 #define TILE_Y(pos) TILE_POS(pos)
 
+/* Size of each of n tiles sharing the span of ntiles tiles */
+#define TILE_SHARE(ntiles, n) ((TILE_SPAN(ntiles) - (((n) - 1) * TILE_SPACE)) / (n))
+
 typedef struct {
   widget_t* quantity_widget;
   widget_t* button;
@@ -78,6 +81,14 @@ static void set_conn_status(home_screen_t* s);
 static void place_quantity_widgets(home_screen_t* s);
 
 
+static const color_t sensor_colors[] = {
+    AMBER,
+    PURPLE,
+    EMERALD,
+    MAGENTA
+};
+
+
 static const widget_class_t home_widget_class = {
     .on_destroy = home_screen_destroy,
     .on_msg     = home_screen_msg
@@ -86,6 +97,7 @@ static const widget_class_t home_widget_class = {
 widget_t*
 home_screen_create()
 {
+  int i;
   home_screen_t* s = calloc(1, sizeof(home_screen_t));
 
   s->sample_timestamp = chTimeNow();
@@ -102,22 +114,26 @@ home_screen_create()
   s->stage_widget = widget_create(s->screen, NULL, NULL, rect);
   widget_set_background(s->stage_widget, GREEN);
 
+  /* The sensor tiles share the column to the right of the stage */
   rect.x = TILE_X(3);
   rect.width = TILE_SPAN(1);
-  rect.height = TILE_SPAN(1);
-  s->sensors[SENSOR_1].button = button_create(s->screen, rect, img_temp_med, WHITE, STEEL, click_sensor_button);
-
-  rect.y = TILE_Y(1);
-  s->sensors[SENSOR_2].button = button_create(s->screen, rect, img_temp_med, WHITE, STEEL, click_sensor_button);
+  rect.height = TILE_SHARE(2, NUM_SENSORS);
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    rect.y = TILE_Y(0) + (i * (rect.height + TILE_SPACE));
+    s->sensors[i].button = button_create(s->screen, rect, img_temp_med, WHITE, STEEL, click_sensor_button);
+  }
 
-  rect.x = TILE_X(0);
+  /* The output tiles share the first two tiles of the bottom row */
   rect.y = TILE_Y(2);
-  s->outputs[OUTPUT_1].button = button_create(s->screen, rect, img_plug, WHITE, STEEL, click_output_button);
-
-  rect.x = TILE_X(1);
-  s->outputs[OUTPUT_2].button = button_create(s->screen, rect, img_plug, WHITE, STEEL, click_output_button);
+  rect.width = TILE_SHARE(2, NUM_OUTPUTS);
+  rect.height = TILE_SPAN(1);
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    rect.x = TILE_X(0) + (i * (rect.width + TILE_SPACE));
+    s->outputs[i].button = button_create(s->screen, rect, img_plug, WHITE, STEEL, click_output_button);
+  }
 
   rect.x = TILE_X(2);
+  rect.width = TILE_SPAN(1);
   s->conn_button = button_create(s->screen, rect, img_signal, RED, STEEL, click_conn_button);
 
   rect.x = TILE_X(3);
@@ -125,18 +141,17 @@ home_screen_create()
 
   rect.x = 0;
   rect.width = TILE_SPAN(3);
-  s->sensors[SENSOR_1].quantity_widget = quantity_widget_create(s->stage_widget, rect, app_cfg_get_temp_unit());
-  widget_disable(s->sensors[SENSOR_1].quantity_widget);
-
-  s->sensors[SENSOR_2].quantity_widget = quantity_widget_create(s->stage_widget, rect, app_cfg_get_temp_unit());
-  widget_disable(s->sensors[SENSOR_2].quantity_widget);
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    s->sensors[i].quantity_widget = quantity_widget_create(s->stage_widget, rect, app_cfg_get_temp_unit());
+    widget_disable(s->sensors[i].quantity_widget);
+  }
 
   place_quantity_widgets(s);
 
-  set_output_settings(s, OUTPUT_1,
-      temp_control_get_output_function(OUTPUT_1));
-  set_output_settings(s, OUTPUT_2,
-      temp_control_get_output_function(OUTPUT_2));
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    set_output_settings(s, i,
+        temp_control_get_output_function(i));
+  }
 
   gui_msg_subscribe(MSG_SENSOR_SAMPLE, s->screen);
   gui_msg_subscribe(MSG_SENSOR_TIMEOUT, s->screen);
@@ -234,10 +249,8 @@ dispatch_sensor_sample(home_screen_t* s, sensor_msg_t* msg)
   if (s->sensors[msg->sensor].enabled) {
     widget_enable(s->sensors[msg->sensor].button, TRUE);
 
-    if (msg->sensor == SENSOR_1)
-      button_set_up_bg_color(s->sensors[msg->sensor].button, AMBER);
-    else
-      button_set_up_bg_color(s->sensors[msg->sensor].button, PURPLE);
+    button_set_up_bg_color(s->sensors[msg->sensor].button,
+        sensor_colors[msg->sensor % (sizeof(sensor_colors) / sizeof(sensor_colors[0]))]);
 
     place_quantity_widgets(s);
   }
@@ -411,10 +424,13 @@ click_sensor_button(button_event_t* event)
   home_screen_t* s = widget_get_instance_data(parent);
 
   sensor_id_t sensor;
-  if (event->widget == s->sensors[SENSOR_1].button)
-    sensor = SENSOR_1;
-  else
-    sensor = SENSOR_2;
+  for (sensor = 0; sensor < NUM_SENSORS; ++sensor) {
+    if (event->widget == s->sensors[sensor].button)
+      break;
+  }
+
+  if (sensor >= NUM_SENSORS)
+    return;
 
   widget_t* settings_screen = controller_settings_screen_create(sensor);
   gui_push_screen(settings_screen);
@@ -429,55 +445,52 @@ click_output_button(button_event_t* event)
   widget_t* parent = widget_get_parent(event->widget);
   home_screen_t* s = widget_get_instance_data(parent);
 
-  const controller_settings_t* controller1_settings = app_cfg_get_controller_settings(CONTROLLER_1);
-  const controller_settings_t* controller2_settings = app_cfg_get_controller_settings(CONTROLLER_2);
-
   output_id_t output;
+  temp_controller_id_t controller;
 
-  if (event->widget == s->outputs[OUTPUT_1].button)
-    output = OUTPUT_1;
-  else
-    output = OUTPUT_2;
+  for (output = 0; output < NUM_OUTPUTS; ++output) {
+    if (event->widget == s->outputs[output].button)
+      break;
+  }
 
-  output_function_t controller_1_function = controller1_settings->output_settings[output].function;
-  output_function_t controller_2_function = controller2_settings->output_settings[output].function;
+  if (output >= NUM_OUTPUTS)
+    return;
 
-  if (controller_1_function == OUTPUT_FUNC_MANUAL ||
-      controller_2_function == OUTPUT_FUNC_MANUAL) {
-    if (s->outputs[output].enabled == false)
-      s->outputs[output].enabled = true;
-    else
-      s->outputs[output].enabled = false;
+  for (controller = 0; controller < NUM_CONTROLLERS; ++controller) {
+    const controller_settings_t* cs = app_cfg_get_controller_settings(controller);
 
-    set_output_settings(s, output, OUTPUT_FUNC_MANUAL);
-  }
-  else if (controller_1_function == OUTPUT_FUNC_HEATING ||
-           controller_1_function == OUTPUT_FUNC_COOLING) {
-    if (s->output_ovrd[output] == true)
-      s->output_ovrd[output] = false;
-    else
-      s->output_ovrd[output] = true;
-
-    output_ovrd_msg_t msg = {
-        .output = output,
-        .controller = CONTROLLER_1
-    };
-    msg_send(MSG_OUTPUT_OVRD, &msg);
-    set_output_icon_color(s, output);
+    if (cs->output_settings[output].function == OUTPUT_FUNC_MANUAL) {
+      if (s->outputs[output].enabled == false)
+        s->outputs[output].enabled = true;
+      else
+        s->outputs[output].enabled = false;
+
+      set_output_settings(s, output, OUTPUT_FUNC_MANUAL);
+      return;
+    }
   }
-  else if (controller_2_function == OUTPUT_FUNC_HEATING ||
-           controller_2_function == OUTPUT_FUNC_COOLING) {
-    if (s->output_ovrd[output] == true)
-      s->output_ovrd[output] = false;
-    else
-      s->output_ovrd[output] = true;
-
-    output_ovrd_msg_t msg = {
-        .output = output,
-        .controller = CONTROLLER_2
-    };
-    msg_send(MSG_OUTPUT_OVRD, &msg);
-    set_output_icon_color(s, output);
+
+  /* Override the output on whichever controller is driving it */
+  for (controller = 0; controller < NUM_CONTROLLERS; ++controller) {
+    const output_settings_t* os =
+        &app_cfg_get_controller_settings(controller)->output_settings[output];
+
+    if (os->enabled &&
+        (os->function == OUTPUT_FUNC_HEATING ||
+         os->function == OUTPUT_FUNC_COOLING)) {
+      if (s->output_ovrd[output] == true)
+        s->output_ovrd[output] = false;
+      else
+        s->output_ovrd[output] = true;
+
+      output_ovrd_msg_t msg = {
+          .output = output,
+          .controller = controller
+      };
+      msg_send(MSG_OUTPUT_OVRD, &msg);
+      set_output_icon_color(s, output);
+      return;
+    }
   }
 }
 
@@ -8,10 +8,15 @@
 #include "net.h"
 #include "bootloader_api.h"
 #include "web_api.h"
+#include "app_cfg.h"
 
 #include <string.h>
 
 
+/* The auth token is too long for one row, so it is shown a piece at a time */
+#define TOKEN_CHARS_PER_ROW 24
+
+
 typedef struct {
   widget_t* widget;
 } info_screen_t;
@@ -27,6 +32,9 @@ back_button_clicked(button_event_t* event);
 static void
 add_info(widget_t* lb, const char* title, const char* version);
 
+static void
+add_token_info(widget_t* lb, const char* token);
+
 
 static const widget_class_t info_screen_widget_class = {
     .on_destroy = info_screen_destroy
@@ -87,6 +95,12 @@ info_screen_create()
   }
   add_info(lb, "MAC Addr", ns->mac_addr);
 
+  /* Local apps have to present the auth token, so it is shown while LAN
+   * access is on
+   */
+  if (app_cfg_get_lan_api_enabled())
+    add_token_info(lb, app_cfg_get_auth_token());
+
   return s->widget;
 }
 
@@ -120,6 +134,32 @@ add_info(widget_t* lb, const char* name, const char* value)
   listbox_add_item(lb, info_panel);
 }
 
+static void
+add_token_info(widget_t* lb, const char* token)
+{
+  char row[TOKEN_CHARS_PER_ROW + 1];
+  const char* name = "LAN Token";
+  size_t len = strlen(token);
+
+  if (len == 0) {
+    add_info(lb, name, "Not activated");
+    return;
+  }
+
+  while (len > 0) {
+    size_t n = MIN(len, TOKEN_CHARS_PER_ROW);
+
+    memcpy(row, token, n);
+    row[n] = 0;
+    add_info(lb, name, row);
+
+    /* Only the first row is titled */
+    name = "";
+    token += n;
+    len -= n;
+  }
+}
+
 static void
 back_button_clicked(button_event_t* event)
 {
@@ -13,14 +13,21 @@
 #define MIN_PROBE_OFFSET -30
 #define MAX_PROBE_OFFSET 30
 
+typedef struct offset_screen_s offset_screen_t;
+
 typedef struct {
+  offset_screen_t* screen;
+  sensor_id_t sensor;
+  bool enabled;
+} probe_button_t;
+
+struct offset_screen_s {
   sensor_id_t sensor_id;
-  bool sensor1_enabled;
-  bool sensor2_enabled;
+  probe_button_t probes[NUM_SENSORS];
 
   widget_t* screen;
   widget_t* button_list;
-} offset_screen_t;
+};
 
 
 static void back_button_clicked(button_event_t* event);
@@ -29,7 +36,13 @@ static void offset_screen_destroy(widget_t* w);
 static void offset_widget_msg(msg_event_t* event);
 static void update_probe_offset(quantity_t probe_offset, void* user_data);
 static void build_offset_screen(offset_screen_t* s, char* title);
+static void probe_offset_button_clicked(button_event_t* event);
+
 
+static const color_t probe_colors[] = {
+    AMBER,
+    MAGENTA
+};
 
 static const widget_class_t offset_widget_class = {
     .on_msg     = offset_widget_msg,
@@ -40,6 +53,12 @@ widget_t*
 offset_screen_create()
 {
   offset_screen_t* s = calloc(1, sizeof(offset_screen_t));
+  int i;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    s->probes[i].screen = s;
+    s->probes[i].sensor = i;
+  }
 
   s->screen = widget_create(NULL, &offset_widget_class, s, display_rect);
   widget_set_background(s->screen, BLACK);
@@ -61,23 +80,15 @@ static void offset_widget_msg(msg_event_t* event)
 
   if (event->msg_id == MSG_SENSOR_SAMPLE) {
     sensor_msg_t* msg = event->msg_data;
-    if (msg->sensor == SENSOR_1 && s->sensor1_enabled == false) {
-      s->sensor1_enabled = true;
-      rebuild_offset_screen(s);
-    }
-    else if (msg->sensor == SENSOR_2 && s->sensor2_enabled == false) {
-      s->sensor2_enabled = true;
+    if (msg->sensor < NUM_SENSORS && s->probes[msg->sensor].enabled == false) {
+      s->probes[msg->sensor].enabled = true;
       rebuild_offset_screen(s);
     }
   }
   else if (event->msg_id == MSG_SENSOR_TIMEOUT) {
     sensor_timeout_msg_t* msg = event->msg_data;
-    if (msg->sensor == SENSOR_1 && s->sensor1_enabled == true) {
-      s->sensor1_enabled = false;
-      rebuild_offset_screen(s);
-    }
-    else if (msg->sensor == SENSOR_2 && s->sensor2_enabled == true) {
-      s->sensor2_enabled = false;
+    if (msg->sensor < NUM_SENSORS && s->probes[msg->sensor].enabled == true) {
+      s->probes[msg->sensor].enabled = false;
       rebuild_offset_screen(s);
     }
   }
@@ -102,27 +113,18 @@ offset_screen_destroy(widget_t* w)
 }
 
 static void
-probe1_offset_button_clicked(button_event_t* event)
-{
-  if (event->id != EVT_BUTTON_CLICK)
-      return;
-
-  offset_screen_t* s = widget_get_user_data(event->widget);
-  s->sensor_id = SENSOR_1;
-
-  build_offset_screen(s, "Probe 1 Offset");
-}
-
-static void
-probe2_offset_button_clicked(button_event_t* event)
+probe_offset_button_clicked(button_event_t* event)
 {
   if (event->id != EVT_BUTTON_CLICK)
       return;
 
-  offset_screen_t* s = widget_get_user_data(event->widget);
-  s->sensor_id = SENSOR_2;
+  probe_button_t* probe = widget_get_user_data(event->widget);
+  offset_screen_t* s = probe->screen;
+  s->sensor_id = probe->sensor;
 
-  build_offset_screen(s, "Probe 2 Offset");
+  char title[32];
+  snprintf(title, sizeof(title), "Probe %d Offset", probe->sensor + 1);
+  build_offset_screen(s, title);
 }
 
 static void
@@ -159,59 +161,41 @@ static void
 rebuild_offset_screen(offset_screen_t* s)
 {
   uint32_t num_buttons = 0;
-  button_spec_t buttons[3];
-  char* text;
+  button_spec_t buttons[NUM_SENSORS];
   char* units_subtext;
-  char* probe1_subtext = NULL;
-  char* probe2_subtext = NULL;
-
-  bool sensor1_connected = get_sensor_conn_status(SENSOR_1);
-  bool sensor2_connected = get_sensor_conn_status(SENSOR_2);
-
-  sensor_config_t* sensor1_cfg = get_sensor_cfg(SENSOR_1);
-  sensor_config_t* sensor2_cfg = get_sensor_cfg(SENSOR_2);
-
-  quantity_t probe1_offset = app_cfg_get_probe_offset(sensor1_cfg->sensor_serial);
-  quantity_t probe2_offset = app_cfg_get_probe_offset(sensor2_cfg->sensor_serial);
-
-  if (app_cfg_get_temp_unit() == UNIT_TEMP_DEG_F) {
-    units_subtext = "F";
-  }
-  else {
-    probe1_offset.value *= (5.0f / 9.0f);
-    probe2_offset.value *= (5.0f / 9.0f);
-    units_subtext = "C";
-  }
-
-  if (sensor1_connected == true) {
-    text = "Probe 1 Offset";
-    probe1_subtext = malloc(128);
-    snprintf(probe1_subtext, 128, "Probe 1 Offset: %d.%d %s",
-         (int)(probe1_offset.value),
-         ((int)(fabs(probe1_offset.value) * 10.0f)) % 10,
+  char* text = malloc(NUM_SENSORS * 32);
+  char* subtext = malloc(NUM_SENSORS * 128);
+  int i;
+
+  bool deg_f = (app_cfg_get_temp_unit() == UNIT_TEMP_DEG_F);
+  units_subtext = deg_f ? "F" : "C";
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (!get_sensor_conn_status(i))
+      continue;
+
+    sensor_config_t* sensor_cfg = get_sensor_cfg(i);
+    quantity_t probe_offset = app_cfg_get_probe_offset(sensor_cfg->sensor_serial);
+    if (!deg_f)
+      probe_offset.value *= (5.0f / 9.0f);
+
+    char* probe_text = text + (i * 32);
+    char* probe_subtext = subtext + (i * 128);
+    snprintf(probe_text, 32, "Probe %d Offset", i + 1);
+    snprintf(probe_subtext, 128, "Probe %d Offset: %d.%d %s",
+         i + 1,
+         (int)(probe_offset.value),
+         ((int)(fabs(probe_offset.value) * 10.0f)) % 10,
          units_subtext);
-    add_button_spec(buttons, &num_buttons, probe1_offset_button_clicked, img_temp_med, AMBER,
-        text, probe1_subtext, s);
-  }
 
-  if (sensor2_connected == true) {
-    text = "Probe 2 Offset";
-    probe2_subtext = malloc(128);
-    snprintf(probe2_subtext, 128, "Probe 2 Offset: %d.%d %s",
-         (int)(probe2_offset.value),
-         ((int)(fabs(probe2_offset.value) * 10.0f)) % 10,
-         units_subtext);
-
-    add_button_spec(buttons, &num_buttons, probe2_offset_button_clicked, img_temp_med, MAGENTA,
-        text, probe2_subtext, s);
+    color_t color = probe_colors[i % (sizeof(probe_colors) / sizeof(probe_colors[0]))];
+    add_button_spec(buttons, &num_buttons, probe_offset_button_clicked, img_temp_med, color,
+        probe_text, probe_subtext, &s->probes[i]);
   }
 
   button_list_set_buttons(s->button_list, buttons, num_buttons);
 
-  if (probe1_subtext != NULL)
-    free(probe1_subtext);
-
-  if (probe2_subtext != NULL)
-    free(probe2_subtext);
+  free(text);
+  free(subtext);
 }
 
@@ -17,6 +17,10 @@
 #define MIN_CYCLE_DELAY 0.0
 #define MAX_CYCLE_DELAY 30.0
 
+/* A window of 0 is "Off" and puts the output back in setpoint shift mode */
+#define MIN_WINDOW 0.0
+#define MAX_WINDOW 1800.0
+
 typedef struct {
   widget_t* screen;
   widget_t* button_list;
@@ -31,6 +35,8 @@ static void back_button_clicked(button_event_t* event);
 static void cycle_delay_button_clicked(button_event_t* event);
 static void function_button_clicked(button_event_t* event);
 static void update_cycle_delay(quantity_t delay, void* user_data);
+static void window_button_clicked(button_event_t* event);
+static void update_window(quantity_t window, void* user_data);
 
 
 static const widget_class_t output_settings_widget_class = {
@@ -70,6 +76,7 @@ set_output_settings(output_screen_t* s)
 
   char* subtext;
   char* delay_subtext;
+  char* window_subtext;
   char* text;
   color_t color;
   const Image_t* img;
@@ -106,8 +113,18 @@ set_output_settings(output_screen_t* s)
   add_button_spec(buttons, &num_buttons, cycle_delay_button_clicked, img_stopwatch, GREEN,
       "Compressor Delay", delay_subtext, s);
 
+  window_subtext = malloc(128);
+  if (s->settings->window.value > 0)
+    snprintf(window_subtext, 128, "PID output window: %d Sec",
+      (int)(s->settings->window.value));
+  else
+    snprintf(window_subtext, 128, "PID output window: Off");
+  add_button_spec(buttons, &num_buttons, window_button_clicked, img_stopwatch, PURPLE,
+      "Output Window", window_subtext, s);
+
   button_list_set_buttons(s->button_list, buttons, num_buttons);
   free(delay_subtext);
+  free(window_subtext);
 }
 
 static void
@@ -160,3 +177,29 @@ update_cycle_delay(quantity_t delay, void* user_data)
 
   set_output_settings(s);
 }
+
+static void
+window_button_clicked(button_event_t* event)
+{
+  if (event->id != EVT_BUTTON_CLICK)
+    return;
+
+  output_screen_t* s = widget_get_user_data(event->widget);
+
+  float velocity_steps[] = {
+      10.0f, 60.0f
+  };
+  widget_t* window_screen = quantity_select_screen_create(
+      "Output Window", s->settings->window, MIN_WINDOW, MAX_WINDOW, velocity_steps, 2,
+      update_window, s);
+  gui_push_screen(window_screen);
+}
+
+static void
+update_window(quantity_t window, void* user_data)
+{
+  output_screen_t* s = user_data;
+  s->settings->window = window;
+
+  set_output_settings(s);
+}
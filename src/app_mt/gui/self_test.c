@@ -56,7 +56,7 @@ static void
 dispatch_api_status(self_test_screen_t* s, api_status_t* status);
 
 static void
-relay_test(widget_t* label, uint32_t write_pad, uint32_t read_pad);
+relay_test(widget_t* label, const relay_channel_t* relay);
 
 static msg_t
 test_thread(void* arg);
@@ -71,6 +71,8 @@ static const widget_class_t self_test_widget_class = {
 widget_t*
 self_test_screen_create()
 {
+  int i;
+  char name[16];
   self_test_screen_t* s = calloc(1, sizeof(self_test_screen_t));
   widget_t* widget = widget_create(NULL, &self_test_widget_class, s, display_rect);
 
@@ -112,29 +114,23 @@ self_test_screen_create()
   button_create(widget, rect, img_update, WHITE, BLACK, update_recovery_img_button_clicked);
   rect.width = 120;
 
-  rect.x = 30;
-  rect.y += 20;
-  label_create(widget, rect, "Sensor 1:", font_opensans_regular_12, WHITE, 1);
-  rect.x = 160;
-  s->sensor_test_status[SENSOR_1] = label_create(widget, rect, "NO DATA", font_opensans_regular_12, WHITE, 1);
-
-  rect.x = 30;
-  rect.y += 20;
-  label_create(widget, rect, "Sensor 2:", font_opensans_regular_12, WHITE, 1);
-  rect.x = 160;
-  s->sensor_test_status[SENSOR_2] = label_create(widget, rect, "NO DATA", font_opensans_regular_12, WHITE, 1);
-
-  rect.x = 30;
-  rect.y += 20;
-  label_create(widget, rect, "Relay 1:", font_opensans_regular_12, WHITE, 1);
-  rect.x = 160;
-  s->relay_test_status[OUTPUT_1] = label_create(widget, rect, "NOT STARTED", font_opensans_regular_12, WHITE, 1);
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    rect.x = 30;
+    rect.y += 20;
+    snprintf(name, sizeof(name), "Sensor %d:", i + 1);
+    label_create(widget, rect, name, font_opensans_regular_12, WHITE, 1);
+    rect.x = 160;
+    s->sensor_test_status[i] = label_create(widget, rect, "NO DATA", font_opensans_regular_12, WHITE, 1);
+  }
 
-  rect.x = 30;
-  rect.y += 20;
-  label_create(widget, rect, "Relay 2:", font_opensans_regular_12, WHITE, 1);
-  rect.x = 160;
-  s->relay_test_status[OUTPUT_2] = label_create(widget, rect, "NOT STARTED", font_opensans_regular_12, WHITE, 1);
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    rect.x = 30;
+    rect.y += 20;
+    snprintf(name, sizeof(name), "Relay %d:", i + 1);
+    label_create(widget, rect, name, font_opensans_regular_12, WHITE, 1);
+    rect.x = 160;
+    s->relay_test_status[i] = label_create(widget, rect, "NOT STARTED", font_opensans_regular_12, WHITE, 1);
+  }
 
   rect.x = 30;
   rect.y += 20;
@@ -157,6 +153,7 @@ static msg_t
 test_thread(void* arg)
 {
   self_test_screen_t* s = arg;
+  int i;
 
   // Wait for temp control threads to start up and stop messing
   // with the relays...
@@ -171,31 +168,31 @@ test_thread(void* arg)
   app_cfg_set_net_settings(&ns);
 
   while (!chThdShouldTerminate()) {
-    relay_test(s->relay_test_status[OUTPUT_1], PAD_RELAY1, PAD_RELAY1_TEST);
-    chThdSleepSeconds(1);
-    relay_test(s->relay_test_status[OUTPUT_2], PAD_RELAY2, PAD_RELAY2_TEST);
-    chThdSleepSeconds(1);
+    for (i = 0; i < NUM_OUTPUTS; ++i) {
+      relay_test(s->relay_test_status[i], temp_control_get_relay_channel(i));
+      chThdSleepSeconds(1);
+    }
   }
 
   return 0;
 }
 
 static void
-relay_test(widget_t* label, uint32_t write_pad, uint32_t read_pad)
+relay_test(widget_t* label, const relay_channel_t* relay)
 {
   color_t color = GREEN;
   char* result = "PASS";
 
-  palSetPad(GPIOC, write_pad);
+  palSetPad(relay->port, relay->pad);
   chThdSleepMilliseconds(100);
-  if (palReadPad(GPIOE, read_pad) != 1) {
+  if (palReadPad(relay->test_port, relay->test_pad) != 1) {
     result = "FAIL";
     color = RED;
   }
 
-  palClearPad(GPIOC, write_pad);
+  palClearPad(relay->port, relay->pad);
   chThdSleepMilliseconds(100);
-  if (palReadPad(GPIOE, read_pad) != 0) {
+  if (palReadPad(relay->test_port, relay->test_pad) != 0) {
     result = "FAIL";
     color = RED;
   }
@@ -12,6 +12,8 @@
 #include "gui/button_list.h"
 #include "quantity_select.h"
 #include "gui/offset.h"
+#include "message.h"
+#include "temp_control.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -37,6 +39,10 @@ static void calibrate_screen_button_clicked(button_event_t* event);
 static void probe_offset_button_clicked(button_event_t* event);
 static void info_button_clicked(button_event_t* event);
 static void control_mode_button_clicked(button_event_t* event);
+static void lan_api_button_clicked(button_event_t* event);
+static void autotune_button_clicked(button_event_t* event);
+static bool can_autotune(const output_settings_t* os);
+static bool any_output_can_autotune(void);
 static void rebuild_settings_screen(settings_screen_t* s);
 static void hysteresis_button_clicked(button_event_t* event);
 static void update_hysteresis(quantity_t hysteresis, void* user_data);
@@ -163,6 +169,73 @@ control_mode_button_clicked(button_event_t* event)
   }
 }
 
+static void
+lan_api_button_clicked(button_event_t* event)
+{
+  if (event->id == EVT_BUTTON_CLICK) {
+    settings_screen_t* s = widget_get_user_data(event->widget);
+
+    app_cfg_set_lan_api_enabled(!app_cfg_get_lan_api_enabled());
+
+    rebuild_settings_screen(s);
+  }
+}
+
+static void
+autotune_button_clicked(button_event_t* event)
+{
+  int c, o;
+
+  if (event->id != EVT_BUTTON_CLICK)
+    return;
+
+  /* Start a relay autotune on every output driving a proportional window */
+  for (c = 0; c < NUM_CONTROLLERS; ++c) {
+    const controller_settings_t* cs = app_cfg_get_controller_settings(c);
+
+    for (o = 0; o < NUM_OUTPUTS; ++o) {
+      if (!can_autotune(&cs->output_settings[o]))
+        continue;
+
+      pid_autotune_msg_t msg = {
+          .output = o,
+          .controller = c
+      };
+      msg_send(MSG_PID_AUTOTUNE, &msg);
+    }
+  }
+
+  gui_pop_screen();
+}
+
+/* The relay test measures the response to the relay duty cycle, so its gains
+ * only make sense for outputs run as a proportional window.
+ */
+static bool
+can_autotune(const output_settings_t* os)
+{
+  return os->enabled &&
+      os->function != OUTPUT_FUNC_MANUAL &&
+      os->window.value > 0;
+}
+
+static bool
+any_output_can_autotune()
+{
+  int c, o;
+
+  for (c = 0; c < NUM_CONTROLLERS; ++c) {
+    const controller_settings_t* cs = app_cfg_get_controller_settings(c);
+
+    for (o = 0; o < NUM_OUTPUTS; ++o) {
+      if (can_autotune(&cs->output_settings[o]))
+        return true;
+    }
+  }
+
+  return false;
+}
+
 static void
 hysteresis_button_clicked(button_event_t* event)
 {
@@ -229,7 +302,7 @@ static void
 rebuild_settings_screen(settings_screen_t* s)
 {
   uint32_t num_buttons = 0;
-  button_spec_t buttons[8];
+  button_spec_t buttons[10];
   color_t color = DARK_GRAY;
 
   char* subtext;
@@ -261,6 +334,10 @@ rebuild_settings_screen(settings_screen_t* s)
   add_button_spec(buttons, &num_buttons, control_mode_button_clicked, img_graph_signal, color,
       "Control Mode", subtext, s);
 
+  if (app_cfg_get_control_mode() == PID && any_output_can_autotune())
+    add_button_spec(buttons, &num_buttons, autotune_button_clicked, img_graph_signal, PURPLE,
+        "PID Autotune", "Tune the PID gains of outputs with a window", s);
+
   hysteresis_subtext = malloc(128);
   quantity_t hysteresis = app_cfg_get_hysteresis();
 
@@ -296,6 +373,17 @@ rebuild_settings_screen(settings_screen_t* s)
   add_button_spec(buttons, &num_buttons, screen_saver_button_clicked, img_screen_saver, PINK,
       "Screen Saver", screen_saver_subtext, s);
 
+  if (app_cfg_get_lan_api_enabled()) {
+    color = GREEN;
+    subtext = "On - Local apps with the token in Info can connect";
+  }
+  else {
+    color = DARK_GRAY;
+    subtext = "Off - Only the BrewBit server can connect";
+  }
+  add_button_spec(buttons, &num_buttons, lan_api_button_clicked, img_signal, color,
+      "LAN Access", subtext, s);
+
   add_button_spec(buttons, &num_buttons, info_button_clicked, img_info, CYAN,
       "Model-T Info", "Display detailed device information", s);
 
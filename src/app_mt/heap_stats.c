@@ -0,0 +1,41 @@
+
+#include "ch.h"
+#include "heap_stats.h"
+
+#include <stdio.h>
+#include <malloc.h>
+
+
+static uint32_t used_max_bytes;
+
+
+void
+heap_stats_get(heap_stats_t* stats)
+{
+  struct mallinfo mi = mallinfo();
+
+  stats->arena_bytes = mi.arena;
+  stats->used_bytes = mi.uordblks;
+  stats->free_bytes = mi.fordblks;
+  stats->core_free_bytes = chCoreStatus();
+
+  if (stats->used_bytes > used_max_bytes)
+    used_max_bytes = stats->used_bytes;
+  stats->used_max_bytes = used_max_bytes;
+}
+
+void
+heap_stats_print()
+{
+  heap_stats_t stats;
+
+  heap_stats_get(&stats);
+
+  printf("heap: %u used (%u max), %u free in %u arena (%u%% fragmented), %u core left\r\n",
+      (unsigned)stats.used_bytes,
+      (unsigned)stats.used_max_bytes,
+      (unsigned)stats.free_bytes,
+      (unsigned)stats.arena_bytes,
+      (unsigned)(stats.arena_bytes ? (stats.free_bytes * 100) / stats.arena_bytes : 0),
+      (unsigned)stats.core_free_bytes);
+}
@@ -0,0 +1,29 @@
+
+#ifndef HEAP_STATS_H
+#define HEAP_STATS_H
+
+#include <stdint.h>
+
+
+typedef struct {
+  /* Memory the C heap has taken from the core allocator. It is never given
+   * back, so this is also the heap high water mark.
+   */
+  uint32_t arena_bytes;
+  uint32_t used_bytes;
+  /* Free space inside the arena, which is all fragmentation */
+  uint32_t free_bytes;
+  /* Highest used_bytes seen by heap_stats_get() */
+  uint32_t used_max_bytes;
+  /* Core memory nothing has claimed yet */
+  uint32_t core_free_bytes;
+} heap_stats_t;
+
+
+void
+heap_stats_get(heap_stats_t* stats);
+
+void
+heap_stats_print(void);
+
+#endif
@@ -0,0 +1,598 @@
+#include "ch.h"
+#include "kv_store.h"
+#include "sxfs.h"
+#include "common.h"
+#include "crc/crc32.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+
+/* The store is a log of entries kept in one of two partitions, managed the
+ * same way as the temp profile library. Each entry holds one or more items
+ * and only becomes valid once its magic is written, which happens last, so
+ * all of the items in an entry take effect together or not at all.
+ *
+ * A hash index in RAM maps each key to the location of its latest value. It
+ * is rebuilt by replaying the log at boot.
+ */
+#define KV_PART_SIZE    0x00020000
+#define KV_PART_MAGIC   0x534B5642 // "BVKS"
+#define KV_ENTRY_MAGIC  0x454B5642 // "BVKE"
+
+#define KV_ITEM_DELETED 0x0001
+
+/* Must be a power of two and comfortably larger than KV_MAX_KEYS */
+#define KV_INDEX_SIZE   128
+
+#define ALIGN4(len)    (((len) + 3) & ~3)
+#define ITEM_SIZE(len) (sizeof(kv_item_hdr_t) + ALIGN4(len))
+#define ENTRY_SIZE(body_len) (sizeof(kv_entry_hdr_t) + (body_len))
+
+
+typedef struct {
+  uint32_t magic;
+  uint32_t generation;
+} kv_part_hdr_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t len;
+} kv_entry_hdr_t;
+
+typedef struct {
+  uint32_t key;
+  uint16_t flags;
+  uint16_t len;
+} kv_item_hdr_t;
+
+typedef struct {
+  uint32_t key;
+  /* Offset of the value in the partition, 0 marks an empty slot */
+  uint32_t offset;
+  uint32_t len;
+} kv_index_entry_t;
+
+typedef struct {
+  const uint8_t* data;
+  uint32_t pos;
+} kv_compare_t;
+
+typedef struct {
+  Mutex mtx;
+  sxfs_part_id_t part;
+  uint32_t generation;
+  uint32_t write_pos;
+
+  /* Space the live values would take after a compaction */
+  uint32_t live_bytes;
+
+  uint32_t num_keys;
+  kv_index_entry_t index[KV_INDEX_SIZE];
+} kv_store_t;
+
+
+static bool read_part_hdr(sxfs_part_id_t part, kv_part_hdr_t* hdr);
+static bool format_part(sxfs_part_id_t part, uint32_t generation);
+static void scan(void);
+static void apply_entry(uint32_t offset, uint32_t len);
+static bool compact(void);
+static bool copy_region(sxfs_part_id_t src, uint32_t src_offset, sxfs_part_id_t dst, uint32_t dst_offset, uint32_t len);
+static uint32_t home_slot(uint32_t key);
+static int find_slot(uint32_t key);
+static bool index_set(uint32_t key, uint32_t offset, uint32_t len);
+static void index_remove(uint32_t key);
+static bool value_equals(const kv_index_entry_t* entry, const void* data, uint32_t len);
+static bool compare_chunk(const uint8_t* data, uint32_t len, void* arg);
+
+
+static kv_store_t kv;
+static const uint8_t zero_pad[4];
+
+
+void
+kv_store_init()
+{
+  kv_part_hdr_t hdr1;
+  kv_part_hdr_t hdr2;
+
+  chMtxInit(&kv.mtx);
+
+  bool valid1 = read_part_hdr(SP_KV_STORE_1, &hdr1);
+  bool valid2 = read_part_hdr(SP_KV_STORE_2, &hdr2);
+
+  if (valid1 && (!valid2 || hdr1.generation >= hdr2.generation)) {
+    kv.part = SP_KV_STORE_1;
+    kv.generation = hdr1.generation;
+
+    /* A compaction was interrupted before the old partition was erased */
+    if (valid2)
+      sxfs_erase_all_async(SP_KV_STORE_2);
+  }
+  else if (valid2) {
+    kv.part = SP_KV_STORE_2;
+    kv.generation = hdr2.generation;
+
+    if (valid1)
+      sxfs_erase_all_async(SP_KV_STORE_1);
+  }
+  else {
+    kv.part = SP_KV_STORE_1;
+    kv.generation = 1;
+    sxfs_erase_all(SP_KV_STORE_1);
+    sxfs_erase_all_async(SP_KV_STORE_2);
+    format_part(kv.part, kv.generation);
+  }
+
+  scan();
+
+  printf("KV store: %d keys, %d bytes used\r\n",
+      (int)kv.num_keys, (int)kv.write_pos);
+}
+
+bool
+kv_get(uint32_t key, void* data, uint32_t data_len, uint32_t* value_len)
+{
+  bool ret = false;
+
+  chMtxLock(&kv.mtx);
+
+  int slot = find_slot(key);
+  if (slot >= 0) {
+    kv_index_entry_t* entry = &kv.index[slot];
+
+    if (value_len != NULL)
+      *value_len = entry->len;
+
+    /* A short buffer only gets the length, so callers can size a retry */
+    if (data_len >= entry->len)
+      ret = sxfs_read(kv.part, entry->offset, data, entry->len);
+  }
+
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+kv_put(uint32_t key, const void* data, uint32_t len)
+{
+  kv_item_t item = {
+      .key = key,
+      .deleted = false,
+      .data = data,
+      .len = len
+  };
+
+  /* Rewriting the value the store already holds only wears the flash */
+  chMtxLock(&kv.mtx);
+  int slot = find_slot(key);
+  bool unchanged = (slot >= 0) && value_equals(&kv.index[slot], data, len);
+  chMtxUnlock();
+
+  if (unchanged)
+    return true;
+
+  return kv_commit(&item, 1);
+}
+
+bool
+kv_delete(uint32_t key)
+{
+  kv_item_t item = {
+      .key = key,
+      .deleted = true,
+      .data = NULL,
+      .len = 0
+  };
+
+  return kv_commit(&item, 1);
+}
+
+bool
+kv_commit(const kv_item_t* items, uint32_t num_items)
+{
+  uint32_t i;
+  uint32_t body_len = 0;
+  uint32_t num_new_keys = 0;
+  bool ret = true;
+
+  if (items == NULL || num_items == 0)
+    return false;
+
+  for (i = 0; i < num_items; ++i) {
+    if (!items[i].deleted &&
+        (items[i].len > KV_MAX_VALUE_SIZE || (items[i].len > 0 && items[i].data == NULL)))
+      return false;
+
+    body_len += ITEM_SIZE(items[i].deleted ? 0 : items[i].len);
+  }
+
+  chMtxLock(&kv.mtx);
+
+  for (i = 0; i < num_items; ++i) {
+    if (!items[i].deleted && find_slot(items[i].key) < 0)
+      num_new_keys++;
+  }
+
+  if (kv.num_keys + num_new_keys > KV_MAX_KEYS) {
+    printf("KV store index full!\r\n");
+    chMtxUnlock();
+    return false;
+  }
+
+  if (kv.write_pos + ENTRY_SIZE(body_len) > KV_PART_SIZE)
+    compact();
+
+  if (kv.write_pos + ENTRY_SIZE(body_len) > KV_PART_SIZE) {
+    printf("KV store full!\r\n");
+    chMtxUnlock();
+    return false;
+  }
+
+  /* The CRC covers the item headers, values and padding. It is worked out
+   * up front so the entry can be written in one pass, and is seeded the
+   * same way as sxfs_crc(), which checks it at boot.
+   */
+  uint32_t crc = 0xFFFFFFFF;
+  for (i = 0; i < num_items; ++i) {
+    uint32_t len = items[i].deleted ? 0 : items[i].len;
+    kv_item_hdr_t item_hdr = {
+        .key = items[i].key,
+        .flags = items[i].deleted ? KV_ITEM_DELETED : 0,
+        .len = len
+    };
+
+    crc = crc32_block(crc, &item_hdr, sizeof(item_hdr));
+    if (len > 0)
+      crc = crc32_block(crc, (void*)items[i].data, len);
+    if (ALIGN4(len) != len)
+      crc = crc32_block(crc, (void*)zero_pad, ALIGN4(len) - len);
+  }
+
+  /* The magic is left erased until everything else is on flash */
+  uint32_t entry_offset = kv.write_pos;
+  kv_entry_hdr_t entry_hdr = {
+      .magic = 0xFFFFFFFF,
+      .crc = crc,
+      .len = body_len
+  };
+  ret = sxfs_write(kv.part, entry_offset, (uint8_t*)&entry_hdr, sizeof(entry_hdr));
+
+  uint32_t pos = entry_offset + sizeof(kv_entry_hdr_t);
+  for (i = 0; ret && i < num_items; ++i) {
+    uint32_t len = items[i].deleted ? 0 : items[i].len;
+    kv_item_hdr_t item_hdr = {
+        .key = items[i].key,
+        .flags = items[i].deleted ? KV_ITEM_DELETED : 0,
+        .len = len
+    };
+
+    ret = sxfs_write(kv.part, pos, (uint8_t*)&item_hdr, sizeof(item_hdr));
+    if (ret && len > 0)
+      ret = sxfs_write(kv.part, pos + sizeof(item_hdr), (uint8_t*)items[i].data, len);
+    if (ret && ALIGN4(len) != len)
+      ret = sxfs_write(kv.part, pos + sizeof(item_hdr) + len, (uint8_t*)zero_pad, ALIGN4(len) - len);
+
+    pos += ITEM_SIZE(len);
+  }
+
+  if (ret) {
+    entry_hdr.magic = KV_ENTRY_MAGIC;
+    ret = sxfs_write(kv.part, entry_offset, (uint8_t*)&entry_hdr.magic, sizeof(entry_hdr.magic));
+  }
+
+  /* Consume the space even on failure since it may be partially written */
+  kv.write_pos += ENTRY_SIZE(body_len);
+
+  if (ret)
+    apply_entry(entry_offset, body_len);
+
+  chMtxUnlock();
+
+  return ret;
+}
+
+void
+kv_store_get_stats(kv_store_stats_t* stats)
+{
+  chMtxLock(&kv.mtx);
+  stats->num_keys = kv.num_keys;
+  stats->used_bytes = kv.write_pos;
+  stats->live_bytes = kv.live_bytes;
+  stats->generation = kv.generation;
+  chMtxUnlock();
+}
+
+static bool
+read_part_hdr(sxfs_part_id_t part, kv_part_hdr_t* hdr)
+{
+  if (!sxfs_read(part, 0, (uint8_t*)hdr, sizeof(kv_part_hdr_t)))
+    return false;
+
+  return (hdr->magic == KV_PART_MAGIC);
+}
+
+static bool
+format_part(sxfs_part_id_t part, uint32_t generation)
+{
+  kv_part_hdr_t hdr = {
+      .magic = KV_PART_MAGIC,
+      .generation = generation
+  };
+
+  return sxfs_write(part, 0, (uint8_t*)&hdr, sizeof(hdr));
+}
+
+static void
+scan()
+{
+  uint32_t offset = sizeof(kv_part_hdr_t);
+
+  memset(kv.index, 0, sizeof(kv.index));
+  kv.num_keys = 0;
+  kv.live_bytes = 0;
+
+  while (offset + sizeof(kv_entry_hdr_t) <= KV_PART_SIZE) {
+    kv_entry_hdr_t hdr;
+    uint32_t crc;
+
+    sxfs_read(kv.part, offset, (uint8_t*)&hdr, sizeof(hdr));
+
+    /* Erased space marks the end of the log. A header that was only partly
+     * written is not erased, and must not be written over.
+     */
+    if (hdr.magic == 0xFFFFFFFF && hdr.crc == 0xFFFFFFFF && hdr.len == 0xFFFFFFFF)
+      break;
+
+    /* A torn header has no usable length, so treat the rest as used */
+    if (hdr.len > (KV_PART_SIZE - offset - sizeof(hdr))) {
+      offset = KV_PART_SIZE;
+      break;
+    }
+
+    if (hdr.magic == KV_ENTRY_MAGIC &&
+        sxfs_crc(kv.part, offset + sizeof(hdr), hdr.len, &crc) &&
+        crc == hdr.crc)
+      apply_entry(offset, hdr.len);
+
+    offset += ENTRY_SIZE(hdr.len);
+  }
+
+  kv.write_pos = offset;
+}
+
+/* Replays the items of a committed entry into the index */
+static void
+apply_entry(uint32_t offset, uint32_t len)
+{
+  uint32_t pos = offset + sizeof(kv_entry_hdr_t);
+  uint32_t end = pos + len;
+
+  while (pos + sizeof(kv_item_hdr_t) <= end) {
+    kv_item_hdr_t item_hdr;
+
+    if (!sxfs_read(kv.part, pos, (uint8_t*)&item_hdr, sizeof(item_hdr)))
+      break;
+
+    if (item_hdr.flags & KV_ITEM_DELETED)
+      index_remove(item_hdr.key);
+    else
+      index_set(item_hdr.key, pos + sizeof(item_hdr), item_hdr.len);
+
+    pos += ITEM_SIZE(item_hdr.len);
+  }
+}
+
+/* Copies each live value into the other partition as an entry of its own.
+ * The index is only updated once the copy is complete and active.
+ */
+static bool
+compact()
+{
+  uint32_t i;
+  sxfs_part_id_t dst =
+      (kv.part == SP_KV_STORE_1) ? SP_KV_STORE_2 : SP_KV_STORE_1;
+  uint32_t dst_pos = sizeof(kv_part_hdr_t);
+
+  printf("Compacting KV store\r\n");
+
+  if (!sxfs_erase_all(dst))
+    return false;
+
+  for (i = 0; i < KV_INDEX_SIZE; ++i) {
+    kv_index_entry_t* entry = &kv.index[i];
+    uint32_t body_len = ITEM_SIZE(entry->len);
+    kv_entry_hdr_t entry_hdr;
+    kv_item_hdr_t item_hdr = {
+        .key = entry->key,
+        .flags = 0,
+        .len = entry->len
+    };
+
+    if (entry->offset == 0)
+      continue;
+
+    if (!sxfs_write(dst, dst_pos + sizeof(entry_hdr), (uint8_t*)&item_hdr, sizeof(item_hdr)) ||
+        !copy_region(kv.part, entry->offset, dst, dst_pos + sizeof(entry_hdr) + sizeof(item_hdr), ALIGN4(entry->len)))
+      return false;
+
+    entry_hdr.magic = KV_ENTRY_MAGIC;
+    entry_hdr.len = body_len;
+    if (!sxfs_crc(dst, dst_pos + sizeof(entry_hdr), body_len, &entry_hdr.crc) ||
+        !sxfs_write(dst, dst_pos, (uint8_t*)&entry_hdr, sizeof(entry_hdr)))
+      return false;
+
+    dst_pos += ENTRY_SIZE(body_len);
+  }
+
+  /* The partition header is written last so the copy only becomes active
+   * once it is complete.
+   */
+  if (!format_part(dst, kv.generation + 1))
+    return false;
+
+  sxfs_erase_all_async(kv.part);
+
+  dst_pos = sizeof(kv_part_hdr_t);
+  for (i = 0; i < KV_INDEX_SIZE; ++i) {
+    kv_index_entry_t* entry = &kv.index[i];
+
+    if (entry->offset == 0)
+      continue;
+
+    entry->offset = dst_pos + sizeof(kv_entry_hdr_t) + sizeof(kv_item_hdr_t);
+    dst_pos += ENTRY_SIZE(ITEM_SIZE(entry->len));
+  }
+
+  kv.part = dst;
+  kv.generation++;
+  kv.write_pos = dst_pos;
+
+  return true;
+}
+
+static bool
+copy_region(sxfs_part_id_t src, uint32_t src_offset, sxfs_part_id_t dst, uint32_t dst_offset, uint32_t len)
+{
+  uint8_t buf[256];
+
+  while (len > 0) {
+    uint32_t chunk_len = MIN(len, sizeof(buf));
+
+    if (!sxfs_read(src, src_offset, buf, chunk_len) ||
+        !sxfs_write(dst, dst_offset, buf, chunk_len))
+      return false;
+
+    src_offset += chunk_len;
+    dst_offset += chunk_len;
+    len -= chunk_len;
+  }
+
+  return true;
+}
+
+static bool
+value_equals(const kv_index_entry_t* entry, const void* data, uint32_t len)
+{
+  kv_compare_t cmp = {
+      .data = data,
+      .pos = 0
+  };
+
+  if (entry->len != len)
+    return false;
+
+  if (len == 0)
+    return true;
+
+  return sxfs_read_stream(kv.part, entry->offset, len, compare_chunk, &cmp);
+}
+
+static bool
+compare_chunk(const uint8_t* data, uint32_t len, void* arg)
+{
+  kv_compare_t* cmp = arg;
+
+  if (memcmp(cmp->data + cmp->pos, data, len) != 0)
+    return false;
+
+  cmp->pos += len;
+  return true;
+}
+
+static uint32_t
+home_slot(uint32_t key)
+{
+  /* Fibonacci hashing, the upper bits of the product are the best mixed */
+  return ((key * 2654435761u) >> 16) & (KV_INDEX_SIZE - 1);
+}
+
+static int
+find_slot(uint32_t key)
+{
+  uint32_t i;
+  uint32_t slot = home_slot(key);
+
+  for (i = 0; i < KV_INDEX_SIZE; ++i) {
+    kv_index_entry_t* entry = &kv.index[slot];
+
+    if (entry->offset == 0)
+      return -1;
+
+    if (entry->key == key)
+      return slot;
+
+    slot = (slot + 1) & (KV_INDEX_SIZE - 1);
+  }
+
+  return -1;
+}
+
+static bool
+index_set(uint32_t key, uint32_t offset, uint32_t len)
+{
+  int slot = find_slot(key);
+
+  if (slot >= 0) {
+    kv.live_bytes -= ENTRY_SIZE(ITEM_SIZE(kv.index[slot].len));
+  }
+  else {
+    if (kv.num_keys >= KV_MAX_KEYS) {
+      printf("KV store index full!\r\n");
+      return false;
+    }
+
+    slot = home_slot(key);
+    while (kv.index[slot].offset != 0)
+      slot = (slot + 1) & (KV_INDEX_SIZE - 1);
+
+    kv.num_keys++;
+  }
+
+  kv.index[slot].key = key;
+  kv.index[slot].offset = offset;
+  kv.index[slot].len = len;
+  kv.live_bytes += ENTRY_SIZE(ITEM_SIZE(len));
+
+  return true;
+}
+
+static void
+index_remove(uint32_t key)
+{
+  int slot = find_slot(key);
+  uint32_t hole;
+  uint32_t next;
+
+  if (slot < 0)
+    return;
+
+  kv.live_bytes -= ENTRY_SIZE(ITEM_SIZE(kv.index[slot].len));
+  kv.num_keys--;
+
+  /* Shift later members of the probe chain back into the hole so lookups
+   * never stop early at an empty slot.
+   */
+  hole = slot;
+  next = hole;
+  while (1) {
+    next = (next + 1) & (KV_INDEX_SIZE - 1);
+    if (kv.index[next].offset == 0)
+      break;
+
+    uint32_t home = home_slot(kv.index[next].key);
+    bool movable = (hole <= next) ?
+        ((home <= hole) || (home > next)) :
+        ((home <= hole) && (home > next));
+
+    if (movable) {
+      kv.index[hole] = kv.index[next];
+      hole = next;
+    }
+  }
+
+  kv.index[hole].offset = 0;
+}
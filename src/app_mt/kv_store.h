@@ -0,0 +1,59 @@
+
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/* Keys are 32 bits. The top byte is a namespace so that subsystems can
+ * manage their own ids without colliding.
+ */
+#define KV_KEY(ns, id) ((((uint32_t)(ns)) << 24) | ((id) & 0x00FFFFFF))
+
+#define KV_MAX_KEYS       96
+#define KV_MAX_VALUE_SIZE 1024
+
+typedef enum {
+  KV_NS_PROBE_OFFSET = 1,
+  KV_NS_NETWORK,
+  KV_NS_PROFILE,
+  KV_NS_COUNTER,
+  KV_NS_IMAGE,
+  KV_NS_SETTINGS
+} kv_namespace_t;
+
+typedef struct {
+  uint32_t key;
+  bool deleted;
+  const void* data;
+  uint32_t len;
+} kv_item_t;
+
+typedef struct {
+  uint32_t num_keys;
+  uint32_t used_bytes;
+  uint32_t live_bytes;
+  uint32_t generation;
+} kv_store_stats_t;
+
+
+void
+kv_store_init(void);
+
+bool
+kv_get(uint32_t key, void* data, uint32_t data_len, uint32_t* value_len);
+
+bool
+kv_put(uint32_t key, const void* data, uint32_t len);
+
+bool
+kv_delete(uint32_t key);
+
+bool
+kv_commit(const kv_item_t* items, uint32_t num_items);
+
+void
+kv_store_get_stats(kv_store_stats_t* stats);
+
+#endif
@@ -0,0 +1,593 @@
+#include "ch.h"
+#include "lan_api.h"
+#include "api_msg.h"
+#include "app_cfg.h"
+#include "message.h"
+#include "net.h"
+#include "sensor.h"
+#include "latency_trace.h"
+#include "common.h"
+#include "wifi/socket.h"
+
+#include <pb_decode.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/* Local clients speak the same length prefixed ApiMessage framing as the
+ * cloud server: device reports for every sample and controller settings in
+ * both directions. A client has to send an AuthRequest carrying the device's
+ * auth token before anything else, and the server only runs while it is
+ * turned on in the settings.
+ */
+#ifndef LAN_API_PORT
+#define LAN_API_PORT 31338
+#endif
+
+#define NET_POLL_INTERVAL   MS2ST(1000)
+#define LISTEN_RETRY_DELAY  S2ST(5)
+#define TX_BUF_SIZE         256
+
+/* Samples and settings changes are sent from the idle handler, so their
+ * senders never wait on the network.
+ */
+#define IDLE_TIMEOUT        100
+
+
+typedef struct {
+  bool new_sample;
+  bool new_settings;
+  float last_sample;
+} lan_controller_status_t;
+
+typedef struct {
+  /* Set by the accept thread, closed by whichever thread sees it fail first */
+  volatile int listen_socket;
+  volatile bool enabled;
+  int client;
+  bool client_authenticated;
+  lan_api_status_t status;
+  lan_controller_status_t controller_status[NUM_CONTROLLERS];
+  msg_parser_t parser;
+
+  uint8_t tx_buf[TX_BUF_SIZE];
+  msg_writer_t tx;
+
+  /* Only touched from the listener thread. A received message is finished
+   * with once it has been parsed, so outgoing messages can reuse it.
+   */
+  ApiMessage msg;
+  controller_settings_t settings;
+} lan_api_t;
+
+
+static msg_t
+accept_thread(void* arg);
+
+static int
+open_listen_socket(void);
+
+static void
+close_listen_socket(lan_api_t* lan);
+
+static bool
+net_is_up(void);
+
+static void
+lan_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+
+static void
+dispatch_client_connected(lan_api_t* lan, int sd);
+
+static void
+dispatch_lan_api_enabled(lan_api_t* lan, bool enabled);
+
+static void
+dispatch_net_status(lan_api_t* lan, net_status_t* ns);
+
+static void
+dispatch_sensor_sample(lan_api_t* lan, sensor_msg_t* sample);
+
+static void
+dispatch_controller_settings(lan_api_t* lan, controller_settings_t* settings);
+
+static void
+lan_api_idle(lan_api_t* lan);
+
+static void
+send_device_report(lan_api_t* lan);
+
+static void
+send_controller_settings(lan_api_t* lan, temp_controller_id_t controller);
+
+static void
+socket_poll(lan_api_t* lan);
+
+static void
+socket_message_rx(lan_api_t* lan);
+
+static void
+handle_auth_request(lan_api_t* lan, const AuthRequest* request);
+
+static void
+send_msg(lan_api_t* lan);
+
+static bool
+tx_flush(void* arg, const uint8_t* buf, uint32_t len);
+
+static void
+drop_client(lan_api_t* lan);
+
+
+static lan_api_t lan_api;
+
+
+void
+lan_api_init()
+{
+  lan_api.listen_socket = -1;
+  lan_api.client = -1;
+  lan_api.enabled = app_cfg_get_lan_api_enabled();
+
+  lan_api.tx.flush = tx_flush;
+  lan_api.tx.arg = &lan_api;
+  lan_api.tx.buf = lan_api.tx_buf;
+  lan_api.tx.buf_size = sizeof(lan_api.tx_buf);
+
+  msg_listener_t* l = msg_listener_create("lan_api", 2048, lan_api_dispatch, &lan_api);
+  msg_listener_set_idle_timeout(l, IDLE_TIMEOUT);
+  msg_subscribe(l, MSG_LAN_CLIENT_CONNECTED, NULL);
+  msg_subscribe(l, MSG_LAN_API_ENABLED, NULL);
+  msg_subscribe(l, MSG_WLAN_SOCKET_READY, NULL);
+  msg_subscribe(l, MSG_NET_STATUS, NULL);
+  msg_subscribe(l, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe(l, MSG_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe(l, MSG_API_CONTROLLER_SETTINGS, NULL);
+
+  chThdCreateFromHeap(NULL, 1024, NORMALPRIO, accept_thread, &lan_api);
+}
+
+const lan_api_status_t*
+lan_api_get_status()
+{
+  return &lan_api.status;
+}
+
+/* accept() blocks until a client turns up, so it gets a thread of its own
+ * and hands each new client over to the listener thread.
+ */
+static msg_t
+accept_thread(void* arg)
+{
+  lan_api_t* lan = arg;
+
+  chRegSetThreadName("lan_accept");
+
+  while (1) {
+    if (!lan->enabled || !net_is_up()) {
+      chThdSleep(NET_POLL_INTERVAL);
+      continue;
+    }
+
+    int sd = open_listen_socket();
+    if (sd < 0) {
+      chThdSleep(LISTEN_RETRY_DELAY);
+      continue;
+    }
+
+    /* The server may have been turned off or the network gone down while the
+     * socket was being opened. Whoever closes it checks under the same lock,
+     * so either they see the socket or it is closed here.
+     */
+    chSysLock();
+    bool publish = lan->enabled && net_is_up();
+    if (publish) {
+      lan->listen_socket = sd;
+      lan->status.listening = true;
+    }
+    chSysUnlock();
+
+    if (!publish) {
+      closesocket(sd);
+      continue;
+    }
+
+    printf("LAN API listening on port %d\r\n", LAN_API_PORT);
+
+    while (1) {
+      sockaddr addr;
+      socklen_t addrlen = sizeof(addr);
+      int client = accept(sd, &addr, &addrlen);
+      if (client < 0)
+        break;
+
+      msg_send(MSG_LAN_CLIENT_CONNECTED, &client);
+    }
+
+    /* Already closed if the network went down or the server was turned off,
+     * otherwise accept failed
+     */
+    close_listen_socket(lan);
+  }
+
+  return 0;
+}
+
+static int
+open_listen_socket()
+{
+  int sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sd < 0) {
+    printf("LAN API socket failed %d\r\n", sd);
+    return -1;
+  }
+
+  sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(LAN_API_PORT),
+    .sin_addr.s_addr = htonl(INADDR_ANY)
+  };
+  long ret = bind(sd, (sockaddr*)&addr, sizeof(addr));
+  if (ret >= 0)
+    ret = listen(sd, 1);
+
+  if (ret < 0) {
+    printf("LAN API bind/listen failed %d\r\n", (int)ret);
+    closesocket(sd);
+    return -1;
+  }
+
+  return sd;
+}
+
+static void
+close_listen_socket(lan_api_t* lan)
+{
+  int sd;
+
+  chSysLock();
+  sd = lan->listen_socket;
+  lan->listen_socket = -1;
+  lan->status.listening = false;
+  chSysUnlock();
+
+  /* Closing it also wakes the accept thread */
+  if (sd >= 0)
+    closesocket(sd);
+}
+
+static bool
+net_is_up()
+{
+  const net_status_t* ns = net_get_status();
+  return (ns->net_state == NS_CONNECTED) && ns->dhcp_resolved;
+}
+
+static void
+lan_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  (void)sub_data;
+
+  lan_api_t* lan = listener_data;
+
+  switch (id) {
+    case MSG_LAN_CLIENT_CONNECTED:
+      dispatch_client_connected(lan, *(int*)msg_data);
+      break;
+
+    case MSG_LAN_API_ENABLED:
+      dispatch_lan_api_enabled(lan, *(bool*)msg_data);
+      break;
+
+    case MSG_WLAN_SOCKET_READY:
+      if ((lan->client >= 0) && (*(int*)msg_data == lan->client))
+        socket_poll(lan);
+      break;
+
+    case MSG_NET_STATUS:
+      dispatch_net_status(lan, msg_data);
+      break;
+
+    case MSG_SENSOR_SAMPLE:
+      dispatch_sensor_sample(lan, msg_data);
+      break;
+
+    case MSG_CONTROLLER_SETTINGS:
+    case MSG_API_CONTROLLER_SETTINGS:
+      dispatch_controller_settings(lan, msg_data);
+      break;
+
+    case MSG_IDLE:
+      lan_api_idle(lan);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void
+dispatch_client_connected(lan_api_t* lan, int sd)
+{
+  int i;
+
+  /* A client accepted just before the server was turned off */
+  if (!lan->enabled) {
+    closesocket(sd);
+    return;
+  }
+
+  /* One client at a time. A tool that reconnects usually left its old
+   * connection behind, so the newest one wins.
+   */
+  if (lan->client >= 0)
+    drop_client(lan);
+
+  int optval = SOCK_ON;
+  if (setsockopt(sd, SOL_SOCKET, SOCKOPT_RECV_NONBLOCK, (char*)&optval, sizeof(optval)) < 0) {
+    printf("LAN API setsockopt failed\r\n");
+    closesocket(sd);
+    return;
+  }
+
+  printf("LAN API client connected\r\n");
+
+  lan->client = sd;
+  lan->client_authenticated = false;
+  lan->status.client_connected = true;
+  lan->status.clients_accepted++;
+  api_msg_reset_parser(&lan->parser);
+
+  /* Start the client off with the current settings once it has
+   * authenticated
+   */
+  for (i = 0; i < NUM_CONTROLLERS; ++i)
+    lan->controller_status[i].new_settings = true;
+}
+
+static void
+dispatch_lan_api_enabled(lan_api_t* lan, bool enabled)
+{
+  /* Under the lock the accept thread checks it with */
+  chSysLock();
+  lan->enabled = enabled;
+  chSysUnlock();
+
+  /* The accept thread waits for it to be turned back on */
+  if (!enabled) {
+    if (lan->client >= 0)
+      drop_client(lan);
+
+    close_listen_socket(lan);
+  }
+}
+
+static void
+dispatch_net_status(lan_api_t* lan, net_status_t* ns)
+{
+  /* The sockets have to be closed while the CC3000 still knows about them,
+   * before any restart hands their descriptors out again.
+   */
+  if ((ns->net_state != NS_CONNECTED) || !ns->dhcp_resolved) {
+    if (lan->client >= 0)
+      drop_client(lan);
+
+    close_listen_socket(lan);
+  }
+}
+
+static void
+dispatch_sensor_sample(lan_api_t* lan, sensor_msg_t* sample)
+{
+  if (sample->sensor >= NUM_SENSORS)
+    return;
+
+  latency_trace_record(LT_DISPATCH_LAN_API, sample->sensor, sample->timestamp);
+
+  lan_controller_status_t* s = &lan->controller_status[sample->sensor];
+  s->new_sample = true;
+  s->last_sample = sample->sample.value;
+}
+
+static void
+dispatch_controller_settings(lan_api_t* lan, controller_settings_t* settings)
+{
+  if (settings->controller >= NUM_CONTROLLERS)
+    return;
+
+  lan->controller_status[settings->controller].new_settings = true;
+}
+
+static void
+lan_api_idle(lan_api_t* lan)
+{
+  int i;
+
+  if ((lan->client < 0) || !lan->client_authenticated)
+    return;
+
+  send_device_report(lan);
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (lan->controller_status[i].new_settings) {
+      lan->controller_status[i].new_settings = false;
+      send_controller_settings(lan, i);
+    }
+  }
+}
+
+static void
+send_device_report(lan_api_t* lan)
+{
+  int i;
+  ApiMessage* msg = &lan->msg;
+
+  memset(msg, 0, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_DEVICE_REPORT;
+  msg->has_deviceReport = true;
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (lan->controller_status[i].new_sample) {
+      lan->controller_status[i].new_sample = false;
+      ControllerReport* pr = &msg->deviceReport.controller_reports[msg->deviceReport.controller_reports_count];
+      msg->deviceReport.controller_reports_count++;
+
+      api_msg_fill_controller_report(pr, i, lan->controller_status[i].last_sample);
+    }
+  }
+
+  if (msg->deviceReport.controller_reports_count > 0)
+    send_msg(lan);
+}
+
+static void
+send_controller_settings(lan_api_t* lan, temp_controller_id_t controller)
+{
+  ApiMessage* msg = &lan->msg;
+  memset(msg, 0, sizeof(ApiMessage));
+
+  msg->type = ApiMessage_Type_CONTROLLER_SETTINGS;
+  msg->has_controllerSettings = true;
+  api_msg_fill_controller_settings(&msg->controllerSettings, controller);
+
+  send_msg(lan);
+}
+
+static void
+socket_poll(lan_api_t* lan)
+{
+  switch (api_msg_socket_poll(&lan->parser, lan->client)) {
+    case MSG_POLL_MSG:
+      socket_message_rx(lan);
+      break;
+
+    case MSG_POLL_TOO_LONG:
+      lan->status.bad_msgs++;
+      drop_client(lan);
+      break;
+
+    case MSG_POLL_ERROR:
+      printf("LAN API client disconnected\r\n");
+      drop_client(lan);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void
+socket_message_rx(lan_api_t* lan)
+{
+  ApiMessage* msg = &lan->msg;
+
+  pb_istream_t stream = pb_istream_from_buffer(lan->parser.data_buf, lan->parser.data_len);
+  if (!pb_decode(&stream, ApiMessage_fields, msg)) {
+    printf("LAN API message decode failed\r\n");
+    lan->status.bad_msgs++;
+    return;
+  }
+
+  lan->status.msgs_received++;
+
+  if (msg->type == ApiMessage_Type_AUTH_REQUEST) {
+    handle_auth_request(lan, &msg->authRequest);
+    return;
+  }
+
+  if (!lan->client_authenticated) {
+    printf("LAN API client sent %d before authenticating\r\n", msg->type);
+    lan->status.auth_failures++;
+    drop_client(lan);
+    return;
+  }
+
+  switch (msg->type) {
+    case ApiMessage_Type_CONTROLLER_SETTINGS:
+      printf("got controller settings from LAN client\r\n");
+      /* Applied as a local change, so the cloud server is told about it and
+       * the client gets the new settings echoed back.
+       */
+      if (api_msg_parse_controller_settings(&msg->controllerSettings, &lan->settings))
+        app_cfg_set_controller_settings(lan->settings.controller, SS_DEVICE, &lan->settings);
+      break;
+
+    default:
+      printf("Unsupported LAN API message: %d\r\n", msg->type);
+      break;
+  }
+}
+
+/* The client has to hold the token the cloud server issued this device. A
+ * device that was never activated has none, and accepts nobody.
+ */
+static void
+handle_auth_request(lan_api_t* lan, const AuthRequest* request)
+{
+  const char* auth_token = app_cfg_get_auth_token();
+  bool authenticated =
+      (auth_token[0] != 0) &&
+      (strncmp(request->auth_token, auth_token, sizeof(request->auth_token)) == 0);
+
+  ApiMessage* msg = &lan->msg;
+  memset(msg, 0, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_AUTH_RESPONSE;
+  msg->has_authResponse = true;
+  msg->authResponse.authenticated = authenticated;
+
+  send_msg(lan);
+
+  if (lan->client < 0)
+    return;
+
+  if (authenticated) {
+    printf("LAN API client authenticated\r\n");
+    lan->client_authenticated = true;
+  }
+  else {
+    printf("LAN API client auth failed\r\n");
+    lan->status.auth_failures++;
+    drop_client(lan);
+  }
+}
+
+static void
+send_msg(lan_api_t* lan)
+{
+  if (lan->client < 0)
+    return;
+
+  if (!api_msg_send(&lan->tx, &lan->msg)) {
+    printf("LAN API send failed\r\n");
+    drop_client(lan);
+    return;
+  }
+
+  lan->status.msgs_sent++;
+}
+
+static bool
+tx_flush(void* arg, const uint8_t* buf, uint32_t len)
+{
+  lan_api_t* lan = arg;
+
+  while (len > 0) {
+    int ret = send(lan->client, buf, len, 0);
+    if (ret < 0)
+      return false;
+
+    buf += ret;
+    len -= ret;
+  }
+
+  return true;
+}
+
+static void
+drop_client(lan_api_t* lan)
+{
+  closesocket(lan->client);
+  lan->client = -1;
+  lan->client_authenticated = false;
+  lan->status.client_connected = false;
+}
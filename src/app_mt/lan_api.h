@@ -0,0 +1,28 @@
+
+#ifndef LAN_API_H
+#define LAN_API_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef struct {
+  bool listening;
+  bool client_connected;
+  uint32_t clients_accepted;
+  uint32_t msgs_sent;
+  uint32_t msgs_received;
+  /* Messages that were too long or failed to decode */
+  uint32_t bad_msgs;
+  /* Clients turned away for a wrong token or for not sending one */
+  uint32_t auth_failures;
+} lan_api_status_t;
+
+
+void
+lan_api_init(void);
+
+const lan_api_status_t*
+lan_api_get_status(void);
+
+#endif
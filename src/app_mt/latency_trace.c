@@ -0,0 +1,162 @@
+
+#include "ch.h"
+#include "latency_trace.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+/* Must be a power of two */
+#define LATENCY_TRACE_SIZE 256
+
+#define TICKS_TO_MS(ticks) (((ticks) * 1000) / CH_FREQUENCY)
+
+typedef struct {
+  /* Written last, so a reader can tell a slot is complete. Zero means the
+   * slot has never been filled.
+   */
+  volatile uint32_t seq;
+  uint8_t point;
+  uint8_t channel;
+  uint32_t latency;
+} latency_trace_entry_t;
+
+
+static uint32_t percentile(const uint32_t* sorted, uint32_t count, uint32_t pct);
+static void sort_latencies(uint32_t* latencies, uint32_t count);
+
+
+static latency_trace_entry_t trace_buf[LATENCY_TRACE_SIZE];
+static volatile uint32_t trace_head;
+
+/* Scratch space for computing summaries, to keep it off thread stacks */
+static uint32_t summary_buf[LATENCY_TRACE_SIZE];
+static Mutex summary_mtx;
+
+static const char* point_names[NUM_LATENCY_TRACE_POINTS] = {
+    [LT_SAMPLE_ACQUIRED]  = "acquired",
+    [LT_DISPATCH_CONTROL] = "to control",
+    [LT_DISPATCH_GUI]     = "to gui",
+    [LT_DISPATCH_WEB_API] = "to web api",
+    [LT_DISPATCH_LAN_API] = "to lan api",
+    [LT_PID_EVALUATED]    = "pid",
+    [LT_FANOUT_COMPLETE]  = "fanout",
+    [LT_RELAY_SWITCHED]   = "relay"
+};
+
+
+void
+latency_trace_init()
+{
+  chMtxInit(&summary_mtx);
+}
+
+void
+latency_trace_record(latency_trace_point_t point, uint8_t channel, systime_t sample_time)
+{
+  /* Reserve a slot with an atomic increment (LDREX/STREX on the M3), so
+   * producers never block each other or the kernel.
+   */
+  uint32_t seq = __sync_add_and_fetch(&trace_head, 1);
+  latency_trace_entry_t* entry = &trace_buf[seq & (LATENCY_TRACE_SIZE - 1)];
+
+  entry->seq = 0;
+  entry->point = point;
+  entry->channel = channel;
+  entry->latency = chTimeNow() - sample_time;
+  entry->seq = seq;
+}
+
+bool
+latency_trace_get_summary(latency_trace_point_t point, latency_summary_t* summary)
+{
+  uint32_t i;
+  uint32_t count = 0;
+
+  if (point >= NUM_LATENCY_TRACE_POINTS)
+    return false;
+
+  chMtxLock(&summary_mtx);
+
+  for (i = 0; i < LATENCY_TRACE_SIZE; ++i) {
+    latency_trace_entry_t entry = trace_buf[i];
+
+    /* Skip empty slots and slots that were being written during the copy */
+    if (entry.seq == 0 || entry.seq != trace_buf[i].seq)
+      continue;
+
+    if (entry.point == point)
+      summary_buf[count++] = entry.latency;
+  }
+
+  memset(summary, 0, sizeof(latency_summary_t));
+  summary->count = count;
+
+  if (count > 0) {
+    sort_latencies(summary_buf, count);
+    summary->p50 = TICKS_TO_MS(percentile(summary_buf, count, 50));
+    summary->p90 = TICKS_TO_MS(percentile(summary_buf, count, 90));
+    summary->p99 = TICKS_TO_MS(percentile(summary_buf, count, 99));
+    summary->max = TICKS_TO_MS(summary_buf[count - 1]);
+  }
+
+  chMtxUnlock();
+
+  return (count > 0);
+}
+
+const char*
+latency_trace_point_name(latency_trace_point_t point)
+{
+  if (point >= NUM_LATENCY_TRACE_POINTS)
+    return "";
+
+  return point_names[point];
+}
+
+void
+latency_trace_print()
+{
+  int i;
+  latency_summary_t summary;
+
+  printf("latency (ms)      n   p50   p90   p99   max\r\n");
+  for (i = 0; i < NUM_LATENCY_TRACE_POINTS; ++i) {
+    if (!latency_trace_get_summary(i, &summary))
+      continue;
+
+    printf("  %-10s %6u %5u %5u %5u %5u\r\n",
+        latency_trace_point_name(i),
+        (unsigned)summary.count,
+        (unsigned)summary.p50,
+        (unsigned)summary.p90,
+        (unsigned)summary.p99,
+        (unsigned)summary.max);
+  }
+}
+
+static uint32_t
+percentile(const uint32_t* sorted, uint32_t count, uint32_t pct)
+{
+  uint32_t idx = ((count * pct) + 99) / 100;
+
+  if (idx > 0)
+    idx--;
+
+  return sorted[MIN(idx, count - 1)];
+}
+
+static void
+sort_latencies(uint32_t* latencies, uint32_t count)
+{
+  uint32_t i, j;
+
+  /* Insertion sort, the buffer is small and usually nearly sorted */
+  for (i = 1; i < count; ++i) {
+    uint32_t v = latencies[i];
+    for (j = i; j > 0 && latencies[j - 1] > v; --j)
+      latencies[j] = latencies[j - 1];
+    latencies[j] = v;
+  }
+}
@@ -0,0 +1,53 @@
+
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include "ch.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/* Stages on the path from a probe read to a relay switching. Acquisition
+ * records the time from starting the probe conversion to reading the
+ * result. Every later point records the time elapsed since that read.
+ */
+typedef enum {
+  LT_SAMPLE_ACQUIRED,
+  /* One dispatch point per MSG_SENSOR_SAMPLE subscriber */
+  LT_DISPATCH_CONTROL,
+  LT_DISPATCH_GUI,
+  LT_DISPATCH_WEB_API,
+  LT_DISPATCH_LAN_API,
+  LT_PID_EVALUATED,
+  LT_FANOUT_COMPLETE,
+  LT_RELAY_SWITCHED,
+
+  NUM_LATENCY_TRACE_POINTS
+} latency_trace_point_t;
+
+typedef struct {
+  uint32_t count;
+  /* Latencies in milliseconds */
+  uint32_t p50;
+  uint32_t p90;
+  uint32_t p99;
+  uint32_t max;
+} latency_summary_t;
+
+
+void
+latency_trace_init(void);
+
+void
+latency_trace_record(latency_trace_point_t point, uint8_t channel, systime_t sample_time);
+
+bool
+latency_trace_get_summary(latency_trace_point_t point, latency_summary_t* summary);
+
+const char*
+latency_trace_point_name(latency_trace_point_t point);
+
+void
+latency_trace_print(void);
+
+#endif
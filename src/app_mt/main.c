@@ -6,6 +6,7 @@
 #include "lcd.h"
 #include "image.h"
 #include "web_api.h"
+#include "lan_api.h"
 #include "touch.h"
 #include "gui.h"
 #include "temp_control.h"
@@ -21,6 +22,11 @@
 #include "screen_saver.h"
 #include "xflash.h"
 #include "recovery_img.h"
+#include "temp_profile_lib.h"
+#include "latency_trace.h"
+#include "diagnostics.h"
+#include "kv_store.h"
+#include "heap_stats.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -89,25 +95,33 @@ main(void)
   get_device_id();
 
   xflash_init();
+  xflash_start_thread();
+
+  kv_store_init();
+
+  /* The library is up before app_cfg so that migrated profiles can be added */
+  temp_profile_lib_init();
 
   app_cfg_init();
 
+  latency_trace_init();
+
   check_for_faults();
 
   gfx_init();
   touch_init();
 
-  sensor_init(SENSOR_1, SD_OW1);
-  sensor_init(SENSOR_2, SD_OW2);
+  sensor_init_all();
 
-  temp_control_init(CONTROLLER_1);
-  temp_control_init(CONTROLLER_2);
+  temp_control_init();
 
   ota_update_init();
   net_init();
   web_api_init();
+  lan_api_init();
   gui_init();
   thread_watchdog_init();
+  diagnostics_init();
 
   create_home_screen();
 
@@ -122,6 +136,11 @@ main(void)
 
   recovery_img_init();
 
+  printf("Startup took %d ms\r\n", (int)(chTimeNow() * 1000 / CH_FREQUENCY));
+
+  /* Baseline for the heap reports the diagnostics module prints while running */
+  heap_stats_print();
+
   while (TRUE) {
     toggle_LED1();
   }
@@ -8,6 +8,9 @@
 
 #define MAX_MAILBOX_MSGS 32
 
+/* Messages sent with msg_post that have not been handled yet */
+#define MAX_POSTED_MSGS 8
+
 typedef struct msg_listener_s {
   Thread* thread;
   const char* name;
@@ -46,8 +49,13 @@ msg_get(msg_listener_t* l);
 static void
 msg_release(thread_msg_t* msg);
 
+static thread_msg_t*
+alloc_posted_msg(void);
+
 
 static msg_subscription_t* subs[NUM_THREAD_MSGS];
+static thread_msg_t posted_msgs[MAX_POSTED_MSGS];
+static bool posted_msg_used[MAX_POSTED_MSGS];
 
 
 msg_listener_t*
@@ -188,6 +196,68 @@ msg_send(msg_id_t id, void* msg_data)
   }
 }
 
+/* Queues the message for each subscriber and returns without waiting for it
+ * to be handled, so msg_data must stay valid until then. Returns false if a
+ * subscriber could not be reached because its mailbox or the pool of posted
+ * messages was full.
+ */
+bool
+msg_post(msg_id_t id, void* msg_data)
+{
+  msg_subscription_t* sub;
+  bool delivered = true;
+
+  if (id >= NUM_THREAD_MSGS)
+    return false;
+
+  msg_listener_t* self = chThdSelf()->msg_listener;
+
+  for (sub = subs[id]; sub != NULL; sub = sub->next) {
+    if (sub->listener == self) {
+      sub->listener->dispatch(id, msg_data, sub->listener->user_data, sub->user_data);
+      continue;
+    }
+
+    thread_msg_t* msg = alloc_posted_msg();
+    if (msg == NULL) {
+      delivered = false;
+      continue;
+    }
+
+    msg->id = id;
+    msg->msg_data = msg_data;
+    msg->user_data = sub->user_data;
+    msg->sender = NULL;
+    msg->processed = false;
+
+    if (chMBPost(&sub->listener->mb, (msg_t)msg, TIME_IMMEDIATE) != RDY_OK) {
+      msg_release(msg);
+      delivered = false;
+    }
+  }
+
+  return delivered;
+}
+
+static thread_msg_t*
+alloc_posted_msg()
+{
+  thread_msg_t* msg = NULL;
+  int i;
+
+  chSysLock();
+  for (i = 0; i < MAX_POSTED_MSGS; ++i) {
+    if (!posted_msg_used[i]) {
+      posted_msg_used[i] = true;
+      msg = &posted_msgs[i];
+      break;
+    }
+  }
+  chSysUnlock();
+
+  return msg;
+}
+
 static thread_msg_t*
 msg_get(msg_listener_t* l)
 {
@@ -207,6 +277,11 @@ msg_release(thread_msg_t* msg)
 
   msg->processed = true;
 
+  if ((msg >= posted_msgs) && (msg < (posted_msgs + MAX_POSTED_MSGS))) {
+    posted_msg_used[msg - posted_msgs] = false;
+    return;
+  }
+
   if (msg->sender != NULL) {
     static thread_msg_t release_msg = {
         .id = MSG_RELEASE,        .msg_data = NULL,        .user_data = NULL,        .sender = NULL,        .processed = true    };
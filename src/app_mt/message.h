@@ -18,6 +18,7 @@ typedef enum {
   MSG_CONTROLLER_SETTINGS,
   MSG_OUTPUT_STATUS,
   MSG_OUTPUT_OVRD,
+  MSG_PID_AUTOTUNE,
 
   MSG_GUI_PUSH_SCREEN,
   MSG_GUI_POP_SCREEN,
@@ -31,12 +32,15 @@ typedef enum {
   MSG_WLAN_DISCONNECT,
   MSG_WLAN_DHCP,
   MSG_WLAN_PING_REPORT,
+  MSG_WLAN_SOCKET_READY,   // a socket has data or has been closed
 
   MSG_NET_NETWORK_SETTINGS,
   MSG_NET_STATUS,
   MSG_NET_NEW_NETWORK,     // a new wireless network is now available
   MSG_NET_NETWORK_UPDATED, // new information for a previously seen network is available
   MSG_NET_NETWORK_TIMEOUT, // a wireless network is no longer available
+  MSG_LAN_CLIENT_CONNECTED, // a client has connected to the LAN API server
+  MSG_LAN_API_ENABLED,      // the LAN API server has been turned on or off
 
   MSG_OTAU_CHECK,
   MSG_OTAU_START,
@@ -87,4 +91,7 @@ msg_unsubscribe(msg_listener_t* l, msg_id_t id, void* user_data);
 void
 msg_send(msg_id_t id, void* msg_data);
 
+bool
+msg_post(msg_id_t id, void* msg_data);
+
 #endif
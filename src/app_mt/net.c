@@ -14,6 +14,7 @@
 #include "message.h"
 #include "netapp.h"
 #include "app_cfg.h"
+#include "kv_store.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -27,6 +28,21 @@
 #define CONNECT_TIMEOUT S2ST(90)
 #define API_TIMEOUT     S2ST(90)
 
+#define NETAPP_DHCP_LEASE_TIMEOUT 14400
+#define NETAPP_ARP_TIMEOUT        3600
+#define NETAPP_KEEPALIVE          10
+#define NETAPP_INACTIVITY_TIMEOUT 0
+
+/* Facts read from the CC3000's NVMEM, cached so that restarts don't have to
+ * go back to the module for them.
+ */
+#define NVMEM_FACTS_KEY    KV_KEY(KV_NS_NETWORK, 1)
+/* CRC of the connection policy and IP config last written to the CC3000 */
+#define APPLIED_CONFIG_KEY KV_KEY(KV_NS_NETWORK, 2)
+
+/* Recoveries can take far longer than the 32 bit product allows */
+#define TICKS_TO_MS(ticks) ((uint32_t)(((uint64_t)(ticks) * 1000) / CH_FREQUENCY))
+
 
 typedef struct {
   bool valid;
@@ -36,6 +52,11 @@ typedef struct {
   network_t network;
 } net_scan_result_t;
 
+typedef struct {
+  nvmem_sp_version_t sp_version;
+  uint8_t mac[6];
+} nvmem_facts_t;
+
 
 static void
 dispatch_net_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
@@ -43,6 +64,27 @@ dispatch_net_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
 static void
 initialize_and_connect(void);
 
+static void
+recover(net_recovery_tier_t first_tier);
+
+static void
+begin_recovery(net_recovery_tier_t tier);
+
+static void
+end_recovery(void);
+
+static void
+restart_wlan(bool full);
+
+static void
+associate(void);
+
+static void
+read_nvmem_facts(void);
+
+static void
+apply_wifi_config(bool force);
+
 static void
 dispatch_idle(void);
 
@@ -74,9 +116,23 @@ get_scan_result(net_scan_result_t* result);
 static net_status_t net_status;
 static network_t networks[16];
 static bool force_reconnect;
-static bool wifi_config_applied;
+static bool wlan_started;
 static systime_t state_begin_time;
 static systime_t scan_interval_start;
+static nvmem_facts_t nvmem_facts;
+static bool nvmem_facts_valid;
+static bool api_was_connected;
+static bool recovering;
+static net_recovery_tier_t recovery_tier;
+static systime_t recovery_start_time;
+static net_recovery_stats_t recovery_stats[NUM_NET_RECOVERY_TIERS];
+
+static const char* recovery_tier_names[NUM_NET_RECOVERY_TIERS] = {
+    [NR_SOCKET]       = "socket",
+    [NR_ASSOCIATE]    = "associate",
+    [NR_SOFT_RESET]   = "soft reset",
+    [NR_FULL_RESTART] = "full restart"
+};
 
 
 void
@@ -111,6 +167,49 @@ net_scan_stop()
   net_status.scan_state = SCAN_DISABLE;
 }
 
+void
+net_get_recovery_stats(net_recovery_tier_t tier, net_recovery_stats_t* stats)
+{
+  if (tier >= NUM_NET_RECOVERY_TIERS) {
+    memset(stats, 0, sizeof(net_recovery_stats_t));
+    return;
+  }
+
+  chSysLock();
+  *stats = recovery_stats[tier];
+  chSysUnlock();
+}
+
+const char*
+net_recovery_tier_name(net_recovery_tier_t tier)
+{
+  if (tier >= NUM_NET_RECOVERY_TIERS)
+    return "";
+
+  return recovery_tier_names[tier];
+}
+
+void
+net_recovery_print()
+{
+  int i;
+  net_recovery_stats_t stats;
+
+  printf("net recovery     tries    ok avg ms max ms\r\n");
+  for (i = 0; i < NUM_NET_RECOVERY_TIERS; ++i) {
+    net_get_recovery_stats(i, &stats);
+    if (stats.attempts == 0)
+      continue;
+
+    printf("  %-12s %7u %5u %6u %6u\r\n",
+        net_recovery_tier_name(i),
+        (unsigned)stats.attempts,
+        (unsigned)stats.recoveries,
+        (unsigned)(stats.recoveries > 0 ? (stats.total_ms / stats.recoveries) : 0),
+        (unsigned)stats.max_ms);
+  }
+}
+
 static void
 set_state(net_state_t state)
 {
@@ -163,10 +262,72 @@ dispatch_net_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
 static void
 dispatch_network_settings()
 {
-  wifi_config_applied = false;
   force_reconnect = true;
 }
 
+/* Picks the recovery tier to try next. Asking for a tier that is no more
+ * thorough than the one already in progress means that tier failed, so the
+ * next one up is used instead.
+ */
+static void
+recover(net_recovery_tier_t first_tier)
+{
+  net_recovery_tier_t tier = first_tier;
+
+  if (recovering && recovery_tier >= first_tier)
+    tier = MIN(recovery_tier + 1, NR_FULL_RESTART);
+
+  begin_recovery(tier);
+
+  switch (tier) {
+    case NR_SOFT_RESET:
+      restart_wlan(false);
+      break;
+
+    case NR_FULL_RESTART:
+      restart_wlan(true);
+      break;
+
+    default:
+      break;
+  }
+
+  if (tier != NR_SOCKET)
+    associate();
+}
+
+static void
+begin_recovery(net_recovery_tier_t tier)
+{
+  printf("Network recovery: %s\r\n", recovery_tier_names[tier]);
+
+  chSysLock();
+  recovery_stats[tier].attempts++;
+  chSysUnlock();
+
+  recovering = true;
+  recovery_tier = tier;
+  recovery_start_time = chTimeNow();
+  api_was_connected = false;
+}
+
+static void
+end_recovery()
+{
+  uint32_t ms = TICKS_TO_MS(chTimeNow() - recovery_start_time);
+  net_recovery_stats_t* stats = &recovery_stats[recovery_tier];
+
+  printf("Recovered by %s in %u ms\r\n", recovery_tier_names[recovery_tier], (unsigned)ms);
+
+  chSysLock();
+  stats->recoveries++;
+  stats->total_ms += ms;
+  stats->max_ms = MAX(stats->max_ms, ms);
+  chSysUnlock();
+
+  recovering = false;
+}
+
 static void
 dispatch_dhcp(netapp_dhcp_params_t* dhcp)
 {
@@ -337,11 +498,25 @@ prune_networks()
   }
 }
 
+/* Used at boot and when the network settings change. Unlike the recovery
+ * tiers this always restarts and reassociates, since the settings are why it
+ * was called. The IP config is only rewritten if it changed.
+ */
 static void
 initialize_and_connect()
 {
-  const net_settings_t* ns = app_cfg_get_net_settings();
+  recovering = false;
+  api_was_connected = false;
+
+  restart_wlan(false);
+  wlan_started = true;
 
+  associate();
+}
+
+static void
+restart_wlan(bool full)
+{
   net_status.dhcp_resolved = false;
   set_state(NS_DISCONNECTED);
 
@@ -349,48 +524,107 @@ initialize_and_connect()
 
   wlan_start(PATCH_LOAD_DEFAULT);
 
-  {
-    nvmem_sp_version_t sp_version;
-    nvmem_read_sp_version(&sp_version);
-    sprintf(net_status.sp_ver, "%d.%d", sp_version.package_id, sp_version.package_build);
-    printf("CC3000 Service Pack Version: %s\r\n", net_status.sp_ver);
-
-    if (sp_version.package_id != 1 || sp_version.package_build != 32) {
-      printf("  Not up to date. Applying patch.\r\n");
-      wlan_apply_patch();
-      printf("  Update complete\r\n");
-
-      nvmem_read_sp_version(&sp_version);
-      sprintf(net_status.sp_ver, "%d.%d", sp_version.package_id, sp_version.package_build);
-      printf("Updated CC3000 Service Pack Version: %s\r\n", net_status.sp_ver);
-    }
+  if (!nvmem_facts_valid && !full) {
+    uint32_t len;
+    nvmem_facts_valid =
+        kv_get(NVMEM_FACTS_KEY, &nvmem_facts, sizeof(nvmem_facts), &len) &&
+        len == sizeof(nvmem_facts) &&
+        nvmem_facts.sp_version.package_id == 1 &&
+        nvmem_facts.sp_version.package_build == 32;
   }
 
-  if (!wifi_config_applied) {
-    wlan_ioctl_set_connection_policy(0, 0, 0);
+  if (full || !nvmem_facts_valid)
+    read_nvmem_facts();
 
-    uint32_t dhcp_timeout = 14400;
-    uint32_t arp_timeout = 3600;
-    uint32_t keepalive = 10;
-    uint32_t inactivity_timeout = 0;
-    netapp_timeout_values(&dhcp_timeout, &arp_timeout, &keepalive, &inactivity_timeout);
+  sprintf(net_status.sp_ver, "%d.%d",
+      nvmem_facts.sp_version.package_id,
+      nvmem_facts.sp_version.package_build);
+  sprintf(net_status.mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X",
+      nvmem_facts.mac[0], nvmem_facts.mac[1], nvmem_facts.mac[2],
+      nvmem_facts.mac[3], nvmem_facts.mac[4], nvmem_facts.mac[5]);
 
-    netapp_dhcp(&ns->ip, &ns->subnet_mask, &ns->gateway, &ns->dns_server);
+  apply_wifi_config(full);
+}
 
-    wlan_stop();
+static void
+read_nvmem_facts()
+{
+  nvmem_sp_version_t* sp_version = &nvmem_facts.sp_version;
 
-    wlan_start(PATCH_LOAD_DEFAULT);
+  nvmem_read_sp_version(sp_version);
+  printf("CC3000 Service Pack Version: %d.%d\r\n",
+      sp_version->package_id, sp_version->package_build);
 
-    wifi_config_applied = true;
-  }
+  if (sp_version->package_id != 1 || sp_version->package_build != 32) {
+    printf("  Not up to date. Applying patch.\r\n");
+    wlan_apply_patch();
+    printf("  Update complete\r\n");
 
-  {
-    uint8_t mac[6];
-    nvmem_get_mac_address(mac);
-    sprintf(net_status.mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X",
-        mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    nvmem_read_sp_version(sp_version);
+    printf("Updated CC3000 Service Pack Version: %d.%d\r\n",
+        sp_version->package_id, sp_version->package_build);
   }
 
+  nvmem_get_mac_address(nvmem_facts.mac);
+
+  nvmem_facts_valid = true;
+  kv_put(NVMEM_FACTS_KEY, &nvmem_facts, sizeof(nvmem_facts));
+}
+
+/* The connection policy and IP config live in the CC3000's own NVMEM, so
+ * they only need writing (and the module restarting) when they differ from
+ * what was last written. The full restart is the last resort, and NVMEM
+ * that was reset or replaced under us would never be caught by the CRC, so
+ * it always writes them.
+ */
+static void
+apply_wifi_config(bool force)
+{
+  const net_settings_t* ns = app_cfg_get_net_settings();
+  uint32_t config[] = {
+      ns->ip,
+      ns->subnet_mask,
+      ns->gateway,
+      ns->dns_server,
+      NETAPP_DHCP_LEASE_TIMEOUT,
+      NETAPP_ARP_TIMEOUT,
+      NETAPP_KEEPALIVE,
+      NETAPP_INACTIVITY_TIMEOUT
+  };
+  uint32_t config_crc = crc32_block(0, config, sizeof(config));
+  uint32_t applied_crc;
+  uint32_t len;
+
+  if (!force &&
+      kv_get(APPLIED_CONFIG_KEY, &applied_crc, sizeof(applied_crc), &len) &&
+      len == sizeof(applied_crc) &&
+      applied_crc == config_crc)
+    return;
+
+  wlan_ioctl_set_connection_policy(0, 0, 0);
+
+  uint32_t dhcp_timeout = NETAPP_DHCP_LEASE_TIMEOUT;
+  uint32_t arp_timeout = NETAPP_ARP_TIMEOUT;
+  uint32_t keepalive = NETAPP_KEEPALIVE;
+  uint32_t inactivity_timeout = NETAPP_INACTIVITY_TIMEOUT;
+  netapp_timeout_values(&dhcp_timeout, &arp_timeout, &keepalive, &inactivity_timeout);
+
+  netapp_dhcp(&ns->ip, &ns->subnet_mask, &ns->gateway, &ns->dns_server);
+
+  wlan_stop();
+
+  wlan_start(PATCH_LOAD_DEFAULT);
+
+  kv_put(APPLIED_CONFIG_KEY, &config_crc, sizeof(config_crc));
+}
+
+static void
+associate()
+{
+  const net_settings_t* ns = app_cfg_get_net_settings();
+
+  net_status.dhcp_resolved = false;
+
   if (strlen(ns->ssid) > 0) {
     set_state(NS_CONNECTING);
 
@@ -405,6 +639,9 @@ initialize_and_connect()
         (const uint8_t*)ns->passphrase,
         strlen(ns->passphrase));
   }
+  else {
+    set_state(NS_DISCONNECTED);
+  }
 }
 
 static void
@@ -415,34 +652,52 @@ dispatch_idle()
   if (force_reconnect) {
     net_status.net_state = NS_DISCONNECTED;
     force_reconnect = false;
+    wlan_started = false;
   }
 
   switch (net_status.net_state) {
     case NS_DISCONNECTED:
-      if (strlen(app_cfg_get_net_settings()->ssid) > 0)
-        initialize_and_connect();
+      if (strlen(app_cfg_get_net_settings()->ssid) > 0) {
+        if (wlan_started)
+          recover(NR_ASSOCIATE);
+        else
+          initialize_and_connect();
+      }
       break;
 
     case NS_WAIT_DHCP:
       if ((chTimeNow() - state_begin_time) > DHCP_TIMEOUT) {
         printf("DHCP Timeout\r\n");
-        initialize_and_connect();
+        recover(NR_ASSOCIATE);
       }
       break;
 
     case NS_CONNECTING:
       if ((chTimeNow() - state_begin_time) > CONNECT_TIMEOUT) {
         printf("Connect Timeout\r\n");
-        initialize_and_connect();
+        recover(NR_ASSOCIATE);
       }
       break;
 
     case NS_CONNECTED:
-      if (web_api_get_status()->state > AS_CONNECTING)
+      if (web_api_get_status()->state > AS_CONNECTING) {
         state_begin_time = chTimeNow();
-      else if ((chTimeNow() - state_begin_time) > API_TIMEOUT) {
-        printf("API Timeout\r\n");
-        initialize_and_connect();
+        api_was_connected = true;
+        if (recovering)
+          end_recovery();
+      }
+      else {
+        /* The web API reconnects its own socket, so give that a chance
+         * before doing anything to the WLAN.
+         */
+        if (api_was_connected && !recovering)
+          begin_recovery(NR_SOCKET);
+        api_was_connected = false;
+
+        if ((chTimeNow() - state_begin_time) > API_TIMEOUT) {
+          printf("API Timeout\r\n");
+          recover(NR_ASSOCIATE);
+        }
       }
       break;
 
@@ -53,6 +53,26 @@ typedef enum {
   IP_CFG_STATIC
 } ip_config_t;
 
+/* Ways of getting back online, from cheapest to most thorough. Each one is
+ * tried when the one before it has not helped.
+ */
+typedef enum {
+  NR_SOCKET,        // the web API reconnects its own socket
+  NR_ASSOCIATE,     // re-associate with the access point
+  NR_SOFT_RESET,    // restart the CC3000 using cached NVMEM facts
+  NR_FULL_RESTART,  // restart the CC3000 and reapply everything
+
+  NUM_NET_RECOVERY_TIERS
+} net_recovery_tier_t;
+
+typedef struct {
+  uint32_t attempts;
+  uint32_t recoveries;
+  /* Time from the tier being tried to the web API being connected again */
+  uint32_t total_ms;
+  uint32_t max_ms;
+} net_recovery_stats_t;
+
 typedef struct {
   char ssid[33];
   char passphrase[128];
@@ -78,4 +98,13 @@ net_scan_start(void);
 void
 net_scan_stop(void);
 
+void
+net_get_recovery_stats(net_recovery_tier_t tier, net_recovery_stats_t* stats);
+
+const char*
+net_recovery_tier_name(net_recovery_tier_t tier);
+
+void
+net_recovery_print(void);
+
 #endif
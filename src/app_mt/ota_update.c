@@ -28,7 +28,8 @@ typedef enum {
   OU_ERR_ERASE = -1,
   OU_ERR_ERASE_VERIFY = -2,
   OU_ERR_WRITE = -3,
-  OU_ERR_WRITE_VERIFY = -4
+  OU_ERR_WRITE_VERIFY = -4,
+  OU_ERR_IMG_UNSUPPORTED = -5
 } ota_update_error_t;
 
 
@@ -71,6 +72,9 @@ dispatch_chunk(FirmwareDownloadResponse* update_chunk);
 static void
 firmware_download_request(uint32_t offset);
 
+static bool
+img_supported(void);
+
 
 static ota_update_t update;
 
@@ -227,12 +231,20 @@ dispatch_chunk(FirmwareDownloadResponse* update_chunk)
 
   if ((update_chunk->offset & (UPDATE_BLOCK_SIZE - 1)) == 0) {
     update.last_block_offset = update_chunk->offset;
-    if (!sxfs_erase(SP_UPDATE_IMG, update.last_block_offset, UPDATE_BLOCK_SIZE)) {
+
+    /* The block is normally erased in the background while the previous one
+     * downloads, so only erase it here if that didn't happen.
+     */
+    if (!sxfs_is_erased(SP_UPDATE_IMG, update.last_block_offset, UPDATE_BLOCK_SIZE) &&
+        !sxfs_erase(SP_UPDATE_IMG, update.last_block_offset, UPDATE_BLOCK_SIZE)) {
       update.error_code = OU_ERR_ERASE;
       set_state(OU_FAILED);
       return;
     }
 
+    /* Fails harmlessly past the end of the partition */
+    sxfs_erase_async(SP_UPDATE_IMG, update.last_block_offset + UPDATE_BLOCK_SIZE, UPDATE_BLOCK_SIZE);
+
     if (!sxfs_is_erased(SP_UPDATE_IMG, update.last_block_offset, UPDATE_BLOCK_SIZE)) {
       update.error_code = OU_ERR_ERASE_VERIFY;
       set_state(OU_FAILED);
@@ -263,6 +275,17 @@ dispatch_chunk(FirmwareDownloadResponse* update_chunk)
 
   free(tmp);
 
+  /* Give up on an image the bootloader can't apply as soon as its headers
+   * are in, rather than after downloading all of it.
+   */
+  if (update_chunk->offset == 0 && !img_supported()) {
+    update.download_in_progress = false;
+    write_checkpoint();
+    update.error_code = OU_ERR_IMG_UNSUPPORTED;
+    set_state(OU_FAILED);
+    return;
+  }
+
   if (update.update_downloaded >= update.update_size) {
     update.download_in_progress = false;
     update.update_size = 0;
@@ -272,7 +295,11 @@ dispatch_chunk(FirmwareDownloadResponse* update_chunk)
 
     // Verify the integrity of the image that we just downloaded
     dfu_parse_result_t result = dfuse_verify(SP_UPDATE_IMG);
-    if (result == DFU_PARSE_OK) {
+    if (result == DFU_PARSE_OK && !img_supported()) {
+      update.error_code = OU_ERR_IMG_UNSUPPORTED;
+      set_state(OU_FAILED);
+    }
+    else if (result == DFU_PARSE_OK) {
       set_state(OU_COMPLETE);
       msg_send(MSG_SHUTDOWN, NULL);
 
@@ -290,6 +317,21 @@ dispatch_chunk(FirmwareDownloadResponse* update_chunk)
   }
 }
 
+/* Compressed images are only understood by newer bootloaders. Handing one
+ * to an older bootloader would leave garbage in the app flash.
+ */
+static bool
+img_supported()
+{
+  bool compressed;
+
+  /* A broken image is reported by dfuse_verify once it is complete */
+  if (dfuse_is_compressed(SP_UPDATE_IMG, &compressed) != DFU_PARSE_OK)
+    return true;
+
+  return !compressed || bootloader_supports_compressed_img();
+}
+
 static void
 firmware_download_request(uint32_t offset)
 {
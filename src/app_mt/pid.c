@@ -1,24 +1,51 @@
-
 #include "pid.h"
 #include "common.h"
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 
 /*
  * This code is based on Brett Beauregard's Improved Beginner PID series of
- * blog posts [1] with additions for self-tuning behavior based on the paper
- * "Self-Tuning of PID Controllers by Adaptive Interaction." by Feng Lin,
- * Robert D Brandt, and George Saikalis [2]
+ * blog posts [1]. Gains are found with a relay feedback test as described by
+ * Astrom and Hagglund in "Automatic Tuning of Simple Regulators with
+ * Specifications on Phase and Amplitude Margins" [2].
  *
  * [1] http://brettbeauregard.com/blog/2011/04/improving-the-beginners-pid-introduction/
- * [2] http://www.ece.eng.wayne.edu/~flin/Conference/AI-PID.pdf
+ * [2] Automatica, Vol. 20, No. 5, pp. 645-651, 1984
  */
 
+/* Number of relay cycles to ignore while the plant settles into oscillation */
+#define AUTOTUNE_SETTLE_CYCLES 1
+
+/* Number of relay cycles averaged to find the ultimate gain and period */
+#define AUTOTUNE_MEASURE_CYCLES 3
+
+/* Give up if the plant has not oscillated within this time */
+#define AUTOTUNE_TIMEOUT S2ST(24 * 60 * 60)
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#if PID_FIXED_POINT
+#define FIX16_ONE 0x00010000
+
+static int32_t fix16_from_float(float f);
+static float fix16_to_float(int32_t q);
+static int32_t fix16_mul(int32_t a, int32_t b);
+static int32_t fix16_add(int32_t a, int32_t b);
+#endif
+
+static void pid_sync_fixed(pid_controller_t* pid);
+
+
 void
 pid_init(pid_controller_t* pid)
 {
   pid->sample_time = MS2ST(2000);
   pid->last_time   = (chTimeNow() - pid->sample_time);
   pid->enabled     = false;
+  pid->output_sign = POSITIVE;
 
   pid_set_gains(pid, 10, .05, .05);
 }
@@ -33,46 +60,42 @@ pid_exec(pid_controller_t* pid, float setpoint, float sample)
   systime_t time_diff = (now - pid->last_time);
 
   if (time_diff >= pid->sample_time) {
+#if PID_FIXED_POINT
+    int32_t sample_q = fix16_from_float(sample);
+    int32_t err_p = fix16_add(fix16_from_float(setpoint), -sample_q);
+    int32_t err_d = fix16_add(sample_q, -pid->last_sample_q);
+    int32_t out;
+
+    pid->err_i_q = fix16_add(pid->err_i_q, fix16_mul(pid->ki_q, err_p));
+    pid->err_i_q = LIMIT(pid->err_i_q, pid->out_min_q, pid->out_max_q);
+
+    out = fix16_add(fix16_mul(pid->kp_q, err_p), pid->err_i_q);
+    out = fix16_add(out, -fix16_mul(pid->kd_q, err_d));
+    out = LIMIT(out, pid->out_min_q, pid->out_max_q);
+
+    pid->last_sample_q = sample_q;
+    pid->out = fix16_to_float(out);
+#else
     float err_p = (setpoint - sample);
     float err_d = (sample - pid->last_sample);
-    float err_d_tune = (err_p - pid->last_err)/time_diff;
 
     pid->err_i += (pid->ki * err_p);
     pid->err_i = LIMIT(pid->err_i, pid->out_min, pid->out_max);
-    pid->err_i_tune += err_p;
-    pid->err_i_tune = LIMIT(pid->err_i_tune, pid->out_min, pid->out_max);
-
-    tune_gains(pid, err_p, err_d_tune);
 
     pid->out = (pid->kp * err_p) + pid->err_i - (pid->kd * err_d);
     pid->out = LIMIT(pid->out, pid->out_min, pid->out_max);
+#endif
 
-    pid->last_err  = err_p;
     pid->last_sample = sample;
-    pid->last_time = now;
-  }
-}
 
-#define GAMMA 0.005
-void
-tune_gains(pid_controller_t* pid, float err_p, float err_d)
-{
-  if (pid->output_sign == NEGATIVE) {
-    pid->kp = pid->kp *-1;
-    pid->ki = pid->ki *-1;
-    pid->kd = pid->kd *-1;
+    /* Keep the execution grid fixed to the sample time unless we have fallen
+     * more than a whole period behind.
+     */
+    if (time_diff < (2 * pid->sample_time))
+      pid->last_time += pid->sample_time;
+    else
+      pid->last_time = now;
   }
-
-  pid->kp += -GAMMA * err_p;
-  pid->kp = LIMIT(pid->kp, 0, 50);
-
-  pid->ki += -GAMMA * err_p * pid->err_i_tune;
-  pid->ki = LIMIT(pid->ki, 0, 5);
-
-  pid->kd += -GAMMA * err_p * err_d;
-  pid->kd = LIMIT(pid->kd, 0, 5);
-
-  pid_set_output_sign(pid, pid->output_sign);
 }
 
 void
@@ -81,7 +104,8 @@ pid_set_gains(pid_controller_t* pid, float kp, float ki, float kd)
   if (kp < 0 || ki < 0 || kd < 0)
     return;
 
-  uint32_t sample_time_s = pid->sample_time / CH_FREQUENCY;
+  /* Sample times are not always a whole number of seconds */
+  float sample_time_s = (float)pid->sample_time / CH_FREQUENCY;
   pid->kp = kp;
   pid->ki = ki * sample_time_s;
   pid->kd = kd / sample_time_s;
@@ -91,6 +115,8 @@ pid_set_gains(pid_controller_t* pid, float kp, float ki, float kd)
     pid->ki = -pid->ki;
     pid->kd = -pid->kd;
   }
+
+  pid_sync_fixed(pid);
 }
 
 void
@@ -107,18 +133,28 @@ pid_reinit(pid_controller_t* pid, float sample)
 {
   pid->last_sample = sample;
   pid->err_i = 0;
+
+#if PID_FIXED_POINT
+  pid->last_sample_q = fix16_from_float(sample);
+  pid->err_i_q = 0;
+#endif
 }
 
 void
 pid_set_output_sign(pid_controller_t* pid, uint8_t sign)
 {
-   pid->output_sign = sign;
+  /* The gains are stored with the sign applied, so only flip them when the
+   * direction actually changes.
+   */
+  if (pid->output_sign != sign) {
+    pid->kp = -pid->kp;
+    pid->ki = -pid->ki;
+    pid->kd = -pid->kd;
+  }
 
-   if (pid->output_sign == NEGATIVE) {
-     pid->kp = -pid->kp;
-     pid->ki = -pid->ki;
-     pid->kd = -pid->kd;
-   }
+  pid->output_sign = sign;
+
+  pid_sync_fixed(pid);
 }
 
 void
@@ -130,8 +166,248 @@ pid_set_output_limits(pid_controller_t* pid, float min, float max)
   pid->out_min = min;
   pid->out_max = max;
 
+  pid_sync_fixed(pid);
+
   if (pid->enabled) {
     pid->out = LIMIT(pid->out, pid->out_min, pid->out_max);
+#if PID_FIXED_POINT
+    pid->err_i_q = LIMIT(pid->err_i_q, pid->out_min_q, pid->out_max_q);
+#else
     pid->err_i = LIMIT(pid->err_i, pid->out_min, pid->out_max);
+#endif
+  }
+}
+
+/* Refresh the Q16.16 copies of the gains and limits after their float
+ * values have been changed through the API.
+ */
+static void
+pid_sync_fixed(pid_controller_t* pid)
+{
+#if PID_FIXED_POINT
+  pid->kp_q = fix16_from_float(pid->kp);
+  pid->ki_q = fix16_from_float(pid->ki);
+  pid->kd_q = fix16_from_float(pid->kd);
+  pid->out_min_q = fix16_from_float(pid->out_min);
+  pid->out_max_q = fix16_from_float(pid->out_max);
+#else
+  (void)pid;
+#endif
+}
+
+#if PID_FIXED_POINT
+/* The conversions work on the IEEE 754 bit pattern with integer operations
+ * only, since the part has no FPU and pid_exec runs them on every call.
+ */
+static int32_t
+fix16_from_float(float f)
+{
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+
+  int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127;
+  uint32_t mantissa = (bits & 0x007FFFFF) | 0x00800000;
+  bool negative = (bits & 0x80000000) != 0;
+  uint32_t mag;
+
+  /* The mantissa is a 1.23 value, so Q16.16 needs a shift of exponent - 7 */
+  int32_t shift = exponent - 7;
+
+  if (exponent == -127 || shift < -24) {
+    /* Zero, denormal or smaller than half an LSB */
+    return 0;
+  }
+  else if (shift >= 8) {
+    /* Out of range, including infinities and NaN */
+    return negative ? INT32_MIN : INT32_MAX;
+  }
+  else if (shift >= 0) {
+    mag = mantissa << shift;
+    if (mag > INT32_MAX)
+      return negative ? INT32_MIN : INT32_MAX;
+  }
+  else {
+    /* Round to nearest */
+    mag = (mantissa + (1U << (-shift - 1))) >> -shift;
+  }
+
+  return negative ? -(int32_t)mag : (int32_t)mag;
+}
+
+static float
+fix16_to_float(int32_t q)
+{
+  uint32_t sign = 0;
+  uint32_t mag = (uint32_t)q;
+  uint32_t bits;
+  float f;
+
+  if (q == 0)
+    return 0;
+
+  if (q < 0) {
+    sign = 0x80000000;
+    mag = -(uint32_t)q;
+  }
+
+  int32_t msb = 31 - __builtin_clz(mag);
+  uint32_t mantissa;
+
+  if (msb > 23) {
+    /* Round to nearest, which can carry into the next power of two */
+    uint32_t drop = msb - 23;
+    mantissa = (uint32_t)(((uint64_t)mag + (1U << (drop - 1))) >> drop);
+    if (mantissa & 0x01000000) {
+      mantissa >>= 1;
+      msb++;
+    }
+  }
+  else {
+    mantissa = mag << (23 - msb);
   }
+
+  bits = sign | ((uint32_t)(msb - 16 + 127) << 23) | (mantissa & 0x007FFFFF);
+  memcpy(&f, &bits, sizeof(f));
+
+  return f;
+}
+
+static int32_t
+fix16_mul(int32_t a, int32_t b)
+{
+  int64_t product = (int64_t)a * b;
+
+  /* Round to nearest before dropping the extra fraction bits */
+  product += (product >= 0) ? (FIX16_ONE / 2) : -(FIX16_ONE / 2);
+  product /= FIX16_ONE;
+
+  if (product > INT32_MAX)
+    return INT32_MAX;
+  if (product < INT32_MIN)
+    return INT32_MIN;
+
+  return (int32_t)product;
+}
+
+static int32_t
+fix16_add(int32_t a, int32_t b)
+{
+  int64_t sum = (int64_t)a + b;
+
+  if (sum > INT32_MAX)
+    return INT32_MAX;
+  if (sum < INT32_MIN)
+    return INT32_MIN;
+
+  return (int32_t)sum;
+}
+#endif
+
+void
+pid_autotune_start(pid_autotune_t* at, float setpoint, float noise_band,
+    float relay_amplitude, uint8_t direction)
+{
+  at->state = AUTOTUNE_IDLE;
+  at->setpoint = setpoint;
+  at->noise_band = noise_band;
+  at->relay_amplitude = relay_amplitude;
+  at->direction = direction;
+  at->relay_on = false;
+  at->err_max = -INFINITY;
+  at->err_min = INFINITY;
+  at->num_cycles = 0;
+  at->sum_amplitude = 0;
+  at->sum_period = 0;
+  at->ku = 0;
+  at->tu = 0;
+  at->start_time = chTimeNow();
+  at->last_cycle_time = at->start_time;
+  at->state = AUTOTUNE_RUNNING;
+}
+
+bool
+pid_autotune_exec(pid_autotune_t* at, float sample)
+{
+  systime_t now = chTimeNow();
+  float err;
+
+  if (at->state != AUTOTUNE_RUNNING)
+    return false;
+
+  if ((now - at->start_time) > AUTOTUNE_TIMEOUT) {
+    printf("autotune timed out\r\n");
+    at->state = AUTOTUNE_FAILED;
+    return false;
+  }
+
+  /* Positive error means the output should be driven */
+  if (at->direction == NEGATIVE)
+    err = sample - at->setpoint;
+  else
+    err = at->setpoint - sample;
+
+  at->err_max = MAX(at->err_max, err);
+  at->err_min = MIN(at->err_min, err);
+
+  if (!at->relay_on && err > at->noise_band) {
+    /* Each off->on transition after the first closes one full oscillation,
+     * so only start measuring once the settling cycles have closed.
+     */
+    if (at->num_cycles > AUTOTUNE_SETTLE_CYCLES) {
+      at->sum_amplitude += (at->err_max - at->err_min) / 2;
+      at->sum_period += (float)(now - at->last_cycle_time) / CH_FREQUENCY;
+    }
+
+    at->num_cycles++;
+    at->last_cycle_time = now;
+    at->err_max = err;
+    at->err_min = err;
+    at->relay_on = true;
+
+    if (at->num_cycles > (AUTOTUNE_SETTLE_CYCLES + AUTOTUNE_MEASURE_CYCLES)) {
+      float a = at->sum_amplitude / AUTOTUNE_MEASURE_CYCLES;
+      float e = at->noise_band;
+
+      at->relay_on = false;
+
+      if (a <= e) {
+        printf("autotune failed, oscillation within noise band\r\n");
+        at->state = AUTOTUNE_FAILED;
+        return false;
+      }
+
+      /* Describing function of a relay with hysteresis */
+      at->ku = (4 * at->relay_amplitude) / (M_PI * sqrtf((a * a) - (e * e)));
+      at->tu = at->sum_period / AUTOTUNE_MEASURE_CYCLES;
+      at->state = AUTOTUNE_DONE;
+
+      printf("autotune done, Ku %f Tu %f\r\n", at->ku, at->tu);
+    }
+  }
+  else if (at->relay_on && err < -at->noise_band) {
+    at->relay_on = false;
+  }
+
+  return at->relay_on;
+}
+
+bool
+pid_autotune_get_gains(const pid_autotune_t* at, pid_gains_t* gains)
+{
+  if (at->state != AUTOTUNE_DONE)
+    return false;
+
+  /* Tyreus-Luyben tuning rules. These are less aggressive than
+   * Ziegler-Nichols and give much less overshoot on lag dominant thermal
+   * plants.
+   */
+  float ti = 2.2f * at->tu;
+  float td = at->tu / 6.3f;
+
+  gains->kp = at->ku / 2.2f;
+  gains->ki = gains->kp / ti;
+  gains->kd = gains->kp * td;
+  gains->valid = true;
+
+  return true;
 }
@@ -10,11 +10,33 @@
 #include "sensor.h"
 
 
+/* Set to TRUE to run the PID loop in Q16.16 fixed point instead of software
+ * emulated floating point.
+ */
+#ifndef PID_FIXED_POINT
+#define PID_FIXED_POINT FALSE
+#endif
+
+
 typedef enum {
   POSITIVE,
   NEGATIVE
 } pid_output_dir_t;
 
+typedef enum {
+  AUTOTUNE_IDLE,
+  AUTOTUNE_RUNNING,
+  AUTOTUNE_DONE,
+  AUTOTUNE_FAILED
+} pid_autotune_state_t;
+
+typedef struct {
+  float kp;
+  float ki;
+  float kd;
+  bool valid;
+} pid_gains_t;
+
 typedef struct {
   bool enabled;
   bool auto_mode;
@@ -24,8 +46,6 @@ typedef struct {
   float kd;
 
   float err_i;
-  float err_i_tune;
-  float last_err;
   float last_sample;
 
   float out;
@@ -33,19 +53,58 @@ typedef struct {
   float out_max;
   int8_t output_sign;
 
+#if PID_FIXED_POINT
+  /* Q16.16 copies of the values above, used by pid_exec. The integral and
+   * last sample are only kept in this form, the gains and limits are
+   * refreshed whenever their float values are set.
+   */
+  int32_t kp_q;
+  int32_t ki_q;
+  int32_t kd_q;
+  int32_t err_i_q;
+  int32_t last_sample_q;
+  int32_t out_min_q;
+  int32_t out_max_q;
+#endif
+
   /* Time is in system ticks */
   systime_t sample_time;
   systime_t last_time;
 } pid_controller_t;
 
+/* Relay feedback autotune state */
+typedef struct {
+  pid_autotune_state_t state;
+  float setpoint;
+  float noise_band;
+  float relay_amplitude;
+  uint8_t direction;
+  bool relay_on;
+
+  float err_max;
+  float err_min;
+  uint8_t num_cycles;
+  float sum_amplitude;
+  float sum_period;
+
+  /* Ultimate gain and period (in seconds) */
+  float ku;
+  float tu;
+
+  systime_t start_time;
+  systime_t last_cycle_time;
+} pid_autotune_t;
+
 
 void pid_init(pid_controller_t* pid);
 void pid_exec(pid_controller_t* pid, float setpoint, float sample);
 void pid_set_gains(pid_controller_t* pid, float Kp, float Ki, float Kd);
-void tune_gains(pid_controller_t* pid, float err_p, float err_d);
 void pid_enable(pid_controller_t* pid, float sample, bool enabled);
 void pid_reinit(pid_controller_t* pid, float sample);
 void pid_set_output_sign(pid_controller_t* pid, uint8_t direction);
 void pid_set_output_limits(pid_controller_t* pid, float Min, float Max);
+void pid_autotune_start(pid_autotune_t* at, float setpoint, float noise_band, float relay_amplitude, uint8_t direction);
+bool pid_autotune_exec(pid_autotune_t* at, float sample);
+bool pid_autotune_get_gains(const pid_autotune_t* at, pid_gains_t* gains);
 
 #endif
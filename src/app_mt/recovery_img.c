@@ -3,20 +3,44 @@
 #include "message.h"
 #include "dfuse.h"
 #include "app_hdr.h"
+#include "kv_store.h"
 
 #include <stdio.h>
+#include <string.h>
+
+
+/* Identity of the last recovery image that passed a full check. It is
+ * deleted before the partition is written, so a match means the image is
+ * unchanged since it was verified.
+ */
+#define RECOVERY_IMG_VERIFIED_KEY KV_KEY(KV_NS_IMAGE, 1)
 
 
 static msg_t
 recovery_img_thread(void* arg);
 
+static bool
+verified_from_cache(void);
+
+static void
+save_verified(void);
+
 
 void
 recovery_img_init()
 {
+  systime_t start = chTimeNow();
   recovery_img_load_state_t state = RECOVERY_IMG_CHECKING;
   msg_send(MSG_RECOVERY_IMG_STATUS, &state);
 
+  if (verified_from_cache()) {
+    printf("Recovery image is present (cached check, %d ms)\r\n",
+        (int)((chTimeNow() - start) * 1000 / CH_FREQUENCY));
+    state = RECOVERY_IMG_LOADED;
+    msg_send(MSG_RECOVERY_IMG_STATUS, &state);
+    return;
+  }
+
   dfu_parse_result_t result = dfuse_verify(SP_RECOVERY_IMG);
   if (result != DFU_PARSE_OK) {
     printf("No recovery image detected (%d)\r\n", result);
@@ -25,12 +49,41 @@ recovery_img_init()
     recovery_img_write();
   }
   else {
-    printf("Recovery image is present\r\n");
+    save_verified();
+
+    printf("Recovery image is present (full check, %d ms)\r\n",
+        (int)((chTimeNow() - start) * 1000 / CH_FREQUENCY));
     state = RECOVERY_IMG_LOADED;
     msg_send(MSG_RECOVERY_IMG_STATUS, &state);
   }
 }
 
+static bool
+verified_from_cache()
+{
+  dfu_image_id_t id;
+  dfu_image_id_t verified_id;
+  uint32_t len;
+
+  if (dfuse_get_image_id(SP_RECOVERY_IMG, &id) != DFU_PARSE_OK)
+    return false;
+
+  if (!kv_get(RECOVERY_IMG_VERIFIED_KEY, &verified_id, sizeof(verified_id), &len) ||
+      len != sizeof(verified_id))
+    return false;
+
+  return (memcmp(&id, &verified_id, sizeof(id)) == 0);
+}
+
+static void
+save_verified()
+{
+  dfu_image_id_t id;
+
+  if (dfuse_get_image_id(SP_RECOVERY_IMG, &id) == DFU_PARSE_OK)
+    kv_put(RECOVERY_IMG_VERIFIED_KEY, &id, sizeof(id));
+}
+
 static msg_t
 recovery_img_thread(void* arg)
 {
@@ -53,6 +106,7 @@ recovery_img_thread(void* arg)
 
   state = RECOVERY_IMG_LOADING;
   msg_send(MSG_RECOVERY_IMG_STATUS, &state);
+  kv_delete(RECOVERY_IMG_VERIFIED_KEY);
   dfuse_write_self(SP_RECOVERY_IMG, img_recs, 2);
 
   state = RECOVERY_IMG_CHECKING;
@@ -60,6 +114,7 @@ recovery_img_thread(void* arg)
 
   result = dfuse_verify(SP_RECOVERY_IMG);
   if (result == DFU_PARSE_OK) {
+    save_verified();
     state = RECOVERY_IMG_LOADED;
     msg_send(MSG_RECOVERY_IMG_STATUS, &state);
   }
@@ -5,6 +5,7 @@
 #include "app_cfg.h"
 #include "thread_watchdog.h"
 #include "crc/crc8.h"
+#include "latency_trace.h"
 
 #include <string.h>
 
@@ -21,16 +22,19 @@ typedef struct sensor_port_s {
   uint8_t sample_size;
   onewire_bus_t* bus;
   Thread* thread;
+  systime_t conversion_start;
   systime_t last_sample_time;
   bool connected;
 } sensor_port_t;
 
 static sensor_port_t* open_ports[NUM_SENSORS];
 
+static onewire_bus_t* const sensor_buses[NUM_SENSORS] = BOARD_SENSOR_CHANNELS;
+
 static msg_t sensor_thread(void* arg);
 static bool sensor_get_sample(sensor_port_t* tp, quantity_t* sample);
 static void filter_sample(sensor_port_t* tp, quantity_t* sample);
-static void send_sensor_msg(sensor_port_t* tp, quantity_t* sample);
+static void send_sensor_msg(sensor_port_t* tp, quantity_t* sample, systime_t sample_time);
 static void send_timeout_msg(sensor_port_t* tp);
 
 static bool read_maxim_temp_sensor(sensor_port_t* tp, quantity_t* sample);
@@ -52,6 +56,15 @@ sensor_init(sensor_id_t sensor, onewire_bus_t* port)
   return tp;
 }
 
+void
+sensor_init_all()
+{
+  int i;
+
+  for (i = 0; i < NUM_SENSORS; ++i)
+    sensor_init(i, sensor_buses[i]);
+}
+
 static msg_t
 sensor_thread(void* arg)
 {
@@ -65,11 +78,14 @@ sensor_thread(void* arg)
     thread_watchdog_kick();
 
     if (sensor_get_sample(tp, &sample)) {
+      systime_t sample_time = chTimeNow();
+
+      latency_trace_record(LT_SAMPLE_ACQUIRED, tp->sensor, tp->conversion_start);
       filter_sample(tp, &sample);
       sample.value = (sample.value + tp->sensor_config.offset.value);
       tp->connected = true;
-      tp->last_sample_time = chTimeNow();
-      send_sensor_msg(tp, &sample);
+      tp->last_sample_time = sample_time;
+      send_sensor_msg(tp, &sample, sample_time);
     }
     else {
       if ((chTimeNow() - tp->last_sample_time) > SENSOR_TIMEOUT) {
@@ -106,13 +122,16 @@ filter_sample(sensor_port_t* tp, quantity_t* sample)
 }
 
 static void
-send_sensor_msg(sensor_port_t* tp, quantity_t* sample)
+send_sensor_msg(sensor_port_t* tp, quantity_t* sample, systime_t sample_time)
 {
   sensor_msg_t msg = {
       .sensor = tp->sensor,
-      .sample = *sample
+      .sample = *sample,
+      .timestamp = sample_time
   };
+
   msg_send(MSG_SENSOR_SAMPLE, &msg);
+  latency_trace_record(LT_FANOUT_COMPLETE, tp->sensor, sample_time);
 }
 
 static void
@@ -169,6 +188,7 @@ read_maxim_temp_sensor(sensor_port_t* tp, quantity_t* sample)
 
   if (!onewire_send_byte(tp->bus, 0x44))
     return false;
+  tp->conversion_start = chTimeNow();
 
   // wait for device to signal conversion complete
   chThdSleepMilliseconds(700);
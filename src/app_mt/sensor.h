@@ -3,6 +3,7 @@
 
 #include "onewire.h"
 #include "types.h"
+#include "board.h"
 #include <stdint.h>
 
 
@@ -13,7 +14,7 @@ typedef enum {
   SENSOR_1,
   SENSOR_2,
 
-  NUM_SENSORS
+  NUM_SENSORS = BOARD_NUM_SENSOR_CHANNELS
 } sensor_id_t;
 
 struct sensor_port_s;
@@ -22,6 +23,8 @@ typedef struct sensor_port_s sensor_port_t;
 typedef struct {
   sensor_id_t sensor;
   quantity_t sample;
+  /* Time the sample was read from the probe */
+  systime_t timestamp;
 } sensor_msg_t;
 
 typedef struct {
@@ -44,6 +47,9 @@ typedef struct {
 sensor_port_t*
 sensor_init(sensor_id_t sensor, onewire_bus_t* port);
 
+void
+sensor_init_all(void);
+
 sensor_config_t*
 get_sensor_cfg(sensor_id_t sensor_id);
 
@@ -8,8 +8,20 @@
 #include "temp_profile.h"
 #include "pid.h"
 #include "board.h"
+#include "latency_trace.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+
+/* Smallest noise band used for the autotune relay test, in degrees F */
+#define AUTOTUNE_MIN_NOISE_BAND 0.2
+
+/* Largest PID output. In setpoint shift mode it is a shift of up to this
+ * many degrees F either way, in a proportional window it is full duty.
+ */
+#define PID_OUTPUT_LIMIT 20
 
 
 typedef enum {
@@ -23,10 +35,16 @@ struct temp_controller_s;
 typedef struct {
   output_id_t id;
   pid_controller_t pid_control;
+  pid_autotune_t autotune;
   output_status_t status;
   bool temp_ovrd;
   bool output_ovrd;
   systime_t cycle_delay_start_time;
+  bool window_active;
+  systime_t window_start_time;
+  systime_t window_on_time;
+  VirtualTimer window_timer;
+  BinarySemaphore wakeup;
   struct temp_controller_s* controller;
   Thread* thread;
 } relay_output_t;
@@ -36,6 +54,7 @@ typedef struct temp_controller_s {
   temp_controller_id_t controller;
   temp_controller_state_t state;
   quantity_t last_sample;
+  systime_t last_sample_time;
   temp_profile_run_t temp_profile_run;
   relay_output_t outputs[NUM_OUTPUTS];
 } temp_controller_t;
@@ -43,15 +62,21 @@ typedef struct temp_controller_s {
 
 static void dispatch_temp_input_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
 static void dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t* msg, bool resume_profile);
-static void dispatch_init(temp_controller_t* tc);
-static void dispatch_sensor_sample(temp_controller_t* tc, sensor_msg_t* msg);
-static void dispatch_sensor_timeout(temp_controller_t* tc, sensor_timeout_msg_t* msg);
-static void dispatch_output_ovrd(temp_controller_t* tc, output_ovrd_msg_t* msg);
+static void dispatch_init(void);
+static void dispatch_sensor_sample(sensor_msg_t* msg);
+static void dispatch_sensor_timeout(sensor_timeout_msg_t* msg);
+static void dispatch_output_ovrd(output_ovrd_msg_t* msg);
+static void dispatch_pid_autotune(pid_autotune_msg_t* msg);
+static void autotune_complete(relay_output_t* output, float sample);
 static void output_init(temp_controller_t* tc, output_id_t id);
 static msg_t output_thread(void* arg);
 static void start_cycle_delay(relay_output_t* output);
+static void switch_relay(relay_output_t* output, bool enable);
 static void set_output_state(relay_output_t* output, output_state_t output_state);
 static void relay_control(relay_output_t* output);
+static void time_proportional_control(relay_output_t* output, const output_settings_t* output_settings);
+static void schedule_window_wakeup(relay_output_t* output, systime_t delay);
+static void window_timer_expired(void* arg);
 static void enable_relay(relay_output_t* output, bool enabled);
 static float get_sp(temp_controller_t* tc);
 static const output_settings_t* get_output_settings(temp_controller_t* tc, output_id_t output);
@@ -59,32 +84,36 @@ static void internal_temp_ovrd_check(relay_output_t* output);
 
 static temp_controller_t* controllers[NUM_CONTROLLERS];
 
-static const uint32_t out_gpio[NUM_OUTPUTS] = {
-    [OUTPUT_1] = PAD_RELAY1,
-    [OUTPUT_2] = PAD_RELAY2
-};
+/* Controller driven by each sensor, so samples can be dispatched directly */
+static temp_controller_t* sensor_controllers[NUM_SENSORS];
+
+static const relay_channel_t relay_channels[NUM_OUTPUTS] = BOARD_RELAY_CHANNELS;
 
 
 void
-temp_control_init(temp_controller_id_t controller)
+temp_control_init()
 {
-  temp_controller_t* tc = calloc(1, sizeof(temp_controller_t));
-  controllers[controller] = tc;
-  tc->controller = controller;
-  if (controller == CONTROLLER_1)
-    tc->sensor = SENSOR_1;
-  else
-    tc->sensor = SENSOR_2;
+  int i;
 
-  tc->state = TC_SENSOR_TIMED_OUT;
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    temp_controller_t* tc = calloc(1, sizeof(temp_controller_t));
+    controllers[i] = tc;
+    tc->controller = i;
+    tc->sensor = (sensor_id_t)i;
+    tc->state = TC_SENSOR_TIMED_OUT;
+    sensor_controllers[tc->sensor] = tc;
+
+    temp_profile_init(&tc->temp_profile_run, i);
+  }
 
-  msg_listener_t* l = msg_listener_create("temp_ctrl", 1024, dispatch_temp_input_msg, tc);
+  msg_listener_t* l = msg_listener_create("temp_ctrl", 1024, dispatch_temp_input_msg, NULL);
 
   msg_subscribe(l, MSG_SENSOR_SAMPLE,   NULL);
   msg_subscribe(l, MSG_SENSOR_TIMEOUT,  NULL);
   msg_subscribe(l, MSG_API_CONTROLLER_SETTINGS, NULL);
   msg_subscribe(l, MSG_CONTROLLER_SETTINGS, NULL);
   msg_subscribe(l, MSG_OUTPUT_OVRD, NULL);
+  msg_subscribe(l, MSG_PID_AUTOTUNE, NULL);
 }
 
 float
@@ -110,6 +139,7 @@ temp_control_get_status(temp_controller_id_t controller, output_id_t output)
   status.kp = tc->outputs[output].pid_control.kp;
   status.ki = tc->outputs[output].pid_control.ki;
   status.kd = tc->outputs[output].pid_control.kd;
+  status.autotuning = (tc->outputs[output].autotune.state == AUTOTUNE_RUNNING);
 
   return (status);
 }
@@ -141,6 +171,15 @@ temp_control_enable_output(output_id_t output, bool enable)
     enable_relay(&tc->outputs[output], enable);
 }
 
+const relay_channel_t*
+temp_control_get_relay_channel(output_id_t output)
+{
+  if (output >= NUM_OUTPUTS)
+    return NULL;
+
+  return &relay_channels[output];
+}
+
 output_function_t
 temp_control_get_output_function(output_id_t output)
 {
@@ -166,18 +205,38 @@ output_init(temp_controller_t* tc, output_id_t output)
 
   out->id = output;
   out->controller = tc;
+  out->window_active = false;
+  chBSemInit(&out->wakeup, TRUE);
 
   if (settings->function == OUTPUT_FUNC_MANUAL)
     return;
 
   pid_init(&out->pid_control);
-  pid_set_output_limits(&out->pid_control, -20, 20);
+
+  /* A proportional window turns the PID output into a duty cycle, where
+   * anything below zero would do nothing but wind the integral down while
+   * the relay is already off.
+   */
+  if (settings->window.value > 0)
+    pid_set_output_limits(&out->pid_control, 0, PID_OUTPUT_LIMIT);
+  else
+    pid_set_output_limits(&out->pid_control, -PID_OUTPUT_LIMIT, PID_OUTPUT_LIMIT);
 
   if (settings->function == OUTPUT_FUNC_COOLING)
     pid_set_output_sign(&out->pid_control, NEGATIVE);
   else
     pid_set_output_sign(&out->pid_control, POSITIVE);
 
+  /* Use the gains from the last successful autotune, if there was one.
+   * Autotune measures the response to the window's duty cycle, so its gains
+   * mean nothing to a setpoint shift.
+   */
+  const pid_gains_t* gains = app_cfg_get_pid_gains(tc->controller, output);
+  if (settings->window.value > 0 && gains != NULL && gains->valid)
+    pid_set_gains(&out->pid_control, gains->kp, gains->ki, gains->kd);
+
+  out->autotune.state = AUTOTUNE_IDLE;
+
   out->thread = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, output_thread, out);
 }
 
@@ -220,7 +279,7 @@ output_thread(void* arg)
 
   while (!chThdShouldTerminate()) {
     //internal_temp_ovrd_check(output);
-
+
     if (output->controller->state != TC_ACTIVE ||
         !output_settings->enabled ||
         output->temp_ovrd)
@@ -240,7 +299,8 @@ output_thread(void* arg)
         break;
 
       case CYCLE_DELAY:
-        if (cycle_delay < 1) {
+        if (cycle_delay < 1 ||
+            output->autotune.state == AUTOTUNE_RUNNING) {
           set_output_state(output, OUTPUT_CONTROL_ENABLED);
           break;
         }
@@ -254,9 +314,15 @@ output_thread(void* arg)
         break;
     }
 
-    chThdSleepSeconds(1);
+    /* Sleep until the next poll, or until the window timer fires */
+    chBSemWaitTimeout(&output->wakeup, S2ST(1));
   }
 
+  chSysLock();
+  if (chVTIsArmedI(&output->window_timer))
+    chVTResetI(&output->window_timer);
+  chSysUnlock();
+
   enable_relay(output, false);
 
   return 0;
@@ -275,11 +341,15 @@ relay_control(relay_output_t* output)
   if (output->output_ovrd) {
     enable_relay(output, false);
     output->pid_control.enabled = false;
+    output->window_active = false;
+    output->autotune.state = AUTOTUNE_IDLE;
     return;
   }
 
   switch (app_cfg_get_control_mode()) {
   case ON_OFF:
+    output->window_active = false;
+    output->autotune.state = AUTOTUNE_IDLE;
     if (output_settings->function == OUTPUT_FUNC_HEATING) {
       if (sample <= setpoint - hysteresis)
         enable_relay(output, true);
@@ -298,6 +368,21 @@ relay_control(relay_output_t* output)
     if (output->pid_control.enabled == false)
       output->pid_control.enabled = true;
 
+    /* While autotuning the relay is driven directly by the relay test. A
+     * cycle delay would stretch the oscillation it measures, so it is
+     * bypassed and the noise band alone paces the switching.
+     */
+    if (output->autotune.state == AUTOTUNE_RUNNING) {
+      output->window_active = false;
+      switch_relay(output, output->autotune.relay_on);
+      break;
+    }
+
+    if (output_settings->window.value > 0) {
+      time_proportional_control(output, output_settings);
+      break;
+    }
+
     if (output_settings->function == OUTPUT_FUNC_HEATING) {
       if (sample < (setpoint + output->pid_control.out) - hysteresis)
         enable_relay(output, true);
@@ -317,6 +402,84 @@ relay_control(relay_output_t* output)
   }
 }
 
+static void
+time_proportional_control(relay_output_t* output, const output_settings_t* output_settings)
+{
+  systime_t now = chTimeNow();
+  systime_t window = S2ST(output_settings->window.value);
+  systime_t cycle_delay = S2ST(60 * output_settings->cycle_delay.value);
+  systime_t elapsed;
+
+  /* A window no longer than the cycle delay has no room left to modulate
+   * in, so stretch it to fit an on and an off period.
+   */
+  if (window <= cycle_delay)
+    window = 2 * cycle_delay;
+
+  /* Start a new window once the previous one has run out. The duty cycle is
+   * latched at the start of the window from the current PID output.
+   */
+  if (!output->window_active ||
+      (now - output->window_start_time) >= window) {
+    float duty = LIMIT(output->pid_control.out, 0, output->pid_control.out_max) /
+        output->pid_control.out_max;
+    systime_t on_time = duty * window;
+
+    /* The off portion of the window can never be shorter than the cycle
+     * delay, so either stretch the on time to the whole window or trim it
+     * to leave room for the delay.
+     */
+    if (on_time > 0 && on_time < window && (window - on_time) < cycle_delay) {
+      if (on_time >= (window / 2))
+        on_time = window;
+      else if (window > cycle_delay)
+        on_time = window - cycle_delay;
+      else
+        on_time = 0;
+    }
+
+    output->window_active = true;
+    output->window_start_time = now;
+    output->window_on_time = on_time;
+  }
+
+  /* The on time was already trimmed to leave the cycle delay off, so the
+   * relay is switched directly rather than pausing the output in
+   * CYCLE_DELAY for the rest of the window.
+   */
+  elapsed = now - output->window_start_time;
+  if (elapsed < output->window_on_time) {
+    switch_relay(output, true);
+    schedule_window_wakeup(output, output->window_on_time - elapsed);
+  }
+  else {
+    switch_relay(output, false);
+    schedule_window_wakeup(output, window - elapsed);
+  }
+}
+
+static void
+schedule_window_wakeup(relay_output_t* output, systime_t delay)
+{
+  if (delay < 1)
+    delay = 1;
+
+  chSysLock();
+  if (chVTIsArmedI(&output->window_timer))
+    chVTResetI(&output->window_timer);
+  chVTSetI(&output->window_timer, delay, window_timer_expired, output);
+  chSysUnlock();
+}
+
+static void
+window_timer_expired(void* arg)
+{
+  relay_output_t* output = arg;
+
+  /* Called from the system tick ISR with the kernel locked */
+  chBSemSignalI(&output->wakeup);
+}
+
 static void
 enable_relay(relay_output_t* output, bool enable)
 {
@@ -324,7 +487,18 @@ enable_relay(relay_output_t* output, bool enable)
   if (output->status.enabled && !enable)
     start_cycle_delay(output);
 
-  palWritePad(GPIOC, out_gpio[output->id], enable);
+  switch_relay(output, enable);
+}
+
+static void
+switch_relay(relay_output_t* output, bool enable)
+{
+  /* Trace automatic switching against the sample that drove it */
+  if (output->status.enabled != enable &&
+      get_output_settings(output->controller, output->id)->function != OUTPUT_FUNC_MANUAL)
+    latency_trace_record(LT_RELAY_SWITCHED, output->id, output->controller->last_sample_time);
+
+  palWritePad(relay_channels[output->id].port, relay_channels[output->id].pad, enable);
   output->status.enabled = enable;
   msg_send(MSG_OUTPUT_STATUS, &output->status);
 }
@@ -354,24 +528,32 @@ dispatch_temp_input_msg(msg_id_t id, void* msg_data, void* listener_data, void*
 
   switch (id) {
   case MSG_INIT:
-    dispatch_init(listener_data);
+    dispatch_init();
     break;
 
   case MSG_SENSOR_SAMPLE:
-    dispatch_sensor_sample(listener_data, msg_data);
+    dispatch_sensor_sample(msg_data);
     break;
 
   case MSG_SENSOR_TIMEOUT:
-    dispatch_sensor_timeout(listener_data, msg_data);
+    dispatch_sensor_timeout(msg_data);
     break;
 
   case MSG_CONTROLLER_SETTINGS:
   case MSG_API_CONTROLLER_SETTINGS:
-    dispatch_controller_settings(listener_data, msg_data, false);
+  {
+    const controller_settings_t* settings = msg_data;
+    if (settings->controller < NUM_CONTROLLERS)
+      dispatch_controller_settings(controllers[settings->controller], settings, false);
     break;
+  }
 
   case MSG_OUTPUT_OVRD:
-    dispatch_output_ovrd(listener_data, msg_data);
+    dispatch_output_ovrd(msg_data);
+    break;
+
+  case MSG_PID_AUTOTUNE:
+    dispatch_pid_autotune(msg_data);
     break;
 
   default:
@@ -394,21 +576,33 @@ get_sp(temp_controller_t* tc)
 }
 
 static void
-dispatch_init(temp_controller_t* tc)
+dispatch_init()
 {
-  const controller_settings_t* cs = app_cfg_get_controller_settings(tc->controller);
-  dispatch_controller_settings(tc, cs, true);
+  int i;
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    const controller_settings_t* cs = app_cfg_get_controller_settings(i);
+    dispatch_controller_settings(controllers[i], cs, true);
+  }
 }
 
 static void
-dispatch_sensor_sample(temp_controller_t* tc, sensor_msg_t* msg)
+dispatch_sensor_sample(sensor_msg_t* msg)
 {
   int i;
+  temp_controller_t* tc;
 
-  if (msg->sensor != tc->sensor)
+  if (msg->sensor < 0 || msg->sensor >= NUM_SENSORS)
     return;
 
+  tc = sensor_controllers[msg->sensor];
+  if (tc == NULL)
+    return;
+
+  latency_trace_record(LT_DISPATCH_CONTROL, msg->sensor, msg->timestamp);
+
   tc->last_sample = msg->sample;
+  tc->last_sample_time = msg->timestamp;
   if (tc->state == TC_SENSOR_TIMED_OUT)
     tc->state = TC_ACTIVE;
 
@@ -417,20 +611,35 @@ dispatch_sensor_sample(temp_controller_t* tc, sensor_msg_t* msg)
     temp_profile_update(&tc->temp_profile_run, msg->sample);
 
   for (i = 0; i < NUM_OUTPUTS; ++i) {
-    const output_settings_t* output_settings = get_output_settings(tc, tc->outputs[i].id);
-      if (app_cfg_get_control_mode() == PID &&
-          output_settings->enabled == true) {
-        pid_exec(&tc->outputs[i].pid_control,
-            get_sp(tc),
-            msg->sample.value);
+    relay_output_t* out = &tc->outputs[i];
+    const output_settings_t* output_settings = get_output_settings(tc, out->id);
+    if (app_cfg_get_control_mode() == PID &&
+        output_settings->enabled == true) {
+      if (out->autotune.state == AUTOTUNE_RUNNING) {
+        pid_autotune_exec(&out->autotune, msg->sample.value);
+        if (out->autotune.state == AUTOTUNE_DONE)
+          autotune_complete(out, msg->sample.value);
+        continue;
       }
+
+      pid_exec(&out->pid_control,
+          get_sp(tc),
+          msg->sample.value);
+      latency_trace_record(LT_PID_EVALUATED, msg->sensor, msg->timestamp);
+    }
   }
 }
 
 static void
-dispatch_sensor_timeout(temp_controller_t* tc, sensor_timeout_msg_t* msg)
+dispatch_sensor_timeout(sensor_timeout_msg_t* msg)
 {
-  if (msg->sensor != tc->sensor)
+  temp_controller_t* tc;
+
+  if (msg->sensor < 0 || msg->sensor >= NUM_SENSORS)
+    return;
+
+  tc = sensor_controllers[msg->sensor];
+  if (tc == NULL)
     return;
 
   if (tc->state == TC_ACTIVE)
@@ -449,6 +658,7 @@ dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t*
     relay_output_t* out = &tc->outputs[i];
     if (out->thread != NULL) {
       chThdTerminate(out->thread);
+      chBSemSignal(&out->wakeup);
       chThdWait(out->thread);
       out->thread = NULL;
     }
@@ -466,15 +676,65 @@ dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t*
     if (resume_profile)
       temp_profile_resume(tpr, tc->controller);
     else
-      temp_profile_start(tpr, tc->controller, settings->temp_profile.id, settings->temp_profile.start_point);
+      temp_profile_start(tpr, tc->controller, settings->temp_profile_id, settings->temp_profile_start_point);
   }
 
   tc->state = TC_SENSOR_TIMED_OUT;
 }
 
 static void
-dispatch_output_ovrd(temp_controller_t* tc, output_ovrd_msg_t* msg)
+dispatch_pid_autotune(pid_autotune_msg_t* msg)
+{
+  if (msg->controller >= NUM_CONTROLLERS || msg->output >= NUM_OUTPUTS)
+    return;
+
+  temp_controller_t* tc = controllers[msg->controller];
+  relay_output_t* out = &tc->outputs[msg->output];
+  const output_settings_t* output_settings = get_output_settings(tc, msg->output);
+  float setpoint = get_sp(tc);
+
+  /* Only outputs driving a proportional window can use the gains it finds */
+  if (out->thread == NULL ||
+      app_cfg_get_control_mode() != PID ||
+      output_settings->function == OUTPUT_FUNC_MANUAL ||
+      output_settings->window.value <= 0 ||
+      isnan(setpoint))
+    return;
+
+  float noise_band = MAX(app_cfg_get_hysteresis().value, AUTOTUNE_MIN_NOISE_BAND);
+
+  /* The relay swings the duty cycle between fully off and fully on, which is
+   * half of the PID output span either side of its midpoint.
+   */
+  pid_autotune_start(&out->autotune, setpoint, noise_band,
+      (out->pid_control.out_max - out->pid_control.out_min) / 2,
+      out->pid_control.output_sign);
+}
+
+static void
+autotune_complete(relay_output_t* output, float sample)
+{
+  pid_gains_t gains;
+
+  if (pid_autotune_get_gains(&output->autotune, &gains)) {
+    printf("autotune gains Kp %f Ki %f Kd %f\r\n", gains.kp, gains.ki, gains.kd);
+
+    app_cfg_set_pid_gains(output->controller->controller, output->id, &gains);
+    pid_set_gains(&output->pid_control, gains.kp, gains.ki, gains.kd);
+    pid_reinit(&output->pid_control, sample);
+  }
+
+  output->autotune.state = AUTOTUNE_IDLE;
+}
+
+static void
+dispatch_output_ovrd(output_ovrd_msg_t* msg)
 {
+  if (msg->controller >= NUM_CONTROLLERS || msg->output >= NUM_OUTPUTS)
+    return;
+
+  temp_controller_t* tc = controllers[msg->controller];
+
   if (tc->outputs[msg->output].output_ovrd == false)
     tc->outputs[msg->output].output_ovrd = true;
   else
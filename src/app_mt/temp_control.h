@@ -7,20 +7,19 @@
 #include "types.h"
 
 
+/* Each controller is driven by the probe with the same index */
 typedef enum {
   CONTROLLER_1,
   CONTROLLER_2,
-  NUM_CONTROLLERS
+  NUM_CONTROLLERS = NUM_SENSORS
 } temp_controller_id_t;
 
-#include "temp_profile.h"
-
 typedef enum {
   OUTPUT_NONE = -1,
   OUTPUT_1,
   OUTPUT_2,
 
-  NUM_OUTPUTS
+  NUM_OUTPUTS = BOARD_NUM_RELAY_CHANNELS
 } output_id_t;
 
 typedef enum {
@@ -60,10 +59,16 @@ typedef struct {
   temp_controller_id_t controller;
 } output_ovrd_msg_t;
 
+typedef struct {
+  output_id_t output;
+  temp_controller_id_t controller;
+} pid_autotune_msg_t;
+
 typedef struct {
   bool enabled;
   output_function_t function;
   quantity_t cycle_delay;
+  quantity_t window;
 } output_settings_t;
 
 typedef struct {
@@ -72,21 +77,25 @@ typedef struct {
   temp_profile_step_type_t type;
 } temp_profile_step_t;
 
+/* Temp profile header. The steps themselves are stored in external flash
+ * following the header and are paged in by temp_profile.c as they are needed.
+ */
 typedef struct {
   uint32_t id;
   char name[100];
   uint32_t num_steps;
   quantity_t start_value;
-  temp_profile_step_t steps[32];
-  int start_point;
-  temp_profile_completion_action_t completion_action;
 } temp_profile_t;
 
+#include "temp_profile.h"
+
 typedef struct {
   temp_controller_id_t controller;
   setpoint_type_t setpoint_type;
   quantity_t static_setpoint;
-  temp_profile_t temp_profile;
+  uint32_t temp_profile_id;
+  int temp_profile_start_point;
+  temp_profile_completion_action_t temp_profile_completion_action;
   output_settings_t output_settings[NUM_OUTPUTS];
   session_action_t session_action;
 } controller_settings_t;
@@ -103,16 +112,27 @@ typedef struct {
   output_state_t state;
 } output_status_t;
 
+typedef struct {
+  ioportid_t port;
+  uint32_t pad;
+  ioportid_t test_port;
+  uint32_t test_pad;
+} relay_channel_t;
+
 typedef struct {
   float kp;
   float ki;
   float kd;
   bool  output_enabled;
+  bool  autotuning;
   output_function_t function;
 } temp_control_status_t;
 
 void
-temp_control_init(temp_controller_id_t controller);
+temp_control_init(void);
+
+const relay_channel_t*
+temp_control_get_relay_channel(output_id_t output);
 
 void
 temp_control_start(controller_settings_t* cmd);
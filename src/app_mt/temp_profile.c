@@ -2,20 +2,37 @@
 #include "temp_profile.h"
 #include "message.h"
 #include "app_cfg.h"
+#include "temp_profile_lib.h"
 #include <stdio.h>
+#include <string.h>
 
 // 4 hours
 #define CHECKPOINT_PERIOD S2ST(4 * 60 * 60)
 
+
 static void write_checkpoint(temp_profile_run_t* run);
+static void page_in_profile(temp_profile_run_t* run);
+static bool page_in_steps(temp_profile_run_t* run);
+static void advance_step(temp_profile_run_t* run);
+
 
+void
+temp_profile_init(temp_profile_run_t* run, temp_controller_id_t controller)
+{
+  chMtxInit(&run->mtx);
+  run->controller = controller;
+  run->profile_valid = false;
+  run->lib_revision = 0;
+}
 
 void
 temp_profile_start(temp_profile_run_t* run, temp_controller_id_t controller, uint32_t temp_profile_id, int start_point)
 {
+  chMtxLock(&run->mtx);
+
   if ((temp_profile_id != run->temp_profile_id) ||
       (start_point >= 0)) {
-    run->current_step = start_point;
+    run->current_step = (start_point > 0) ? start_point : 0;
     run->current_step_start_time = chTimeNow();
 
     if (run->current_step == 0) {
@@ -29,6 +46,10 @@ temp_profile_start(temp_profile_run_t* run, temp_controller_id_t controller, uin
   run->controller = controller;
   run->temp_profile_id = temp_profile_id;
 
+  page_in_profile(run);
+
+  chMtxUnlock();
+
   write_checkpoint(run);
 
   printf("Starting profile\r\n");
@@ -45,6 +66,8 @@ temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller)
 {
   const temp_profile_checkpoint_t* checkpoint = app_cfg_get_temp_profile_checkpoint(controller);
 
+  chMtxLock(&run->mtx);
+
   run->controller = controller;
   run->temp_profile_id = checkpoint->temp_profile_id;
   run->state = checkpoint->state;
@@ -52,6 +75,10 @@ temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller)
   run->current_step_start_time = chTimeNow() - checkpoint->current_step_time;
   run->next_checkpoint = chTimeNow() + CHECKPOINT_PERIOD;
 
+  page_in_profile(run);
+
+  chMtxUnlock();
+
   printf("Resuming profile\r\n");
   printf("  controller: %d\r\n", (int)run->controller);
   printf("  profile id: %d\r\n", (int)run->temp_profile_id);
@@ -64,16 +91,22 @@ temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller)
 void
 temp_profile_update(temp_profile_run_t* run, quantity_t sample)
 {
+  chMtxLock(&run->mtx);
+
   switch (run->state) {
     case TPS_SEEKING_START_VALUE:
     {
-      const temp_profile_t* profile = &app_cfg_get_controller_settings(run->controller)->temp_profile;
-      float start_err = sample.value - profile->start_value.value;
+      if (!run->profile_valid)
+        break;
+
+      float start_err = sample.value - run->profile.start_value.value;
 
       if (start_err < 1 && start_err > -1) {
         run->current_step = 0;
         run->current_step_start_time = chTimeNow();
         run->state = TPS_RUNNING;
+        if (!page_in_steps(run))
+          run->profile_valid = false;
       }
       break;
     }
@@ -82,6 +115,8 @@ temp_profile_update(temp_profile_run_t* run, quantity_t sample)
       break;
   }
 
+  chMtxUnlock();
+
   if (chTimeNow() > run->next_checkpoint)
     write_checkpoint(run);
 }
@@ -108,24 +143,22 @@ write_checkpoint(temp_profile_run_t* run)
 bool
 temp_profile_get_current_setpoint(temp_profile_run_t* run, float* sp)
 {
-  bool ret = true;
-  const temp_profile_t* profile = &app_cfg_get_controller_settings(run->controller)->temp_profile;
+  chMtxLock(&run->mtx);
+
+  /* Pick up edits to the running profile */
+  if (run->lib_revision != temp_profile_lib_get_revision())
+    page_in_profile(run);
+
+  if (!run->profile_valid) {
+    chMtxUnlock();
+    return false;
+  }
+
+  const temp_profile_t* profile = &run->profile;
 
   if (run->state == TPS_RUNNING) {
-    if (chTimeNow() > run->current_step_start_time + S2ST(profile->steps[run->current_step].duration)) {
-      if (++run->current_step >= profile->num_steps) {
-        if (profile->completion_action == TEMP_PROFILE_COMPLETION_ACTION_START_OVER) {
-          run->current_step = 0;
-          run->current_step_start_time = chTimeNow();
-        }
-        else {
-          run->state = TPS_HOLD_LAST;
-        }
-      }
-      else {
-        run->current_step_start_time = chTimeNow();
-      }
-    }
+    if (chTimeNow() > run->current_step_start_time + S2ST(run->current_step_data.duration))
+      advance_step(run);
   }
 
   switch (run->state) {
@@ -135,16 +168,12 @@ temp_profile_get_current_setpoint(temp_profile_run_t* run, float* sp)
 
     case TPS_RUNNING:
     {
-      const temp_profile_step_t* cur_step = &profile->steps[run->current_step];
+      const temp_profile_step_t* cur_step = &run->current_step_data;
       if (cur_step->type == STEP_HOLD) {
         *sp = cur_step->value.value;
       }
       else {
-        float last_temp;
-        if (run->current_step == 0)
-          last_temp = profile->start_value.value;
-        else
-          last_temp = profile->steps[run->current_step - 1].value.value;
+        float last_temp = run->current_step_start_value;
 
         systime_t duration_into_step = chTimeNow() - run->current_step_start_time;
         *sp = last_temp + ((cur_step->value.value - last_temp) * duration_into_step / S2ST(cur_step->duration));
@@ -153,12 +182,101 @@ temp_profile_get_current_setpoint(temp_profile_run_t* run, float* sp)
     }
 
     case TPS_HOLD_LAST:
+      /* The last step is left paged in when the profile completes */
       if (profile->num_steps > 0)
-        *sp = profile->steps[profile->num_steps-1].value.value;
+        *sp = run->current_step_data.value.value;
       else
         *sp = profile->start_value.value;
       break;
   }
 
-  return ret;
+  chMtxUnlock();
+
+  return true;
+}
+
+static void
+advance_step(temp_profile_run_t* run)
+{
+  const controller_settings_t* cs = app_cfg_get_controller_settings(run->controller);
+
+  if (++run->current_step >= run->profile.num_steps) {
+    if (cs->temp_profile_completion_action == TEMP_PROFILE_COMPLETION_ACTION_START_OVER) {
+      run->current_step = 0;
+      run->current_step_start_time = chTimeNow();
+      if (!page_in_steps(run))
+        run->profile_valid = false;
+    }
+    else {
+      run->current_step = run->profile.num_steps - 1;
+      run->state = TPS_HOLD_LAST;
+    }
+  }
+  else {
+    /* Shift the next step into place and fetch the one after it */
+    run->current_step_start_value = run->current_step_data.value.value;
+    run->current_step_data = run->next_step_data;
+    if (run->current_step + 1 < run->profile.num_steps &&
+        !temp_profile_lib_read_step(run->temp_profile_id, run->current_step + 1, &run->next_step_data)) {
+      printf("Temp profile step %d read failed!\r\n", (int)(run->current_step + 1));
+      run->profile_valid = false;
+    }
+    run->current_step_start_time = chTimeNow();
+  }
+}
+
+/* Profiles run straight out of the on-device library. Only the header and
+ * the active/next steps are paged into RAM.
+ */
+static void
+page_in_profile(temp_profile_run_t* run)
+{
+  run->lib_revision = temp_profile_lib_get_revision();
+  run->profile_valid = temp_profile_lib_load(run->temp_profile_id, &run->profile);
+
+  if (!run->profile_valid) {
+    printf("Temp profile %d not found in flash\r\n", (int)run->temp_profile_id);
+    return;
+  }
+
+  if (run->profile.num_steps == 0) {
+    run->state = TPS_HOLD_LAST;
+    return;
+  }
+
+  if (run->current_step >= run->profile.num_steps) {
+    run->current_step = run->profile.num_steps - 1;
+    run->state = TPS_HOLD_LAST;
+  }
+
+  if (!page_in_steps(run)) {
+    printf("Temp profile %d steps read failed!\r\n", (int)run->temp_profile_id);
+    run->profile_valid = false;
+  }
+}
+
+static bool
+page_in_steps(temp_profile_run_t* run)
+{
+  uint32_t step = run->current_step;
+
+  if (run->profile.num_steps == 0)
+    return true;
+
+  if (step == 0)
+    run->current_step_start_value = run->profile.start_value.value;
+  else {
+    temp_profile_step_t prev_step;
+    if (!temp_profile_lib_read_step(run->temp_profile_id, step - 1, &prev_step))
+      return false;
+    run->current_step_start_value = prev_step.value.value;
+  }
+
+  if (!temp_profile_lib_read_step(run->temp_profile_id, step, &run->current_step_data))
+    return false;
+
+  if (step + 1 < run->profile.num_steps)
+    return temp_profile_lib_read_step(run->temp_profile_id, step + 1, &run->next_step_data);
+
+  return true;
 }
@@ -8,6 +8,8 @@
 #include "temp_control.h"
 
 
+#define MAX_TEMP_PROFILE_STEPS 4000
+
 typedef enum {
   TPS_SEEKING_START_VALUE,
   TPS_RUNNING,
@@ -21,6 +23,15 @@ typedef struct {
   uint32_t current_step;
   systime_t current_step_start_time;
   systime_t next_checkpoint;
+
+  /* Profile header and the active/next steps paged in from flash */
+  Mutex mtx;
+  bool profile_valid;
+  temp_profile_t profile;
+  float current_step_start_value;
+  temp_profile_step_t current_step_data;
+  temp_profile_step_t next_step_data;
+  uint32_t lib_revision;
 } temp_profile_run_t;
 
 typedef struct {
@@ -31,6 +42,9 @@ typedef struct {
 } temp_profile_checkpoint_t;
 
 
+void
+temp_profile_init(temp_profile_run_t* run, temp_controller_id_t controller);
+
 void
 temp_profile_start(temp_profile_run_t* run, temp_controller_id_t controller, uint32_t temp_profile_id, int start_point);
 
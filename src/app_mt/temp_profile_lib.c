@@ -0,0 +1,555 @@
+
+#include "ch.h"
+#include "temp_profile_lib.h"
+#include "temp_profile.h"
+#include "sxfs.h"
+#include "common.h"
+#include "crc/crc32.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+
+/* The library is a log of profile records stored in one of two partitions.
+ * New records are appended to the active partition. When it fills up, the
+ * live records are compacted into the other partition, which then becomes
+ * active with a higher generation number.
+ */
+#define LIB_PART_SIZE   0x00040000
+#define LIB_PART_MAGIC  0x4C505442 // "BTPL"
+#define LIB_REC_MAGIC   0x52505442 // "BTPR"
+#define LIB_REC_LIVE    0xFFFFFFFF
+#define LIB_REC_DELETED 0x00000000
+
+#define REC_SIZE(num_steps) \
+  (sizeof(lib_rec_hdr_t) + ((num_steps) * sizeof(temp_profile_step_t)))
+
+
+typedef struct {
+  uint32_t magic;
+  uint32_t generation;
+} lib_part_hdr_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t live;
+  temp_profile_t profile;
+} lib_rec_hdr_t;
+
+_Static_assert(sizeof(lib_part_hdr_t) + REC_SIZE(MAX_TEMP_PROFILE_STEPS) <= LIB_PART_SIZE,
+    "largest temp profile does not fit in a library partition");
+
+typedef struct {
+  Mutex mtx;
+  sxfs_part_id_t part;
+  uint32_t generation;
+  uint32_t write_pos;
+
+  /* Bumped whenever a profile is added, replaced or removed */
+  uint32_t revision;
+
+  uint32_t pending_offset;
+  uint32_t pending_num_steps;
+  bool pending;
+
+  uint32_t num_entries;
+  temp_profile_lib_entry_t entries[MAX_TEMP_PROFILE_LIB_ENTRIES];
+} temp_profile_lib_t;
+
+
+static bool read_part_hdr(sxfs_part_id_t part, lib_part_hdr_t* hdr);
+static bool format_part(sxfs_part_id_t part, uint32_t generation);
+static void scan(void);
+static bool compact(void);
+static bool copy_region(sxfs_part_id_t src, uint32_t src_offset, sxfs_part_id_t dst, uint32_t dst_offset, uint32_t len);
+static bool read_rec_hdr(uint32_t offset, lib_rec_hdr_t* rec);
+static bool rec_crc_ok(uint32_t offset, const lib_rec_hdr_t* rec);
+static int find_entry(uint32_t id);
+static bool index_add(uint32_t id, uint32_t name_hash, uint32_t num_steps, uint32_t offset);
+static void index_remove(int idx);
+static uint32_t name_hash(const char* name);
+
+
+static temp_profile_lib_t lib;
+
+
+void
+temp_profile_lib_init()
+{
+  lib_part_hdr_t hdr1;
+  lib_part_hdr_t hdr2;
+
+  chMtxInit(&lib.mtx);
+
+  bool valid1 = read_part_hdr(SP_TEMP_PROFILE_LIB_1, &hdr1);
+  bool valid2 = read_part_hdr(SP_TEMP_PROFILE_LIB_2, &hdr2);
+
+  if (valid1 && (!valid2 || hdr1.generation >= hdr2.generation)) {
+    lib.part = SP_TEMP_PROFILE_LIB_1;
+    lib.generation = hdr1.generation;
+
+    /* A compaction was interrupted before the old partition was erased */
+    if (valid2)
+      sxfs_erase_all_async(SP_TEMP_PROFILE_LIB_2);
+  }
+  else if (valid2) {
+    lib.part = SP_TEMP_PROFILE_LIB_2;
+    lib.generation = hdr2.generation;
+
+    if (valid1)
+      sxfs_erase_all_async(SP_TEMP_PROFILE_LIB_1);
+  }
+  else {
+    lib.part = SP_TEMP_PROFILE_LIB_1;
+    lib.generation = 1;
+    sxfs_erase_all(SP_TEMP_PROFILE_LIB_1);
+    sxfs_erase_all(SP_TEMP_PROFILE_LIB_2);
+    format_part(lib.part, lib.generation);
+  }
+
+  scan();
+
+  printf("Temp profile library: %d profiles, %d bytes used\r\n",
+      (int)lib.num_entries, (int)lib.write_pos);
+}
+
+uint32_t
+temp_profile_lib_get_count()
+{
+  return lib.num_entries;
+}
+
+uint32_t
+temp_profile_lib_get_revision()
+{
+  return lib.revision;
+}
+
+bool
+temp_profile_lib_get_entry(uint32_t idx, temp_profile_lib_entry_t* entry)
+{
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+  if (idx < lib.num_entries) {
+    *entry = lib.entries[idx];
+    ret = true;
+  }
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+temp_profile_lib_find(uint32_t id, temp_profile_lib_entry_t* entry)
+{
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+  int idx = find_entry(id);
+  if (idx >= 0) {
+    *entry = lib.entries[idx];
+    ret = true;
+  }
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+temp_profile_lib_find_by_name(const char* name, temp_profile_lib_entry_t* entry)
+{
+  uint32_t i;
+  uint32_t hash = name_hash(name);
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+  for (i = 0; i < lib.num_entries; ++i) {
+    lib_rec_hdr_t rec;
+
+    if (lib.entries[i].name_hash != hash)
+      continue;
+
+    /* Confirm the match since different names may share a hash */
+    if (read_rec_hdr(lib.entries[i].offset, &rec) &&
+        strncmp(rec.profile.name, name, sizeof(rec.profile.name)) == 0) {
+      *entry = lib.entries[i];
+      ret = true;
+      break;
+    }
+  }
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+temp_profile_lib_load(uint32_t id, temp_profile_t* profile)
+{
+  lib_rec_hdr_t rec;
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+  int idx = find_entry(id);
+  if (idx >= 0 && read_rec_hdr(lib.entries[idx].offset, &rec)) {
+    *profile = rec.profile;
+    ret = true;
+  }
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+temp_profile_lib_add_begin(const temp_profile_t* profile)
+{
+  bool ret = false;
+
+  if (profile->num_steps > MAX_TEMP_PROFILE_STEPS)
+    return false;
+
+  uint32_t rec_size = REC_SIZE(profile->num_steps);
+
+  chMtxLock(&lib.mtx);
+
+  /* A profile left out of the index would be dropped by the next compaction,
+   * so refuse it up front. Replacing one already indexed is fine.
+   */
+  if (lib.num_entries >= MAX_TEMP_PROFILE_LIB_ENTRIES &&
+      find_entry(profile->id) < 0) {
+    printf("Temp profile library index full!\r\n");
+    chMtxUnlock();
+    return false;
+  }
+
+  if (lib.write_pos + rec_size > LIB_PART_SIZE)
+    compact();
+
+  if (lib.write_pos + rec_size <= LIB_PART_SIZE) {
+    /* The magic and CRC are left erased until temp_profile_lib_add_end() */
+    lib_rec_hdr_t rec = {
+        .magic = 0xFFFFFFFF,
+        .crc = 0xFFFFFFFF,
+        .live = LIB_REC_LIVE,
+        .profile = *profile
+    };
+
+    ret = sxfs_write(lib.part, lib.write_pos, (uint8_t*)&rec, sizeof(rec));
+    if (ret) {
+      lib.pending = true;
+      lib.pending_offset = lib.write_pos;
+      lib.pending_num_steps = profile->num_steps;
+    }
+
+    /* Consume the space even on failure since it may be partially written */
+    lib.write_pos += rec_size;
+  }
+  else {
+    printf("Temp profile library full!\r\n");
+  }
+
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+temp_profile_lib_add_step(uint32_t step_idx, const temp_profile_step_t* step)
+{
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+  if (lib.pending && step_idx < lib.pending_num_steps) {
+    uint32_t offset = lib.pending_offset + sizeof(lib_rec_hdr_t) +
+        (step_idx * sizeof(temp_profile_step_t));
+    ret = sxfs_write(lib.part, offset, (uint8_t*)step, sizeof(temp_profile_step_t));
+  }
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+temp_profile_lib_add_end()
+{
+  lib_rec_hdr_t rec;
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+
+  if (!lib.pending) {
+    chMtxUnlock();
+    return false;
+  }
+  lib.pending = false;
+
+  uint32_t crc_len = sizeof(temp_profile_t) + (lib.pending_num_steps * sizeof(temp_profile_step_t));
+  if (sxfs_read(lib.part, lib.pending_offset, (uint8_t*)&rec, sizeof(rec)) &&
+      sxfs_crc(lib.part, lib.pending_offset + offsetof(lib_rec_hdr_t, profile), crc_len, &rec.crc)) {
+    rec.magic = LIB_REC_MAGIC;
+    ret = sxfs_write(lib.part, lib.pending_offset, (uint8_t*)&rec, offsetof(lib_rec_hdr_t, live));
+  }
+
+  if (ret) {
+    /* Retire any older copy of this profile */
+    int idx = find_entry(rec.profile.id);
+    if (idx >= 0) {
+      uint32_t deleted = LIB_REC_DELETED;
+      sxfs_write(lib.part, lib.entries[idx].offset + offsetof(lib_rec_hdr_t, live),
+          (uint8_t*)&deleted, sizeof(deleted));
+    }
+
+    /* Another profile may have taken the last index slot since
+     * temp_profile_lib_add_begin(), so retire this record rather than leave
+     * it unindexed
+     */
+    ret = index_add(rec.profile.id, name_hash(rec.profile.name), rec.profile.num_steps, lib.pending_offset);
+    if (ret) {
+      lib.revision++;
+    }
+    else {
+      uint32_t deleted = LIB_REC_DELETED;
+      sxfs_write(lib.part, lib.pending_offset + offsetof(lib_rec_hdr_t, live),
+          (uint8_t*)&deleted, sizeof(deleted));
+    }
+  }
+
+  chMtxUnlock();
+
+  return ret;
+}
+
+bool
+temp_profile_lib_remove(uint32_t id)
+{
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+  int idx = find_entry(id);
+  if (idx >= 0) {
+    uint32_t deleted = LIB_REC_DELETED;
+    ret = sxfs_write(lib.part, lib.entries[idx].offset + offsetof(lib_rec_hdr_t, live),
+        (uint8_t*)&deleted, sizeof(deleted));
+    index_remove(idx);
+    lib.revision++;
+  }
+  chMtxUnlock();
+
+  return ret;
+}
+
+/* The record is located by id on every read since compaction moves it */
+bool
+temp_profile_lib_read_step(uint32_t id, uint32_t step_idx, temp_profile_step_t* step)
+{
+  bool ret = false;
+
+  chMtxLock(&lib.mtx);
+  int idx = find_entry(id);
+  if (idx >= 0 && step_idx < lib.entries[idx].num_steps) {
+    uint32_t offset = lib.entries[idx].offset + sizeof(lib_rec_hdr_t) +
+        (step_idx * sizeof(temp_profile_step_t));
+    ret = sxfs_read(lib.part, offset, (uint8_t*)step, sizeof(temp_profile_step_t));
+  }
+  chMtxUnlock();
+
+  return ret;
+}
+
+static bool
+read_part_hdr(sxfs_part_id_t part, lib_part_hdr_t* hdr)
+{
+  if (!sxfs_read(part, 0, (uint8_t*)hdr, sizeof(lib_part_hdr_t)))
+    return false;
+
+  return (hdr->magic == LIB_PART_MAGIC);
+}
+
+static bool
+format_part(sxfs_part_id_t part, uint32_t generation)
+{
+  lib_part_hdr_t hdr = {
+      .magic = LIB_PART_MAGIC,
+      .generation = generation
+  };
+
+  return sxfs_write(part, 0, (uint8_t*)&hdr, sizeof(hdr));
+}
+
+static void
+scan()
+{
+  uint32_t offset = sizeof(lib_part_hdr_t);
+
+  lib.num_entries = 0;
+
+  while (offset + sizeof(lib_rec_hdr_t) <= LIB_PART_SIZE) {
+    lib_rec_hdr_t rec;
+
+    /* Nothing past an unreadable header can be trusted or written over */
+    if (!sxfs_read(lib.part, offset, (uint8_t*)&rec, sizeof(rec))) {
+      printf("Temp profile library read failed at %d\r\n", (int)offset);
+      offset = LIB_PART_SIZE;
+      break;
+    }
+
+    /* Erased space marks the end of the log */
+    if (rec.magic == 0xFFFFFFFF && rec.profile.num_steps == 0xFFFFFFFF)
+      break;
+
+    /* A torn header has no usable length, so treat the rest as used */
+    if (rec.profile.num_steps > MAX_TEMP_PROFILE_STEPS) {
+      offset = LIB_PART_SIZE;
+      break;
+    }
+
+    /* The CRC is only checked here, so loads and lookups read the header
+     * alone
+     */
+    if (rec.magic == LIB_REC_MAGIC && rec.live != LIB_REC_DELETED &&
+        rec_crc_ok(offset, &rec))
+      index_add(rec.profile.id, name_hash(rec.profile.name), rec.profile.num_steps, offset);
+
+    offset += REC_SIZE(rec.profile.num_steps);
+  }
+
+  lib.write_pos = offset;
+}
+
+static bool
+compact()
+{
+  uint32_t i;
+  sxfs_part_id_t dst =
+      (lib.part == SP_TEMP_PROFILE_LIB_1) ? SP_TEMP_PROFILE_LIB_2 : SP_TEMP_PROFILE_LIB_1;
+  uint32_t dst_pos = sizeof(lib_part_hdr_t);
+
+  printf("Compacting temp profile library\r\n");
+
+  if (!sxfs_erase_all(dst))
+    return false;
+
+  for (i = 0; i < lib.num_entries; ++i) {
+    uint32_t rec_size = REC_SIZE(lib.entries[i].num_steps);
+
+    if (!copy_region(lib.part, lib.entries[i].offset, dst, dst_pos, rec_size))
+      return false;
+
+    dst_pos += rec_size;
+  }
+
+  /* The partition header is written last so the copy only becomes active
+   * once it is complete.
+   */
+  if (!format_part(dst, lib.generation + 1))
+    return false;
+
+  sxfs_erase_all_async(lib.part);
+
+  dst_pos = sizeof(lib_part_hdr_t);
+  for (i = 0; i < lib.num_entries; ++i) {
+    lib.entries[i].offset = dst_pos;
+    dst_pos += REC_SIZE(lib.entries[i].num_steps);
+  }
+
+  lib.part = dst;
+  lib.generation++;
+  lib.write_pos = dst_pos;
+
+  return true;
+}
+
+static bool
+copy_region(sxfs_part_id_t src, uint32_t src_offset, sxfs_part_id_t dst, uint32_t dst_offset, uint32_t len)
+{
+  uint8_t buf[256];
+
+  while (len > 0) {
+    uint32_t chunk_len = MIN(len, sizeof(buf));
+
+    if (!sxfs_read(src, src_offset, buf, chunk_len) ||
+        !sxfs_write(dst, dst_offset, buf, chunk_len))
+      return false;
+
+    src_offset += chunk_len;
+    dst_offset += chunk_len;
+    len -= chunk_len;
+  }
+
+  return true;
+}
+
+/* Only indexed records are read, and their CRC was checked when they were
+ * indexed
+ */
+static bool
+read_rec_hdr(uint32_t offset, lib_rec_hdr_t* rec)
+{
+  if (!sxfs_read(lib.part, offset, (uint8_t*)rec, sizeof(lib_rec_hdr_t)))
+    return false;
+
+  return (rec->magic == LIB_REC_MAGIC &&
+      rec->profile.num_steps <= MAX_TEMP_PROFILE_STEPS);
+}
+
+static bool
+rec_crc_ok(uint32_t offset, const lib_rec_hdr_t* rec)
+{
+  uint32_t crc;
+  uint32_t crc_len = sizeof(temp_profile_t) + (rec->profile.num_steps * sizeof(temp_profile_step_t));
+
+  if (!sxfs_crc(lib.part, offset + offsetof(lib_rec_hdr_t, profile), crc_len, &crc))
+    return false;
+
+  return (crc == rec->crc);
+}
+
+static int
+find_entry(uint32_t id)
+{
+  uint32_t i;
+
+  for (i = 0; i < lib.num_entries; ++i) {
+    if (lib.entries[i].id == id)
+      return i;
+  }
+
+  return -1;
+}
+
+static bool
+index_add(uint32_t id, uint32_t name_hash, uint32_t num_steps, uint32_t offset)
+{
+  /* Newer records replace older ones with the same id */
+  int idx = find_entry(id);
+  if (idx < 0) {
+    if (lib.num_entries >= MAX_TEMP_PROFILE_LIB_ENTRIES) {
+      printf("Temp profile library index full!\r\n");
+      return false;
+    }
+    idx = lib.num_entries++;
+  }
+
+  lib.entries[idx].id = id;
+  lib.entries[idx].name_hash = name_hash;
+  lib.entries[idx].num_steps = num_steps;
+  lib.entries[idx].offset = offset;
+
+  return true;
+}
+
+static void
+index_remove(int idx)
+{
+  memmove(&lib.entries[idx], &lib.entries[idx + 1],
+      (lib.num_entries - idx - 1) * sizeof(temp_profile_lib_entry_t));
+  lib.num_entries--;
+}
+
+static uint32_t
+name_hash(const char* name)
+{
+  return crc32_block(0, (void*)name, strnlen(name, sizeof(((temp_profile_t*)0)->name)));
+}
@@ -0,0 +1,55 @@
+
+#ifndef TEMP_PROFILE_LIB_H
+#define TEMP_PROFILE_LIB_H
+
+#include "types.h"
+#include "temp_control.h"
+
+
+#define MAX_TEMP_PROFILE_LIB_ENTRIES 64
+
+typedef struct {
+  uint32_t id;
+  uint32_t name_hash;
+  uint32_t num_steps;
+  uint32_t offset;
+} temp_profile_lib_entry_t;
+
+
+void
+temp_profile_lib_init(void);
+
+uint32_t
+temp_profile_lib_get_count(void);
+
+uint32_t
+temp_profile_lib_get_revision(void);
+
+bool
+temp_profile_lib_get_entry(uint32_t idx, temp_profile_lib_entry_t* entry);
+
+bool
+temp_profile_lib_find(uint32_t id, temp_profile_lib_entry_t* entry);
+
+bool
+temp_profile_lib_find_by_name(const char* name, temp_profile_lib_entry_t* entry);
+
+bool
+temp_profile_lib_load(uint32_t id, temp_profile_t* profile);
+
+bool
+temp_profile_lib_add_begin(const temp_profile_t* profile);
+
+bool
+temp_profile_lib_add_step(uint32_t step_idx, const temp_profile_step_t* step);
+
+bool
+temp_profile_lib_add_end(void);
+
+bool
+temp_profile_lib_remove(uint32_t id);
+
+bool
+temp_profile_lib_read_step(uint32_t id, uint32_t step_idx, temp_profile_step_t* step);
+
+#endif
@@ -0,0 +1,47 @@
+
+#include "scratch_arena.h"
+
+#include <string.h>
+
+
+#define ARENA_ALIGN 8
+
+
+void
+scratch_arena_init(scratch_arena_t* arena, void* buf, uint32_t size)
+{
+  arena->buf = buf;
+  arena->size = size;
+  arena->used = 0;
+  arena->high_water = 0;
+  arena->failures = 0;
+}
+
+/* Blocks are zeroed, like calloc */
+void*
+scratch_arena_alloc(scratch_arena_t* arena, uint32_t size)
+{
+  uint32_t start = (arena->used + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1);
+
+  if (size > arena->size || start > (arena->size - size)) {
+    arena->failures++;
+    return NULL;
+  }
+
+  arena->used = start + size;
+  if (arena->used > arena->high_water)
+    arena->high_water = arena->used;
+
+  memset(arena->buf + start, 0, size);
+
+  return arena->buf + start;
+}
+
+void
+scratch_arena_release(scratch_arena_t* arena, void* block)
+{
+  uint8_t* p = block;
+
+  if (p >= arena->buf && p < (arena->buf + arena->used))
+    arena->used = p - arena->buf;
+}
@@ -0,0 +1,30 @@
+
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <stdint.h>
+
+
+/* A bump allocator over a fixed buffer, for short lived structures that are
+ * built, used and dropped by a single thread. Releasing a block also
+ * releases everything allocated after it.
+ */
+typedef struct {
+  uint8_t* buf;
+  uint32_t size;
+  uint32_t used;
+  uint32_t high_water;
+  uint32_t failures;
+} scratch_arena_t;
+
+
+void
+scratch_arena_init(scratch_arena_t* arena, void* buf, uint32_t size);
+
+void*
+scratch_arena_alloc(scratch_arena_t* arena, uint32_t size);
+
+void
+scratch_arena_release(scratch_arena_t* arena, void* block);
+
+#endif
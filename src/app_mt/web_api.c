@@ -20,6 +20,10 @@
 #include "ota_update.h"
 #include "sxfs.h"
 #include "pid.h"
+#include "latency_trace.h"
+#include "scratch_arena.h"
+#include "api_msg.h"
+#include "crc/crc32.h"
 
 #ifndef WEB_API_HOST
 #define WEB_API_HOST_STR "dg.brewbit.com"
@@ -39,11 +43,27 @@
 #define RECV_TIMEOUT           S2ST(20)
 #define MAX_SEND_ERRS          25
 
+/* The CC3000 doesn't report DNS record TTLs, so a resolved server address
+ * is trusted for a fixed time, or until connecting to it fails.
+ */
+#define DNS_CACHE_TTL S2ST(60 * 60)
+
+/* Connect retries back off exponentially between these. The cap keeps an
+ * attempt inside every API_TIMEOUT window in net.c.
+ */
+#define CONNECT_BACKOFF_MIN S2ST(1)
+#define CONNECT_BACKOFF_MAX S2ST(64)
+
+/* Outgoing data is sent a TCP segment at a time, which also keeps each send
+ * within the CC3000 TX buffer.
+ */
+#define TX_BUF_SIZE 1460
+
+/* Room for the largest set of structures built at once in the web API
+ * thread, with slack for alignment.
+ */
+#define SCRATCH_SIZE (sizeof(ApiMessage) + sizeof(controller_settings_t) + 16)
 
-typedef enum {
-  RECV_LEN,
-  RECV_DATA
-} parser_state_t;
 
 typedef struct {
   bool new_sample;
@@ -51,16 +71,6 @@ typedef struct {
   quantity_t last_sample;
 } api_controller_status_t;
 
-typedef struct {
-  parser_state_t state;
-
-  uint8_t* recv_buf;
-  uint32_t bytes_remaining;
-
-  uint32_t data_len;
-  uint8_t data_buf[ApiMessage_size];
-} msg_parser_t;
-
 typedef struct {
   int socket;
   api_status_t status;
@@ -76,8 +86,33 @@ typedef struct {
   systime_t last_recv_time;
   uint32_t send_errors;
   msg_parser_t parser;
+  /* Messages are decoded straight out of the parser's buffer into here */
+  ApiMessage rx_msg;
   msg_listener_t* msg_listener;
+  /* Records before backlog_start have already reached the server. The
+   * partition is only erased once all of them have.
+   */
+  uint32_t backlog_start;
   uint32_t backlog_pos;
+
+  uint32_t server_addr;
+  systime_t server_addr_time;
+  systime_t last_connect_time;
+  systime_t connect_delay;
+  uint32_t backoff_seed;
+
+  /* Encoded messages are gathered here, length prefix included, and flushed
+   * whenever it fills up or a message is complete. A message goes either to
+   * the socket or to the backlog, decided before any of it is flushed.
+   */
+  uint8_t tx_buf[TX_BUF_SIZE];
+  msg_writer_t tx;
+  bool tx_can_backlog;
+  bool tx_to_backlog;
+  uint32_t tx_backlog_pos;
+
+  /* Outgoing messages are built here rather than on the heap */
+  scratch_arena_t scratch;
 } web_api_t;
 
 
@@ -96,6 +131,12 @@ was_authenticated(void);
 static void
 connect_to_server(web_api_t* api);
 
+static systime_t
+backoff_delay(web_api_t* api, uint32_t failures);
+
+static bool
+resolve_server(web_api_t* api, const char* hostname, uint32_t* hostaddr);
+
 static void
 monitor_connection(web_api_t* api);
 
@@ -105,12 +146,21 @@ send_data_to_server(web_api_t* api);
 static void
 send_backlog(web_api_t* api);
 
+static uint32_t
+backlog_record_start(web_api_t* api, uint32_t offset);
+
 static void
 socket_message_rx(web_api_t* api, const uint8_t* data, uint32_t data_len);
 
 static void
 send_api_msg(web_api_t* api, ApiMessage* msg, bool can_backlog);
 
+static bool
+tx_begin(void* arg, uint32_t frame_len);
+
+static bool
+tx_flush(void* arg, const uint8_t* buf, uint32_t len);
+
 static void
 dispatch_api_msg(web_api_t* api, ApiMessage* msg);
 
@@ -155,6 +205,7 @@ dispatch_firmware_rqst(web_api_t* api, firmware_update_t* firmware_data);
 static void
 send_sensor_report(web_api_t* api);
 
+
 static void
 dispatch_device_settings_from_server(DeviceSettings* settings);
 
@@ -171,14 +222,12 @@ static void
 socket_poll(web_api_t* api);
 
 static bool
-send_or_store(web_api_t* api, void* buf, uint32_t buf_len, bool can_backlog);
-
-static bool
-socket_send(web_api_t* api, void* buf, uint32_t buf_len);
+socket_send(web_api_t* api, const void* buf, uint32_t buf_len);
 
 
 extern char device_id[32];
 static web_api_t* api;
+static uint64_t scratch_buf[(SCRATCH_SIZE + 7) / 8];
 
 
 void
@@ -187,6 +236,20 @@ web_api_init()
   api = calloc(1, sizeof(web_api_t));
   api->status.state = AS_AWAITING_NET_CONNECTION;
 
+  scratch_arena_init(&api->scratch, scratch_buf, sizeof(scratch_buf));
+
+  api->tx.begin = tx_begin;
+  api->tx.flush = tx_flush;
+  api->tx.arg = api;
+  api->tx.buf = api->tx_buf;
+  api->tx.buf_size = sizeof(api->tx_buf);
+
+  /* Seeded per device so that a fleet losing the server together doesn't
+   * retry in lockstep.
+   */
+  api->backoff_seed = crc32_block(0, device_id, strlen(device_id));
+
+  api->backlog_start = 0;
   api->backlog_pos = 0;
   while (1) {
     uint32_t msg_len = 0xFFFFFFFF;
@@ -194,7 +257,8 @@ web_api_init()
     if (!ret || msg_len == 0xFFFFFFFF)
       break;
 
-    api->backlog_pos += msg_len;
+    // Each record is a message with its length prefix, as it goes on the wire
+    api->backlog_pos += sizeof(msg_len) + ntohl(msg_len);
   }
 
   api->msg_listener = msg_listener_create("web_api", 2048, web_api_dispatch, api);
@@ -202,6 +266,7 @@ web_api_init()
   msg_listener_enable_watchdog(api->msg_listener, 3 * 60 * 1000);
 
   msg_subscribe(api->msg_listener, MSG_NET_STATUS, NULL);
+  msg_subscribe(api->msg_listener, MSG_WLAN_SOCKET_READY, NULL);
   msg_subscribe(api->msg_listener, MSG_API_FW_UPDATE_CHECK, NULL);
   msg_subscribe(api->msg_listener, MSG_API_FW_DNLD_RQST, NULL);
   msg_subscribe(api->msg_listener, MSG_SENSOR_SAMPLE, NULL);
@@ -214,6 +279,14 @@ web_api_get_status()
   return &api->status;
 }
 
+void
+web_api_get_scratch_stats(api_scratch_stats_t* stats)
+{
+  stats->size = api->scratch.size;
+  stats->high_water = api->scratch.high_water;
+  stats->failures = api->scratch.failures;
+}
+
 const char*
 web_api_get_endpoint()
 {
@@ -241,6 +314,12 @@ web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
       web_api_idle(api);
       break;
 
+    case MSG_WLAN_SOCKET_READY:
+      if ((api->status.state > AS_CONNECTING) &&
+          (*(int*)msg_data == api->socket))
+        socket_poll(api);
+      break;
+
     default:
       break;
   }
@@ -306,14 +385,31 @@ was_authenticated()
 static void
 connect_to_server(web_api_t* api)
 {
+  api_connect_stats_t* stats = &api->status.connect_stats;
+
+  if ((chTimeNow() - api->last_connect_time) < api->connect_delay)
+    return;
+
+  api->last_connect_time = chTimeNow();
+  stats->attempts++;
+
   printf("Connecting to: %s:%d\r\n", WEB_API_HOST_STR, WEB_API_PORT);
-  if (socket_connect(api, WEB_API_HOST_STR, WEB_API_PORT)) {
+  if (!socket_connect(api, WEB_API_HOST_STR, WEB_API_PORT)) {
+    stats->failures++;
+    stats->consecutive_failures++;
+    api->connect_delay = backoff_delay(api, stats->consecutive_failures);
+    stats->retry_delay_ms = (api->connect_delay * 1000) / CH_FREQUENCY;
+    printf("Retrying in %u ms\r\n", (unsigned)stats->retry_delay_ms);
+  }
+  else {
+    stats->consecutive_failures = 0;
+    stats->retry_delay_ms = 0;
+    api->connect_delay = 0;
+
     api->last_recv_time = chTimeNow();
     api->send_errors = 0;
 
-    api->parser.state = RECV_LEN;
-    api->parser.bytes_remaining = 4;
-    api->parser.recv_buf = (uint8_t*)&api->parser.data_len;
+    api_msg_reset_parser(&api->parser);
 
     if (was_authenticated()) {
       set_state(api, AS_REQUESTING_AUTH);
@@ -326,6 +422,20 @@ connect_to_server(web_api_t* api)
   }
 }
 
+/* Exponential backoff with half of each delay randomized, so the retries
+ * still spread out once the delay reaches its cap.
+ */
+static systime_t
+backoff_delay(web_api_t* api, uint32_t failures)
+{
+  systime_t delay = CONNECT_BACKOFF_MIN << MIN(failures - 1, 6);
+  delay = MIN(delay, CONNECT_BACKOFF_MAX);
+
+  api->backoff_seed = (api->backoff_seed * 1103515245) + 12345;
+
+  return (delay / 2) + ((api->backoff_seed >> 16) % ((delay / 2) + 1));
+}
+
 static void
 monitor_connection(web_api_t* api)
 {
@@ -349,7 +459,7 @@ static void
 send_data_to_server(web_api_t* api)
 {
   if ((api->status.state == AS_CONNECTED) &&
-      (api->backlog_pos > 0))
+      (api->backlog_pos > api->backlog_start))
     send_backlog(api);
 
   if (was_authenticated()) {
@@ -370,20 +480,22 @@ send_data_to_server(web_api_t* api)
 static void
 send_backlog(web_api_t* api)
 {
-  uint32_t backlog_read_pos = 0;
-  uint32_t data_left_to_send = api->backlog_pos;
-  uint8_t* send_buf = malloc(1024);
+  uint32_t backlog_read_pos = api->backlog_start;
+  uint32_t data_left_to_send = api->backlog_pos - api->backlog_start;
 
   printf("Sending %d bytes from backlog\r\n", (int)data_left_to_send);
 
+  /* No message is being encoded between idle ticks, so the TX buffer is
+   * free to carry the backlog.
+   */
   while (data_left_to_send > 0) {
-    uint32_t send_len = MIN(1024, data_left_to_send);
-    if (!sxfs_read(SP_WEB_API_BACKLOG, backlog_read_pos, send_buf, send_len)) {
+    uint32_t send_len = MIN(sizeof(api->tx_buf), data_left_to_send);
+    if (!sxfs_read(SP_WEB_API_BACKLOG, backlog_read_pos, api->tx_buf, send_len)) {
       printf("Backlog read failed!\r\n");
       break;
     }
 
-    if (!socket_send(api, send_buf, send_len)) {
+    if (!socket_send(api, api->tx_buf, send_len)) {
       printf("Backlog send failed!\r\n");
       break;
     }
@@ -391,22 +503,84 @@ send_backlog(web_api_t* api)
     backlog_read_pos += send_len;
     data_left_to_send -= send_len;
   }
-  free(send_buf);
 
-  sxfs_erase_all(SP_WEB_API_BACKLOG);
+  if (data_left_to_send > 0) {
+    /* Keep what the server didn't get for the next connection. A record cut
+     * off part way is sent again from its start, on a new connection so the
+     * server isn't left out of step with the framing.
+     */
+    api->backlog_start = backlog_record_start(api, backlog_read_pos);
+    if (api->socket >= 0) {
+      closesocket(api->socket);
+      api->socket = -1;
+      set_state(api, AS_CONNECTING);
+    }
+    return;
+  }
+
+  /* New records go in from the start of the partition, which is the first
+   * sector the eraser gets to.
+   */
+  sxfs_erase_all_async(SP_WEB_API_BACKLOG);
+  api->backlog_start = 0;
   api->backlog_pos = 0;
 }
 
+/* Finds the start of the record that runs past offset */
+static uint32_t
+backlog_record_start(web_api_t* api, uint32_t offset)
+{
+  uint32_t pos = api->backlog_start;
+
+  while (pos < api->backlog_pos) {
+    uint32_t msg_len;
+    if (!sxfs_read(SP_WEB_API_BACKLOG, pos, (uint8_t*)&msg_len, sizeof(msg_len)))
+      break;
+
+    uint32_t next = pos + sizeof(msg_len) + ntohl(msg_len);
+    if (next > offset)
+      break;
+
+    pos = next;
+  }
+
+  return pos;
+}
+
 static bool
-socket_connect(web_api_t* api, const char* hostname, uint16_t port)
+resolve_server(web_api_t* api, const char* hostname, uint32_t* hostaddr)
 {
-  uint32_t hostaddr;
-  int ret = gethostbyname(hostname, strlen(hostname), &hostaddr);
-  if (ret < 0) {
+  api_connect_stats_t* stats = &api->status.connect_stats;
+
+  if ((api->server_addr != 0) &&
+      (chTimeNow() - api->server_addr_time) < DNS_CACHE_TTL) {
+    stats->dns_cache_hits++;
+    *hostaddr = api->server_addr;
+    return true;
+  }
+
+  stats->dns_lookups++;
+  int ret = gethostbyname(hostname, strlen(hostname), hostaddr);
+  if (ret < 0 || *hostaddr == 0) {
     printf("gethostbyname failed %d\r\n", ret);
     return false;
   }
 
+  api->server_addr = *hostaddr;
+  api->server_addr_time = chTimeNow();
+
+  return true;
+}
+
+static bool
+socket_connect(web_api_t* api, const char* hostname, uint16_t port)
+{
+  uint32_t hostaddr;
+  int ret;
+
+  if (!resolve_server(api, hostname, &hostaddr))
+    return false;
+
   api->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (api->socket < 0) {
     printf("Connect failed %d\r\n", api->socket);
@@ -431,6 +605,8 @@ socket_connect(web_api_t* api, const char* hostname, uint16_t port)
   if (ret < 0) {
     closesocket(api->socket);
     api->socket = -1;
+    /* The server may have moved, look it up again next time */
+    api->server_addr = 0;
     printf("connect failed %d\r\n", ret);
     return false;
   }
@@ -441,76 +617,27 @@ socket_connect(web_api_t* api, const char* hostname, uint16_t port)
 static void
 socket_poll(web_api_t* api)
 {
-  int ret = recv(api->socket, api->parser.recv_buf, api->parser.bytes_remaining, 0);
-  if (ret < 0) {
-    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-      printf("recv failed %d %d\r\n", ret, errno);
+  switch (api_msg_socket_poll(&api->parser, api->socket)) {
+    case MSG_POLL_NONE:
+      break;
+
+    case MSG_POLL_PARTIAL:
+      api->last_recv_time = chTimeNow();
+      break;
+
+    case MSG_POLL_MSG:
+      api->last_recv_time = chTimeNow();
+      socket_message_rx(api, api->parser.data_buf, api->parser.data_len);
+      break;
+
+    case MSG_POLL_TOO_LONG:
+    case MSG_POLL_ERROR:
+      printf("recv failed %d\r\n", errno);
       printf("socket disconnected\r\n");
       closesocket(api->socket);
       api->socket = -1;
       set_state(api, AS_CONNECTING);
-    }
-  }
-  else {
-    api->parser.bytes_remaining -= ret;
-    api->parser.recv_buf += ret;
-    if (ret > 0)
-      api->last_recv_time = chTimeNow();
-
-    if (api->parser.bytes_remaining == 0) {
-      switch (api->parser.state) {
-        case RECV_LEN:
-          api->parser.data_len = ntohl(api->parser.data_len);
-          if (api->parser.data_len > 0) {
-            api->parser.state = RECV_DATA;
-            api->parser.bytes_remaining = api->parser.data_len;
-            api->parser.recv_buf = api->parser.data_buf;
-          }
-          else {
-            api->parser.state = RECV_LEN;
-            api->parser.bytes_remaining = 4;
-            api->parser.recv_buf = (uint8_t*)&api->parser.data_len;
-          }
-          break;
-
-        case RECV_DATA:
-          api->parser.bytes_remaining = 4;
-          api->parser.recv_buf = (uint8_t*)&api->parser.data_len;
-          api->parser.state = RECV_LEN;
-
-          socket_message_rx(api, api->parser.data_buf, api->parser.data_len);
-          break;
-      }
-    }
-  }
-}
-
-static void
-populate_output_status(ControllerReport* pr, sensor_id_t controller, output_id_t output)
-{
-  const controller_settings_t* controller_settings = app_cfg_get_controller_settings(controller);
-
-  if (controller_settings->output_settings[output].enabled) {
-    output_ctrl_t control_mode = app_cfg_get_control_mode();
-    temp_control_status_t output_status = temp_control_get_status(controller, output);
-
-    pr->output_status[pr->output_status_count].output_index = output;
-    pr->output_status[pr->output_status_count].has_output_index = true;
-
-    pr->output_status[pr->output_status_count].status = output_status.output_enabled;
-    pr->output_status[pr->output_status_count].has_status = true;
-
-    if (control_mode == PID) {
-      pr->output_status[pr->output_status_count].kp = output_status.kp;
-      pr->output_status[pr->output_status_count].has_kp = true;
-
-      pr->output_status[pr->output_status_count].ki = output_status.ki;
-      pr->output_status[pr->output_status_count].has_ki = true;
-
-      pr->output_status[pr->output_status_count].kd = output_status.kd;
-      pr->output_status[pr->output_status_count].has_kd = true;
-    }
-    pr->output_status_count++;
+      break;
   }
 }
 
@@ -518,7 +645,10 @@ static void
 send_sensor_report(web_api_t* api)
 {
   int i;
-  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  ApiMessage* msg = scratch_arena_alloc(&api->scratch, sizeof(ApiMessage));
+  if (msg == NULL)
+    return;
+
   msg->type = ApiMessage_Type_DEVICE_REPORT;
   msg->has_deviceReport = true;
   msg->deviceReport.controller_reports_count = 0;
@@ -529,12 +659,7 @@ send_sensor_report(web_api_t* api)
       ControllerReport* pr = &msg->deviceReport.controller_reports[msg->deviceReport.controller_reports_count];
       msg->deviceReport.controller_reports_count++;
 
-      pr->controller_index = i;
-      pr->sensor_reading = api->controller_status[i].last_sample.value;
-      pr->setpoint = temp_control_get_current_setpoint(i);
-
-      populate_output_status(pr, i, OUTPUT_1);
-      populate_output_status(pr, i, OUTPUT_2);
+      api_msg_fill_controller_report(pr, i, api->controller_status[i].last_sample.value);
 
       if (api->server_time_available) {
         pr->has_timestamp = true;
@@ -548,7 +673,7 @@ send_sensor_report(web_api_t* api)
     send_api_msg(api, msg, api->server_time_available);
   }
 
-  free(msg);
+  scratch_arena_release(&api->scratch, msg);
 }
 
 static time_t
@@ -560,20 +685,26 @@ get_server_time(web_api_t* api)
 static void
 request_activation_token(web_api_t* api)
 {
-  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  ApiMessage* msg = scratch_arena_alloc(&api->scratch, sizeof(ApiMessage));
+  if (msg == NULL)
+    return;
+
   msg->type = ApiMessage_Type_ACTIVATION_TOKEN_REQUEST;
   msg->has_activationTokenRequest = true;
   strcpy(msg->activationTokenRequest.device_id, device_id);
 
   send_api_msg(api, msg, false);
 
-  free(msg);
+  scratch_arena_release(&api->scratch, msg);
 }
 
 static void
 request_auth(web_api_t* api)
 {
-  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  ApiMessage* msg = scratch_arena_alloc(&api->scratch, sizeof(ApiMessage));
+  if (msg == NULL)
+    return;
+
   msg->type = ApiMessage_Type_AUTH_REQUEST;
   msg->has_authRequest = true;
   strncpy(msg->authRequest.device_id, device_id, sizeof(msg->authRequest.device_id));
@@ -584,7 +715,7 @@ request_auth(web_api_t* api)
 
   send_api_msg(api, msg, false);
 
-  free(msg);
+  scratch_arena_release(&api->scratch, msg);
 }
 
 static void
@@ -592,8 +723,18 @@ dispatch_net_status(web_api_t* api, net_status_t* ns)
 {
   if (ns->net_state == NS_CONNECTED &&
       ns->dhcp_resolved) {
-    if (api->status.state == AS_AWAITING_NET_CONNECTION)
+    if (api->status.state == AS_AWAITING_NET_CONNECTION) {
+      /* A fresh network connection is worth trying straight away. It may be
+       * a different AP or lease with its own DNS, so look the server up
+       * again too.
+       */
+      api->server_addr = 0;
+      api->server_addr_time = 0;
+      api->status.connect_stats.consecutive_failures = 0;
+      api->status.connect_stats.retry_delay_ms = 0;
+      api->connect_delay = 0;
       set_state(api, AS_CONNECTING);
+    }
   }
   else {
     set_state(api, AS_AWAITING_NET_CONNECTION);
@@ -606,6 +747,8 @@ dispatch_sensor_sample(web_api_t* api, sensor_msg_t* sample)
   if (sample->sensor >= NUM_SENSORS)
     return;
 
+  latency_trace_record(LT_DISPATCH_WEB_API, sample->sensor, sample->timestamp);
+
   api_controller_status_t* s = &api->controller_status[sample->sensor];
   s->new_sample = true;
   s->last_sample = sample->sample;
@@ -637,7 +780,10 @@ static void
 send_device_settings(
     web_api_t* api)
 {
-  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  ApiMessage* msg = scratch_arena_alloc(&api->scratch, sizeof(ApiMessage));
+  if (msg == NULL)
+    return;
+
   msg->type = ApiMessage_Type_DEVICE_SETTINGS;
   msg->has_deviceSettings = true;
 
@@ -661,7 +807,7 @@ send_device_settings(
   printf("Sending device settings\r\n");
   send_api_msg(api, msg, true);
 
-  free(msg);
+  scratch_arena_release(&api->scratch, msg);
 }
 
 static void
@@ -669,81 +815,50 @@ send_controller_settings(
     web_api_t* api)
 {
   int i;
-  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  ApiMessage* msg = scratch_arena_alloc(&api->scratch, sizeof(ApiMessage));
+  if (msg == NULL)
+    return;
+
   msg->type = ApiMessage_Type_CONTROLLER_SETTINGS;
   msg->has_controllerSettings = true;
 
   for (i = 0; i < NUM_CONTROLLERS; ++i) {
     if (api->controller_status[i].new_settings) {
       api->controller_status[i].new_settings = false;
-      const controller_settings_t* ssl = app_cfg_get_controller_settings(i);
-      ControllerSettings* ss = &msg->controllerSettings;
-
-      ss->has_session_action = true;
-      ss->session_action = ssl->session_action;
-
-      ss->sensor_index = i;
-      switch (ssl->setpoint_type) {
-        case SP_STATIC:
-          ss->setpoint_type = ControllerSettings_SetpointType_STATIC;
-          ss->has_static_setpoint = true;
-          ss->static_setpoint = ssl->static_setpoint.value;
-          break;
-
-        case SP_TEMP_PROFILE:
-          ss->setpoint_type = ControllerSettings_SetpointType_TEMP_PROFILE;
-          ss->has_temp_profile_id = true;
-          ss->temp_profile_id = ssl->temp_profile.id;
-          ss->has_temp_profile_completion_action = true;
-          ss->temp_profile_completion_action = ControllerSettings_CompletionAction_HOLD_LAST;
-          ss->has_temp_profile_start_point = true;
-          ss->temp_profile_start_point = 0;
-          break;
-
-        default:
-          printf("Invalid setpoint type: %d\r\n", ssl->setpoint_type);
-          break;
-      }
-
-      int j;
-      for (j = 0; j < NUM_OUTPUTS; ++j) {
-        const output_settings_t* osl = &ssl->output_settings[j];
-        if (osl->enabled) {
-          OutputSettings* os = &msg->controllerSettings.output_settings[msg->controllerSettings.output_settings_count];
-          msg->controllerSettings.output_settings_count++;
-
-          os->index = j;
-          os->function = osl->function;
-          os->cycle_delay = osl->cycle_delay.value;
-        }
-      }
+      api_msg_fill_controller_settings(&msg->controllerSettings, i);
 
       printf("Sending controller settings\r\n");
       send_api_msg(api, msg, true);
     }
   }
 
-  free(msg);
+  scratch_arena_release(&api->scratch, msg);
 }
 
 static void
 check_for_update(web_api_t* api)
 {
   printf("sending update check\r\n");
-  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  ApiMessage* msg = scratch_arena_alloc(&api->scratch, sizeof(ApiMessage));
+  if (msg == NULL)
+    return;
+
   msg->type = ApiMessage_Type_FIRMWARE_UPDATE_CHECK_REQUEST;
   msg->has_firmwareUpdateCheckRequest = true;
   sprintf(msg->firmwareUpdateCheckRequest.current_version, "%d.%d.%d", MAJOR_VERSION, MINOR_VERSION, PATCH_VERSION);
 
   send_api_msg(api, msg, false);
 
-  free(msg);
+  scratch_arena_release(&api->scratch, msg);
 }
 
 static void
 dispatch_firmware_rqst(web_api_t* api, firmware_update_t* firmware_data)
 {
-  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  ApiMessage* msg = scratch_arena_alloc(&api->scratch, sizeof(ApiMessage));
+  if (msg == NULL)
+    return;
+
   msg->type = ApiMessage_Type_FIRMWARE_DOWNLOAD_REQUEST;
   msg->has_firmwareDownloadRequest = true;
   msg->firmwareDownloadRequest.offset = firmware_data->offset;
@@ -754,54 +869,64 @@ dispatch_firmware_rqst(web_api_t* api, firmware_update_t* firmware_data)
 
   send_api_msg(api, msg, false);
 
-  free(msg);
+  scratch_arena_release(&api->scratch, msg);
 }
 
 static void
 send_api_msg(web_api_t* api, ApiMessage* msg, bool can_backlog)
 {
-  uint8_t* buffer = malloc(ApiMessage_size);
+  api->tx_can_backlog = can_backlog;
 
-  pb_ostream_t stream = pb_ostream_from_buffer(buffer, ApiMessage_size);
-  bool encoded_ok = pb_encode(&stream, ApiMessage_fields, msg);
+  if (!api_msg_send(&api->tx, msg))
+    printf("message send failed!\r\n");
+}
 
-  if (encoded_ok) {
-    uint32_t buf_len = htonl(stream.bytes_written);
-    if (send_or_store(api, &buf_len, sizeof(buf_len), can_backlog)) {
-      if (!send_or_store(api, buffer, stream.bytes_written, can_backlog)) {
-        printf("buffer send failed!\r\n");
-      }
-    }
-    else {
-      printf("message length send failed!\r\n");
-    }
+/* Picks where the message goes before any of it is flushed */
+static bool
+tx_begin(void* arg, uint32_t frame_len)
+{
+  web_api_t* api = arg;
+
+  api->tx_to_backlog = (api->status.state <= AS_CONNECTING);
+  if (!api->tx_to_backlog)
+    return true;
+
+  if (!api->tx_can_backlog) {
+    printf("Unable to save message to backlog!\r\n");
+    return false;
   }
 
-  free(buffer);
+  /* The whole record is reserved up front, so a write that fails part way
+   * can't leave a short one for the next record to be appended to.
+   */
+  if (!sxfs_is_erased(SP_WEB_API_BACKLOG, api->backlog_pos, frame_len)) {
+    printf("No room in backlog for %d bytes\r\n", (int)frame_len);
+    return false;
+  }
+
+  printf("Not connected. Saving to backlog %d\r\n", (int)api->backlog_pos);
+  api->tx_backlog_pos = api->backlog_pos;
+  api->backlog_pos += frame_len;
+
+  return true;
 }
 
 static bool
-send_or_store(web_api_t* api, void* buf, uint32_t buf_len, bool can_backlog)
+tx_flush(void* arg, const uint8_t* buf, uint32_t len)
 {
-  if (api->status.state > AS_CONNECTING) {
-    return socket_send(api, buf, buf_len);
-  }
-  else {
-    if (!can_backlog) {
-      printf("Unable to save message to backlog!\r\n");
-      return false;
-    }
+  web_api_t* api = arg;
 
-    printf("Not connected. Saving to backlog %d\r\n", (int)api->backlog_pos);
-    bool ret = sxfs_write(SP_WEB_API_BACKLOG, api->backlog_pos, buf, buf_len);
-    if (ret)
-      api->backlog_pos += buf_len;
-    return ret;
-  }
+  if (!api->tx_to_backlog)
+    return socket_send(api, buf, len);
+
+  // Written within the record reserved for this message
+  bool ret = sxfs_write(SP_WEB_API_BACKLOG, api->tx_backlog_pos, (uint8_t*)buf, len);
+  api->tx_backlog_pos += len;
+  return ret;
 }
 
 static bool
-socket_send(web_api_t* api, void* buf, uint32_t buf_len)
+socket_send(web_api_t* api, const void* buf, uint32_t buf_len)
 {
   int bytes_left = buf_len;
   while (bytes_left > 0) {
@@ -828,7 +953,7 @@ socket_send(web_api_t* api, void* buf, uint32_t buf_len)
 static void
 socket_message_rx(web_api_t* api, const uint8_t* data, uint32_t data_len)
 {
-  ApiMessage* msg = malloc(sizeof(ApiMessage));
+  ApiMessage* msg = &api->rx_msg;
 
   pb_istream_t stream = pb_istream_from_buffer((const uint8_t*)data, data_len);
   bool status = pb_decode(&stream, ApiMessage_fields, msg);
@@ -837,8 +962,6 @@ socket_message_rx(web_api_t* api, const uint8_t* data, uint32_t data_len)
     dispatch_api_msg(api, msg);
   else
     printf("Fucked up message received!\r\n");
-
-  free(msg);
 }
 
 static void
@@ -916,103 +1039,16 @@ dispatch_device_settings_from_server(DeviceSettings* settings)
 static void
 dispatch_controller_settings_from_server(ControllerSettings* settings)
 {
-  int i;
-
   printf("got controller settings from server\r\n");
 
-  controller_settings_t* csl = calloc(1, sizeof(controller_settings_t));
-  memcpy(csl, app_cfg_get_controller_settings(settings->sensor_index), sizeof(controller_settings_t));
-
-  csl->controller = settings->sensor_index;
-
-  printf("  got %d temp profiles\r\n", settings->temp_profiles_count);
-  printf("  got %d output settings\r\n", settings->output_settings_count);
-  csl->output_settings[OUTPUT_1].enabled = false;
-  csl->output_settings[OUTPUT_2].enabled = false;
-  for (i = 0; i < (int)settings->output_settings_count; ++i) {
-    OutputSettings* osm = &settings->output_settings[i];
-    output_settings_t* os = &csl->output_settings[osm->index];
-
-    os->cycle_delay.value = osm->cycle_delay;
-    os->cycle_delay.unit = UNIT_TIME_MIN;
-    os->function = osm->function;
-    os->enabled = true;
-
-    printf("    output %d\r\n", i);
-    printf("      delay %f\r\n", os->cycle_delay.value);
-    printf("      function %d\r\n", os->function);
-  }
-
-  printf("  got sensor settings\r\n");
-
-  switch (settings->setpoint_type) {
-    case ControllerSettings_SetpointType_STATIC:
-      if (!settings->has_static_setpoint)
-        printf("Sensor settings specified static setpoint, but none provided!\r\n");
-      else {
-        csl->setpoint_type = SP_STATIC;
-        csl->static_setpoint.value = settings->static_setpoint;
-        csl->static_setpoint.unit = UNIT_TEMP_DEG_F;
-      }
-      break;
-
-    case ControllerSettings_SetpointType_TEMP_PROFILE:
-      if (!settings->has_temp_profile_id)
-        printf("Sensor settings specified temp profile, but no provided!\r\n");
-      else {
-        csl->setpoint_type = SP_TEMP_PROFILE;
-
-        TempProfile* tpm = &settings->temp_profiles[0];
-        csl->temp_profile.id = tpm->id;
-        strncpy(csl->temp_profile.name, tpm->name, sizeof(csl->temp_profile.name));
-        csl->temp_profile.num_steps = tpm->steps_count;
-        csl->temp_profile.start_value.value = tpm->start_value;
-        csl->temp_profile.start_value.unit = UNIT_TEMP_DEG_F;
-        csl->temp_profile.start_point = settings->temp_profile_start_point;
-        csl->temp_profile.completion_action = settings->temp_profile_completion_action;
-
-        printf("    profile '%s' (%d)\r\n", csl->temp_profile.name, (int)csl->temp_profile.id);
-        printf("      steps %d\r\n", (int)csl->temp_profile.num_steps);
-        printf("      start temp %f\r\n", csl->temp_profile.start_value.value);
-        printf("      start point %d\r\n", csl->temp_profile.start_point);
-        printf("      completion action %d\r\n", csl->temp_profile.completion_action);
-
-        for (i = 0; i < (int)tpm->steps_count; ++i) {
-          temp_profile_step_t* step = &csl->temp_profile.steps[i];
-          TempProfileStep* stepm = &tpm->steps[i];
-
-          step->duration = stepm->duration;
-          step->value.value = stepm->value;
-          step->value.unit = UNIT_TEMP_DEG_F;
-          switch(stepm->type) {
-            case TempProfileStep_TempProfileStepType_HOLD:
-              step->type = STEP_HOLD;
-              break;
-
-            case TempProfileStep_TempProfileStepType_RAMP:
-              step->type = STEP_RAMP;
-              break;
-
-            default:
-              printf("Invalid step type: %d\r\n", stepm->type);
-              break;
-          }
-        }
-      }
-      break;
-
-    default:
-      printf("Invalid setpoint type: %d\r\n", settings->setpoint_type);
-      break;
-  }
+  controller_settings_t* csl = scratch_arena_alloc(&api->scratch, sizeof(controller_settings_t));
+  if (csl == NULL)
+    return;
 
-  printf("    sensor %d\r\n", csl->controller);
-  printf("      setpoint_type %d\r\n", csl->setpoint_type);
-  printf("      static %f\r\n", csl->static_setpoint.value);
-  printf("      temp profile %d\r\n", (int)csl->temp_profile.id);
+  if (api_msg_parse_controller_settings(settings, csl))
+    app_cfg_set_controller_settings(csl->controller, SS_SERVER, csl);
 
-  app_cfg_set_controller_settings(csl->controller, SS_SERVER, csl);
-  free(csl);
+  scratch_arena_release(&api->scratch, csl);
 }
 
 static void
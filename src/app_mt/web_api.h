@@ -2,6 +2,8 @@
 #ifndef WEB_API_H
 #define WEB_API_H
 
+#include <stdint.h>
+
 typedef enum {
   AS_AWAITING_NET_CONNECTION,
   AS_CONNECTING,
@@ -11,11 +13,29 @@ typedef enum {
   AS_CONNECTED
 } api_state_t;
 
+typedef struct {
+  uint32_t attempts;
+  uint32_t failures;
+  /* Failures since the last successful connect, which set the backoff */
+  uint32_t consecutive_failures;
+  uint32_t dns_lookups;
+  uint32_t dns_cache_hits;
+  /* Delay before the next connect attempt */
+  uint32_t retry_delay_ms;
+} api_connect_stats_t;
+
 typedef struct {
   api_state_t state;
   char activation_token[16];
+  api_connect_stats_t connect_stats;
 } api_status_t;
 
+typedef struct {
+  uint32_t size;
+  uint32_t high_water;
+  uint32_t failures;
+} api_scratch_stats_t;
+
 
 void
 web_api_init(void);
@@ -23,6 +43,9 @@ web_api_init(void);
 const api_status_t*
 web_api_get_status(void);
 
+void
+web_api_get_scratch_stats(api_scratch_stats_t* stats);
+
 const char*
 web_api_get_endpoint(void);
 
@@ -93,19 +93,25 @@ signed long c_nvmem_read(uint32_t ulFileId, uint32_t ulLength,
   args = UINT32_TO_STREAM(args, ulLength);
   args = UINT32_TO_STREAM(args, ulOffset);
 
-  // Initiate a HCI command
-  hci_command_send(HCI_CMND_NVMEM_READ, NVMEM_READ_PARAMS_LEN,
-      HCI_CMND_NVMEM_READ, &ucStatus);
+  // The data packet can follow the response immediately, so say where it
+  // should go before sending the command
+  params.fromlen = NULL;
+  params.from = NULL;
+  params.buf = buff;
+  hci_expect_data(&params);
+
+  // Initiate a HCI command. If it timed out the data isn't coming either, so
+  // don't wait out a second timeout for it
+  if (hci_command_send(HCI_CMND_NVMEM_READ, NVMEM_READ_PARAMS_LEN,
+      HCI_CMND_NVMEM_READ, &ucStatus) != ESUCCESS) {
+    hci_expect_data(NULL);
+    return 0xFF;
+  }
 
   // In case there is data - read it - even if an error code is returned
   // Note: It is the user responsibility to ignore the data in case of an error code
 
-  // Wait for the data in a synchronous way. Here we assume that the buffer is
-  // big enough to store also parameters of nvmem
-
-  params.fromlen = NULL;
-  params.from = NULL;
-  params.buf = buff;
+  // Wait for the data in a synchronous way
   hci_wait_for_data(&params);
 
   return ucStatus;
@@ -254,8 +260,9 @@ uint8_t c_nvmem_read_sp_version(nvmem_sp_version_t* sp_version)
   uint8_t retBuf[5];
 
   // Initiate a HCI command, no args are required
-  hci_command_send(HCI_CMND_READ_SP_VERSION, 0,
-      HCI_CMND_READ_SP_VERSION, retBuf);
+  if (hci_command_send(HCI_CMND_READ_SP_VERSION, 0,
+      HCI_CMND_READ_SP_VERSION, retBuf) != ESUCCESS)
+    return 0xFF;
 
   sp_version->package_id = retBuf[3];
   sp_version->package_build = retBuf[4];
@@ -297,8 +304,9 @@ signed long c_nvmem_create_entry(uint32_t ulFileId, uint32_t ulNewLen)
   args = UINT32_TO_STREAM(args, ulNewLen);
 
   // Initiate a HCI command
-  hci_command_send(HCI_CMND_NVMEM_CREATE_ENTRY, NVMEM_CREATE_PARAMS_LEN,
-      HCI_CMND_NVMEM_CREATE_ENTRY, &retval);
+  if (hci_command_send(HCI_CMND_NVMEM_CREATE_ENTRY, NVMEM_CREATE_PARAMS_LEN,
+      HCI_CMND_NVMEM_CREATE_ENTRY, &retval) != ESUCCESS)
+    return EFAIL;
 
   return(retval);
 }
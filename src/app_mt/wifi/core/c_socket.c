@@ -236,8 +236,11 @@ long c_accept(long sd, sockaddr *addr, socklen_t *addrlen)
   args = UINT32_TO_STREAM(args, sd);
 
   // Initiate a HCI command
-  hci_command_send(HCI_CMND_ACCEPT, SOCKET_ACCEPT_PARAMS_LEN,
-      HCI_CMND_ACCEPT, &tAcceptReturnArguments);
+  if (hci_command_send(HCI_CMND_ACCEPT, SOCKET_ACCEPT_PARAMS_LEN,
+      HCI_CMND_ACCEPT, &tAcceptReturnArguments) != ESUCCESS) {
+    errno = EFAIL;
+    return(ret);
+  }
 
   // need specify return parameters!!!
   memcpy(addr, &tAcceptReturnArguments.tSocketAddress, ASIC_ADDR_LEN);
@@ -375,8 +378,10 @@ c_gethostbyname(const char * hostname, uint16_t usNameLen, uint32_t* out_ip_addr
   ARRAY_TO_STREAM(args, hostname, usNameLen);
 
   // Initiate a HCI command
-  hci_command_send(HCI_CMND_GETHOSTNAME, SOCKET_GET_HOST_BY_NAME_PARAMS_LEN + usNameLen - 1,
-      HCI_EVNT_BSD_GETHOSTBYNAME, &ret);
+  if (hci_command_send(HCI_CMND_GETHOSTNAME, SOCKET_GET_HOST_BY_NAME_PARAMS_LEN + usNameLen - 1,
+      HCI_EVNT_BSD_GETHOSTBYNAME, &ret) != ESUCCESS) {
+    return errno;
+  }
 
   errno = ret.retVal;
 
@@ -512,8 +517,11 @@ int c_select(long nfds, wfd_set *readsds, wfd_set *writesds,
   }
 
   // Initiate a HCI command
-  hci_command_send(HCI_CMND_BSD_SELECT, SOCKET_SELECT_PARAMS_LEN,
-      HCI_EVNT_SELECT, &tParams);
+  if (hci_command_send(HCI_CMND_BSD_SELECT, SOCKET_SELECT_PARAMS_LEN,
+      HCI_EVNT_SELECT, &tParams) != ESUCCESS) {
+    errno = EFAIL;
+    return(-1);
+  }
 
   // Update actually read FD
   if (tParams.iStatus >= 0) {
@@ -597,8 +605,10 @@ c_setsockopt(long sd, long level, long optname, const void *optval, socklen_t op
   ARRAY_TO_STREAM(args, ((uint8_t *)optval), optlen);
 
   // Initiate a HCI command
-  hci_command_send(HCI_CMND_SETSOCKOPT, SOCKET_SET_SOCK_OPT_PARAMS_LEN  + optlen,
-      HCI_CMND_SETSOCKOPT, &ret);
+  if (hci_command_send(HCI_CMND_SETSOCKOPT, SOCKET_SET_SOCK_OPT_PARAMS_LEN  + optlen,
+      HCI_CMND_SETSOCKOPT, &ret) != ESUCCESS) {
+    ret = EFAIL;
+  }
 
   if (ret >= 0) {
     return (0);
@@ -669,8 +679,11 @@ int c_getsockopt(long sd, long level, long optname, void *optval,
   args = UINT32_TO_STREAM(args, optname);
 
   // Initiate a HCI command
-  hci_command_send(HCI_CMND_GETSOCKOPT, SOCKET_GET_SOCK_OPT_PARAMS_LEN,
-      HCI_CMND_GETSOCKOPT, &tRetParams);
+  if (hci_command_send(HCI_CMND_GETSOCKOPT, SOCKET_GET_SOCK_OPT_PARAMS_LEN,
+      HCI_CMND_GETSOCKOPT, &tRetParams) != ESUCCESS) {
+    errno = EFAIL;
+    return (errno);
+  }
 
   if (((signed char)tRetParams.iStatus) >= 0) {
     *optlen = 4;
@@ -711,6 +724,7 @@ simple_link_recv(long sd, void *buf, long len, long flags, sockaddr *from,
   int ret;
   uint8_t *args;
   tBsdReadReturnParams tSocketReadEvent;
+  hci_data_read_params_t params;
 
   args = hci_get_cmd_buffer();
 
@@ -719,27 +733,34 @@ simple_link_recv(long sd, void *buf, long len, long flags, sockaddr *from,
   args = UINT32_TO_STREAM(args, len);
   args = UINT32_TO_STREAM(args, flags);
 
-  // Generate the read command, and wait for the
-  hci_command_send(opcode,  SOCKET_RECV_FROM_PARAMS_LEN,
-      opcode, &tSocketReadEvent);
+  // The data packet can follow the read event immediately, so say where it
+  // should go before asking for it
+  params.from = from;
+  params.fromlen = fromlen;
+  params.buf = buf;
+  hci_expect_data(&params);
 
+  // Generate the read command, and wait for the
+  if (hci_command_send(opcode,  SOCKET_RECV_FROM_PARAMS_LEN,
+      opcode, &tSocketReadEvent) != ESUCCESS) {
+    hci_expect_data(NULL);
+    errno = EFAIL;
+    ret = -1;
+  }
   // In case the number of bytes is more then zero - read data
-  if (tSocketReadEvent.iNumberOfBytes > 0) {
-    // Wait for the data in a synchronous way. Here we assume that the bug is
-    // big enough to store also parameters of receive from too....
-    hci_data_read_params_t params;
-    params.from = from;
-    params.fromlen = fromlen;
-    params.buf = buf;
+  else if (tSocketReadEvent.iNumberOfBytes > 0) {
+    // Wait for the data in a synchronous way
     hci_wait_for_data(&params);
     errno = 0;
     ret = tSocketReadEvent.iNumberOfBytes;
   }
   else if (tSocketReadEvent.iNumberOfBytes == 0) {
+    hci_expect_data(NULL);
     errno = EAGAIN;
     ret = -1;
   }
   else {
+    hci_expect_data(NULL);
     ret = errno = tSocketReadEvent.iNumberOfBytes;
   }
 
@@ -889,8 +910,11 @@ simple_link_send(long sd, const void *buf, long len, long flags,
     rx_opcode = HCI_EVNT_SEND;
 
   // Initiate a HCI command
-  hci_data_send(opcode, uArgSize, len, (uint8_t*)to, tolen,
-      rx_opcode, &tSocketSendEvent);
+  if (hci_data_send(opcode, uArgSize, len, (uint8_t*)to, tolen,
+      rx_opcode, &tSocketSendEvent) != ESUCCESS) {
+    errno = EFAIL;
+    return -1;
+  }
 
   return  (len);
 }
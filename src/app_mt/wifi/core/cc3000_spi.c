@@ -21,6 +21,9 @@
 #define SPI_WRITE_OP 1
 #define SPI_READ_OP  3
 
+/* The CC3000 releases IRQ shortly after CS is deasserted */
+#define IRQ_RELEASE_TIMEOUT_US 500
+
 
 typedef enum {
   SPI_STATE_POWERUP,
@@ -37,6 +40,12 @@ wait_io_ready(void);
 static bool
 irq_asserted(void);
 
+static void
+wait_irq_released(void);
+
+static void
+spi_read_packet(void);
+
 static msg_t
 spi_io_thread(void* arg);
 
@@ -53,7 +62,8 @@ Semaphore sem_io_ready;
 Semaphore sem_write_complete;
 Thread* io_thread;
 
-int irq_count, missed_irq_count, irq_timeout_count;
+int irq_count, missed_irq_count, irq_timeout_count, spurious_irq_count;
+static spi_stats_t spi_stats;
 
 uint8_t wlan_rx_buffer[CC3000_RX_BUFFER_SIZE];
 uint8_t wlan_tx_buffer[CC3000_TX_BUFFER_SIZE];
@@ -74,8 +84,8 @@ static const EXTConfig extcfg = {
     },
 };
 
-// Static buffer for 5 bytes of SPI HEADER
-static const uint8_t tSpiReadHeader[] = {SPI_READ_OP, 0, 0, 0, 0};
+// Read header, padded to cover the HCI header that is read along with it
+static const uint8_t tSpiReadHeader[HEADERS_SIZE_EVNT] = {SPI_READ_OP, 0, 0, 0, 0};
 
 //*****************************************************************************
 //
@@ -176,6 +186,101 @@ irq_asserted()
   return (palReadPad(PORT_WIFI_IRQ, PAD_WIFI_IRQ) == 0);
 }
 
+/* Wait for the CC3000 to release IRQ after a transaction, so that the next
+ * falling edge belongs to the next packet. This is usually a few
+ * microseconds, so it is polled rather than slept on.
+ */
+static void
+wait_irq_released()
+{
+  halrtcnt_t start = halGetCounterValue();
+
+  while (irq_asserted() &&
+         ((halGetCounterValue() - start) < US2RTT(IRQ_RELEASE_TIMEOUT_US)))
+    ;
+}
+
+/* Reads one packet within a single CS assertion. The SPI and HCI headers are
+ * read together, then the rest of the payload. Socket and NVMEM data goes by
+ * DMA straight into the buffer of the thread waiting for it, so only the
+ * headers and arguments land in wlan_rx_buffer. The arguments are read first
+ * since they name the socket the data is for.
+ */
+static void
+spi_read_packet()
+{
+  uint8_t* pkt = wlan_rx_buffer + SPI_HEADER_SIZE;
+  uint8_t* data_dest = NULL;
+  uint16_t data_len = 0;
+  uint16_t args_read = 0;
+  uint16_t payload_size;
+  uint16_t remaining;
+  bool drop = false;
+
+  ASSERT_CS();
+
+  spiExchange(SPI_WLAN, HEADERS_SIZE_EVNT, tSpiReadHeader, wlan_rx_buffer);
+
+  payload_size = (wlan_rx_buffer[3] << 8) | (wlan_rx_buffer[4]);
+  if ((payload_size & 1) == 0)
+    payload_size++;
+
+  /* Part of the payload came in with the header */
+  remaining = payload_size;
+  if (remaining > (HEADERS_SIZE_EVNT - SPI_HEADER_SIZE))
+    remaining -= (HEADERS_SIZE_EVNT - SPI_HEADER_SIZE);
+  else
+    remaining = 0;
+
+  if (pkt[0] == HCI_TYPE_DATA) {
+    uint16_t arg_size = pkt[HCI_PACKET_ARGSIZE_OFFSET];
+
+    if ((arg_size > 0) && (arg_size <= remaining)) {
+      spiReceive(SPI_WLAN, arg_size, pkt + HCI_DATA_HEADER_SIZE);
+      args_read = arg_size;
+      remaining -= arg_size;
+    }
+
+    if (args_read == arg_size)
+      data_dest = hci_get_rx_data_dest(pkt, payload_size, &data_len);
+  }
+
+  if (data_dest != NULL) {
+    spiReceive(SPI_WLAN, data_len, data_dest);
+
+    remaining -= data_len;
+    if (remaining > 0)
+      spiIgnore(SPI_WLAN, remaining);
+
+    spi_stats.rx_direct_bytes += data_len;
+  }
+  else if (remaining > (CC3000_RX_BUFFER_SIZE - HEADERS_SIZE_EVNT - args_read)) {
+    /* Too big for the buffer, clock it out and drop it */
+    spiIgnore(SPI_WLAN, remaining);
+    drop = true;
+  }
+  else if (remaining > 0) {
+    spiReceive(SPI_WLAN, remaining, wlan_rx_buffer + HEADERS_SIZE_EVNT + args_read);
+  }
+
+  DEASSERT_CS();
+
+  spi_stats.rx_packets++;
+  spi_stats.rx_bytes += SPI_HEADER_SIZE + payload_size;
+
+  wait_irq_released();
+
+  /* Dispatch the data to the HCI module */
+  if (!drop)
+    hci_dispatch_packet(pkt, payload_size);
+}
+
+void
+spi_get_stats(spi_stats_t* stats)
+{
+  *stats = spi_stats;
+}
+
 static msg_t
 spi_io_thread(void* arg)
 {
@@ -202,6 +307,11 @@ spi_io_thread(void* arg)
 
       DEASSERT_CS();
 
+      spi_stats.tx_packets++;
+      spi_stats.tx_bytes += txPacketLength;
+
+      wait_irq_released();
+
       /* Clear the pending write vars */
       txPacket = NULL;
       txPacketLength = 0;
@@ -209,27 +319,13 @@ spi_io_thread(void* arg)
       /* Signal the waiting thread that the write is complete */
       chSemSignal(&sem_write_complete);
     }
+    else if (irq_asserted()) {
+      spi_read_packet();
+    }
     else {
-      /* Assert CS to start read */
-      ASSERT_CS();
-
-      /* Read header */
-      spiExchange(SPI_WLAN, SPI_HEADER_SIZE, tSpiReadHeader, wlan_rx_buffer);
-
-      /* Read payload */
-      uint16_t payload_size = (wlan_rx_buffer[3] << 8) | (wlan_rx_buffer[4]);
-      if ((payload_size & 1) == 0)
-        payload_size++;
-
-      if (payload_size)
-        spiReceive(SPI_WLAN, payload_size, wlan_rx_buffer + SPI_HEADER_SIZE);
-
-      DEASSERT_CS();
-
-      /* Dispatch the data to the HCI module */
-      hci_dispatch_packet(wlan_rx_buffer + SPI_HEADER_SIZE, payload_size);
+      /* A stray edge, the CC3000 has nothing for us */
+      spurious_irq_count++;
     }
-    chThdSleepMilliseconds(5);
   }
 
   return 0;
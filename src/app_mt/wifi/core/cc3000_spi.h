@@ -7,10 +7,21 @@
 #include "types.h"
 
 
+typedef struct {
+  uint32_t rx_packets;
+  uint32_t rx_bytes;
+  /* Received straight into the reader's buffer */
+  uint32_t rx_direct_bytes;
+  uint32_t tx_packets;
+  uint32_t tx_bytes;
+} spi_stats_t;
+
+
 void spi_open(void);
 void spi_close(void);
 uint8_t* spi_get_buffer(void);
 void spi_write(uint16_t usLength);
+void spi_get_stats(spi_stats_t* stats);
 
 #endif
 
@@ -56,6 +56,9 @@
 
 #define SL_PATCH_PORTION_SIZE                     (1000)
 
+// One slot for each thread that may be talking to the CC3000 at once
+#define HCI_MAX_PENDING_CMDS                       (6)
+
 #define FLOW_CONTROL_EVENT_HANDLE_OFFSET           (0)
 #define FLOW_CONTROL_EVENT_BLOCK_MODE_OFFSET       (1)
 #define FLOW_CONTROL_EVENT_FREE_BUFFS_OFFSET       (2)
@@ -105,14 +108,45 @@
 #define GET_SCAN_RESULTS_BSSID_OFFSET              (44)
 
 
+/* A command waiting for its response, and possibly for a data packet after
+ * that. A thread has at most one command outstanding, so each slot belongs to
+ * a thread. Responses are matched on opcode, and on socket for the events
+ * that carry one, so commands on different sockets can overlap.
+ */
 typedef struct {
-  bool data_expected;
+  Thread* thread;
+  /* Event being waited for, zero once the response has been claimed */
   uint16_t opcode;
+  int32_t sd;
   void* params;
+  /* Set while a data packet is expected. data_ready is set once the response
+   * is in, and data_claimed once the packet is being received.
+   */
+  hci_data_read_params_t* data_params;
+  bool data_ready;
+  bool data_claimed;
+  /* Counts, since the data can arrive before the response has been seen */
+  Semaphore sem;
 } pending_cmd_t;
 
+/* Responses nobody is waiting for any more are decoded here and dropped */
+typedef union {
+  uint32_t status;
+  uint8_t sp_version[5];
+  tBsdReturnParams bsd;
+  tBsdReadReturnParams read;
+  tBsdGethostbynameParams host;
+  tBsdSelectRecvParams select;
+  tBsdGetSockOptReturnParams sockopt;
+  wlan_scan_results_t scan;
+  netapp_ipconfig_args_t ipconfig;
+} discarded_params_t;
+
 typedef struct {
-  Semaphore sem_recv;
+  /* Reset whenever a slot is answered or freed, which wakes every thread
+   * waiting in begin_cmd rather than just one of them.
+   */
+  Semaphore cmd_done;
   systime_t cmd_timeout;
   hci_stats_t stats;
 } hci_t;
@@ -127,11 +161,39 @@ hci_dispatch_data(uint8_t* buffer, uint16_t buffer_size);
 static int32_t
 hci_event_unsol_flowcontrol_handler(uint8_t* pEvent);
 
+static pending_cmd_t*
+begin_cmd(uint16_t rx_opcode, int32_t sd, void* params);
+
+static void
+end_cmd(pending_cmd_t* cmd);
+
 static void
-wait_for_response(void);
+cmd_done_broadcast_s(void);
+
+static pending_cmd_t*
+find_own_cmd(void);
+
+static bool
+wait_for_response(pending_cmd_t* cmd);
+
+static pending_cmd_t*
+claim_response(uint16_t opcode, int32_t sd);
 
+static pending_cmd_t*
+claim_data(const uint8_t* hdr);
 
-static pending_cmd_t pending_cmd;
+static int32_t
+event_socket(uint16_t opcode, uint8_t* args);
+
+static bool
+release_main_mutex(void);
+
+
+extern Mutex g_main_mutex;
+
+static pending_cmd_t pending_cmds[HCI_MAX_PENDING_CMDS];
+static pending_cmd_t* rx_data_cmd;
+static discarded_params_t discarded_params;
 static hci_t hci;
 
 
@@ -139,6 +201,8 @@ static hci_t hci;
 void
 hci_init()
 {
+  int i;
+
   hci.stats.num_sent_packets = 0;
   hci.stats.num_released_packets = 0;
   hci.stats.num_free_buffers = 0;
@@ -147,7 +211,15 @@ hci_init()
 
   hci.cmd_timeout = S2ST(20);
 
-  chSemInit(&hci.sem_recv, 0);
+  for (i = 0; i < HCI_MAX_PENDING_CMDS; ++i) {
+    pending_cmds[i].thread = NULL;
+    pending_cmds[i].opcode = 0;
+    pending_cmds[i].data_params = NULL;
+    chSemInit(&pending_cmds[i].sem, 0);
+  }
+  rx_data_cmd = NULL;
+
+  chSemInit(&hci.cmd_done, 0);
 }
 
 void
@@ -162,12 +234,240 @@ hci_get_stats()
   return &hci.stats;
 }
 
+/* Called with the caller's own slot, or with the lock held */
+static pending_cmd_t*
+find_own_cmd()
+{
+  int i;
+  Thread* self = chThdSelf();
+
+  for (i = 0; i < HCI_MAX_PENDING_CMDS; ++i) {
+    if (pending_cmds[i].thread == self)
+      return &pending_cmds[i];
+  }
+
+  return NULL;
+}
+
+/* Takes a slot for the calling thread, once no other command is waiting for
+ * the same response. The caller may hold g_main_mutex here, which is fine
+ * because nothing that frees a slot needs it. Returns NULL if no slot came
+ * free within the command timeout.
+ */
+static pending_cmd_t*
+begin_cmd(uint16_t rx_opcode, int32_t sd, void* params)
+{
+  systime_t start = chTimeNow();
+
+  while (1) {
+    int i;
+    pending_cmd_t* cmd = NULL;
+    bool busy = false;
+
+    chSysLock();
+    for (i = 0; i < HCI_MAX_PENDING_CMDS; ++i) {
+      pending_cmd_t* c = &pending_cmds[i];
+
+      // Slots taken ahead of a command by hci_expect_data have no opcode yet
+      if (c->thread == chThdSelf())
+        cmd = c;
+      else if (c->thread != NULL &&
+               rx_opcode != 0 &&
+               c->opcode == rx_opcode &&
+               (c->sd < 0 || c->sd == sd))
+        busy = true;
+    }
+
+    if (!busy && cmd == NULL) {
+      for (i = 0; i < HCI_MAX_PENDING_CMDS; ++i) {
+        if (pending_cmds[i].thread == NULL) {
+          cmd = &pending_cmds[i];
+          cmd->thread = chThdSelf();
+          cmd->data_params = NULL;
+          break;
+        }
+      }
+    }
+
+    if (!busy && cmd != NULL) {
+      cmd->opcode = rx_opcode;
+      cmd->sd = sd;
+      cmd->params = params;
+      cmd->data_ready = false;
+      cmd->data_claimed = false;
+      chSemResetI(&cmd->sem, 0);
+      chSysUnlock();
+
+      return cmd;
+    }
+
+    // Still locked, so a slot freed after the scan above can't be missed
+    systime_t waited = chTimeNow() - start;
+    if (waited >= hci.cmd_timeout) {
+      chSysUnlock();
+      return NULL;
+    }
+
+    chSemWaitTimeoutS(&hci.cmd_done, hci.cmd_timeout - waited);
+    chSysUnlock();
+  }
+}
+
 static void
-wait_for_response()
+end_cmd(pending_cmd_t* cmd)
 {
-  msg_t rdy = chSemWaitTimeout(&hci.sem_recv, hci.cmd_timeout);
-  if (rdy != RDY_OK)
-    hci.stats.num_timeouts++;
+  chSysLock();
+  cmd->thread = NULL;
+  cmd->opcode = 0;
+  cmd->data_params = NULL;
+  cmd_done_broadcast_s();
+  chSysUnlock();
+}
+
+/* Several threads can be waiting in begin_cmd, for different slots. Each of
+ * them has to look again, so they are all released.
+ */
+static void
+cmd_done_broadcast_s()
+{
+  chSemResetI(&hci.cmd_done, 0);
+  chSchRescheduleS();
+}
+
+/* g_main_mutex only guards the command buffer and the SPI write, so it is let
+ * go while waiting for the CC3000. That lets commands for other sockets go
+ * out in the meantime.
+ */
+static bool
+release_main_mutex()
+{
+  if (chThdSelf()->p_mtxlist != &g_main_mutex)
+    return false;
+
+  chMtxUnlock();
+  return true;
+}
+
+/* Returns false if the response didn't arrive in time */
+static bool
+wait_for_response(pending_cmd_t* cmd)
+{
+  bool relock = release_main_mutex();
+  bool answered = true;
+
+  msg_t rdy = chSemWaitTimeout(&cmd->sem, hci.cmd_timeout);
+  if (rdy != RDY_OK) {
+    bool claimed;
+
+    chSysLock();
+    claimed = (cmd->opcode == 0);
+    cmd->opcode = 0;
+    if (!claimed)
+      cmd_done_broadcast_s();
+    chSysUnlock();
+
+    // A response that was claimed is being decoded into our params right now
+    if (claimed) {
+      chSemWait(&cmd->sem);
+    }
+    else {
+      hci.stats.num_timeouts++;
+      answered = false;
+    }
+  }
+
+  // Keep the slot if a data packet is still to come
+  if (cmd->data_params == NULL)
+    end_cmd(cmd);
+
+  if (relock)
+    chMtxLock(&g_main_mutex);
+
+  return answered;
+}
+
+/* Socket for the events that name one, so that responses for different
+ * sockets can be told apart. The commands for them take it as their first
+ * argument too.
+ */
+static int32_t
+event_socket(uint16_t opcode, uint8_t* args)
+{
+  switch (opcode) {
+    case HCI_EVNT_RECV:
+    case HCI_EVNT_RECVFROM:
+    case HCI_EVNT_SEND:
+    case HCI_EVNT_SENDTO:
+      return STREAM_TO_UINT32(args, 0);
+
+    default:
+      return -1;
+  }
+}
+
+static pending_cmd_t*
+claim_response(uint16_t opcode, int32_t sd)
+{
+  int i;
+  pending_cmd_t* cmd = NULL;
+
+  chSysLock();
+  for (i = 0; i < HCI_MAX_PENDING_CMDS; ++i) {
+    pending_cmd_t* c = &pending_cmds[i];
+
+    if (c->thread != NULL &&
+        c->opcode == opcode &&
+        (c->sd < 0 || c->sd == sd)) {
+      cmd = c;
+      cmd->opcode = 0;
+      cmd->data_ready = (cmd->data_params != NULL);
+      break;
+    }
+  }
+  chSysUnlock();
+
+  return cmd;
+}
+
+/* A data packet follows the response to its command. Socket data goes to the
+ * command for the socket named in its arguments, anything else (NVMEM reads)
+ * to one that has no socket. Failing that it only goes to a command that is
+ * the only one waiting for data, never to a guess between several.
+ */
+static pending_cmd_t*
+claim_data(const uint8_t* hdr)
+{
+  int i;
+  pending_cmd_t* cmd = NULL;
+  pending_cmd_t* only = NULL;
+  int num_ready = 0;
+  uint8_t opcode = STREAM_TO_UINT8(hdr, HCI_EVENT_OPCODE_OFFSET);
+  int32_t sd = -1;
+
+  if (((opcode == HCI_DATA_RECV) || (opcode == HCI_DATA_RECVFROM)) &&
+      (STREAM_TO_UINT8(hdr, HCI_PACKET_ARGSIZE_OFFSET) >= 4))
+    sd = STREAM_TO_UINT32(hdr, HCI_DATA_HEADER_SIZE);
+
+  chSysLock();
+  for (i = 0; i < HCI_MAX_PENDING_CMDS; ++i) {
+    pending_cmd_t* c = &pending_cmds[i];
+
+    if (c->thread != NULL && c->data_ready && !c->data_claimed) {
+      num_ready++;
+      only = c;
+      if (cmd == NULL && c->sd == sd)
+        cmd = c;
+    }
+  }
+
+  if (cmd == NULL && num_ready == 1)
+    cmd = only;
+
+  if (cmd != NULL)
+    cmd->data_claimed = true;
+  chSysUnlock();
+
+  return cmd;
 }
 
 //*****************************************************************************
@@ -178,12 +478,12 @@ wait_for_response()
 //!  @param  pucBuff      pointer to the command's arguments buffer
 //!  @param  ucArgsLength length of the arguments
 //!
-//!  @return              none
+//!  @return              ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief               Initiate an HCI command.
 //
 //*****************************************************************************
-void
+int32_t
 hci_command_send(
     uint16_t usOpcode,
     uint8_t ucArgsLength,
@@ -191,6 +491,7 @@ hci_command_send(
     void* params)
 { 
   uint8_t *stream;
+  pending_cmd_t* cmd;
 
   stream = spi_get_buffer();
 
@@ -198,14 +499,16 @@ hci_command_send(
   stream = UINT16_TO_STREAM(stream, usOpcode);
   UINT8_TO_STREAM(stream, ucArgsLength);
 
-  // Update the opcode of the event we will be waiting for
-  pending_cmd.params = params;
-  pending_cmd.opcode = rx_opcode;
-  pending_cmd.data_expected = false;
+  // Take a slot for the response before the CC3000 can send it
+  cmd = begin_cmd(rx_opcode, event_socket(rx_opcode, hci_get_cmd_buffer()), params);
+  if (cmd == NULL) {
+    hci.stats.num_timeouts++;
+    return EFAIL;
+  }
 
   spi_write(ucArgsLength + HCI_CMND_HEADER_SIZE);
 
-  wait_for_response();
+  return wait_for_response(cmd) ? ESUCCESS : EFAIL;
 }
 
 //*****************************************************************************
@@ -218,12 +521,12 @@ hci_command_send(
 //!  @param  ucTail          pointer to the data buffer
 //!  @param  usTailLength    buffer length
 //!
-//!  @return none
+//!  @return ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief              Initiate an HCI data write operation
 //
 //*****************************************************************************
-void
+int32_t
 hci_data_send(
     uint8_t ucOpcode,
     uint16_t usArgsLength,
@@ -234,6 +537,7 @@ hci_data_send(
     void* params)
 {
   uint8_t *stream;
+  pending_cmd_t* cmd;
 
   (void)ucTail;
 
@@ -244,15 +548,17 @@ hci_data_send(
   UINT8_TO_STREAM(stream, usArgsLength);
   stream = UINT16_TO_STREAM(stream, usArgsLength + usDataLength + usTailLength);
 
-  // Update the opcode of the event we will be waiting for
-  pending_cmd.params = params;
-  pending_cmd.opcode = rx_opcode;
-  pending_cmd.data_expected = false;
+  // Take a slot for the response before the CC3000 can send it
+  cmd = begin_cmd(rx_opcode, event_socket(rx_opcode, hci_get_data_buffer()), params);
+  if (cmd == NULL) {
+    hci.stats.num_timeouts++;
+    return EFAIL;
+  }
 
   // Send the packet over the SPI
   spi_write(HCI_DATA_HEADER_SIZE + usArgsLength + usDataLength + usTailLength);
 
-  wait_for_response();
+  return wait_for_response(cmd) ? ESUCCESS : EFAIL;
 }
 
 
@@ -265,12 +571,12 @@ hci_data_send(
 //!  @param  ucArgsLength  arguments length
 //!  @param  ucDataLength  data length
 //!
-//!  @return none
+//!  @return ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief              Prepeare HCI header and initiate an HCI data write operation
 //
 //*****************************************************************************
-void hci_data_command_send(
+int32_t hci_data_command_send(
     uint16_t usOpcode,
     uint8_t ucArgsLength,
     uint16_t ucDataLength,
@@ -278,21 +584,24 @@ void hci_data_command_send(
     void* params)
 { 
   uint8_t *stream = spi_get_buffer();
+  pending_cmd_t* cmd;
 
   UINT8_TO_STREAM(stream, HCI_TYPE_DATA);
   UINT8_TO_STREAM(stream, usOpcode);
   UINT8_TO_STREAM(stream, ucArgsLength);
   stream = UINT16_TO_STREAM(stream, ucArgsLength + ucDataLength);
 
-  // Update the opcode of the event we will be waiting for
-  pending_cmd.params = params;
-  pending_cmd.opcode = rx_opcode;
-  pending_cmd.data_expected = false;
+  // Take a slot for the response before the CC3000 can send it
+  cmd = begin_cmd(rx_opcode, event_socket(rx_opcode, hci_get_data_cmd_buffer()), params);
+  if (cmd == NULL) {
+    hci.stats.num_timeouts++;
+    return EFAIL;
+  }
 
   // Send the command over SPI on data channel
   spi_write(ucArgsLength + ucDataLength + HCI_DATA_CMD_HEADER_SIZE);
 
-  wait_for_response();
+  return wait_for_response(cmd) ? ESUCCESS : EFAIL;
 }
 
 //*****************************************************************************
@@ -304,12 +613,12 @@ void hci_data_command_send(
 //!  @param  patch         pointer to patch content buffer 
 //!  @param  usDataLength  data length
 //!
-//!  @return              none
+//!  @return              ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief               Prepeare HCI header and initiate an HCI patch write operation
 //
 //*****************************************************************************
-void
+int32_t
 hci_patch_send(
     uint8_t ucOpcode,
     char *patch,
@@ -320,15 +629,18 @@ hci_patch_send(
   uint16_t usTransLength;
   uint8_t *stream = spi_get_buffer();
   uint8_t *data_ptr = stream;
+  pending_cmd_t* cmd;
 
   UINT8_TO_STREAM(stream, HCI_TYPE_PATCH);
   UINT8_TO_STREAM(stream, ucOpcode);
   stream = UINT16_TO_STREAM(stream, usDataLength + HCI_PATCH_PORTION_HEADER_SIZE);
 
-  // Update the opcode of the event we will be waiting for
-  pending_cmd.params = params;
-  pending_cmd.opcode = rx_opcode;
-  pending_cmd.data_expected = false;
+  // Take a slot for the response before the CC3000 can send it
+  cmd = begin_cmd(rx_opcode, -1, params);
+  if (cmd == NULL) {
+    hci.stats.num_timeouts++;
+    return EFAIL;
+  }
 
   if (usDataLength <= SL_PATCH_PORTION_SIZE) {
     UINT16_TO_STREAM(stream, usDataLength);
@@ -369,7 +681,7 @@ hci_patch_send(
     }
   }
 
-  wait_for_response();
+  return wait_for_response(cmd) ? ESUCCESS : EFAIL;
 }
 
 
@@ -415,17 +727,27 @@ hci_dispatch_data(
     uint8_t* buffer,
     uint16_t buffer_size)
 {
-  hci_data_read_params_t* params = pending_cmd.params;
+  // If the data went straight to the caller's buffer, the slot was claimed
+  // when the packet was read
+  pending_cmd_t* cmd = rx_data_cmd;
+  bool direct = (cmd != NULL);
+  hci_data_read_params_t* params;
 
   uint8_t arg_size = STREAM_TO_UINT8(buffer, HCI_PACKET_ARGSIZE_OFFSET);
   uint16_t pkt_length = STREAM_TO_UINT16(buffer, HCI_PACKET_LENGTH_OFFSET);
 
+  rx_data_cmd = NULL;
+  if (cmd == NULL)
+    cmd = claim_data(buffer);
+
   // Don't copy data over if the app is not expecting it
-  if (!pending_cmd.data_expected) {
+  if (cmd == NULL) {
     printf("Received unrequested data packet! %d %d %d\r\n", buffer[0], arg_size, pkt_length);
     return;
   }
 
+  params = cmd->data_params;
+
   // Data received: note that the only case where from and from length
   // are not null is in recv from, so fill the args accordingly
   if ((params->from != NULL) && (params->fromlen != NULL)) {
@@ -440,7 +762,7 @@ hci_dispatch_data(
     printf("Invalid data length: %d %d %d\r\n", pkt_length, arg_size, buffer_size);
     data_length = -1;
   }
-  else {
+  else if (!direct) {
     memcpy(params->buf,
         buffer + HCI_DATA_HEADER_SIZE + arg_size,
         data_length);
@@ -449,8 +771,7 @@ hci_dispatch_data(
   // fixes the Nvram read not returning length
   params->data_len = data_length;
 
-  pending_cmd.data_expected = false;
-  chSemSignal(&hci.sem_recv);
+  chSemSignal(&cmd->sem);
 }
 
 //*****************************************************************************
@@ -473,12 +794,18 @@ hci_dispatch_event(
   uint16_t opcode = STREAM_TO_UINT16(event_hdr, HCI_EVENT_OPCODE_OFFSET);
   uint16_t usLength = STREAM_TO_UINT8(event_hdr, HCI_DATA_LENGTH_OFFSET);
   uint8_t* pucReceivedParams = event_hdr + HCI_EVENT_HEADER_SIZE;
+  pending_cmd_t* cmd;
+  void* cmd_params = &discarded_params;
 
   if ((usLength + HCI_EVENT_HEADER_SIZE - 1) > event_size) {
     printf("Invalid event size: %d %d %d\r\n", opcode, usLength, event_size);
     return;
   }
 
+  cmd = claim_response(opcode, event_socket(opcode, pucReceivedParams));
+  if (cmd != NULL && cmd->params != NULL)
+    cmd_params = cmd->params;
+
   switch(opcode) {
     case HCI_EVNT_DATA_UNSOL_FREE_BUFF:
       hci_event_unsol_flowcontrol_handler(event_hdr);
@@ -538,7 +865,7 @@ hci_dispatch_event(
     case HCI_EVNT_SEND:
     case HCI_EVNT_SENDTO:
       {
-        tBsdReadReturnParams* params = pending_cmd.params;
+        tBsdReadReturnParams* params = cmd_params;
         params->iSocketDescriptor = STREAM_TO_UINT32(pucReceivedParams, SL_RECEIVE_SD_OFFSET);
         params->iNumberOfBytes = STREAM_TO_UINT32(pucReceivedParams, SL_RECEIVE_NUM_BYTES_OFFSET);
       }
@@ -578,7 +905,7 @@ hci_dispatch_event(
     case HCI_CMND_NVMEM_WRITE_PATCH:
     case HCI_NETAPP_PING_REPORT:
       {
-        uint8_t* status = pending_cmd.params;
+        uint8_t* status = cmd_params;
         *status = STREAM_TO_UINT8(event_hdr, HCI_EVENT_STATUS_OFFSET);
       }
       break;
@@ -602,14 +929,14 @@ hci_dispatch_event(
     case HCI_EVNT_CONNECT:
     case HCI_EVNT_NVMEM_WRITE:
       {
-        uint32_t* param = pending_cmd.params;
+        uint32_t* param = cmd_params;
         *param = STREAM_TO_UINT32(pucReceivedParams, 0);
       }
       break;
 
     case HCI_EVNT_READ_SP_VERSION:
       {
-        uint8_t* params = pending_cmd.params;
+        uint8_t* params = cmd_params;
 
         params[0] = STREAM_TO_UINT8(event_hdr, HCI_EVENT_STATUS_OFFSET);
         memcpy(&params[1], pucReceivedParams, 4);
@@ -618,7 +945,7 @@ hci_dispatch_event(
 
     case HCI_EVNT_BSD_GETHOSTBYNAME:
       {
-        tBsdGethostbynameParams* params = pending_cmd.params;
+        tBsdGethostbynameParams* params = cmd_params;
         params->retVal = STREAM_TO_UINT32(pucReceivedParams, GET_HOST_BY_NAME_RETVAL_OFFSET);
         params->outputAddress = STREAM_TO_UINT32(pucReceivedParams, GET_HOST_BY_NAME_ADDR_OFFSET);
       }
@@ -626,7 +953,7 @@ hci_dispatch_event(
 
     case HCI_EVNT_ACCEPT:
       {
-        tBsdReturnParams* params = pending_cmd.params;
+        tBsdReturnParams* params = cmd_params;
         params->iSocketDescriptor = STREAM_TO_UINT32(pucReceivedParams, ACCEPT_SD_OFFSET);
         params->iStatus = STREAM_TO_UINT32(pucReceivedParams, ACCEPT_RETURN_STATUS_OFFSET);
 
@@ -640,7 +967,7 @@ hci_dispatch_event(
     case HCI_EVNT_RECV:
     case HCI_EVNT_RECVFROM:
       {
-        tBsdReadReturnParams* params = pending_cmd.params;
+        tBsdReadReturnParams* params = cmd_params;
         params->iSocketDescriptor = STREAM_TO_UINT32(pucReceivedParams,SL_RECEIVE_SD_OFFSET);
         params->iNumberOfBytes = STREAM_TO_UINT32(pucReceivedParams,SL_RECEIVE_NUM_BYTES_OFFSET);
         params->uiFlags = STREAM_TO_UINT32(pucReceivedParams,SL_RECEIVE__FLAGS__OFFSET);
@@ -652,7 +979,7 @@ hci_dispatch_event(
 
     case HCI_EVNT_SELECT:
       {
-        tBsdSelectRecvParams* params = pending_cmd.params;
+        tBsdSelectRecvParams* params = cmd_params;
         params->iStatus = STREAM_TO_UINT32(pucReceivedParams, SELECT_STATUS_OFFSET);
         params->uiRdfd = STREAM_TO_UINT32(pucReceivedParams, SELECT_READFD_OFFSET);
         params->uiWrfd = STREAM_TO_UINT32(pucReceivedParams, SELECT_WRITEFD_OFFSET);
@@ -662,7 +989,7 @@ hci_dispatch_event(
 
     case HCI_CMND_GETSOCKOPT:
       {
-        tBsdGetSockOptReturnParams* params = pending_cmd.params;
+        tBsdGetSockOptReturnParams* params = cmd_params;
         params->iStatus = STREAM_TO_UINT8(event_hdr, HCI_EVENT_STATUS_OFFSET);
         //This argument returns in network order
         memcpy(&params->ucOptValue, pucReceivedParams, 4);
@@ -671,7 +998,7 @@ hci_dispatch_event(
 
     case HCI_CMND_WLAN_IOCTL_GET_SCAN_RESULTS:
       {
-        wlan_scan_results_t* params = pending_cmd.params;
+        wlan_scan_results_t* params = cmd_params;
 
 
 
@@ -691,7 +1018,7 @@ hci_dispatch_event(
 
     case HCI_NETAPP_IPCONFIG:
       {
-        netapp_ipconfig_args_t* params = pending_cmd.params;
+        netapp_ipconfig_args_t* params = cmd_params;
         //Read IP address
         memcpy(params->ip_addr, pucReceivedParams, NETAPP_IPCONFIG_IP_LENGTH);
         pucReceivedParams += NETAPP_IPCONFIG_IP_LENGTH;
@@ -723,7 +1050,7 @@ hci_dispatch_event(
 
     case HCI_EVNT_PATCHES_REQ:
       {
-        uint8_t* patch_req_type = pending_cmd.params;
+        uint8_t* patch_req_type = cmd_params;
         *patch_req_type = pucReceivedParams[0];
       }
       break;
@@ -732,10 +1059,12 @@ hci_dispatch_event(
       break;
   }
 
-  // If this is the opcode that the app was waiting for, signal them
-  if (opcode == pending_cmd.opcode) {
-    pending_cmd.opcode = 0;
-    chSemSignal(&hci.sem_recv);
+  // If this is the response a thread was waiting for, signal them
+  if (cmd != NULL) {
+    chSysLock();
+    chSemSignalI(&cmd->sem);
+    cmd_done_broadcast_s();
+    chSysUnlock();
   }
 }
 
@@ -773,8 +1102,13 @@ hci_event_unsol_flowcontrol_handler(
     pReadPayload += FLOW_CONTROL_EVENT_SIZE;
   }
 
+  chSysLock();
   hci.stats.num_free_buffers += temp;
   hci.stats.num_released_packets += temp;
+  chSysUnlock();
+
+  if (temp > 0)
+    socket_tx_buffers_released();
 
   return(ESUCCESS);
 }
@@ -795,26 +1129,113 @@ void
 hci_wait_for_data(
     hci_data_read_params_t* params)
 {
+  pending_cmd_t* cmd = find_own_cmd();
+  bool relock;
+
+  if (cmd == NULL || cmd->data_params != params)
+    return;
+
+  relock = release_main_mutex();
+
   // In the blocking implementation the control to caller will be returned only
   // after the end of current transaction, i.e. only after data will be received
-  pending_cmd.opcode = 0;
-  pending_cmd.params = params;
-  pending_cmd.data_expected = true;
+  msg_t rdy = chSemWaitTimeout(&cmd->sem, hci.cmd_timeout);
+  if (rdy != RDY_OK) {
+    bool claimed;
+
+    // Don't let a late packet land in a buffer the caller has given up on
+    chSysLock();
+    claimed = cmd->data_claimed;
+    cmd->data_ready = false;
+    chSysUnlock();
+
+    if (claimed)
+      chSemWait(&cmd->sem);
+    else
+      hci.stats.num_timeouts++;
+  }
 
-  wait_for_response();
+  end_cmd(cmd);
+
+  if (relock)
+    chMtxLock(&g_main_mutex);
+}
+
+void
+hci_expect_data(
+    hci_data_read_params_t* params)
+{
+  pending_cmd_t* cmd = find_own_cmd();
+
+  if (params == NULL) {
+    if (cmd == NULL)
+      return;
+
+    // Nothing more is coming, give the slot up if the response is in
+    chSysLock();
+    cmd->data_params = NULL;
+    cmd->data_ready = false;
+    chSysUnlock();
+
+    if (cmd->opcode == 0)
+      end_cmd(cmd);
+    return;
+  }
+
+  if (cmd == NULL) {
+    // Take a slot now, the command that fills it in comes next
+    cmd = begin_cmd(0, -1, NULL);
+    if (cmd == NULL)
+      return;
+  }
+
+  chSysLock();
+  cmd->data_params = params;
+  cmd->data_ready = false;
+  cmd->data_claimed = false;
+  chSysUnlock();
+}
+
+uint8_t*
+hci_get_rx_data_dest(
+    const uint8_t* hdr,
+    uint16_t payload_size,
+    uint16_t* data_len)
+{
+  uint8_t arg_size = STREAM_TO_UINT8(hdr, HCI_PACKET_ARGSIZE_OFFSET);
+  uint16_t pkt_length = STREAM_TO_UINT16(hdr, HCI_PACKET_LENGTH_OFFSET);
+
+  // Anything malformed goes through the normal path, which reports it
+  if ((pkt_length <= arg_size) ||
+      (pkt_length + HCI_DATA_HEADER_SIZE > payload_size))
+    return NULL;
+
+  // The arguments have been read by now, so the socket in them picks the
+  // command the data is for
+  rx_data_cmd = claim_data(hdr);
+  if (rx_data_cmd == NULL)
+    return NULL;
+
+  *data_len = pkt_length - arg_size;
+
+  return rx_data_cmd->data_params->buf;
 }
 
 bool
 hci_claim_buffer()
 {
+  bool claimed = false;
+
+  // Senders on different sockets can race for the last buffer now
+  chSysLock();
   if (hci.stats.num_free_buffers > 0) {
     hci.stats.num_free_buffers--;
     hci.stats.num_sent_packets++;
-
-    return true;
+    claimed = true;
   }
+  chSysUnlock();
 
-  return false;
+  return claimed;
 }
 
 //*****************************************************************************
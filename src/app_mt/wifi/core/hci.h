@@ -97,12 +97,12 @@ hci_get_stats(void);
 //!  @param  pucBuff      pointer to the command's arguments buffer
 //!  @param  ucArgsLength length of the arguments
 //!
-//!  @return              none
+//!  @return              ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief               Initiate an HCI command.
 //
 //*****************************************************************************
-void
+int32_t
 hci_command_send(
     uint16_t usOpcode,
     uint8_t ucArgsLength,
@@ -120,12 +120,12 @@ hci_command_send(
 //!  @param  ucTail          pointer to the data buffer
 //!  @param  usTailLength    buffer length
 //!
-//!  @return none
+//!  @return ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief              Initiate an HCI data write operation
 //
 //*****************************************************************************
-void
+int32_t
 hci_data_send(
     uint8_t ucOpcode,
     uint16_t usArgsLength,
@@ -145,12 +145,12 @@ hci_data_send(
 //!  @param  ucArgsLength  arguments length
 //!  @param  ucDataLength  data length
 //!
-//!  @return none
+//!  @return ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief              Prepare HCI header and initiate an HCI data write operation
 //
 //*****************************************************************************
-void
+int32_t
 hci_data_command_send(
     uint16_t usOpcode,
     uint8_t ucArgsLength,
@@ -167,12 +167,12 @@ hci_data_command_send(
 //!  @param  patch         pointer to patch content buffer
 //!  @param  usDataLength  data length
 //!
-//!  @return              none
+//!  @return              ESUCCESS, or EFAIL if the command timed out
 //!
 //!  @brief               Prepare HCI header and initiate an HCI patch write operation
 //
 //*****************************************************************************
-void
+int32_t
 hci_patch_send(
     uint8_t ucOpcode,
     char *patch,
@@ -199,6 +199,45 @@ void
 hci_wait_for_data(
     hci_data_read_params_t* params);
 
+//*****************************************************************************
+//
+//!  hci_expect_data
+//!
+//!  @param  params     where to deliver the data, or NULL to cancel
+//!
+//!  @return               none
+//!
+//!  @brief                Register the destination for a data packet before
+//!                        sending the command that produces it, so that the
+//!                        packet can be received straight into the caller's
+//!                        buffer however soon it arrives.
+//
+//*****************************************************************************
+void
+hci_expect_data(
+    hci_data_read_params_t* params);
+
+//*****************************************************************************
+//
+//!  hci_get_rx_data_dest
+//!
+//!  @param  hdr            HCI header of the data packet being received
+//!  @param  payload_size   size of the SPI payload
+//!  @param  data_len       returns the number of data bytes
+//!
+//!  @return               the caller's buffer, or NULL if the data should be
+//!                        received into the SPI buffer
+//!
+//!  @brief                Called from the SPI layer once the HCI header of a
+//!                        data packet has been read.
+//
+//*****************************************************************************
+uint8_t*
+hci_get_rx_data_dest(
+    const uint8_t* hdr,
+    uint16_t payload_size,
+    uint16_t* data_len);
+
 //*****************************************************************************
 //
 //!  hci_dispatch_packet
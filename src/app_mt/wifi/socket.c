@@ -42,6 +42,7 @@
 #include "socket.h"
 #include "core/c_socket.h"
 #include "wlan.h"
+#include "message.h"
 
 #include <string.h>
 #include <stdbool.h>
@@ -49,6 +50,26 @@
 
 #define MAX_NUM_OF_SOCKETS 4
 
+/* The CC3000 has no event for received data, so readiness comes from a
+ * select() that blocks in the CC3000 and returns as soon as data arrives.
+ * Other socket calls carry on meanwhile, but sockets opened or read in the
+ * meantime are only added to the set once it returns.
+ */
+#define SELECT_TIMEOUT_MS 100
+
+/* With nobody waiting to read, the only changes to the set are sockets being
+ * opened, so select can block for longer and keep the SPI link quiet.
+ */
+#define IDLE_SELECT_TIMEOUT_MS 1000
+
+/* The CC3000 has no event for an incoming connection either, so a blocked
+ * accept() polls for one. Clients can wait a second to be let in.
+ */
+#define ACCEPT_POLL_MS 1000
+
+/* How long a send waits for the CC3000 to free a buffer */
+#define SEND_BUFFER_TIMEOUT S2ST(5)
+
 
 typedef struct {
   int sd;
@@ -57,12 +78,26 @@ typedef struct {
   BinarySemaphore sd_semaphore;
   systime_t recv_timeout;
   long nonblock;
+  /* Set when the socket has data or has been closed, and cleared when it is
+   * read. Readable sockets are left out of select() until then.
+   */
+  bool readable;
+  /* Readiness that has not been announced with MSG_WLAN_SOCKET_READY yet */
+  bool notify;
+  /* The announcement is posted without waiting, so its data lives here */
+  int notify_sd;
 } wlan_socket_t;
 
 
 static msg_t
 socket_io_thread(void* arg);
 
+static void
+mark_ready(wlan_socket_t* s);
+
+static void
+notify_ready_sockets(void);
+
 static int
 common_recv(long sd, void *buf, long len, long flags, sockaddr *from, socklen_t *fromlen);
 
@@ -84,13 +119,16 @@ extern int g_wlan_stopped;
 
 static wlan_socket_t sockets[MAX_NUM_OF_SOCKETS];
 static Semaphore accept_semaphore;
-static Semaphore select_sleep_semaphore;
+static BinarySemaphore io_wake_sem;
+static BinarySemaphore tx_buffer_sem;
 static Thread* select_thread;
+static int recv_waiters;
 
 static int accept_new_sd;
 static int accept_socket;
 static int accept_addrlen;
 static int should_poll_accept;
+static systime_t last_accept_poll;
 static sockaddr accept_sock_addr;
 
 
@@ -104,13 +142,17 @@ socket_start()
     sockets[i].status = SOCKET_STATUS_INACTIVE;
     sockets[i].recv_timeout = TIME_INFINITE;
     sockets[i].nonblock = SOCK_OFF;
-    chBSemInit(&sockets[i].sd_semaphore, FALSE);
+    sockets[i].readable = false;
+    sockets[i].notify = false;
+    chBSemInit(&sockets[i].sd_semaphore, TRUE);
   }
 
   chSemInit(&accept_semaphore, 0);
-  chSemInit(&select_sleep_semaphore, 0);
+  chBSemInit(&io_wake_sem, TRUE);
+  chBSemInit(&tx_buffer_sem, TRUE);
   should_poll_accept = 0;
   accept_socket = -1;
+  recv_waiters = 0;
 
   select_thread = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, socket_io_thread, NULL);
 }
@@ -122,17 +164,30 @@ socket_stop()
 
   if (select_thread != NULL) {
     chThdTerminate(select_thread);
-    chSemSignal(&select_sleep_semaphore);
+    chBSemSignal(&io_wake_sem);
     chThdWait(select_thread);
     select_thread = NULL;
   }
 
+  /* Release anyone blocked in accept */
+  chSemReset(&accept_semaphore, 0);
+
   for (i = 0; i < MAX_NUM_OF_SOCKETS; i++){
     sockets[i].sd = -1;
     sockets[i].status = SOCKET_STATUS_INACTIVE;
+
+    /* Wake anyone still blocked in recv */
+    chBSemSignal(&sockets[i].sd_semaphore);
   }
 }
 
+/* Called from the HCI layer when the CC3000 reports freed buffers */
+void
+socket_tx_buffers_released()
+{
+  chBSemSignal(&tx_buffer_sem);
+}
+
 //*****************************************************************************
 //
 //!  get_socket_active_status
@@ -174,6 +229,14 @@ set_socket_active_status(int32_t sd, wlan_socket_status_t status, int error)
 
   sock->status = status;
   sock->last_error = error;
+
+  /* A reader needs to find out about the close straight away. This runs in
+   * the SPI thread, so leave the announcement to the I/O thread.
+   */
+  if (status == SOCKET_STATUS_INACTIVE) {
+    mark_ready(sock);
+    chBSemSignal(&io_wake_sem);
+  }
 }
 
 int
@@ -199,6 +262,12 @@ find_add_next_free_socket(int sd)
       sockets[i].sd = sd;
       sockets[i].recv_timeout = TIME_INFINITE;
       sockets[i].nonblock = SOCK_OFF;
+      sockets[i].readable = false;
+      sockets[i].notify = false;
+      chBSemReset(&sockets[i].sd_semaphore, TRUE);
+
+      /* Start watching it */
+      chBSemSignal(&io_wake_sem);
       return;
     }
   }
@@ -290,8 +359,12 @@ closesocket(long sd)
   find_clear_socket(sd);
   /* if this is a listeningsocket then reset
      the global variable pointing to it*/
-  if (sd == accept_socket)
+  if (sd == accept_socket) {
     accept_socket = -1;
+    /* Poll again now, so accept fails without waiting out the interval */
+    last_accept_poll = chTimeNow() - MS2ST(ACCEPT_POLL_MS);
+    chBSemSignal(&io_wake_sem);
+  }
 
   chMtxUnlock();
 
@@ -354,12 +427,14 @@ accept(long sd, sockaddr *addr, socklen_t *addrlen)
     val = SOCK_ON;
     setsockopt( sd, SOL_SOCKET, SOCKOPT_ACCEPT_NONBLOCK, &val, sizeof(val));
 
+    /* The first poll is due straight away */
+    last_accept_poll = chTimeNow() - MS2ST(ACCEPT_POLL_MS);
     should_poll_accept = 1;
-    /* wakeup select thread if needed, and go to sleep until polling succeeds */
-    chSemSignalWait(&select_sleep_semaphore, &accept_semaphore);
-    chSemWait(&select_sleep_semaphore); /* suspend select thread until waiting for more data */
-
-    if (g_wlan_stopped) { /* if wlan_stop then return */
+    /* wakeup select thread if needed, and go to sleep until polling succeeds.
+       The select thread stops polling before it wakes us. */
+    chBSemSignal(&io_wake_sem);
+    /* socket_stop resets the semaphore if the WLAN goes down under us */
+    if (chSemWait(&accept_semaphore) != RDY_OK || g_wlan_stopped) {
         should_poll_accept = 0;
         return -1;
     }
@@ -371,7 +446,6 @@ accept(long sd, sockaddr *addr, socklen_t *addrlen)
 
     memcpy(addr, &accept_sock_addr, accept_addrlen);
     memcpy(addrlen, &accept_addrlen, sizeof(socklen_t));
-    should_poll_accept = 0;
 
     return accept_new_sd;
 }
@@ -820,22 +894,43 @@ common_recv(long sd, void *buf, long len, long flags,
   else
     timeout = s->recv_timeout;
 
-  /* wakeup select thread if needed */
-  chSemSignal(&select_sleep_semaphore);
-  /* wait for data to become available */
+  /* wait for the I/O thread to find data */
+  if (timeout != TIME_IMMEDIATE) {
+    chSysLock();
+    recv_waiters++;
+    chSysUnlock();
+  }
   msg_t rdy = chBSemWaitTimeout(&s->sd_semaphore, timeout);
-  /* suspend select thread until waiting for more data */
-  chSemWait(&select_sleep_semaphore);
+  if (timeout != TIME_IMMEDIATE) {
+    chSysLock();
+    recv_waiters--;
+    chSysUnlock();
+  }
 
   if (rdy == RDY_TIMEOUT) {
     errno = EWOULDBLOCK;
     return -1;
   }
 
+  /* have the I/O thread watch the socket again */
+  s->readable = false;
+  chBSemSignal(&io_wake_sem);
+
   if (g_wlan_stopped) { //if wlan_stop then return
     return -1;
   }
 
+  if (s->last_error != 0) {
+    errno = s->last_error;
+    s->last_error = 0;
+    return -1;
+  }
+
+  if (s->status == SOCKET_STATUS_INACTIVE) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
   if (rdy == RDY_OK) {
     /* call the original recv knowing there is available data
        and it's a non-blocking call */
@@ -950,16 +1045,59 @@ common_send(long sd, const void *buf, long len, long flags,
     return -1;
   }
 
-  chMtxLock(&g_main_mutex);
-  if (to != NULL)
-    ret = c_sendto(sd, buf, len, flags, to, tolen);
-  else
-    ret = c_send(sd, buf, len, flags);
-  chMtxUnlock();
+  while (1) {
+    chMtxLock(&g_main_mutex);
+    if (to != NULL)
+      ret = c_sendto(sd, buf, len, flags, to, tolen);
+    else
+      ret = c_send(sd, buf, len, flags);
+    chMtxUnlock();
+
+    /* -2 means the CC3000 has no free buffers. Wait for it to report some
+     * rather than failing the send.
+     */
+    if (ret != -2)
+      break;
+
+    if (chBSemWaitTimeout(&tx_buffer_sem, SEND_BUFFER_TIMEOUT) == RDY_TIMEOUT) {
+      errno = EAGAIN;
+      ret = -1;
+      break;
+    }
+  }
 
   return ret;
 }
 
+static void
+mark_ready(wlan_socket_t* s)
+{
+  s->readable = true;
+  s->notify = true;
+  chBSemSignal(&s->sd_semaphore);
+}
+
+/* Posted rather than sent, so that a listener busy in a socket call of its
+ * own can't hold up select for everyone else. A post that doesn't get
+ * through is retried on the next pass.
+ */
+static void
+notify_ready_sockets()
+{
+  int i;
+
+  for (i = 0; i < MAX_NUM_OF_SOCKETS; i++) {
+    if (sockets[i].notify) {
+      sockets[i].notify = false;
+      sockets[i].notify_sd = sockets[i].sd;
+
+      if ((sockets[i].notify_sd >= 0) &&
+          !msg_post(MSG_WLAN_SOCKET_READY, &sockets[i].notify_sd))
+        sockets[i].notify = true;
+    }
+  }
+}
+
 static msg_t
 socket_io_thread(void *arg)
 {
@@ -969,20 +1107,13 @@ socket_io_thread(void *arg)
   wfd_set readsds;
 
   int ret = 0;
-  int maxFD = 0;
+  int maxFD;
   int i = 0;
 
   chRegSetThreadName("socket_io");
 
-  memset(&timeout, 0, sizeof(struct timeval));
-  timeout.tv_sec = 0;
-  timeout.tv_usec = (200 * 1000);          /* 200 msecs */
-
   while (1) {
-    /* first check if recv/recvfrom/accept was called */
-    chSemWait(&select_sleep_semaphore);
-    /* increase the count back by one to be decreased by the original caller */
-    chSemSignal(&select_sleep_semaphore);
+    bool reader_waiting = (recv_waiters > 0);
 
     if (chThdShouldTerminate()) {
       /* Wlan_stop will terminate the thread and by that all
@@ -990,31 +1121,64 @@ socket_io_thread(void *arg)
       return 0;
     }
 
+    notify_ready_sockets();
+
     WFD_ZERO(&readsds);
+    maxFD = 0;
 
-    /* ping correct socket descriptor param for select */
+    /* Watch the connected sockets that have not been flagged already. A
+     * flagged one is waiting for its reader, and has to go back in the set
+     * soon after it is read.
+     */
     for (i = 0; i < MAX_NUM_OF_SOCKETS; i++){
-      if (sockets[i].status == SOCKET_STATUS_ACTIVE){
-        WFD_SET(sockets[i].sd, &readsds);
-        if (maxFD <= sockets[i].sd)
-          maxFD = sockets[i].sd + 1;
+      if (sockets[i].status == SOCKET_STATUS_ACTIVE &&
+          sockets[i].sd != accept_socket) {
+        if (sockets[i].readable) {
+          reader_waiting = true;
+        }
+        else {
+          WFD_SET(sockets[i].sd, &readsds);
+          if (maxFD <= sockets[i].sd)
+            maxFD = sockets[i].sd + 1;
+        }
       }
     }
 
-    ret = select(maxFD, &readsds, NULL, NULL, &timeout); /* Polling instead of blocking here\
-                                                              to process "accept" below */
+    if (maxFD == 0 && !should_poll_accept) {
+      /* Nothing to do until a socket is opened, read or closed */
+      chBSemWait(&io_wake_sem);
+      continue;
+    }
 
-    if (ret>0) {
-      for (i = 0; i < MAX_NUM_OF_SOCKETS; i++) {
-        if (sockets[i].status == SOCKET_STATUS_ACTIVE && //check that the socket is valid
-            sockets[i].sd != accept_socket &&    //verify this is not an accept socket
-            WFD_ISSET(sockets[i].sd, &readsds)) {    //and has pending data
-          chBSemSignal(&sockets[i].sd_semaphore); //release the semaphore
+    if (maxFD > 0) {
+      /* select() may adjust the timeout, so set it up every time */
+      uint32_t timeout_ms = reader_waiting ? SELECT_TIMEOUT_MS : IDLE_SELECT_TIMEOUT_MS;
+      memset(&timeout, 0, sizeof(struct timeval));
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+      ret = select(maxFD, &readsds, NULL, NULL, &timeout);
+
+      if (ret > 0) {
+        for (i = 0; i < MAX_NUM_OF_SOCKETS; i++) {
+          if (sockets[i].status == SOCKET_STATUS_ACTIVE &&
+              sockets[i].sd != accept_socket &&
+              WFD_ISSET(sockets[i].sd, &readsds))
+            mark_ready(&sockets[i]);
         }
       }
     }
+    else {
+      /* Only polling accept, so sleep until the next poll is due */
+      systime_t since_poll = chTimeNow() - last_accept_poll;
+      if (since_poll < MS2ST(ACCEPT_POLL_MS))
+        chBSemWaitTimeout(&io_wake_sem, MS2ST(ACCEPT_POLL_MS) - since_poll);
+    }
+
+    if (should_poll_accept &&
+        (chTimeNow() - last_accept_poll >= MS2ST(ACCEPT_POLL_MS))) {
+      last_accept_poll = chTimeNow();
 
-    if (should_poll_accept) {
       chMtxLock(&g_main_mutex);
       accept_new_sd = c_accept(accept_socket, &accept_sock_addr, (socklen_t*)&accept_addrlen);
       chMtxUnlock();
@@ -1028,8 +1192,12 @@ socket_io_thread(void *arg)
 //        set_socket_active_status(accept_socket, SOCKET_STATUS_INACTIVE, errno);
 //      }
 
-      if (accept_new_sd != SOC_IN_PROGRESS)
+      /* Stop polling before waking the accept thread, so the result is not
+         overwritten before it has been picked up */
+      if (accept_new_sd != SOC_IN_PROGRESS) {
+        should_poll_accept = 0;
         chSemSignal(&accept_semaphore);
+      }
     }
   }
 
@@ -73,6 +73,9 @@ socket_start(void);
 void
 socket_stop(void);
 
+void
+socket_tx_buffers_released(void);
+
 int
 socket_get_last_error(int32_t sd);
 
@@ -8,6 +8,7 @@
 #include "dfuse.h"
 #include "app_hdr.h"
 #include "crc/crc32.h"
+#include "common.h"
 
 #include <chprintf.h>
 #include <string.h>
@@ -16,9 +17,32 @@
 #define APP_FLASH_START       0x08004000
 #define BOOTLOADER_FLASH_SIZE 0x4000 /* 16k */
 
+/* Records of the last app image that passed a full CRC check are appended
+ * to a log in the boot params partition, after the boot command. Booting an
+ * image that matches the latest record skips the full CRC scan.
+ *
+ * A record also holds the CRC of the end of the image, which is checked on
+ * every boot. Images are programmed front to back, so a write that stopped
+ * part way leaves the end erased or stale and fails that check even when
+ * the header was already rewritten.
+ */
+#define VERIFY_REC_OFFSET 0x1000
+#define VERIFY_REC_SPAN   0x1000
+#define VERIFY_REC_MAGIC  0x32564642 /* "BFV2" */
+#define NUM_VERIFY_RECS   (VERIFY_REC_SPAN / sizeof(verify_rec_t))
+#define VERIFY_TAIL_SIZE  1024
+
 
 typedef void (*app_entry_t)(void);
 
+/* The magic is programmed last, so a record with a good magic is complete */
+typedef struct {
+  uint32_t magic;
+  uint32_t img_size;
+  uint32_t img_crc;
+  uint32_t tail_crc;
+} verify_rec_t;
+
 extern uint8_t __app_start__[];
 
 
@@ -34,6 +58,24 @@ write_app_img(sxfs_part_id_t part);
 static void
 process_boot_cmd(void);
 
+static int
+find_verify_rec(verify_rec_t* rec);
+
+static bool
+verify_rec_erased(const verify_rec_t* rec);
+
+static uint32_t
+app_tail_crc(void);
+
+static bool
+app_verified(void);
+
+static void
+set_app_verified(void);
+
+static void
+clear_app_verified(void);
+
 
 __attribute__ ((section("bootloader_api")))
 const bootloader_api_t _bootloader_api = {
@@ -99,8 +141,14 @@ process_boot_cmd()
   }
 
   if (boot_cmd != BOOT_DEFAULT) {
+    /* An erased command can be programmed straight to the default. Parts
+     * without parameter sectors erase the whole partition, verify log and
+     * all, so that is only done for a real command.
+     */
+    if (boot_cmd != (boot_cmd_t)0xFFFFFFFF)
+      sxfs_erase(SP_BOOT_PARAMS, 0, sizeof(boot_cmd));
+
     boot_cmd = BOOT_DEFAULT;
-    sxfs_erase_all(SP_BOOT_PARAMS);
     sxfs_write(SP_BOOT_PARAMS, 0, (uint8_t*)&boot_cmd, sizeof(boot_cmd));
   }
 }
@@ -109,13 +157,130 @@ static void
 boot_app()
 {
   if (memcmp((const void*)_app_hdr.magic, "BBMT-APP", 8) == 0) {
-    uint32_t crc_calc = crc32_block(0xffffffff, __app_start__, _app_hdr.img_size) ^ 0xffffffff;
+    if (!app_verified()) {
+      uint32_t crc_calc = crc32_block(0xffffffff, __app_start__, _app_hdr.img_size) ^ 0xffffffff;
+      if (crc_calc != _app_hdr.crc)
+        return;
+
+      set_app_verified();
+    }
+
+    chThdSleepMilliseconds(100);
+    jump_to_app((uint32_t)__app_start__);
+  }
+}
+
+/* Returns the index of the latest valid verify record, or -1 if there is
+ * none. The log is append only, so the latest record is the last one with a
+ * good magic before the first erased slot. Slots from a torn write are
+ * neither, and are skipped.
+ */
+static int
+find_verify_rec(verify_rec_t* rec)
+{
+  int i;
+  int found = -1;
+  verify_rec_t r;
+
+  for (i = 0; i < (int)NUM_VERIFY_RECS; ++i) {
+    sxfs_read(SP_BOOT_PARAMS, VERIFY_REC_OFFSET + (i * sizeof(r)), (uint8_t*)&r, sizeof(r));
+    if (verify_rec_erased(&r))
+      break;
 
-    if (crc_calc == _app_hdr.crc) {
-      chThdSleepMilliseconds(100);
-      jump_to_app((uint32_t)__app_start__);
+    if (r.magic == VERIFY_REC_MAGIC) {
+      *rec = r;
+      found = i;
     }
   }
+
+  return found;
+}
+
+static bool
+verify_rec_erased(const verify_rec_t* rec)
+{
+  return (rec->magic == 0xFFFFFFFF &&
+          rec->img_size == 0xFFFFFFFF &&
+          rec->img_crc == 0xFFFFFFFF &&
+          rec->tail_crc == 0xFFFFFFFF);
+}
+
+/* CRC of the last VERIFY_TAIL_SIZE bytes of the image, cheap enough to run
+ * on every boot.
+ */
+static uint32_t
+app_tail_crc()
+{
+  uint32_t tail_len = MIN(_app_hdr.img_size, VERIFY_TAIL_SIZE);
+
+  return crc32_block(0xffffffff, __app_start__ + _app_hdr.img_size - tail_len, tail_len);
+}
+
+static bool
+app_verified()
+{
+  verify_rec_t rec;
+
+  if (find_verify_rec(&rec) < 0)
+    return false;
+
+  return (rec.img_size == _app_hdr.img_size &&
+          rec.img_crc == _app_hdr.crc &&
+          rec.tail_crc == app_tail_crc());
+}
+
+static void
+set_app_verified()
+{
+  int i;
+  verify_rec_t r;
+  verify_rec_t rec = {
+      .magic = 0xFFFFFFFF,
+      .img_size = _app_hdr.img_size,
+      .img_crc = _app_hdr.crc,
+      .tail_crc = app_tail_crc()
+  };
+
+  for (i = 0; i < (int)NUM_VERIFY_RECS; ++i) {
+    sxfs_read(SP_BOOT_PARAMS, VERIFY_REC_OFFSET + (i * sizeof(r)), (uint8_t*)&r, sizeof(r));
+    if (verify_rec_erased(&r))
+      break;
+  }
+
+  if (i == (int)NUM_VERIFY_RECS) {
+    /* The log is full. Parts without parameter sectors can only erase the
+     * whole partition, so the boot command is carried across the erase.
+     */
+    if (!sxfs_erase(SP_BOOT_PARAMS, VERIFY_REC_OFFSET, VERIFY_REC_SPAN)) {
+      boot_cmd_t boot_cmd;
+
+      sxfs_read(SP_BOOT_PARAMS, 0, (uint8_t*)&boot_cmd, sizeof(boot_cmd));
+      sxfs_erase_all(SP_BOOT_PARAMS);
+      if (boot_cmd != (boot_cmd_t)0xFFFFFFFF)
+        sxfs_write(SP_BOOT_PARAMS, 0, (uint8_t*)&boot_cmd, sizeof(boot_cmd));
+    }
+    i = 0;
+  }
+
+  uint32_t offset = VERIFY_REC_OFFSET + (i * sizeof(rec));
+  sxfs_write(SP_BOOT_PARAMS, offset, (uint8_t*)&rec, sizeof(rec));
+
+  rec.magic = VERIFY_REC_MAGIC;
+  sxfs_write(SP_BOOT_PARAMS, offset, (uint8_t*)&rec.magic, sizeof(rec.magic));
+}
+
+/* Programming the magic to zero invalidates the record without an erase */
+static void
+clear_app_verified()
+{
+  int i;
+  verify_rec_t rec;
+
+  i = find_verify_rec(&rec);
+  if (i >= 0) {
+    rec.magic = 0;
+    sxfs_write(SP_BOOT_PARAMS, VERIFY_REC_OFFSET + (i * sizeof(rec)), (uint8_t*)&rec.magic, sizeof(rec.magic));
+  }
 }
 
 static void
@@ -127,6 +292,7 @@ write_app_img(sxfs_part_id_t part)
       .end = APP_FLASH_START + board_get_flash_size() - BOOTLOADER_FLASH_SIZE - 1
   };
 
+  clear_app_verified();
   dfuse_apply_update(part, &valid_addr_range);
 }
 
@@ -1,11 +1,14 @@
 PROJECT = bootloader
 
 MAJOR_VERSION = 1
-MINOR_VERSION = 0
-PATCH_VERSION = 1
+MINOR_VERSION = 1
+PATCH_VERSION = 0
 
 BOARD = II-MT-CONTROLLER
 
+# The bootloader is single threaded, so it can own the CRC unit
+PROJECT_DEFS = -DCRC32_USE_HW=1
+
 PROJECT_CSRC = \
        bootloader.c \
        main.c \
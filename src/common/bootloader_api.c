@@ -5,10 +5,15 @@
 #include "bootloader_api.h"
 #include "sxfs.h"
 
+#include <stdlib.h>
+
 static void
 save_boot_cmd(boot_cmd_t boot_cmd)
 {
-  sxfs_erase_all(SP_BOOT_PARAMS);
+  /* Only erase the sector holding the command. When the parameter sectors
+   * are at the bottom of the flash this is a single 4K erase.
+   */
+  sxfs_erase(SP_BOOT_PARAMS, 0, sizeof(boot_cmd));
   sxfs_write(SP_BOOT_PARAMS, 0, (uint8_t*)&boot_cmd, sizeof(boot_cmd));
 
   NVIC_SystemReset();
@@ -25,3 +30,17 @@ bootloader_load_update_img()
 {
   save_boot_cmd(BOOT_LOAD_UPDATE_IMG);
 }
+
+/* Compressed update images (dfu.py -z) can only be applied by bootloader
+ * 1.1.0 or later. Older ones would program the compressed data as is.
+ */
+bool
+bootloader_supports_compressed_img()
+{
+  char* end;
+  const char* ver = _bootloader_api.get_version();
+  unsigned long major = strtoul(ver, &end, 10);
+  unsigned long minor = (*end == '.') ? strtoul(end + 1, NULL, 10) : 0;
+
+  return (major > 1) || ((major == 1) && (minor >= 1));
+}
@@ -2,6 +2,8 @@
 #ifndef BOOTLOADER_API_H
 #define BOOTLOADER_API_H
 
+#include <stdbool.h>
+
 typedef enum {
   BOOT_DEFAULT,
   BOOT_LOAD_RECOVERY_IMG,
@@ -20,4 +22,7 @@ bootloader_load_recovery_img(void);
 void
 bootloader_load_update_img(void);
 
+bool
+bootloader_supports_compressed_img(void);
+
 #endif
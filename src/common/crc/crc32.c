@@ -16,6 +16,23 @@
 
 #include "crc32.h"
 
+#ifndef CRC32_USE_HW
+#define CRC32_USE_HW 0
+#endif
+
+/* The slicing tables cost 3K of flash. Builds using the hardware unit for
+ * the large blocks can leave them out.
+ */
+#ifndef CRC32_SLICE_BY_4
+#define CRC32_SLICE_BY_4 (!CRC32_USE_HW)
+#endif
+
+#if CRC32_USE_HW
+#include "hal.h"
+
+static uint32_t crc32_hw_words(uint32_t crc, const uint32_t* data, uint32_t nwords);
+#endif
+
 /* ======================================================================== */
 /*  CRC32_TBL    -- Lookup table used for the CRC-32 code.                  */
 /* ======================================================================== */
@@ -75,6 +92,179 @@ uint32_t crc32_tbl[256] =
     0x2D02EF8DL
 };
 
+#if CRC32_SLICE_BY_4
+/* ======================================================================== */
+/*  CRC32_TBL_S4 -- Tables for slicing-by-4.  Entry [k][i] is the CRC of    */
+/*                  byte i followed by k+1 zero bytes, so four bytes can    */
+/*                  be folded in with four independent lookups.             */
+/* ======================================================================== */
+static const uint32_t crc32_tbl_s4[3][256] =
+{
+    {
+        0x00000000L, 0x191B3141L, 0x32366282L, 0x2B2D53C3L, 0x646CC504L,
+        0x7D77F445L, 0x565AA786L, 0x4F4196C7L, 0xC8D98A08L, 0xD1C2BB49L,
+        0xFAEFE88AL, 0xE3F4D9CBL, 0xACB54F0CL, 0xB5AE7E4DL, 0x9E832D8EL,
+        0x87981CCFL, 0x4AC21251L, 0x53D92310L, 0x78F470D3L, 0x61EF4192L,
+        0x2EAED755L, 0x37B5E614L, 0x1C98B5D7L, 0x05838496L, 0x821B9859L,
+        0x9B00A918L, 0xB02DFADBL, 0xA936CB9AL, 0xE6775D5DL, 0xFF6C6C1CL,
+        0xD4413FDFL, 0xCD5A0E9EL, 0x958424A2L, 0x8C9F15E3L, 0xA7B24620L,
+        0xBEA97761L, 0xF1E8E1A6L, 0xE8F3D0E7L, 0xC3DE8324L, 0xDAC5B265L,
+        0x5D5DAEAAL, 0x44469FEBL, 0x6F6BCC28L, 0x7670FD69L, 0x39316BAEL,
+        0x202A5AEFL, 0x0B07092CL, 0x121C386DL, 0xDF4636F3L, 0xC65D07B2L,
+        0xED705471L, 0xF46B6530L, 0xBB2AF3F7L, 0xA231C2B6L, 0x891C9175L,
+        0x9007A034L, 0x179FBCFBL, 0x0E848DBAL, 0x25A9DE79L, 0x3CB2EF38L,
+        0x73F379FFL, 0x6AE848BEL, 0x41C51B7DL, 0x58DE2A3CL, 0xF0794F05L,
+        0xE9627E44L, 0xC24F2D87L, 0xDB541CC6L, 0x94158A01L, 0x8D0EBB40L,
+        0xA623E883L, 0xBF38D9C2L, 0x38A0C50DL, 0x21BBF44CL, 0x0A96A78FL,
+        0x138D96CEL, 0x5CCC0009L, 0x45D73148L, 0x6EFA628BL, 0x77E153CAL,
+        0xBABB5D54L, 0xA3A06C15L, 0x888D3FD6L, 0x91960E97L, 0xDED79850L,
+        0xC7CCA911L, 0xECE1FAD2L, 0xF5FACB93L, 0x7262D75CL, 0x6B79E61DL,
+        0x4054B5DEL, 0x594F849FL, 0x160E1258L, 0x0F152319L, 0x243870DAL,
+        0x3D23419BL, 0x65FD6BA7L, 0x7CE65AE6L, 0x57CB0925L, 0x4ED03864L,
+        0x0191AEA3L, 0x188A9FE2L, 0x33A7CC21L, 0x2ABCFD60L, 0xAD24E1AFL,
+        0xB43FD0EEL, 0x9F12832DL, 0x8609B26CL, 0xC94824ABL, 0xD05315EAL,
+        0xFB7E4629L, 0xE2657768L, 0x2F3F79F6L, 0x362448B7L, 0x1D091B74L,
+        0x04122A35L, 0x4B53BCF2L, 0x52488DB3L, 0x7965DE70L, 0x607EEF31L,
+        0xE7E6F3FEL, 0xFEFDC2BFL, 0xD5D0917CL, 0xCCCBA03DL, 0x838A36FAL,
+        0x9A9107BBL, 0xB1BC5478L, 0xA8A76539L, 0x3B83984BL, 0x2298A90AL,
+        0x09B5FAC9L, 0x10AECB88L, 0x5FEF5D4FL, 0x46F46C0EL, 0x6DD93FCDL,
+        0x74C20E8CL, 0xF35A1243L, 0xEA412302L, 0xC16C70C1L, 0xD8774180L,
+        0x9736D747L, 0x8E2DE606L, 0xA500B5C5L, 0xBC1B8484L, 0x71418A1AL,
+        0x685ABB5BL, 0x4377E898L, 0x5A6CD9D9L, 0x152D4F1EL, 0x0C367E5FL,
+        0x271B2D9CL, 0x3E001CDDL, 0xB9980012L, 0xA0833153L, 0x8BAE6290L,
+        0x92B553D1L, 0xDDF4C516L, 0xC4EFF457L, 0xEFC2A794L, 0xF6D996D5L,
+        0xAE07BCE9L, 0xB71C8DA8L, 0x9C31DE6BL, 0x852AEF2AL, 0xCA6B79EDL,
+        0xD37048ACL, 0xF85D1B6FL, 0xE1462A2EL, 0x66DE36E1L, 0x7FC507A0L,
+        0x54E85463L, 0x4DF36522L, 0x02B2F3E5L, 0x1BA9C2A4L, 0x30849167L,
+        0x299FA026L, 0xE4C5AEB8L, 0xFDDE9FF9L, 0xD6F3CC3AL, 0xCFE8FD7BL,
+        0x80A96BBCL, 0x99B25AFDL, 0xB29F093EL, 0xAB84387FL, 0x2C1C24B0L,
+        0x350715F1L, 0x1E2A4632L, 0x07317773L, 0x4870E1B4L, 0x516BD0F5L,
+        0x7A468336L, 0x635DB277L, 0xCBFAD74EL, 0xD2E1E60FL, 0xF9CCB5CCL,
+        0xE0D7848DL, 0xAF96124AL, 0xB68D230BL, 0x9DA070C8L, 0x84BB4189L,
+        0x03235D46L, 0x1A386C07L, 0x31153FC4L, 0x280E0E85L, 0x674F9842L,
+        0x7E54A903L, 0x5579FAC0L, 0x4C62CB81L, 0x8138C51FL, 0x9823F45EL,
+        0xB30EA79DL, 0xAA1596DCL, 0xE554001BL, 0xFC4F315AL, 0xD7626299L,
+        0xCE7953D8L, 0x49E14F17L, 0x50FA7E56L, 0x7BD72D95L, 0x62CC1CD4L,
+        0x2D8D8A13L, 0x3496BB52L, 0x1FBBE891L, 0x06A0D9D0L, 0x5E7EF3ECL,
+        0x4765C2ADL, 0x6C48916EL, 0x7553A02FL, 0x3A1236E8L, 0x230907A9L,
+        0x0824546AL, 0x113F652BL, 0x96A779E4L, 0x8FBC48A5L, 0xA4911B66L,
+        0xBD8A2A27L, 0xF2CBBCE0L, 0xEBD08DA1L, 0xC0FDDE62L, 0xD9E6EF23L,
+        0x14BCE1BDL, 0x0DA7D0FCL, 0x268A833FL, 0x3F91B27EL, 0x70D024B9L,
+        0x69CB15F8L, 0x42E6463BL, 0x5BFD777AL, 0xDC656BB5L, 0xC57E5AF4L,
+        0xEE530937L, 0xF7483876L, 0xB809AEB1L, 0xA1129FF0L, 0x8A3FCC33L,
+        0x9324FD72L
+    },
+    {
+        0x00000000L, 0x01C26A37L, 0x0384D46EL, 0x0246BE59L, 0x0709A8DCL,
+        0x06CBC2EBL, 0x048D7CB2L, 0x054F1685L, 0x0E1351B8L, 0x0FD13B8FL,
+        0x0D9785D6L, 0x0C55EFE1L, 0x091AF964L, 0x08D89353L, 0x0A9E2D0AL,
+        0x0B5C473DL, 0x1C26A370L, 0x1DE4C947L, 0x1FA2771EL, 0x1E601D29L,
+        0x1B2F0BACL, 0x1AED619BL, 0x18ABDFC2L, 0x1969B5F5L, 0x1235F2C8L,
+        0x13F798FFL, 0x11B126A6L, 0x10734C91L, 0x153C5A14L, 0x14FE3023L,
+        0x16B88E7AL, 0x177AE44DL, 0x384D46E0L, 0x398F2CD7L, 0x3BC9928EL,
+        0x3A0BF8B9L, 0x3F44EE3CL, 0x3E86840BL, 0x3CC03A52L, 0x3D025065L,
+        0x365E1758L, 0x379C7D6FL, 0x35DAC336L, 0x3418A901L, 0x3157BF84L,
+        0x3095D5B3L, 0x32D36BEAL, 0x331101DDL, 0x246BE590L, 0x25A98FA7L,
+        0x27EF31FEL, 0x262D5BC9L, 0x23624D4CL, 0x22A0277BL, 0x20E69922L,
+        0x2124F315L, 0x2A78B428L, 0x2BBADE1FL, 0x29FC6046L, 0x283E0A71L,
+        0x2D711CF4L, 0x2CB376C3L, 0x2EF5C89AL, 0x2F37A2ADL, 0x709A8DC0L,
+        0x7158E7F7L, 0x731E59AEL, 0x72DC3399L, 0x7793251CL, 0x76514F2BL,
+        0x7417F172L, 0x75D59B45L, 0x7E89DC78L, 0x7F4BB64FL, 0x7D0D0816L,
+        0x7CCF6221L, 0x798074A4L, 0x78421E93L, 0x7A04A0CAL, 0x7BC6CAFDL,
+        0x6CBC2EB0L, 0x6D7E4487L, 0x6F38FADEL, 0x6EFA90E9L, 0x6BB5866CL,
+        0x6A77EC5BL, 0x68315202L, 0x69F33835L, 0x62AF7F08L, 0x636D153FL,
+        0x612BAB66L, 0x60E9C151L, 0x65A6D7D4L, 0x6464BDE3L, 0x662203BAL,
+        0x67E0698DL, 0x48D7CB20L, 0x4915A117L, 0x4B531F4EL, 0x4A917579L,
+        0x4FDE63FCL, 0x4E1C09CBL, 0x4C5AB792L, 0x4D98DDA5L, 0x46C49A98L,
+        0x4706F0AFL, 0x45404EF6L, 0x448224C1L, 0x41CD3244L, 0x400F5873L,
+        0x4249E62AL, 0x438B8C1DL, 0x54F16850L, 0x55330267L, 0x5775BC3EL,
+        0x56B7D609L, 0x53F8C08CL, 0x523AAABBL, 0x507C14E2L, 0x51BE7ED5L,
+        0x5AE239E8L, 0x5B2053DFL, 0x5966ED86L, 0x58A487B1L, 0x5DEB9134L,
+        0x5C29FB03L, 0x5E6F455AL, 0x5FAD2F6DL, 0xE1351B80L, 0xE0F771B7L,
+        0xE2B1CFEEL, 0xE373A5D9L, 0xE63CB35CL, 0xE7FED96BL, 0xE5B86732L,
+        0xE47A0D05L, 0xEF264A38L, 0xEEE4200FL, 0xECA29E56L, 0xED60F461L,
+        0xE82FE2E4L, 0xE9ED88D3L, 0xEBAB368AL, 0xEA695CBDL, 0xFD13B8F0L,
+        0xFCD1D2C7L, 0xFE976C9EL, 0xFF5506A9L, 0xFA1A102CL, 0xFBD87A1BL,
+        0xF99EC442L, 0xF85CAE75L, 0xF300E948L, 0xF2C2837FL, 0xF0843D26L,
+        0xF1465711L, 0xF4094194L, 0xF5CB2BA3L, 0xF78D95FAL, 0xF64FFFCDL,
+        0xD9785D60L, 0xD8BA3757L, 0xDAFC890EL, 0xDB3EE339L, 0xDE71F5BCL,
+        0xDFB39F8BL, 0xDDF521D2L, 0xDC374BE5L, 0xD76B0CD8L, 0xD6A966EFL,
+        0xD4EFD8B6L, 0xD52DB281L, 0xD062A404L, 0xD1A0CE33L, 0xD3E6706AL,
+        0xD2241A5DL, 0xC55EFE10L, 0xC49C9427L, 0xC6DA2A7EL, 0xC7184049L,
+        0xC25756CCL, 0xC3953CFBL, 0xC1D382A2L, 0xC011E895L, 0xCB4DAFA8L,
+        0xCA8FC59FL, 0xC8C97BC6L, 0xC90B11F1L, 0xCC440774L, 0xCD866D43L,
+        0xCFC0D31AL, 0xCE02B92DL, 0x91AF9640L, 0x906DFC77L, 0x922B422EL,
+        0x93E92819L, 0x96A63E9CL, 0x976454ABL, 0x9522EAF2L, 0x94E080C5L,
+        0x9FBCC7F8L, 0x9E7EADCFL, 0x9C381396L, 0x9DFA79A1L, 0x98B56F24L,
+        0x99770513L, 0x9B31BB4AL, 0x9AF3D17DL, 0x8D893530L, 0x8C4B5F07L,
+        0x8E0DE15EL, 0x8FCF8B69L, 0x8A809DECL, 0x8B42F7DBL, 0x89044982L,
+        0x88C623B5L, 0x839A6488L, 0x82580EBFL, 0x801EB0E6L, 0x81DCDAD1L,
+        0x8493CC54L, 0x8551A663L, 0x8717183AL, 0x86D5720DL, 0xA9E2D0A0L,
+        0xA820BA97L, 0xAA6604CEL, 0xABA46EF9L, 0xAEEB787CL, 0xAF29124BL,
+        0xAD6FAC12L, 0xACADC625L, 0xA7F18118L, 0xA633EB2FL, 0xA4755576L,
+        0xA5B73F41L, 0xA0F829C4L, 0xA13A43F3L, 0xA37CFDAAL, 0xA2BE979DL,
+        0xB5C473D0L, 0xB40619E7L, 0xB640A7BEL, 0xB782CD89L, 0xB2CDDB0CL,
+        0xB30FB13BL, 0xB1490F62L, 0xB08B6555L, 0xBBD72268L, 0xBA15485FL,
+        0xB853F606L, 0xB9919C31L, 0xBCDE8AB4L, 0xBD1CE083L, 0xBF5A5EDAL,
+        0xBE9834EDL
+    },
+    {
+        0x00000000L, 0xB8BC6765L, 0xAA09C88BL, 0x12B5AFEEL, 0x8F629757L,
+        0x37DEF032L, 0x256B5FDCL, 0x9DD738B9L, 0xC5B428EFL, 0x7D084F8AL,
+        0x6FBDE064L, 0xD7018701L, 0x4AD6BFB8L, 0xF26AD8DDL, 0xE0DF7733L,
+        0x58631056L, 0x5019579FL, 0xE8A530FAL, 0xFA109F14L, 0x42ACF871L,
+        0xDF7BC0C8L, 0x67C7A7ADL, 0x75720843L, 0xCDCE6F26L, 0x95AD7F70L,
+        0x2D111815L, 0x3FA4B7FBL, 0x8718D09EL, 0x1ACFE827L, 0xA2738F42L,
+        0xB0C620ACL, 0x087A47C9L, 0xA032AF3EL, 0x188EC85BL, 0x0A3B67B5L,
+        0xB28700D0L, 0x2F503869L, 0x97EC5F0CL, 0x8559F0E2L, 0x3DE59787L,
+        0x658687D1L, 0xDD3AE0B4L, 0xCF8F4F5AL, 0x7733283FL, 0xEAE41086L,
+        0x525877E3L, 0x40EDD80DL, 0xF851BF68L, 0xF02BF8A1L, 0x48979FC4L,
+        0x5A22302AL, 0xE29E574FL, 0x7F496FF6L, 0xC7F50893L, 0xD540A77DL,
+        0x6DFCC018L, 0x359FD04EL, 0x8D23B72BL, 0x9F9618C5L, 0x272A7FA0L,
+        0xBAFD4719L, 0x0241207CL, 0x10F48F92L, 0xA848E8F7L, 0x9B14583DL,
+        0x23A83F58L, 0x311D90B6L, 0x89A1F7D3L, 0x1476CF6AL, 0xACCAA80FL,
+        0xBE7F07E1L, 0x06C36084L, 0x5EA070D2L, 0xE61C17B7L, 0xF4A9B859L,
+        0x4C15DF3CL, 0xD1C2E785L, 0x697E80E0L, 0x7BCB2F0EL, 0xC377486BL,
+        0xCB0D0FA2L, 0x73B168C7L, 0x6104C729L, 0xD9B8A04CL, 0x446F98F5L,
+        0xFCD3FF90L, 0xEE66507EL, 0x56DA371BL, 0x0EB9274DL, 0xB6054028L,
+        0xA4B0EFC6L, 0x1C0C88A3L, 0x81DBB01AL, 0x3967D77FL, 0x2BD27891L,
+        0x936E1FF4L, 0x3B26F703L, 0x839A9066L, 0x912F3F88L, 0x299358EDL,
+        0xB4446054L, 0x0CF80731L, 0x1E4DA8DFL, 0xA6F1CFBAL, 0xFE92DFECL,
+        0x462EB889L, 0x549B1767L, 0xEC277002L, 0x71F048BBL, 0xC94C2FDEL,
+        0xDBF98030L, 0x6345E755L, 0x6B3FA09CL, 0xD383C7F9L, 0xC1366817L,
+        0x798A0F72L, 0xE45D37CBL, 0x5CE150AEL, 0x4E54FF40L, 0xF6E89825L,
+        0xAE8B8873L, 0x1637EF16L, 0x048240F8L, 0xBC3E279DL, 0x21E91F24L,
+        0x99557841L, 0x8BE0D7AFL, 0x335CB0CAL, 0xED59B63BL, 0x55E5D15EL,
+        0x47507EB0L, 0xFFEC19D5L, 0x623B216CL, 0xDA874609L, 0xC832E9E7L,
+        0x708E8E82L, 0x28ED9ED4L, 0x9051F9B1L, 0x82E4565FL, 0x3A58313AL,
+        0xA78F0983L, 0x1F336EE6L, 0x0D86C108L, 0xB53AA66DL, 0xBD40E1A4L,
+        0x05FC86C1L, 0x1749292FL, 0xAFF54E4AL, 0x322276F3L, 0x8A9E1196L,
+        0x982BBE78L, 0x2097D91DL, 0x78F4C94BL, 0xC048AE2EL, 0xD2FD01C0L,
+        0x6A4166A5L, 0xF7965E1CL, 0x4F2A3979L, 0x5D9F9697L, 0xE523F1F2L,
+        0x4D6B1905L, 0xF5D77E60L, 0xE762D18EL, 0x5FDEB6EBL, 0xC2098E52L,
+        0x7AB5E937L, 0x680046D9L, 0xD0BC21BCL, 0x88DF31EAL, 0x3063568FL,
+        0x22D6F961L, 0x9A6A9E04L, 0x07BDA6BDL, 0xBF01C1D8L, 0xADB46E36L,
+        0x15080953L, 0x1D724E9AL, 0xA5CE29FFL, 0xB77B8611L, 0x0FC7E174L,
+        0x9210D9CDL, 0x2AACBEA8L, 0x38191146L, 0x80A57623L, 0xD8C66675L,
+        0x607A0110L, 0x72CFAEFEL, 0xCA73C99BL, 0x57A4F122L, 0xEF189647L,
+        0xFDAD39A9L, 0x45115ECCL, 0x764DEE06L, 0xCEF18963L, 0xDC44268DL,
+        0x64F841E8L, 0xF92F7951L, 0x41931E34L, 0x5326B1DAL, 0xEB9AD6BFL,
+        0xB3F9C6E9L, 0x0B45A18CL, 0x19F00E62L, 0xA14C6907L, 0x3C9B51BEL,
+        0x842736DBL, 0x96929935L, 0x2E2EFE50L, 0x2654B999L, 0x9EE8DEFCL,
+        0x8C5D7112L, 0x34E11677L, 0xA9362ECEL, 0x118A49ABL, 0x033FE645L,
+        0xBB838120L, 0xE3E09176L, 0x5B5CF613L, 0x49E959FDL, 0xF1553E98L,
+        0x6C820621L, 0xD43E6144L, 0xC68BCEAAL, 0x7E37A9CFL, 0xD67F4138L,
+        0x6EC3265DL, 0x7C7689B3L, 0xC4CAEED6L, 0x591DD66FL, 0xE1A1B10AL,
+        0xF3141EE4L, 0x4BA87981L, 0x13CB69D7L, 0xAB770EB2L, 0xB9C2A15CL,
+        0x017EC639L, 0x9CA9FE80L, 0x241599E5L, 0x36A0360BL, 0x8E1C516EL,
+        0x866616A7L, 0x3EDA71C2L, 0x2C6FDE2CL, 0x94D3B949L, 0x090481F0L,
+        0xB1B8E695L, 0xA30D497BL, 0x1BB12E1EL, 0x43D23E48L, 0xFB6E592DL,
+        0xE9DBF6C3L, 0x516791A6L, 0xCCB0A91FL, 0x740CCE7AL, 0x66B96194L,
+        0xDE0506F1L
+    }
+};
+#endif
+
 /* ======================================================================== */
 /*  CRC32_UPDATE -- Updates a 32-bit CRC using the lookup table above.      */
 /*                  Note:  The 32-bit CRC is set up as a right-shifting     */
@@ -120,14 +310,92 @@ uint32_t crc32_upd32(uint32_t crc, uint32_t data)
 /* ======================================================================== */
 uint32_t crc32_block(uint32_t crc, void* data, uint32_t len)
 {
-  uint32_t i;
+  const uint8_t* p = data;
+
+#if CRC32_USE_HW
+  /* The hardware unit reads whole aligned words, so bring the leading
+   * bytes up to a word boundary in software first.
+   */
+  while (len >= 4 && ((uintptr_t)p & 3) != 0) {
+    crc = (crc >> 8) ^ crc32_tbl[(crc ^ *p++) & 0xFF];
+    len--;
+  }
+
+  if (len >= 4) {
+    uint32_t nwords = len / 4;
+
+    crc = crc32_hw_words(crc, (const uint32_t*)p, nwords);
+    p   += nwords * 4;
+    len -= nwords * 4;
+  }
+#endif
+
+#if CRC32_SLICE_BY_4 && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  while (len > 0 && ((uintptr_t)p & 3) != 0) {
+    crc = (crc >> 8) ^ crc32_tbl[(crc ^ *p++) & 0xFF];
+    len--;
+  }
 
-  for (i = 0; i < len; i++)
-    crc = (crc >> 8) ^ crc32_tbl[(crc ^ ((uint8_t*)data)[i]) & 0xFF];
+  /* Slicing-by-4: one aligned word load and four lookups per word */
+  while (len >= 4) {
+    crc ^= *(const uint32_t*)p;
+    crc  = crc32_tbl_s4[2][ crc        & 0xFF] ^
+           crc32_tbl_s4[1][(crc >>  8) & 0xFF] ^
+           crc32_tbl_s4[0][(crc >> 16) & 0xFF] ^
+           crc32_tbl   [ crc >> 24        ];
+    p   += 4;
+    len -= 4;
+  }
+#endif
+
+  while (len > 0) {
+    crc = (crc >> 8) ^ crc32_tbl[(crc ^ *p++) & 0xFF];
+    len--;
+  }
 
   return crc;
 }
 
+#if CRC32_USE_HW
+/* ======================================================================== */
+/*  CRC32_HW_WORDS -- Runs words through the STM32 CRC unit.  The unit      */
+/*                    only does the MSB-first form of the same polynomial,  */
+/*                    so the input and result are bit reversed to get the   */
+/*                    right-shifting CRC.  The unit is shared state, so     */
+/*                    this is only enabled in single threaded builds.       */
+/*                                                                          */
+/*                    The F2 unit can only be reset to 0xFFFFFFFF.  To      */
+/*                    carry on from a running CRC, one extra word is fed    */
+/*                    in that takes the unit from its reset value to the    */
+/*                    running value, found by undoing the 32 shifts a word  */
+/*                    write does.                                           */
+/* ======================================================================== */
+static uint32_t crc32_hw_words(uint32_t crc, const uint32_t* data, uint32_t nwords)
+{
+  RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+  CRC->CR = CRC_CR_RESET;
+
+  if (crc != 0xFFFFFFFF) {
+    uint32_t state = __RBIT(crc);
+    int i;
+
+    for (i = 0; i < 32; ++i) {
+      if (state & 1)
+        state = ((state ^ 0x04C11DB7) >> 1) | 0x80000000;
+      else
+        state >>= 1;
+    }
+
+    CRC->DR = state ^ 0xFFFFFFFF;
+  }
+
+  while (nwords-- > 0)
+    CRC->DR = __RBIT(*data++);
+
+  return __RBIT(CRC->DR);
+}
+#endif
+
 /* ======================================================================== */
 /*     This specific file is placed in the public domain by its author,     */
 /*                              Joseph Zbiciak.                             */
@@ -49,6 +49,16 @@ typedef struct __attribute__ ((__packed__)) {
 #define PREFIX_IMAGE_SIZE_OFFSET  6
 #define PREFIX_NUM_TARGETS_OFFSET 10
 
+/* Targets with this name hold elements compressed with the heatshrink LZSS
+ * bitstream (see scripts/dfu.py -z). Each element starts with its
+ * uncompressed size, stored little endian, followed by the compressed data.
+ */
+#define HS_TARGET_NAME    "heatshrink w10 l4"
+#define HS_WINDOW_BITS    10
+#define HS_LOOKAHEAD_BITS 4
+#define HS_WINDOW_SIZE    (1 << HS_WINDOW_BITS)
+#define HS_OUT_BUF_SIZE   256
+
 #define BSWAP16(x) \
       ((((x) >> 8) & 0xff) | \
        (((x) & 0xff) << 8))
@@ -123,7 +133,7 @@ dfuse_read_image_element(sxfs_part_id_t part, uint32_t offset, dfu_image_element
 }
 
 static dfu_parse_result_t
-dfuse_read_suffix(sxfs_part_id_t part, dfu_prefix_t* prefix, dfu_suffix_t* suffix)
+dfuse_read_suffix(sxfs_part_id_t part, dfu_prefix_t* prefix, dfu_suffix_t* suffix, bool check_crc)
 {
   if (prefix == NULL || suffix == NULL)
     return DFU_INVALID_ARGS;
@@ -146,6 +156,9 @@ dfuse_read_suffix(sxfs_part_id_t part, dfu_prefix_t* prefix, dfu_suffix_t* suffi
   if (suffix->suffix_len != 16)
     return DFU_INVALID_SUFFIX_LEN;
 
+  if (!check_crc)
+    return DFU_PARSE_OK;
+
   uint32_t crc;
   sxfs_crc(part, 0, prefix->dfu_image_size + (sizeof(dfu_suffix_t) - 4), &crc);
   if (suffix->crc != crc)
@@ -163,14 +176,174 @@ typedef struct {
   void (*suffix)(dfu_suffix_t*);
 } dfu_parse_ops_t;
 
+typedef enum {
+  HS_SIZE,
+  HS_TAG,
+  HS_LITERAL,
+  HS_INDEX,
+  HS_COUNT
+} hs_state_t;
+
+typedef struct {
+  hs_state_t state;
+  uint32_t value;
+  uint8_t nbits;
+  uint8_t need;
+  uint16_t index;
+  uint16_t window_pos;
+  uint16_t out_len;
+  uint32_t size;
+  uint32_t remaining;
+} hs_decoder_t;
+
+typedef struct {
+  dfu_parse_ops_t* ops;
+  addr_range_t* valid_addr_range;
+  uint32_t target_addr;
+  hs_decoder_t hs;
+} img_data_ctx_t;
+
+
+/* Decompression history and output staging. Only one element is ever being
+ * decompressed at a time.
+ */
+static uint8_t hs_window[HS_WINDOW_SIZE];
+static uint8_t hs_out_buf[HS_OUT_BUF_SIZE];
+
+
 static bool
 in_addr_range(addr_range_t* addr_range, uint32_t start, uint32_t end)
 {
   return (start >= addr_range->start) && (end <= addr_range->end);
 }
 
+static void
+emit_img_data(img_data_ctx_t* ctx, const uint8_t* data, uint32_t len)
+{
+  if (in_addr_range(ctx->valid_addr_range, ctx->target_addr, ctx->target_addr + len-1))
+    ctx->ops->img_data(ctx->target_addr, (uint8_t*)data, len);
+
+  ctx->target_addr += len;
+}
+
+static bool
+dispatch_img_data(const uint8_t* data, uint32_t len, void* arg)
+{
+  emit_img_data(arg, data, len);
+
+  return true;
+}
+
+static void
+hs_flush(img_data_ctx_t* ctx)
+{
+  if (ctx->hs.out_len > 0) {
+    emit_img_data(ctx, hs_out_buf, ctx->hs.out_len);
+    ctx->hs.out_len = 0;
+  }
+}
+
+static void
+hs_put_byte(img_data_ctx_t* ctx, uint8_t b)
+{
+  hs_decoder_t* hs = &ctx->hs;
+
+  hs_window[hs->window_pos++ & (HS_WINDOW_SIZE - 1)] = b;
+  hs_out_buf[hs->out_len++] = b;
+  hs->remaining--;
+
+  if (hs->out_len == HS_OUT_BUF_SIZE)
+    hs_flush(ctx);
+}
+
+/* Consumes one bit. Returns false if the stream refers to data before the
+ * start of the element or runs past its stated size.
+ */
+static bool
+hs_step(img_data_ctx_t* ctx, uint8_t bit)
+{
+  hs_decoder_t* hs = &ctx->hs;
+  uint32_t v;
+
+  hs->value = (hs->value << 1) | bit;
+  if (++hs->nbits < hs->need)
+    return true;
+
+  v = hs->value;
+  hs->value = 0;
+  hs->nbits = 0;
+
+  switch (hs->state) {
+    case HS_TAG:
+      hs->state = v ? HS_LITERAL : HS_INDEX;
+      hs->need = v ? 8 : HS_WINDOW_BITS;
+      return true;
+
+    case HS_LITERAL:
+      hs_put_byte(ctx, v);
+      break;
+
+    case HS_INDEX:
+      hs->index = v + 1;
+      hs->state = HS_COUNT;
+      hs->need = HS_LOOKAHEAD_BITS;
+      return true;
+
+    case HS_COUNT:
+      if (hs->index > (hs->size - hs->remaining) || (v + 1) > hs->remaining)
+        return false;
+
+      for (v = v + 1; v > 0; --v)
+        hs_put_byte(ctx, hs_window[(hs->window_pos - hs->index) & (HS_WINDOW_SIZE - 1)]);
+      break;
+
+    default:
+      return false;
+  }
+
+  hs->state = HS_TAG;
+  hs->need = 1;
+
+  return true;
+}
+
+static bool
+dispatch_compressed_img_data(const uint8_t* data, uint32_t len, void* arg)
+{
+  img_data_ctx_t* ctx = arg;
+  hs_decoder_t* hs = &ctx->hs;
+  int bit;
+
+  for (; len > 0 && hs->state == HS_SIZE; --len, ++data) {
+    hs->size |= ((uint32_t)*data) << (8 * hs->nbits);
+    if (++hs->nbits == 4) {
+      hs->remaining = hs->size;
+      hs->nbits = 0;
+      hs->state = HS_TAG;
+      hs->need = 1;
+    }
+  }
+
+  /* Anything after the last output byte is padding */
+  for (; len > 0 && hs->remaining > 0; --len, ++data) {
+    for (bit = 7; bit >= 0 && hs->remaining > 0; --bit) {
+      if (!hs_step(ctx, (*data >> bit) & 1))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+static bool
+target_is_compressed(dfu_target_prefix_t* target_prefix)
+{
+  return (target_prefix->target_named != 0) &&
+      (memcmp(target_prefix->target_name, HS_TARGET_NAME, sizeof(HS_TARGET_NAME)) == 0);
+}
+
 static dfu_parse_result_t
-dfuse_parse(sxfs_part_id_t part, dfu_parse_ops_t* ops, addr_range_t* valid_addr_range)
+dfuse_parse(sxfs_part_id_t part, dfu_parse_ops_t* ops, addr_range_t* valid_addr_range, bool check_crc)
 {
   int i;
   dfu_prefix_t prefix;
@@ -183,7 +356,7 @@ dfuse_parse(sxfs_part_id_t part, dfu_parse_ops_t* ops, addr_range_t* valid_addr_
   if (ops && ops->prefix)
     ops->prefix(&prefix);
 
-  result = dfuse_read_suffix(part, &prefix, &suffix);
+  result = dfuse_read_suffix(part, &prefix, &suffix, check_crc);
   if (result != DFU_PARSE_OK)
     return result;
 
@@ -199,6 +372,8 @@ dfuse_parse(sxfs_part_id_t part, dfu_parse_ops_t* ops, addr_range_t* valid_addr_
 
     offset += sizeof(dfu_target_prefix_t);
 
+    bool compressed = target_is_compressed(&target_prefix);
+
     int j;
     for (j = 0; j < (int)target_prefix.num_elements; ++j) {
       dfu_image_element_t img_element;
@@ -207,30 +382,39 @@ dfuse_parse(sxfs_part_id_t part, dfu_parse_ops_t* ops, addr_range_t* valid_addr_
         return result;
       offset += sizeof(dfu_image_element_t);
 
-      if (img_element.element_size == 0)
+      if (img_element.element_size == 0 ||
+          (offset + img_element.element_size) > prefix.dfu_image_size)
         return DFU_INVALID_IMG_ELEMENT_SIZE;
 
       if (ops && ops->img_element)
         ops->img_element(&img_element);
 
-      uint32_t target_addr = img_element.element_addr;
-      uint8_t data[256];
-      uint32_t data_remaining = img_element.element_size;
-      while (data_remaining > 0) {
-        uint32_t read_len = MIN(data_remaining, sizeof(data));
-
-        sxfs_read(part, offset, data, read_len);
-
-        if ((ops != NULL) &&
-            (ops->img_data != NULL) &&
-            (valid_addr_range != NULL) &&
-            (in_addr_range(valid_addr_range, target_addr, target_addr + read_len-1)))
-          ops->img_data(target_addr, data, read_len);
-
-        offset += read_len;
-        target_addr += read_len;
-        data_remaining -= read_len;
+      /* The image CRC was already checked along with the suffix, so the
+       * element data only needs to be read if someone is going to use it.
+       */
+      if ((ops != NULL) &&
+          (ops->img_data != NULL) &&
+          (valid_addr_range != NULL)) {
+        img_data_ctx_t ctx = {
+            .ops = ops,
+            .valid_addr_range = valid_addr_range,
+            .target_addr = img_element.element_addr,
+            .hs = { .state = HS_SIZE }
+        };
+
+        if (compressed) {
+          if (!sxfs_read_stream(part, offset, img_element.element_size, dispatch_compressed_img_data, &ctx))
+            return DFU_INVALID_IMG_ELEMENT_SIZE;
+
+          hs_flush(&ctx);
+          if (ctx.hs.state == HS_SIZE || ctx.hs.remaining > 0)
+            return DFU_INVALID_IMG_ELEMENT_SIZE;
+        }
+        else if (!sxfs_read_stream(part, offset, img_element.element_size, dispatch_img_data, &ctx))
+          return DFU_INVALID_IMG_ELEMENT_SIZE;
       }
+
+      offset += img_element.element_size;
     }
   }
 
@@ -243,25 +427,137 @@ dfuse_parse(sxfs_part_id_t part, dfu_parse_ops_t* ops, addr_range_t* valid_addr_
 dfu_parse_result_t
 dfuse_verify(sxfs_part_id_t part)
 {
-  return dfuse_parse(part, NULL, NULL);
+  return dfuse_parse(part, NULL, NULL, true);
 }
 
+dfu_parse_result_t
+dfuse_get_image_id(sxfs_part_id_t part, dfu_image_id_t* id)
+{
+  dfu_prefix_t prefix;
+  dfu_suffix_t suffix;
+  dfu_parse_result_t result;
+
+  if (id == NULL)
+    return DFU_INVALID_ARGS;
+
+  result = dfuse_read_prefix(part, &prefix);
+  if (result != DFU_PARSE_OK)
+    return result;
+
+  result = dfuse_read_suffix(part, &prefix, &suffix, false);
+  if (result != DFU_PARSE_OK)
+    return result;
+
+  id->image_size = prefix.dfu_image_size;
+  id->crc = suffix.crc;
+
+  return DFU_PARSE_OK;
+}
+
+/* Reports whether any target holds compressed elements. Only the prefixes
+ * are read and the scan stops at the first target that isn't there yet, so
+ * this can be used on an image that is still being downloaded.
+ */
+dfu_parse_result_t
+dfuse_is_compressed(sxfs_part_id_t part, bool* compressed)
+{
+  int i;
+  dfu_prefix_t prefix;
+  dfu_parse_result_t result;
+
+  if (compressed == NULL)
+    return DFU_INVALID_ARGS;
+
+  *compressed = false;
+
+  result = dfuse_read_prefix(part, &prefix);
+  if (result != DFU_PARSE_OK)
+    return result;
+
+  uint32_t offset = sizeof(dfu_prefix_t);
+  for (i = 0; i < prefix.num_targets; ++i) {
+    dfu_target_prefix_t target_prefix;
+    if (dfuse_read_target_prefix(part, offset, &target_prefix) != DFU_PARSE_OK)
+      break;
+
+    if (target_is_compressed(&target_prefix)) {
+      *compressed = true;
+      break;
+    }
+
+    offset += sizeof(dfu_target_prefix_t) + target_prefix.target_size;
+  }
+
+  return DFU_PARSE_OK;
+}
+
+/* Internal flash sectors whose contents differ from the image being
+ * applied, and the ones of those that have been erased so far.
+ */
+static uint32_t dirty_sectors;
+static uint32_t erased_sectors;
+
 static void
-handle_img_data(uint32_t addr, uint8_t* data, uint32_t size)
+compare_img_data(uint32_t addr, uint8_t* data, uint32_t size)
 {
-  if (!iflash_is_erased(addr, size))
-    iflash_erase(addr, size);
+  while (size > 0) {
+    flashsector_t sector = iflash_sector_at(addr);
+    uint32_t len = MIN(size, iflash_sector_end(sector) - addr);
+
+    if (!iflash_compare(addr, data, len))
+      dirty_sectors |= (1 << sector);
 
-  iflash_write(addr, data, size);
+    addr += len;
+    data += len;
+    size -= len;
+  }
 }
 
+static void
+write_img_data(uint32_t addr, uint8_t* data, uint32_t size)
+{
+  while (size > 0) {
+    flashsector_t sector = iflash_sector_at(addr);
+    uint32_t len = MIN(size, iflash_sector_end(sector) - addr);
+
+    if (dirty_sectors & (1 << sector)) {
+      if ((erased_sectors & (1 << sector)) == 0) {
+        if (!iflash_is_erased(iflash_sector_begin(sector), iflash_sector_size(sector)))
+          iflash_sector_erase(sector);
+        erased_sectors |= (1 << sector);
+      }
+
+      iflash_write(addr, data, len);
+    }
+
+    addr += len;
+    data += len;
+    size -= len;
+  }
+}
+
+/* Applies the image in two passes. The first compares it against internal
+ * flash to find the sectors that need to change, the second erases each of
+ * those once and programs them. Sectors that already match are left alone.
+ */
 dfu_parse_result_t
 dfuse_apply_update(sxfs_part_id_t part, addr_range_t* valid_addr_range)
 {
+  dfu_parse_result_t result;
   dfu_parse_ops_t ops = {
-      .img_data = handle_img_data
+      .img_data = compare_img_data
   };
-  return dfuse_parse(part, &ops, valid_addr_range);
+
+  dirty_sectors = 0;
+  erased_sectors = 0;
+
+  result = dfuse_parse(part, &ops, valid_addr_range, true);
+  if (result != DFU_PARSE_OK || dirty_sectors == 0)
+    return result;
+
+  /* The image was checked by the first pass */
+  ops.img_data = write_img_data;
+  return dfuse_parse(part, &ops, valid_addr_range, false);
 }
 
 void
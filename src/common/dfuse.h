@@ -28,10 +28,24 @@ typedef struct {
   uint32_t end;
 } addr_range_t;
 
+/* Identifies an image without checking it. Used to tell whether an image
+ * that was verified before has been replaced since.
+ */
+typedef struct {
+  uint32_t image_size;
+  uint32_t crc;
+} dfu_image_id_t;
+
 
 dfu_parse_result_t
 dfuse_verify(sxfs_part_id_t part);
 
+dfu_parse_result_t
+dfuse_get_image_id(sxfs_part_id_t part, dfu_image_id_t* id);
+
+dfu_parse_result_t
+dfuse_is_compressed(sxfs_part_id_t part, bool* compressed);
+
 dfu_parse_result_t
 dfuse_apply_update(sxfs_part_id_t part, addr_range_t* valid_addr_range);
 
@@ -61,7 +61,7 @@ iflash_sector_begin(flashsector_t sector)
 }
 
 uint32_t
-flashSectorEnd(flashsector_t sector)
+iflash_sector_end(flashsector_t sector)
 {
     return iflash_sector_begin(sector + 1);
 }
@@ -70,7 +70,7 @@ flashsector_t
 iflash_sector_at(uint32_t address)
 {
     flashsector_t sector = 0;
-    while (address >= flashSectorEnd(sector))
+    while (address >= iflash_sector_end(sector))
         ++sector;
     return sector;
 }
@@ -162,7 +162,7 @@ iflash_erase(uint32_t address, uint32_t s)
     int err = iflash_sector_erase(sector);
     if (err != FLASH_RETURN_SUCCESS)
       return err;
-    address = flashSectorEnd(sector);
+    address = iflash_sector_end(sector);
     size -= iflash_sector_size(sector);
   }
 
@@ -221,20 +221,15 @@ iflash_read(uint32_t address, uint8_t* buffer, uint32_t size)
   return FLASH_RETURN_SUCCESS;
 }
 
+/* Must be called with the PG bit set in FLASH->CR */
 static void
 iflash_write_data(uint32_t address, const flashdata_t data)
 {
-  /* Enter flash programming mode */
-  FLASH->CR |= FLASH_CR_PG;
-
   /* Write the data */
   *(flashdata_t*)address = data;
 
   /* Wait for completion */
   flashWaitWhileBusy();
-
-  /* Exit flash programming mode */
-  FLASH->CR &= ~FLASH_CR_PG;
 }
 
 int
@@ -251,6 +246,11 @@ iflash_write(uint32_t address, const uint8_t* buffer, uint32_t size)
   FLASH->CR &= ~FLASH_CR_PSIZE_MASK;
   FLASH->CR |= FLASH_CR_PSIZE_VALUE;
 
+  /* Stay in programming mode for the whole buffer rather than toggling it
+   * around every word.
+   */
+  FLASH->CR |= FLASH_CR_PG;
+
   /* Check if the flash address is correctly aligned */
   uint32_t alignOffset = address % sizeof(flashdata_t);
   if (alignOffset != 0) {
@@ -300,6 +300,9 @@ iflash_write(uint32_t address, const uint8_t* buffer, uint32_t size)
     iflash_write_data(address, tmp);
   }
 
+  /* Exit flash programming mode */
+  FLASH->CR &= ~FLASH_CR_PG;
+
   /* Lock flash again */
   iflash_lock();
 
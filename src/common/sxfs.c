@@ -38,26 +38,71 @@ static const part_info_t part_info[NUM_SXFS_PARTS] = {
         .offset = 0x00320000,
         .size   = 0x00010000 // 64 KB
     },
+    [SP_TEMP_PROFILE_LIB_1] = {
+        .offset = 0x00330000,
+        .size   = 0x00040000 // 256 KB
+    },
+    [SP_TEMP_PROFILE_LIB_2] = {
+        .offset = 0x00370000,
+        .size   = 0x00040000 // 256 KB
+    },
+    [SP_KV_STORE_1] = {
+        .offset = 0x003B0000,
+        .size   = 0x00020000 // 128 KB
+    },
+    [SP_KV_STORE_2] = {
+        .offset = 0x003D0000,
+        .size   = 0x00020000 // 128 KB
+    },
 };
 
 
-bool
-sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+static bool
+erase_range(sxfs_part_id_t part_id, uint32_t offset, uint32_t len, bool async)
 {
-  if (part_id >= NUM_SXFS_PARTS)
+  if (part_id >= NUM_SXFS_PARTS || len == 0)
     return false;
 
-  // Round up to the nearest 64K which is the smallest erasable size
-  len = (((len - 1) / XFLASH_SECTOR_SIZE) + 1) * XFLASH_SECTOR_SIZE;
-
   part_info_t pinfo = part_info[part_id];
+
+  // Round up to the smallest erasable size, which is 4K on parameter sectors
+  uint32_t erase_size = sxfs_erase_size(part_id, offset);
+  len = (((len - 1) / erase_size) + 1) * erase_size;
+
   if (offset + len > pinfo.size)
     return false;
 
-  if (xflash_erase(pinfo.offset + offset, len) != 0)
-    return false;
+  int ret;
+  if (async)
+    ret = xflash_erase_async(pinfo.offset + offset, len);
+  else
+    ret = xflash_erase(pinfo.offset + offset, len);
 
-  return true;
+  return (ret == 0);
+}
+
+uint32_t
+sxfs_erase_size(sxfs_part_id_t part_id, uint32_t offset)
+{
+  if (part_id >= NUM_SXFS_PARTS)
+    return XFLASH_SECTOR_SIZE;
+
+  return xflash_erase_size(part_info[part_id].offset + offset);
+}
+
+bool
+sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  return erase_range(part_id, offset, len, false);
+}
+
+/* Queues the erase and returns straight away. Reads and writes to the range
+ * wait for the erase to complete.
+ */
+bool
+sxfs_erase_async(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  return erase_range(part_id, offset, len, true);
 }
 
 bool
@@ -70,6 +115,16 @@ sxfs_erase_all(sxfs_part_id_t part_id)
   return sxfs_erase(part_id, 0, pinfo.size);
 }
 
+bool
+sxfs_erase_all_async(sxfs_part_id_t part_id)
+{
+  if (part_id >= NUM_SXFS_PARTS)
+    return false;
+
+  part_info_t pinfo = part_info[part_id];
+  return sxfs_erase_async(part_id, 0, pinfo.size);
+}
+
 bool
 sxfs_is_erased(sxfs_part_id_t part_id, uint32_t offset, uint32_t data_len)
 {
@@ -77,6 +132,9 @@ sxfs_is_erased(sxfs_part_id_t part_id, uint32_t offset, uint32_t data_len)
     return false;
 
   part_info_t pinfo = part_info[part_id];
+  if ((offset + data_len) > pinfo.size)
+    return false;
+
   return xflash_is_erased(pinfo.offset + offset, data_len);
 }
 
@@ -111,6 +169,20 @@ sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_
   return true;
 }
 
+bool
+sxfs_read_stream(sxfs_part_id_t part_id, uint32_t offset, uint32_t len,
+    xflash_read_cb_t cb, void* arg)
+{
+  if (part_id >= NUM_SXFS_PARTS || cb == NULL)
+    return false;
+
+  part_info_t pinfo = part_info[part_id];
+  if ((offset + len) > pinfo.size)
+    return false;
+
+  return xflash_read_stream(pinfo.offset + offset, len, cb, arg);
+}
+
 bool
 sxfs_crc(sxfs_part_id_t part_id, uint32_t offset, uint32_t size, uint32_t* crc)
 {
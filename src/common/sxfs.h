@@ -4,6 +4,8 @@
 #define SXFS_H
 
 
+#include "xflash.h"
+
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -20,6 +22,10 @@ typedef enum {
   SP_WEB_API_BACKLOG,
   SP_APP_CFG_1,
   SP_APP_CFG_2,
+  SP_TEMP_PROFILE_LIB_1,
+  SP_TEMP_PROFILE_LIB_2,
+  SP_KV_STORE_1,
+  SP_KV_STORE_2,
 
   NUM_SXFS_PARTS
 } sxfs_part_id_t;
@@ -31,12 +37,25 @@ sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data
 bool
 sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len);
 
+bool
+sxfs_read_stream(sxfs_part_id_t part_id, uint32_t offset, uint32_t len,
+    xflash_read_cb_t cb, void* arg);
+
+uint32_t
+sxfs_erase_size(sxfs_part_id_t part_id, uint32_t offset);
+
 bool
 sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len);
 
 bool
 sxfs_erase_all(sxfs_part_id_t part_id);
 
+bool
+sxfs_erase_async(sxfs_part_id_t part_id, uint32_t offset, uint32_t len);
+
+bool
+sxfs_erase_all_async(sxfs_part_id_t part_id);
+
 bool
 sxfs_is_erased(sxfs_part_id_t part_id, uint32_t offset, uint32_t data_len);
 
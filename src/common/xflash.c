@@ -8,10 +8,30 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 #define NO_ADDR 0xFFFFFFFF
 
+/* Largest single DMA transfer. The stream NDTR register is 16 bits wide. */
+#define MAX_DMA_XFER 0x8000
+
+/* Streaming reads are double buffered in chunks of this size, and hold the
+ * bus for at most one segment at a time so other readers can get in.
+ */
+#define STREAM_CHUNK_SIZE   512
+#define STREAM_SEGMENT_SIZE 0x4000
+
+/* Number of ranges that can be waiting for the background eraser */
+#define ERASE_QUEUE_LEN 8
+
+#define TICKS_TO_MS(ticks) (((ticks) * 1000) / CH_FREQUENCY)
+
+/* tRES, the time from release from deep power-down until the part accepts
+ * commands.
+ */
+#define RES_DELAY_US 30
+
 
 // Read Commands
 #define CMD_READ      0x03
@@ -62,6 +82,29 @@
 #define SR_P_ERR 0x40
 #define SR_SRWD  0x80
 
+// Config Register Bitmasks
+#define CR_TBPARM 0x04
+
+/* The 4K parameter sectors fill one 64K sector at either the bottom or the
+ * top of the array, depending on the one-time programmable TBPARM bit.
+ */
+#define PARAM_REGION_SIZE XFLASH_SECTOR_SIZE
+
+
+typedef struct {
+  uint32_t addr;
+  uint32_t size;
+} erase_req_t;
+
+#if XFLASH_CACHE_PAGES > 0
+typedef struct {
+  bool valid;
+  uint32_t page_addr;
+  uint32_t last_used;
+  uint8_t data[XFLASH_PAGE_SIZE];
+} cache_page_t;
+#endif
+
 
 static void
 xflash_txn_begin(void);
@@ -69,17 +112,71 @@ xflash_txn_begin(void);
 static void
 xflash_txn_end(void);
 
+static void
+lock_range(uint32_t addr, uint32_t len);
+
+static bool
+erase_pending(uint32_t addr, uint32_t len);
+
+static void
+erase_queue_step(void);
+
+static void
+wake(void);
+
+static void
+power_down(void);
+
+#if CH_USE_DYNAMIC
+static msg_t
+xflash_thread_func(void* arg);
+#endif
+
+static void
+send_cmd_hdr(uint8_t cmd, uint32_t addr);
+
 static void
 send_cmd(uint8_t cmd, uint32_t addr,
     const uint8_t* cmd_tx_buf, uint32_t cmd_tx_len,
     uint8_t* cmd_rx_buf, uint32_t cmd_rx_len);
 
+static void
+receive(uint8_t* buf, uint32_t len);
+
+static void
+wait_for_receive(void);
+
+static bool
+read_stream_segment(uint32_t addr, uint32_t len,
+    xflash_read_cb_t cb, void* arg);
+
+static bool
+check_erased(const uint8_t* data, uint32_t len, void* arg);
+
+static bool
+accumulate_crc(const uint8_t* data, uint32_t len, void* arg);
+
 static uint8_t
 read_status_reg(void);
 
 static void
 write_enable(void);
 
+static uint32_t
+erase_step(uint32_t addr, uint32_t len, uint8_t* cmd);
+
+static bool
+valid_erase_range(uint32_t addr, uint32_t len);
+
+static int
+erase(uint8_t cmd, uint32_t erase_addr);
+
+static void
+cache_read(uint32_t addr, uint8_t* buf, uint32_t len);
+
+static void
+cache_invalidate(uint32_t addr, uint32_t len);
+
 
 static const SPIConfig flash_spi_cfg = {
     .end_cb = NULL,
@@ -89,11 +186,159 @@ static const SPIConfig flash_spi_cfg = {
 };
 static Mutex xflash_mutex;
 
+/* The erase queue and stats are protected by xflash_mutex */
+static erase_req_t erase_queue[ERASE_QUEUE_LEN];
+static uint32_t erase_queue_len;
+static volatile bool erase_busy;
+static BinarySemaphore erase_sem;
+static Thread* xflash_thread;
+static xflash_erase_stats_t erase_stats;
+
+/* Double buffer for streamed reads, protected by xflash_mutex. It is only
+ * used while a segment holds the lock, so segments of different streams can
+ * share it.
+ */
+static uint8_t stream_bufs[2 * STREAM_CHUNK_SIZE];
+
+/* Power state is protected by xflash_mutex */
+static bool powered_down;
+static systime_t last_access;
+static uint32_t idle_timeout_ms = XFLASH_IDLE_TIMEOUT_MS;
+static xflash_power_stats_t power_stats;
+static uint32_t param_region_start;
+
+/* The page cache is protected by xflash_mutex */
+#if XFLASH_CACHE_PAGES > 0
+static cache_page_t cache_pages[XFLASH_CACHE_PAGES];
+static uint32_t cache_tick;
+#endif
+static xflash_cache_stats_t cache_stats;
+
 
 void
 xflash_init()
 {
+  uint8_t cr;
+
   chMtxInit(&xflash_mutex);
+  chBSemInit(&erase_sem, TRUE);
+
+  /* The part keeps its power state across an MCU reset, so it may still be
+   * in deep power-down from before.
+   */
+  powered_down = true;
+  wake();
+
+  send_cmd(CMD_RCR, NO_ADDR, NULL, 0, &cr, 1);
+  if (cr & CR_TBPARM)
+    param_region_start = XFLASH_SIZE - PARAM_REGION_SIZE;
+  else
+    param_region_start = 0;
+}
+
+/* Starts the thread that runs queued erases and powers the part down when
+ * it is idle. Without it erases are synchronous and the part stays in
+ * standby.
+ */
+void
+xflash_start_thread()
+{
+#if CH_USE_DYNAMIC
+  if (xflash_thread == NULL)
+    xflash_thread = chThdCreateFromHeap(NULL, 1024, LOWPRIO, xflash_thread_func, NULL);
+#endif
+}
+
+void
+xflash_set_idle_timeout(uint32_t timeout_ms)
+{
+  chMtxLock(&xflash_mutex);
+  idle_timeout_ms = timeout_ms;
+  chMtxUnlock();
+
+  /* Let the thread pick up the new timeout */
+  chBSemSignal(&erase_sem);
+}
+
+void
+xflash_get_power_stats(xflash_power_stats_t* stats)
+{
+  chMtxLock(&xflash_mutex);
+  *stats = power_stats;
+  chMtxUnlock();
+}
+
+/* Must be called with xflash_mutex held before talking to the part */
+static void
+wake()
+{
+  if (powered_down) {
+    halrtcnt_t start = halGetCounterValue();
+
+    send_cmd(CMD_RES, NO_ADDR, NULL, 0, NULL, 0);
+    halPolledDelay(US2RTT(RES_DELAY_US));
+    powered_down = false;
+
+    uint32_t wake_us = (halGetCounterValue() - start) / (halGetCounterFrequency() / 1000000);
+    power_stats.wakes++;
+    power_stats.wake_total_us += wake_us;
+    power_stats.wake_max_us = MAX(power_stats.wake_max_us, wake_us);
+  }
+
+  last_access = chTimeNow();
+}
+
+/* Must be called with xflash_mutex held */
+static void
+power_down()
+{
+  send_cmd(CMD_DP, NO_ADDR, NULL, 0, NULL, 0);
+  powered_down = true;
+  power_stats.power_downs++;
+}
+
+/* Locks the flash for an operation on the given range. If a queued erase
+ * covers part of the range, the caller works through the queue itself until
+ * the range is clear, so the caller never sees data that is about to
+ * disappear and never waits on the low priority eraser being scheduled.
+ * A sector the eraser has already started holds the mutex, which lends the
+ * eraser the caller's priority until it is done.
+ */
+static void
+lock_range(uint32_t addr, uint32_t len)
+{
+  systime_t start = chTimeNow();
+  bool blocked = erase_busy;
+
+  chMtxLock(&xflash_mutex);
+
+  wake();
+
+  while (erase_pending(addr, len)) {
+    blocked = true;
+    erase_queue_step();
+  }
+
+  if (blocked) {
+    uint32_t wait_ms = TICKS_TO_MS(chTimeNow() - start);
+    erase_stats.blocked_count++;
+    erase_stats.blocked_total_ms += wait_ms;
+    erase_stats.blocked_max_ms = MAX(erase_stats.blocked_max_ms, wait_ms);
+  }
+}
+
+static bool
+erase_pending(uint32_t addr, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < erase_queue_len; ++i) {
+    erase_req_t* req = &erase_queue[i];
+    if ((addr < (req->addr + req->size)) && (req->addr < (addr + len)))
+      return true;
+  }
+
+  return false;
 }
 
 static void
@@ -115,30 +360,66 @@ xflash_txn_end()
 #endif
 }
 
+/* Sends the command byte and address. Must be called inside a transaction. */
 static void
-send_cmd(uint8_t cmd, uint32_t addr, const uint8_t* cmd_tx_buf, uint32_t cmd_tx_len, uint8_t* cmd_rx_buf, uint32_t cmd_rx_len)
+send_cmd_hdr(uint8_t cmd, uint32_t addr)
 {
-  xflash_txn_begin();
-
-  spiSend(SPI_FLASH, 1, &cmd);
+  uint8_t hdr[4];
+  uint32_t hdr_len = 1;
 
+  hdr[0] = cmd;
   if (addr != NO_ADDR) {
-    uint8_t addr_buf[3];
-    addr_buf[0] = addr >> 16;
-    addr_buf[1] = addr >> 8;
-    addr_buf[2] = addr;
-    spiSend(SPI_FLASH, 3, addr_buf);
+    hdr[1] = addr >> 16;
+    hdr[2] = addr >> 8;
+    hdr[3] = addr;
+    hdr_len = 4;
   }
 
+  spiSend(SPI_FLASH, hdr_len, hdr);
+}
+
+static void
+send_cmd(uint8_t cmd, uint32_t addr, const uint8_t* cmd_tx_buf, uint32_t cmd_tx_len, uint8_t* cmd_rx_buf, uint32_t cmd_rx_len)
+{
+  xflash_txn_begin();
+
+  send_cmd_hdr(cmd, addr);
+
   if (cmd_tx_len > 0)
     spiSend(SPI_FLASH, cmd_tx_len, cmd_tx_buf);
 
   if (cmd_rx_len > 0)
-    spiReceive(SPI_FLASH, cmd_rx_len, cmd_rx_buf);
+    receive(cmd_rx_buf, cmd_rx_len);
 
   xflash_txn_end();
 }
 
+/* Receives any length in as few DMA transfers as possible. The flash keeps
+ * incrementing the address for as long as chip select is held.
+ */
+static void
+receive(uint8_t* buf, uint32_t len)
+{
+  while (len > 0) {
+    uint32_t xfer_len = MIN(len, MAX_DMA_XFER);
+    spiReceive(SPI_FLASH, xfer_len, buf);
+    buf += xfer_len;
+    len -= xfer_len;
+  }
+}
+
+static void
+wait_for_receive()
+{
+  /* The state is checked with the kernel locked so a transfer completing
+   * just before we sleep can't be missed.
+   */
+  chSysLock();
+  if (SPI_FLASH->state == SPI_ACTIVE)
+    _spi_wait_s(SPI_FLASH);
+  chSysUnlock();
+}
+
 static uint8_t
 read_status_reg()
 {
@@ -153,17 +434,78 @@ write_enable()
   send_cmd(CMD_WREN, NO_ADDR, NULL, 0, NULL, 0);
 }
 
+/* Returns the smallest erase unit at the given address */
+uint32_t
+xflash_erase_size(uint32_t addr)
+{
+  if ((addr >= param_region_start) &&
+      (addr < (param_region_start + PARAM_REGION_SIZE)))
+    return XFLASH_PARAM_SECTOR_SIZE;
+
+  return XFLASH_SECTOR_SIZE;
+}
+
+/* Picks the erase command for the start of the given range. Whole 64K
+ * sectors are always erased with one SE, parameter sectors are only used for
+ * anything smaller. Returns the number of bytes the command will erase, or 0
+ * if the range can't be erased from this address.
+ */
+static uint32_t
+erase_step(uint32_t addr, uint32_t len, uint8_t* cmd)
+{
+  if (((addr & (XFLASH_SECTOR_SIZE - 1)) == 0) && (len >= XFLASH_SECTOR_SIZE)) {
+    *cmd = CMD_SE;
+    return XFLASH_SECTOR_SIZE;
+  }
+
+  if ((xflash_erase_size(addr) == XFLASH_PARAM_SECTOR_SIZE) &&
+      ((addr & (XFLASH_PARAM_SECTOR_SIZE - 1)) == 0) &&
+      (len >= XFLASH_PARAM_SECTOR_SIZE)) {
+    *cmd = CMD_P4E;
+    return XFLASH_PARAM_SECTOR_SIZE;
+  }
+
+  return 0;
+}
+
+static bool
+valid_erase_range(uint32_t addr, uint32_t len)
+{
+  uint8_t cmd;
+
+  if (len == 0)
+    return false;
+
+  while (len > 0) {
+    uint32_t step = erase_step(addr, len, &cmd);
+    if (step == 0)
+      return false;
+
+    addr += step;
+    len -= step;
+  }
+
+  return true;
+}
+
 static int
-erase(uint32_t erase_addr)
+erase(uint8_t cmd, uint32_t erase_addr)
 {
+  int ret = 0;
+
   write_enable();
-  send_cmd(CMD_SE, erase_addr, NULL, 0, NULL, 0);
+  send_cmd(cmd, erase_addr, NULL, 0, NULL, 0);
 
+  cache_invalidate(erase_addr,
+      (cmd == CMD_SE) ? XFLASH_SECTOR_SIZE : XFLASH_PARAM_SECTOR_SIZE);
+
+  erase_busy = true;
   while (1) {
     uint8_t sr = read_status_reg();
     if (sr & SR_E_ERR) {
       send_cmd(CMD_CLSR, NO_ADDR, NULL, 0, NULL, 0);
-      return -1;
+      ret = -1;
+      break;
     }
 
     if (sr & SR_WIP)
@@ -171,63 +513,189 @@ erase(uint32_t erase_addr)
     else
       break;
   }
+  erase_busy = false;
 
-  return 0;
+  return ret;
 }
 
 int
 xflash_erase(uint32_t addr, uint32_t size)
 {
-  int bytes_remaining = size;
+  uint32_t bytes_remaining = size;
   uint32_t erase_addr = addr;
 
+  if (!valid_erase_range(addr, size))
+    return -1;
+
   while (bytes_remaining > 0) {
-    if ((bytes_remaining < XFLASH_SECTOR_SIZE) ||
-        ((erase_addr & (XFLASH_SECTOR_SIZE - 1)) != 0))
-      return -1;
+    uint8_t cmd;
+    uint32_t step = erase_step(erase_addr, bytes_remaining, &cmd);
 
-    chMtxLock(&xflash_mutex);
-    int ret = erase(erase_addr);
+    lock_range(erase_addr, step);
+    int ret = erase(cmd, erase_addr);
     chMtxUnlock();
 
     if (ret != 0)
       return ret;
 
-    erase_addr += XFLASH_SECTOR_SIZE;
-    bytes_remaining -= XFLASH_SECTOR_SIZE;
+    erase_addr += step;
+    bytes_remaining -= step;
   }
 
   return 0;
 }
 
-bool
-xflash_is_erased(uint32_t addr, uint32_t len)
+int
+xflash_erase_async(uint32_t addr, uint32_t size)
 {
-  uint8_t* buf = malloc(256);
-  bool erased = true;
+  uint32_t i;
 
-  while (len > 0) {
-    int read_len = MIN(256, len);
-    xflash_read(addr, buf, read_len);
+  if (!valid_erase_range(addr, size))
+    return -1;
 
-    int i;
-    for (i = 0; i < read_len; ++i) {
-      if (buf[i] != 0xFF) {
-        erased = false;
+  if (xflash_thread == NULL)
+    return xflash_erase(addr, size);
+
+  chMtxLock(&xflash_mutex);
+
+  for (i = 0; i < erase_queue_len; ++i) {
+    erase_req_t* req = &erase_queue[i];
+    if ((addr >= req->addr) && ((addr + size) <= (req->addr + req->size))) {
+      /* Already queued */
+      chMtxUnlock();
+      return 0;
+    }
+  }
+
+  if (erase_queue_len >= ERASE_QUEUE_LEN) {
+    chMtxUnlock();
+    return xflash_erase(addr, size);
+  }
+
+  erase_queue[erase_queue_len].addr = addr;
+  erase_queue[erase_queue_len].size = size;
+  erase_queue_len++;
+
+  chMtxUnlock();
+
+  chBSemSignal(&erase_sem);
+
+  return 0;
+}
+
+void
+xflash_get_erase_stats(xflash_erase_stats_t* stats)
+{
+  chMtxLock(&xflash_mutex);
+  *stats = erase_stats;
+  stats->queue_len = erase_queue_len;
+  chMtxUnlock();
+}
+
+#if CH_USE_DYNAMIC
+/* Works through the erase queue a sector at a time. This runs at low
+ * priority and drops the lock between sectors, so anyone blocked by an
+ * erase gets the flash before the next sector is started.
+ *
+ * The part has no erase suspend, so a read arriving mid-sector still waits
+ * for that sector to finish. A sector takes around half a second, compared
+ * to many seconds for a large range erased inline.
+ *
+ * When there is nothing to erase and the part has not been used for the
+ * idle timeout, it is put into deep power-down. The next operation wakes it.
+ */
+static msg_t
+xflash_thread_func(void* arg)
+{
+  (void)arg;
+
+  chRegSetThreadName("xflash");
+
+  while (1) {
+    chMtxLock(&xflash_mutex);
+    systime_t timeout = (idle_timeout_ms > 0) ? MS2ST(idle_timeout_ms) : TIME_INFINITE;
+    chMtxUnlock();
+
+    if (chBSemWaitTimeout(&erase_sem, timeout) == RDY_TIMEOUT) {
+      chMtxLock(&xflash_mutex);
+      if (!powered_down &&
+          (erase_queue_len == 0) &&
+          ((chTimeNow() - last_access) >= timeout))
+        power_down();
+      chMtxUnlock();
+      continue;
+    }
+
+    while (1) {
+      chMtxLock(&xflash_mutex);
+
+      if (erase_queue_len == 0) {
+        chMtxUnlock();
         break;
       }
+
+      wake();
+      erase_queue_step();
+
+      chMtxUnlock();
     }
+  }
 
-    if (!erased)
-      break;
+  return 0;
+}
+#endif
+
+/* Erases the next sector of the request at the head of the queue. Must be
+ * called with xflash_mutex held, the part awake and the queue not empty.
+ */
+static void
+erase_queue_step()
+{
+  erase_req_t* req = &erase_queue[0];
+  uint8_t cmd;
+  uint32_t step = erase_step(req->addr, req->size, &cmd);
+
+  if (erase(cmd, req->addr) != 0) {
+    printf("background erase failed 0x%08x\r\n", (unsigned int)req->addr);
+    erase_stats.errors++;
+  }
+  else {
+    erase_stats.sectors_erased++;
+  }
+
+  req->addr += step;
+  req->size -= step;
+  if (req->size == 0) {
+    erase_queue_len--;
+    memmove(&erase_queue[0], &erase_queue[1], erase_queue_len * sizeof(erase_req_t));
+  }
+}
+
+bool
+xflash_is_erased(uint32_t addr, uint32_t len)
+{
+  return xflash_read_stream(addr, len, check_erased, NULL);
+}
 
-    addr += read_len;
-    len -= read_len;
+static bool
+check_erased(const uint8_t* data, uint32_t len, void* arg)
+{
+  (void)arg;
+
+  /* Check a word at a time where the buffer allows it */
+  while (len >= 4 && (((uint32_t)data & 3) == 0)) {
+    if (*(const uint32_t*)data != 0xFFFFFFFF)
+      return false;
+    data += 4;
+    len -= 4;
   }
 
-  free(buf);
+  while (len-- > 0) {
+    if (*data++ != 0xFF)
+      return false;
+  }
 
-  return erased;
+  return true;
 }
 
 static int
@@ -237,6 +705,8 @@ page_program(uint32_t addr, const uint8_t* buf, uint32_t buf_len)
 
   send_cmd(CMD_PP, addr, buf, buf_len, NULL, 0);
 
+  cache_invalidate(addr, buf_len);
+
   while (1) {
     uint8_t sr = read_status_reg();
     if (sr & SR_P_ERR) {
@@ -260,7 +730,7 @@ xflash_write(uint32_t addr, const uint8_t* buf, uint32_t buf_len)
   data_to_write = MIN(data_to_write, buf_len);
 
   while (buf_len != 0) {
-    chMtxLock(&xflash_mutex);
+    lock_range(addr, data_to_write);
     int ret = page_program(addr, buf, data_to_write);
     chMtxUnlock();
 
@@ -278,30 +748,173 @@ xflash_write(uint32_t addr, const uint8_t* buf, uint32_t buf_len)
 
 void
 xflash_read(uint32_t addr, uint8_t* buf, uint32_t buf_len)
+{
+  lock_range(addr, buf_len);
+
+  /* Small reads are mostly headers and lengths that get read again soon, so
+   * they go through the cache. Bulk reads would only flush it.
+   */
+  if (buf_len <= XFLASH_PAGE_SIZE)
+    cache_read(addr, buf, buf_len);
+  else
+    send_cmd(CMD_READ, addr, NULL, 0, buf, buf_len);
+
+  chMtxUnlock();
+}
+
+static void
+cache_read(uint32_t addr, uint8_t* buf, uint32_t len)
+{
+#if XFLASH_CACHE_PAGES > 0
+  while (len > 0) {
+    uint32_t page_addr = addr & ~(XFLASH_PAGE_SIZE - 1);
+    uint32_t page_offset = addr - page_addr;
+    uint32_t copy_len = MIN(len, XFLASH_PAGE_SIZE - page_offset);
+    cache_page_t* page = NULL;
+    cache_page_t* lru = &cache_pages[0];
+    int i;
+
+    for (i = 0; i < XFLASH_CACHE_PAGES; ++i) {
+      cache_page_t* p = &cache_pages[i];
+      if (p->valid && p->page_addr == page_addr) {
+        page = p;
+        break;
+      }
+
+      if (!p->valid || (lru->valid && p->last_used < lru->last_used))
+        lru = p;
+    }
+
+    if (page != NULL) {
+      cache_stats.hits++;
+    }
+    else {
+      cache_stats.misses++;
+      page = lru;
+      page->valid = false;
+      send_cmd(CMD_READ, page_addr, NULL, 0, page->data, XFLASH_PAGE_SIZE);
+      page->page_addr = page_addr;
+      page->valid = true;
+    }
+    page->last_used = ++cache_tick;
+
+    memcpy(buf, page->data + page_offset, copy_len);
+
+    addr += copy_len;
+    buf += copy_len;
+    len -= copy_len;
+  }
+#else
+  send_cmd(CMD_READ, addr, NULL, 0, buf, len);
+#endif
+}
+
+/* Must be called with xflash_mutex held, after the flash has been changed */
+static void
+cache_invalidate(uint32_t addr, uint32_t len)
+{
+#if XFLASH_CACHE_PAGES > 0
+  int i;
+
+  for (i = 0; i < XFLASH_CACHE_PAGES; ++i) {
+    cache_page_t* p = &cache_pages[i];
+    if (p->valid &&
+        (p->page_addr < (addr + len)) &&
+        (addr < (p->page_addr + XFLASH_PAGE_SIZE)))
+      p->valid = false;
+  }
+#else
+  (void)addr;
+  (void)len;
+#endif
+}
+
+void
+xflash_get_cache_stats(xflash_cache_stats_t* stats)
 {
   chMtxLock(&xflash_mutex);
-  send_cmd(CMD_READ, addr, NULL, 0, buf, buf_len);
+  *stats = cache_stats;
   chMtxUnlock();
 }
 
-uint32_t
-xflash_crc(uint32_t addr, uint32_t size)
+bool
+xflash_read_stream(uint32_t addr, uint32_t len, xflash_read_cb_t cb, void* arg)
 {
-  uint8_t* buf = calloc(1, 256);
-  uint32_t crc = 0xFFFFFFFF;
+  bool ret = true;
+
+  while (ret && len > 0) {
+    uint32_t seg_len = MIN(len, STREAM_SEGMENT_SIZE);
+
+    ret = read_stream_segment(addr, seg_len, cb, arg);
+
+    addr += seg_len;
+    len -= seg_len;
+  }
 
-  while (size > 0) {
-    uint32_t nrecv = MIN(size, 256);
+  return ret;
+}
+
+/* Reads one segment in a single transaction. While the callback works on one
+ * buffer, DMA fills the other.
+ */
+static bool
+read_stream_segment(uint32_t addr, uint32_t len,
+    xflash_read_cb_t cb, void* arg)
+{
+  uint8_t* cur_buf = stream_bufs;
+  uint8_t* next_buf = stream_bufs + STREAM_CHUNK_SIZE;
+  uint32_t cur_len = MIN(len, STREAM_CHUNK_SIZE);
+  bool ret = true;
+
+  lock_range(addr, len);
+  xflash_txn_begin();
+
+  send_cmd_hdr(CMD_READ, addr);
+  spiReceive(SPI_FLASH, cur_len, cur_buf);
+  len -= cur_len;
+
+  while (1) {
+    uint32_t next_len = MIN(len, STREAM_CHUNK_SIZE);
+    uint8_t* tmp;
 
-    xflash_read(addr, buf, nrecv);
+    if (next_len > 0)
+      spiStartReceive(SPI_FLASH, next_len, next_buf);
 
-    crc = crc32_block(crc, buf, nrecv);
+    ret = cb(cur_buf, cur_len, arg);
 
-    addr += nrecv;
-    size -= nrecv;
+    if (next_len > 0)
+      wait_for_receive();
+
+    if (!ret || next_len == 0)
+      break;
+
+    len -= next_len;
+    cur_len = next_len;
+    tmp = cur_buf;
+    cur_buf = next_buf;
+    next_buf = tmp;
   }
 
-  free(buf);
+  xflash_txn_end();
+  chMtxUnlock();
+
+  return ret;
+}
+
+uint32_t
+xflash_crc(uint32_t addr, uint32_t size)
+{
+  uint32_t crc = 0xFFFFFFFF;
+
+  xflash_read_stream(addr, size, accumulate_crc, &crc);
 
   return crc;
 }
+
+static bool
+accumulate_crc(const uint8_t* data, uint32_t len, void* arg)
+{
+  uint32_t* crc = arg;
+  *crc = crc32_block(*crc, (void*)data, len);
+  return true;
+}
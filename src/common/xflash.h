@@ -2,19 +2,78 @@
 #ifndef XFLASH_H
 #define XFLASH_H
 
+#include <stdint.h>
 #include <stdbool.h>
 
 
-#define XFLASH_SECTOR_SIZE      0x10000 // 64K
-#define XFLASH_PAGE_SIZE        0x100   // 256
+#define XFLASH_SIZE              0x400000 // 4M
+#define XFLASH_SECTOR_SIZE       0x10000  // 64K
+#define XFLASH_PARAM_SECTOR_SIZE 0x1000   // 4K
+#define XFLASH_PAGE_SIZE         0x100    // 256
 
+/* Number of pages kept in the read cache. Set to 0 to disable it. */
+#ifndef XFLASH_CACHE_PAGES
+#define XFLASH_CACHE_PAGES       8
+#endif
+
+/* Idle time before the part is put into deep power-down. 0 disables it. */
+#ifndef XFLASH_IDLE_TIMEOUT_MS
+#define XFLASH_IDLE_TIMEOUT_MS   5000
+#endif
+
+
+/* Called with each chunk of a streaming read. Return false to stop the read.
+ * The flash is locked while this runs, so it must not call back into xflash.
+ */
+typedef bool (*xflash_read_cb_t)(const uint8_t* data, uint32_t len, void* arg);
+
+typedef struct {
+  uint32_t sectors_erased;
+  uint32_t errors;
+  uint32_t queue_len;
+
+  /* Operations that had to wait for an erase to finish */
+  uint32_t blocked_count;
+  uint32_t blocked_total_ms;
+  uint32_t blocked_max_ms;
+} xflash_erase_stats_t;
+
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+} xflash_cache_stats_t;
+
+typedef struct {
+  uint32_t power_downs;
+  uint32_t wakes;
+  uint32_t wake_total_us;
+  uint32_t wake_max_us;
+} xflash_power_stats_t;
 
 void
 xflash_init(void);
 
+void
+xflash_start_thread(void);
+
+void
+xflash_set_idle_timeout(uint32_t timeout_ms);
+
+void
+xflash_get_power_stats(xflash_power_stats_t* stats);
+
+uint32_t
+xflash_erase_size(uint32_t addr);
+
 int
 xflash_erase(uint32_t addr, uint32_t size);
 
+int
+xflash_erase_async(uint32_t addr, uint32_t size);
+
+void
+xflash_get_erase_stats(xflash_erase_stats_t* stats);
+
 bool
 xflash_is_erased(uint32_t addr, uint32_t len);
 
@@ -24,6 +83,12 @@ xflash_write(uint32_t addr, const uint8_t* buf, uint32_t buf_len);
 void
 xflash_read(uint32_t addr, uint8_t* buf, uint32_t buf_len);
 
+void
+xflash_get_cache_stats(xflash_cache_stats_t* stats);
+
+bool
+xflash_read_stream(uint32_t addr, uint32_t len, xflash_read_cb_t cb, void* arg);
+
 uint32_t
 xflash_crc(uint32_t addr, uint32_t size);
 
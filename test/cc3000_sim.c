@@ -0,0 +1,378 @@
+#include "cc3000_sim.h"
+#include "ch.h"
+#include "hal.h"
+
+#include <string.h>
+#include <time.h>
+
+
+#define SPI_HEADER_SIZE 5
+#define SPI_READ_OP     3
+#define SPI_READY       2
+
+#define WIFI_IRQ_CHANNEL 12
+
+typedef enum {
+  XFER_NONE,
+  XFER_READ,
+  XFER_WRITE
+} xfer_t;
+
+typedef struct {
+  uint16_t len;
+  uint8_t data[SPI_HEADER_SIZE + CC3000_SIM_MAX_PACKET_SIZE];
+} sim_packet_t;
+
+
+SPIDriver SPID2;
+EXTDriver EXTD1;
+
+static sim_packet_t packets[CC3000_SIM_MAX_PACKETS];
+static uint32_t head;
+static uint32_t num_queued;
+
+static sim_packet_t last_write;
+static uint32_t num_writes;
+
+static bool irq;
+static bool irq_enabled;
+static bool powered;
+static xfer_t xfer;
+static uint32_t xfer_pos;
+static uint32_t bytes_clocked;
+static halrtcnt_t counter;
+
+static tfunc_t io_thread_fn;
+static void* io_thread_arg;
+static bool io_thread_terminate;
+static bool io_thread_running;
+
+
+void
+cc3000_sim_reset()
+{
+  head = 0;
+  num_queued = 0;
+  num_writes = 0;
+  last_write.len = 0;
+  bytes_clocked = 0;
+}
+
+bool
+cc3000_sim_queue(const uint8_t* payload, uint16_t len)
+{
+  sim_packet_t* p;
+
+  if (num_queued == CC3000_SIM_MAX_PACKETS || len > CC3000_SIM_MAX_PACKET_SIZE)
+    return false;
+
+  p = &packets[(head + num_queued++) % CC3000_SIM_MAX_PACKETS];
+  p->len = SPI_HEADER_SIZE + len;
+  p->data[0] = SPI_READY;
+  p->data[1] = 0;
+  p->data[2] = 0;
+  p->data[3] = len >> 8;
+  p->data[4] = len & 0xFF;
+  memcpy(p->data + SPI_HEADER_SIZE, payload, len);
+
+  return true;
+}
+
+uint32_t
+cc3000_sim_num_queued()
+{
+  return num_queued;
+}
+
+const uint8_t*
+cc3000_sim_last_write(uint16_t* len)
+{
+  *len = last_write.len;
+  return last_write.data;
+}
+
+uint32_t
+cc3000_sim_num_writes()
+{
+  return num_writes;
+}
+
+uint32_t
+cc3000_sim_bytes_clocked()
+{
+  return bytes_clocked;
+}
+
+double
+cc3000_sim_seconds()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + (now.tv_nsec * 1e-9);
+}
+
+/* IRQ is active low, so asserting it is the falling edge the driver
+ * listens for.
+ */
+static void
+assert_irq()
+{
+  if (irq)
+    return;
+
+  irq = true;
+  if (irq_enabled && EXTD1.config->channels[WIFI_IRQ_CHANNEL].cb != NULL)
+    EXTD1.config->channels[WIFI_IRQ_CHANNEL].cb(&EXTD1, WIFI_IRQ_CHANNEL);
+}
+
+static void
+run_io_thread()
+{
+  /* A write from inside the thread is handled by the running thread */
+  if (io_thread_running || io_thread_fn == NULL)
+    return;
+
+  io_thread_terminate = false;
+  io_thread_running = true;
+  io_thread_fn(io_thread_arg);
+  io_thread_running = false;
+}
+
+void
+cc3000_sim_run()
+{
+  run_io_thread();
+}
+
+/* Nothing else can signal a semaphore while the only thread waits on it,
+ * so a wait is where the device gets to act. It raises IRQ for the next
+ * queued packet or, once it has nothing left, asks the thread to stop.
+ */
+static msg_t
+sem_wait(Semaphore* sp)
+{
+  if (sp->cnt == 0 && num_queued > 0 && xfer == XFER_NONE)
+    assert_irq();
+
+  if (sp->cnt == 0) {
+    io_thread_terminate = true;
+    return RDY_OK;
+  }
+
+  sp->cnt--;
+  return RDY_OK;
+}
+
+msg_t
+chSemWait(Semaphore* sp)
+{
+  return sem_wait(sp);
+}
+
+msg_t
+chSemWaitTimeout(Semaphore* sp, systime_t time)
+{
+  (void)time;
+
+  return sem_wait(sp);
+}
+
+msg_t
+chSemSignalWait(Semaphore* sps, Semaphore* spw)
+{
+  chSemSignal(sps);
+  run_io_thread();
+  return sem_wait(spw);
+}
+
+Thread*
+chThdCreateFromHeap(void* heapp, size_t size, int prio, tfunc_t pf, void* arg)
+{
+  (void)heapp;
+  (void)size;
+  (void)prio;
+
+  io_thread_fn = pf;
+  io_thread_arg = arg;
+  return (Thread*)&io_thread_fn;
+}
+
+void
+chThdTerminate(Thread* tp)
+{
+  (void)tp;
+
+  io_thread_terminate = true;
+}
+
+msg_t
+chThdWait(Thread* tp)
+{
+  (void)tp;
+
+  io_thread_fn = NULL;
+  return 0;
+}
+
+bool
+chThdShouldTerminate()
+{
+  return io_thread_terminate;
+}
+
+void
+spiStart(SPIDriver* spip, const SPIConfig* config)
+{
+  spip->config = config;
+}
+
+/* With IRQ up the host is reading the packet the device offered. With IRQ
+ * released it wants to write, and the device answers by asserting IRQ.
+ */
+void
+spiSelect(SPIDriver* spip)
+{
+  (void)spip;
+
+  xfer_pos = 0;
+  if (irq && num_queued > 0) {
+    xfer = XFER_READ;
+  }
+  else {
+    xfer = XFER_WRITE;
+    last_write.len = 0;
+    assert_irq();
+  }
+}
+
+void
+spiUnselect(SPIDriver* spip)
+{
+  (void)spip;
+
+  if (xfer == XFER_READ) {
+    head = (head + 1) % CC3000_SIM_MAX_PACKETS;
+    num_queued--;
+  }
+  else if (xfer == XFER_WRITE && last_write.len > 0) {
+    num_writes++;
+  }
+
+  xfer = XFER_NONE;
+  irq = false;
+}
+
+static void
+clock_out(uint8_t* rxbuf, size_t n)
+{
+  const sim_packet_t* p = &packets[head];
+  size_t i;
+
+  for (i = 0; i < n; ++i, ++xfer_pos) {
+    uint8_t b = (xfer == XFER_READ && xfer_pos < p->len) ? p->data[xfer_pos] : 0;
+    if (rxbuf != NULL)
+      rxbuf[i] = b;
+  }
+  bytes_clocked += n;
+}
+
+void
+spiExchange(SPIDriver* spip, size_t n, const void* txbuf, void* rxbuf)
+{
+  (void)spip;
+
+  /* Only a read header is ever exchanged */
+  if (xfer != XFER_READ || ((const uint8_t*)txbuf)[0] != SPI_READ_OP) {
+    memset(rxbuf, 0, n);
+    return;
+  }
+
+  clock_out(rxbuf, n);
+}
+
+void
+spiReceive(SPIDriver* spip, size_t n, void* rxbuf)
+{
+  (void)spip;
+
+  clock_out(rxbuf, n);
+}
+
+void
+spiIgnore(SPIDriver* spip, size_t n)
+{
+  (void)spip;
+
+  clock_out(NULL, n);
+}
+
+void
+spiSend(SPIDriver* spip, size_t n, const void* txbuf)
+{
+  (void)spip;
+
+  if (last_write.len + n <= sizeof(last_write.data)) {
+    memcpy(last_write.data + last_write.len, txbuf, n);
+    last_write.len += n;
+  }
+  bytes_clocked += n;
+}
+
+void
+extStart(EXTDriver* extp, const EXTConfig* config)
+{
+  extp->config = config;
+  extp->state = EXT_ACTIVE;
+}
+
+void
+extChannelEnable(EXTDriver* extp, expchannel_t channel)
+{
+  (void)extp;
+
+  if (channel == WIFI_IRQ_CHANNEL)
+    irq_enabled = true;
+}
+
+void
+extChannelDisable(EXTDriver* extp, expchannel_t channel)
+{
+  (void)extp;
+
+  if (channel == WIFI_IRQ_CHANNEL)
+    irq_enabled = false;
+}
+
+uint8_t
+palReadPad(ioportid_t port, uint16_t pad)
+{
+  if (port == PORT_WIFI_IRQ && pad == PAD_WIFI_IRQ)
+    return irq ? 0 : 1;
+  return 0;
+}
+
+/* Powering up the CC3000 asserts IRQ until the host's first write */
+void
+palSetPad(ioportid_t port, uint16_t pad)
+{
+  if (port == PORT_WIFI_EN && pad == PAD_WIFI_EN && !powered) {
+    powered = true;
+    assert_irq();
+  }
+}
+
+void
+palClearPad(ioportid_t port, uint16_t pad)
+{
+  if (port == PORT_WIFI_EN && pad == PAD_WIFI_EN) {
+    powered = false;
+    irq = false;
+  }
+}
+
+halrtcnt_t
+halGetCounterValue()
+{
+  return counter++;
+}
@@ -0,0 +1,46 @@
+/* Simulated CC3000 on the other end of the SPI link. It raises IRQ when it
+ * has a packet queued, streams the packet out when the host selects it and
+ * accepts writes the way the real part does. The driver's I/O thread is run
+ * in place until the device has nothing left to send.
+ */
+#ifndef CC3000_SIM_H
+#define CC3000_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define CC3000_SIM_MAX_PACKETS     64
+#define CC3000_SIM_MAX_PACKET_SIZE 2048
+
+
+/* Drops queued packets and writes. The driver state is left alone. */
+void
+cc3000_sim_reset(void);
+
+/* Queues an HCI packet for the host to read. The SPI header is added. */
+bool
+cc3000_sim_queue(const uint8_t* payload, uint16_t len);
+
+uint32_t
+cc3000_sim_num_queued(void);
+
+/* Runs the driver's I/O thread until every queued packet has been read */
+void
+cc3000_sim_run(void);
+
+/* The last packet written by the host, SPI header included */
+const uint8_t*
+cc3000_sim_last_write(uint16_t* len);
+
+uint32_t
+cc3000_sim_num_writes(void);
+
+/* Bytes clocked over the link in either direction */
+uint32_t
+cc3000_sim_bytes_clocked(void);
+
+double
+cc3000_sim_seconds(void);
+
+#endif
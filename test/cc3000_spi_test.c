@@ -0,0 +1,336 @@
+/* Runs the CC3000 SPI driver against a simulated CC3000. Checks that events
+ * and data are delivered intact, that socket data goes straight into the
+ * reader's buffer without passing through wlan_rx_buffer, and measures how
+ * many packets and bytes per second the read path can move.
+ */
+#include "test.h"
+#include "cc3000_sim.h"
+#include "hci.h"
+
+#include <string.h>
+
+
+#define RECV_ARGS_SIZE  24
+#define MEASURE_PACKETS 20000
+
+/* SPI2 runs at PCLK1/2 on the controller board */
+#define SPI_CLOCK_HZ    15000000
+
+#define SENTINEL 0xA5
+
+
+extern uint8_t wlan_rx_buffer[CC3000_RX_BUFFER_SIZE];
+
+/* Stands in for the HCI layer, with one reader that may be waiting for
+ * socket data. The arguments have to be in by the time it is asked where the
+ * data goes, since they name the socket.
+ */
+static uint8_t reader_buf[CC3000_RX_BUFFER_SIZE];
+static bool reader_waiting;
+
+static uint8_t expected[CC3000_RX_BUFFER_SIZE];
+static uint16_t expected_len;
+
+static uint32_t num_dispatched;
+static uint32_t num_direct;
+static uint32_t num_bad;
+static bool check_rx_buffer;
+
+
+uint8_t*
+hci_get_rx_data_dest(const uint8_t* hdr, uint16_t payload_size, uint16_t* data_len)
+{
+  uint8_t arg_size = hdr[HCI_PACKET_ARGSIZE_OFFSET];
+  uint16_t pkt_length = hdr[HCI_PACKET_LENGTH_OFFSET] | (hdr[HCI_PACKET_LENGTH_OFFSET + 1] << 8);
+
+  if (memcmp(hdr + HCI_DATA_HEADER_SIZE, expected + HCI_DATA_HEADER_SIZE, arg_size) != 0)
+    num_bad++;
+
+  if (!reader_waiting ||
+      (pkt_length <= arg_size) ||
+      (pkt_length + HCI_DATA_HEADER_SIZE > payload_size))
+    return NULL;
+
+  reader_waiting = false;
+  num_direct++;
+  *data_len = pkt_length - arg_size;
+  return reader_buf;
+}
+
+void
+hci_dispatch_packet(uint8_t* buffer, uint16_t buffer_size)
+{
+  uint8_t arg_size = buffer[HCI_PACKET_ARGSIZE_OFFSET];
+  uint16_t hdr_len = HCI_DATA_HEADER_SIZE + arg_size;
+  bool ok;
+
+  num_dispatched++;
+
+  /* Reads are padded out to an odd length */
+  ok = (buffer_size == (expected_len | 1));
+
+  if (buffer[0] == HCI_TYPE_DATA && num_direct > 0 && !reader_waiting) {
+    ok = ok && (memcmp(buffer, expected, hdr_len) == 0) &&
+        (memcmp(reader_buf, expected + hdr_len, expected_len - hdr_len) == 0);
+
+    /* Nothing past the arguments should have been written to the buffer */
+    if (check_rx_buffer)
+      ok = ok && (wlan_rx_buffer[SPI_HEADER_SIZE + hdr_len] == SENTINEL) &&
+          (wlan_rx_buffer[CC3000_RX_BUFFER_SIZE - 1] == SENTINEL);
+  }
+  else {
+    ok = ok && (memcmp(buffer, expected, expected_len) == 0);
+  }
+
+  if (!ok)
+    num_bad++;
+}
+
+static uint16_t
+make_event(uint8_t* pkt, uint16_t opcode, uint8_t args_len, uint8_t seed)
+{
+  uint16_t i;
+
+  pkt[0] = HCI_TYPE_EVNT;
+  pkt[1] = opcode & 0xFF;
+  pkt[2] = opcode >> 8;
+  pkt[3] = args_len;
+  pkt[4] = 0;
+  for (i = 0; i < args_len; ++i)
+    pkt[HCI_EVENT_HEADER_SIZE + i] = seed + i;
+
+  return HCI_EVENT_HEADER_SIZE + args_len;
+}
+
+static uint16_t
+make_data(uint8_t* pkt, uint16_t data_len, uint8_t seed)
+{
+  uint16_t pkt_length = RECV_ARGS_SIZE + data_len;
+  uint16_t i;
+
+  pkt[0] = HCI_TYPE_DATA;
+  pkt[1] = HCI_DATA_RECV;
+  pkt[2] = RECV_ARGS_SIZE;
+  pkt[3] = pkt_length & 0xFF;
+  pkt[4] = pkt_length >> 8;
+  for (i = 0; i < pkt_length; ++i)
+    pkt[HCI_DATA_HEADER_SIZE + i] = (uint8_t)(seed * 7 + i);
+
+  return HCI_DATA_HEADER_SIZE + pkt_length;
+}
+
+/* Hands one packet to the driver and lets it read it */
+static void
+deliver(uint16_t len)
+{
+  expected_len = len;
+  num_direct = 0;
+  CHECK(cc3000_sim_queue(expected, len));
+  cc3000_sim_run();
+  CHECK(cc3000_sim_num_queued() == 0);
+}
+
+static void
+start(void)
+{
+  uint16_t len;
+  const uint8_t* w;
+  uint8_t* cmd = spi_get_buffer();
+
+  cc3000_sim_reset();
+  spi_open();
+
+  /* The first write goes out as soon as the CC3000 has powered up */
+  memset(cmd, 0x11, 5);
+  spi_write(5);
+
+  w = cc3000_sim_last_write(&len);
+  CHECK(cc3000_sim_num_writes() == 1);
+  CHECK(len == SPI_HEADER_SIZE + 5);
+  CHECK(w[0] == 1 && w[1] == 0 && w[2] == 5);
+}
+
+static void
+test_events(void)
+{
+  spi_stats_t before, after;
+  uint8_t args_len;
+
+  spi_get_stats(&before);
+  num_dispatched = 0;
+  num_bad = 0;
+
+  /* Both parities, and sizes either side of what comes in with the header */
+  for (args_len = 0; args_len < 40; ++args_len) {
+    deliver(make_event(expected, HCI_EVNT_RECV, args_len, args_len));
+  }
+
+  spi_get_stats(&after);
+  CHECK(num_dispatched == 40);
+  CHECK(num_bad == 0);
+  CHECK(after.rx_packets - before.rx_packets == 40);
+  CHECK(after.rx_direct_bytes == before.rx_direct_bytes);
+}
+
+static void
+test_direct_data(void)
+{
+  static const uint16_t sizes[] = { 1, 2, 3, 100, 511, 512, 1024, 1400, 1468 };
+  spi_stats_t before, after;
+  uint32_t direct_bytes = 0;
+  uint32_t i;
+
+  spi_get_stats(&before);
+  num_dispatched = 0;
+  num_bad = 0;
+  check_rx_buffer = true;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    memset(wlan_rx_buffer, SENTINEL, sizeof(wlan_rx_buffer));
+    memset(reader_buf, 0, sizeof(reader_buf));
+    reader_waiting = true;
+
+    deliver(make_data(expected, sizes[i], i));
+
+    CHECK(!reader_waiting);
+    direct_bytes += sizes[i];
+  }
+
+  check_rx_buffer = false;
+  spi_get_stats(&after);
+  CHECK(num_dispatched == i);
+  CHECK(num_bad == 0);
+  CHECK(after.rx_direct_bytes - before.rx_direct_bytes == direct_bytes);
+}
+
+/* Data nobody has asked for yet still comes through the SPI buffer */
+static void
+test_unclaimed_data(void)
+{
+  spi_stats_t before, after;
+
+  spi_get_stats(&before);
+  num_dispatched = 0;
+  num_bad = 0;
+  reader_waiting = false;
+
+  deliver(make_data(expected, 300, 3));
+
+  spi_get_stats(&after);
+  CHECK(num_dispatched == 1);
+  CHECK(num_bad == 0);
+  CHECK(after.rx_direct_bytes == before.rx_direct_bytes);
+}
+
+/* A packet too big for the buffer is clocked out and dropped, and the link
+ * stays in step for the next one.
+ */
+static void
+test_oversized(void)
+{
+  static uint8_t big[CC3000_RX_BUFFER_SIZE + 100];
+  spi_stats_t before, after;
+
+  spi_get_stats(&before);
+  num_dispatched = 0;
+  num_bad = 0;
+  reader_waiting = false;
+
+  memset(big, 0x5A, sizeof(big));
+  big[0] = HCI_TYPE_EVNT;
+  CHECK(cc3000_sim_queue(big, sizeof(big)));
+  cc3000_sim_run();
+  CHECK(num_dispatched == 0);
+
+  deliver(make_event(expected, HCI_EVNT_RECV, 8, 1));
+
+  spi_get_stats(&after);
+  CHECK(num_dispatched == 1);
+  CHECK(num_bad == 0);
+  CHECK(after.rx_packets - before.rx_packets == 2);
+}
+
+static void
+test_write(void)
+{
+  uint8_t* cmd = spi_get_buffer();
+  const uint8_t* w;
+  uint16_t len;
+  uint32_t writes = cc3000_sim_num_writes();
+  uint16_t i;
+
+  for (i = 0; i < 200; ++i)
+    cmd[i] = i;
+  spi_write(200);
+
+  w = cc3000_sim_last_write(&len);
+  CHECK(cc3000_sim_num_writes() == writes + 1);
+  /* Even lengths are padded to odd */
+  CHECK(len == SPI_HEADER_SIZE + 201);
+  CHECK(w[0] == 1 && w[1] == 0 && w[2] == 201);
+  CHECK(memcmp(w + SPI_HEADER_SIZE, cmd, 200) == 0);
+}
+
+/* Streams socket reads through the driver. The host rate is the driver's
+ * own cost per packet. The SPI clock puts a ceiling on the device.
+ */
+static void
+measure(uint16_t data_len)
+{
+  spi_stats_t before, after;
+  double start, host_secs, wire_secs;
+  uint32_t clocked;
+  uint32_t bytes;
+  uint16_t len;
+  uint32_t i;
+
+  len = make_data(expected, data_len, 9);
+  expected_len = len;
+  num_bad = 0;
+
+  spi_get_stats(&before);
+  clocked = cc3000_sim_bytes_clocked();
+  host_secs = 0;
+
+  for (i = 0; i < MEASURE_PACKETS; ++i) {
+    CHECK(cc3000_sim_queue(expected, len));
+    reader_waiting = true;
+    num_direct = 0;
+
+    start = cc3000_sim_seconds();
+    cc3000_sim_run();
+    host_secs += cc3000_sim_seconds() - start;
+  }
+
+  spi_get_stats(&after);
+  CHECK(num_bad == 0);
+  CHECK(after.rx_packets - before.rx_packets == MEASURE_PACKETS);
+
+  bytes = after.rx_bytes - before.rx_bytes;
+  wire_secs = (cc3000_sim_bytes_clocked() - clocked) * 8.0 / SPI_CLOCK_HZ;
+
+  printf("  %4u byte reads on host: %.0f packets/s, %.1f MB/s (SPI clock limit %.0f packets/s, %.0f KB/s)\n",
+      data_len,
+      MEASURE_PACKETS / host_secs, bytes / host_secs / 1e6,
+      MEASURE_PACKETS / wire_secs, bytes / wire_secs / 1e3);
+}
+
+int
+main(void)
+{
+  start();
+
+  test_events();
+  test_direct_data();
+  test_unclaimed_data();
+  test_oversized();
+  test_write();
+
+  measure(64);
+  measure(512);
+  measure(1468);
+
+  spi_close();
+
+  return test_result("cc3000_spi_test");
+}
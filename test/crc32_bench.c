@@ -0,0 +1,127 @@
+/* Checks crc32_block() against a bitwise reference across chunk sizes and
+ * alignments, then measures its throughput. The Makefile builds it with and
+ * without slicing-by-4 so the two loops can be compared.
+ */
+#include "test.h"
+#include "crc/crc32.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+
+#if CRC32_SLICE_BY_4
+#define VARIANT "slice-by-4"
+#else
+#define VARIANT "bytewise"
+#endif
+
+#define BUF_SIZE     4096
+#define BENCH_SIZE   (64 * 1024)
+#define BENCH_ROUNDS 2000
+
+
+static uint8_t buf[BUF_SIZE + 4];
+static uint8_t bench_buf[BENCH_SIZE];
+
+
+static uint32_t
+crc_reference(uint32_t crc, const uint8_t* p, uint32_t len)
+{
+  int i;
+
+  while (len-- > 0) {
+    crc ^= *p++;
+    for (i = 0; i < 8; ++i)
+      crc = (crc & 1) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+  }
+
+  return crc;
+}
+
+static void
+fill(uint8_t* p, uint32_t len, uint32_t seed)
+{
+  while (len-- > 0) {
+    seed = (seed * 1103515245) + 12345;
+    *p++ = seed >> 16;
+  }
+}
+
+static void
+test_check_value(void)
+{
+  const char digits[] = "123456789";
+
+  CHECK((crc32_block(0xFFFFFFFF, (void*)digits, 9) ^ 0xFFFFFFFF) == 0xCBF43926);
+  CHECK(crc32_block(0x12345678, buf, 0) == 0x12345678);
+}
+
+static void
+test_chunks(void)
+{
+  static const uint32_t chunk_sizes[] = { 1, 2, 3, 4, 5, 7, 8, 13, 64, 255, 512, BUF_SIZE };
+  uint32_t align;
+  uint32_t i;
+
+  fill(buf, sizeof(buf), 1);
+
+  for (align = 0; align < 4; ++align) {
+    uint8_t* data = buf + align;
+    uint32_t expected = crc_reference(0xFFFFFFFF, data, BUF_SIZE);
+
+    CHECK(crc32_block(0xFFFFFFFF, data, BUF_SIZE) == expected);
+
+    /* Later chunks start from a running value and at odd alignments */
+    for (i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++i) {
+      uint32_t crc = 0xFFFFFFFF;
+      uint32_t pos = 0;
+
+      while (pos < BUF_SIZE) {
+        uint32_t len = chunk_sizes[i];
+        if (len > BUF_SIZE - pos)
+          len = BUF_SIZE - pos;
+
+        crc = crc32_block(crc, data + pos, len);
+        pos += len;
+      }
+
+      CHECK(crc == expected);
+    }
+
+    /* Seeds other than 0xFFFFFFFF, as used by the app config records */
+    CHECK(crc32_block(0, data, 1000) == crc_reference(0, data, 1000));
+  }
+}
+
+static void
+bench(void)
+{
+  struct timespec start;
+  struct timespec end;
+  uint32_t crc = 0xFFFFFFFF;
+  int i;
+
+  fill(bench_buf, sizeof(bench_buf), 2);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < BENCH_ROUNDS; ++i)
+    crc = crc32_block(crc, bench_buf, sizeof(bench_buf));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double secs = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+  double bytes = (double)BENCH_SIZE * BENCH_ROUNDS;
+
+  printf("  %s crc32 on host: %.0f MB/s, %.2f ns/byte (crc %08x)\n",
+      VARIANT, (bytes / secs) / 1e6, (secs * 1e9) / bytes, (unsigned)crc);
+}
+
+int
+main(void)
+{
+  test_check_value();
+  test_chunks();
+  bench();
+
+  return test_result("crc32_bench (" VARIANT ")");
+}
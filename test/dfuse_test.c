@@ -0,0 +1,265 @@
+/* Builds images with scripts/dfu.py, both plain and compressed, and applies
+ * them with the firmware's DfuSe parser to check that the decoder gives back
+ * exactly what the script was handed.
+ */
+#include "test.h"
+#include "sxfs_sim.h"
+#include "dfuse.h"
+#include "iflash.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#ifndef DFU_PY
+#define DFU_PY "python ../scripts/dfu.py"
+#endif
+
+#ifndef BUILD_DIR
+#define BUILD_DIR "."
+#endif
+
+#define FLASH_BASE  0x08000000
+#define FLASH_SIZE  0x100000
+#define APP_START   0x08008000
+#define HDR_SIZE    0x200
+
+typedef enum {
+  FILL_ZERO,
+  FILL_ERASED,
+  FILL_TEXT,
+  FILL_RANDOM,
+  FILL_MIXED
+} fill_t;
+
+
+static uint8_t iflash[FLASH_SIZE];
+static uint8_t hdr[HDR_SIZE];
+static uint8_t app[SXFS_SIM_PART_SIZE];
+static uint8_t dfu[SXFS_SIM_PART_SIZE];
+
+
+/* STM32F2 layout: four 16K sectors, one 64K and then 128K ones */
+uint32_t
+iflash_sector_size(flashsector_t sector)
+{
+  if (sector < 4)
+    return 0x4000;
+  if (sector == 4)
+    return 0x10000;
+  return 0x20000;
+}
+
+uint32_t
+iflash_sector_begin(flashsector_t sector)
+{
+  uint32_t addr = FLASH_BASE;
+
+  while (sector > 0)
+    addr += iflash_sector_size(--sector);
+  return addr;
+}
+
+uint32_t
+iflash_sector_end(flashsector_t sector)
+{
+  return iflash_sector_begin(sector) + iflash_sector_size(sector);
+}
+
+flashsector_t
+iflash_sector_at(uint32_t address)
+{
+  flashsector_t sector = 0;
+
+  while (address >= iflash_sector_end(sector))
+    sector++;
+  return sector;
+}
+
+int
+iflash_sector_erase(flashsector_t sector)
+{
+  memset(&iflash[iflash_sector_begin(sector) - FLASH_BASE], 0xFF, iflash_sector_size(sector));
+  return FLASH_RETURN_SUCCESS;
+}
+
+bool_t
+iflash_is_erased(uint32_t address, uint32_t size)
+{
+  uint32_t i;
+
+  for (i = 0; i < size; ++i) {
+    if (iflash[address - FLASH_BASE + i] != 0xFF)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+bool_t
+iflash_compare(uint32_t address, const uint8_t* buffer, uint32_t size)
+{
+  return memcmp(&iflash[address - FLASH_BASE], buffer, size) == 0;
+}
+
+int
+iflash_write(uint32_t address, const uint8_t* buffer, uint32_t size)
+{
+  uint32_t i;
+
+  for (i = 0; i < size; ++i)
+    iflash[address - FLASH_BASE + i] &= buffer[i];
+  return FLASH_RETURN_SUCCESS;
+}
+
+static void
+fill(uint8_t* data, uint32_t size, fill_t how)
+{
+  static const char text[] = "Controller 1 Setpoint 68.0F Output 2 Heating ";
+  uint32_t i;
+
+  for (i = 0; i < size; ++i) {
+    switch (how) {
+    case FILL_ZERO:   data[i] = 0; break;
+    case FILL_ERASED: data[i] = 0xFF; break;
+    case FILL_TEXT:   data[i] = text[i % (sizeof(text) - 1)]; break;
+    case FILL_RANDOM: data[i] = rand(); break;
+    /* Runs of code-like words broken up by noise, closest to a real image */
+    case FILL_MIXED:  data[i] = ((i / 64) & 1) ? rand() : (uint8_t)(i >> 2); break;
+    }
+  }
+}
+
+static void
+write_file(const char* path, const uint8_t* data, uint32_t size)
+{
+  FILE* f = fopen(path, "wb");
+
+  CHECK(f != NULL);
+  if (f == NULL)
+    return;
+  CHECK(fwrite(data, 1, size, f) == size);
+  fclose(f);
+}
+
+/* Runs dfu.py over the header and app blobs and loads the result into the
+ * update partition. Returns the size of the image.
+ */
+static uint32_t
+build_image(bool compress, uint32_t app_size)
+{
+  char cmd[512];
+  FILE* f;
+  uint32_t size;
+
+  write_file(BUILD_DIR "/dfuse_test_hdr.bin", hdr, sizeof(hdr));
+  write_file(BUILD_DIR "/dfuse_test_app.bin", app, app_size);
+
+  snprintf(cmd, sizeof(cmd),
+      DFU_PY " %s -b 0x%08x:" BUILD_DIR "/dfuse_test_hdr.bin -b 0x%08x:" BUILD_DIR "/dfuse_test_app.bin "
+      BUILD_DIR "/dfuse_test.dfu > /dev/null",
+      compress ? "-z" : "", APP_START, APP_START + HDR_SIZE);
+  CHECK(system(cmd) == 0);
+
+  f = fopen(BUILD_DIR "/dfuse_test.dfu", "rb");
+  CHECK(f != NULL);
+  if (f == NULL)
+    return 0;
+  size = fread(dfu, 1, sizeof(dfu), f);
+  CHECK(size < sizeof(dfu));
+  fclose(f);
+
+  sxfs_sim_reset();
+  CHECK(sxfs_write(SP_UPDATE_IMG, 0, dfu, size));
+
+  return size;
+}
+
+static void
+round_trip(uint32_t app_size, fill_t how)
+{
+  addr_range_t valid_addr_range = {
+      .start = APP_START,
+      .end = FLASH_BASE + FLASH_SIZE - 1
+  };
+  bool compressed;
+  int z;
+
+  fill(hdr, sizeof(hdr), FILL_MIXED);
+  fill(app, app_size, how);
+
+  for (z = 0; z < 2; ++z) {
+    build_image(z, app_size);
+
+    CHECK(dfuse_verify(SP_UPDATE_IMG) == DFU_PARSE_OK);
+    CHECK(dfuse_is_compressed(SP_UPDATE_IMG, &compressed) == DFU_PARSE_OK);
+    CHECK(compressed == z);
+
+    /* Start from whatever the previous round left in flash */
+    CHECK(dfuse_apply_update(SP_UPDATE_IMG, &valid_addr_range) == DFU_PARSE_OK);
+    CHECK(memcmp(&iflash[APP_START - FLASH_BASE], hdr, sizeof(hdr)) == 0);
+    if (memcmp(&iflash[APP_START + HDR_SIZE - FLASH_BASE], app, app_size) != 0) {
+      printf("%s image of %u bytes (fill %d) did not round trip\n",
+          z ? "compressed" : "plain", app_size, how);
+      test_failures++;
+    }
+  }
+}
+
+/* The compressed image is only known from its target prefix, which must be
+ * found before the rest of it has arrived.
+ */
+static void
+test_partial_image(void)
+{
+  uint32_t size;
+  bool compressed;
+
+  fill(hdr, sizeof(hdr), FILL_MIXED);
+  fill(app, 0x8000, FILL_MIXED);
+
+  size = build_image(true, 0x8000);
+  sxfs_sim_reset();
+  CHECK(sxfs_write(SP_UPDATE_IMG, 0, dfu, MIN(size, 1024)));
+
+  CHECK(dfuse_verify(SP_UPDATE_IMG) != DFU_PARSE_OK);
+  CHECK(dfuse_is_compressed(SP_UPDATE_IMG, &compressed) == DFU_PARSE_OK);
+  CHECK(compressed);
+}
+
+static void
+test_corrupt_image(void)
+{
+  uint32_t size;
+
+  fill(hdr, sizeof(hdr), FILL_MIXED);
+  fill(app, 0x4000, FILL_TEXT);
+
+  size = build_image(true, 0x4000);
+  dfu[size / 2] ^= 0x10;
+  sxfs_sim_reset();
+  CHECK(sxfs_write(SP_UPDATE_IMG, 0, dfu, size));
+
+  CHECK(dfuse_verify(SP_UPDATE_IMG) == DFU_INVALID_CRC);
+}
+
+int
+main(void)
+{
+  static const uint32_t sizes[] = { 1, 2, 17, 255, 256, 1023, 1024, 1025, 4099, 0x10000, 0x1C000 };
+  uint32_t i;
+  fill_t how;
+
+  srand(1);
+  memset(iflash, 0xFF, sizeof(iflash));
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    for (how = FILL_ZERO; how <= FILL_MIXED; ++how)
+      round_trip(sizes[i], how);
+  }
+
+  test_partial_image();
+  test_corrupt_image();
+
+  return test_result("dfuse_test");
+}
@@ -0,0 +1,93 @@
+#include "fopdt_plant.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+
+void
+fopdt_init(fopdt_plant_t* p, float gain, float tau, float dead_time, float ambient, float step)
+{
+  uint32_t i;
+
+  p->gain = gain;
+  p->tau = tau;
+  p->dead_time = dead_time;
+  p->ambient = ambient;
+  p->temp = ambient;
+  p->step = step;
+  p->delay_len = MAX((uint32_t)((dead_time / step) + 0.5f), 1);
+  p->delay_idx = 0;
+  p->delay_line = malloc(p->delay_len * sizeof(float));
+
+  for (i = 0; i < p->delay_len; ++i)
+    p->delay_line[i] = 0;
+}
+
+void
+fopdt_free(fopdt_plant_t* p)
+{
+  free(p->delay_line);
+  p->delay_line = NULL;
+}
+
+float
+fopdt_step(fopdt_plant_t* p, float drive)
+{
+  /* The oldest entry is the drive applied one dead time ago */
+  float delayed = p->delay_line[p->delay_idx];
+  p->delay_line[p->delay_idx] = drive;
+  p->delay_idx = (p->delay_idx + 1) % p->delay_len;
+
+  float target = p->ambient + (p->gain * delayed);
+  p->temp += (target - p->temp) * (1 - expf(-p->step / p->tau));
+
+  return p->temp;
+}
+
+void
+fopdt_ultimate(const fopdt_plant_t* p, float* ku, float* tu)
+{
+  /* Find the frequency where the phase lag of exp(-Ls)/(1 + tau s) reaches
+   * 180 degrees by bisection.
+   */
+  double lo = 0;
+  double hi = M_PI / p->dead_time;
+  int i;
+
+  for (i = 0; i < 100; ++i) {
+    double w = (lo + hi) / 2;
+    double phase = (w * p->dead_time) + atan(w * p->tau);
+
+    if (phase < M_PI)
+      lo = w;
+    else
+      hi = w;
+  }
+
+  double w = (lo + hi) / 2;
+  *ku = sqrt(1 + (w * p->tau) * (w * p->tau)) / p->gain;
+  *tu = 2 * M_PI / w;
+}
+
+void
+fopdt_relay_cycle(const fopdt_plant_t* p, float on_at, float off_at, float* period, float* amplitude)
+{
+  double dead_time = p->delay_len * p->step;
+  double coast = exp(-dead_time / p->tau);
+  double full_on = p->ambient + p->gain;
+  double full_off = p->ambient;
+
+  /* After each switch the plant keeps heading for the old target for one
+   * dead time before turning around.
+   */
+  double low = full_off + ((on_at - full_off) * coast);
+  double high = full_on + ((off_at - full_on) * coast);
+  double rise = p->tau * log((full_on - low) / (full_on - off_at));
+  double fall = p->tau * log((full_off - high) / (full_off - on_at));
+
+  *period = (2 * dead_time) + rise + fall;
+  *amplitude = fabs(high - low) / 2;
+}
@@ -0,0 +1,47 @@
+/* First order plus dead time model of a thermal plant, such as a fermenter
+ * heated or cooled through a relay.
+ */
+#ifndef FOPDT_PLANT_H
+#define FOPDT_PLANT_H
+
+#include <stdint.h>
+
+
+typedef struct {
+  /* Steady state rise over ambient at full drive, in degrees */
+  float gain;
+  /* Time constant and dead time, in seconds */
+  float tau;
+  float dead_time;
+  float ambient;
+  float temp;
+
+  /* Drive history covering the dead time */
+  float* delay_line;
+  uint32_t delay_len;
+  uint32_t delay_idx;
+  float step;
+} fopdt_plant_t;
+
+
+void
+fopdt_init(fopdt_plant_t* p, float gain, float tau, float dead_time, float ambient, float step);
+
+void
+fopdt_free(fopdt_plant_t* p);
+
+/* Advances the plant by one step with a drive between 0 and 1 */
+float
+fopdt_step(fopdt_plant_t* p, float drive);
+
+/* Ultimate gain (per unit of drive) and period (seconds) of the model */
+void
+fopdt_ultimate(const fopdt_plant_t* p, float* ku, float* tu);
+
+/* Exact period and amplitude of the limit cycle an on/off relay settles
+ * into when it switches fully on at on_at and fully off at off_at.
+ */
+void
+fopdt_relay_cycle(const fopdt_plant_t* p, float on_at, float off_at, float* period, float* amplitude);
+
+#endif
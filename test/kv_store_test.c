@@ -0,0 +1,274 @@
+/* Runs the KV store against simulated NOR flash, cutting writes short at
+ * every point of a commit and of a compaction to check that a reboot always
+ * finds either the old or the new value.
+ */
+#include "test.h"
+#include "sxfs_sim.h"
+#include "kv_store.h"
+
+#include <string.h>
+
+
+#define NUM_KEYS   4
+#define VALUE_SIZE 1000
+
+#define KEY(k) KV_KEY(KV_NS_COUNTER, (k) + 1)
+
+
+static uint8_t value_buf[KV_MAX_VALUE_SIZE];
+
+
+static void
+reboot(void)
+{
+  sxfs_sim_set_write_budget(SXFS_SIM_UNLIMITED);
+  kv_store_init();
+}
+
+static void
+format(void)
+{
+  sxfs_sim_reset();
+  kv_store_init();
+}
+
+static bool
+value_is(uint32_t key, const void* data, uint32_t len)
+{
+  uint32_t value_len = 0;
+
+  if (!kv_get(key, value_buf, sizeof(value_buf), &value_len))
+    return false;
+
+  return (value_len == len) && (memcmp(value_buf, data, len) == 0);
+}
+
+static void
+fill_value(uint8_t* value, uint32_t key, uint32_t round)
+{
+  uint32_t i;
+
+  for (i = 0; i < VALUE_SIZE; ++i)
+    value[i] = (uint8_t)((key * 31) + round + i);
+  memcpy(value, &round, sizeof(round));
+}
+
+static void
+test_round_trip(void)
+{
+  const char a[] = "first value";
+  const char b[] = "odd";
+
+  format();
+
+  CHECK(kv_put(KEY(0), a, sizeof(a)));
+  CHECK(kv_put(KEY(1), b, sizeof(b)));
+  CHECK(value_is(KEY(0), a, sizeof(a)));
+  CHECK(value_is(KEY(1), b, sizeof(b)));
+
+  reboot();
+  CHECK(value_is(KEY(0), a, sizeof(a)));
+  CHECK(value_is(KEY(1), b, sizeof(b)));
+
+  CHECK(kv_delete(KEY(1)));
+  reboot();
+  CHECK(value_is(KEY(0), a, sizeof(a)));
+  CHECK(!kv_get(KEY(1), value_buf, sizeof(value_buf), NULL));
+}
+
+static void
+test_unchanged_put(void)
+{
+  uint8_t value[VALUE_SIZE];
+  uint32_t written;
+
+  format();
+
+  fill_value(value, 0, 1);
+  CHECK(kv_put(KEY(0), value, sizeof(value)));
+
+  written = sxfs_sim_bytes_written();
+  CHECK(kv_put(KEY(0), value, sizeof(value)));
+  CHECK(sxfs_sim_bytes_written() == written);
+
+  /* Same length, last byte differs */
+  value[VALUE_SIZE - 1] ^= 1;
+  CHECK(kv_put(KEY(0), value, sizeof(value)));
+  CHECK(sxfs_sim_bytes_written() > written);
+  CHECK(value_is(KEY(0), value, sizeof(value)));
+
+  /* A prefix of the stored value is a change */
+  written = sxfs_sim_bytes_written();
+  CHECK(kv_put(KEY(0), value, sizeof(value) - 1));
+  CHECK(sxfs_sim_bytes_written() > written);
+  CHECK(value_is(KEY(0), value, sizeof(value) - 1));
+}
+
+static void
+test_torn_commit(void)
+{
+  const char old_value[] = "old value";
+  const char new_value[] = "new value!";
+  const char next_value[] = "next";
+  const char other[] = "other key";
+  uint32_t commit_size;
+  uint32_t budget;
+
+  format();
+  kv_put(KEY(1), other, sizeof(other));
+  kv_put(KEY(0), old_value, sizeof(old_value));
+  commit_size = sxfs_sim_bytes_written();
+  kv_put(KEY(0), new_value, sizeof(new_value));
+  commit_size = sxfs_sim_bytes_written() - commit_size;
+
+  for (budget = 0; budget <= commit_size; ++budget) {
+    int failures = test_failures;
+
+    format();
+    kv_put(KEY(1), other, sizeof(other));
+    kv_put(KEY(0), old_value, sizeof(old_value));
+
+    sxfs_sim_set_write_budget(budget);
+    bool committed = kv_put(KEY(0), new_value, sizeof(new_value));
+    CHECK(committed == (budget == commit_size));
+
+    reboot();
+    if (committed)
+      CHECK(value_is(KEY(0), new_value, sizeof(new_value)));
+    else
+      CHECK(value_is(KEY(0), old_value, sizeof(old_value)));
+    CHECK(value_is(KEY(1), other, sizeof(other)));
+
+    /* The store keeps working after recovering */
+    CHECK(kv_put(KEY(0), next_value, sizeof(next_value)));
+    reboot();
+    CHECK(value_is(KEY(0), next_value, sizeof(next_value)));
+    CHECK(value_is(KEY(1), other, sizeof(other)));
+
+    if (test_failures != failures)
+      printf("  torn commit after %u of %u bytes\n", (unsigned)budget, (unsigned)commit_size);
+  }
+}
+
+/* Updates the keys in turn until a put compacts the store. Returns the
+ * number of puts before that one.
+ */
+static uint32_t
+fill_until_compaction(uint32_t max_puts, uint32_t* rounds)
+{
+  uint8_t value[VALUE_SIZE];
+  kv_store_stats_t stats;
+  uint32_t i;
+
+  kv_store_get_stats(&stats);
+  uint32_t generation = stats.generation;
+
+  for (i = 0; i < max_puts; ++i) {
+    uint32_t key = i % NUM_KEYS;
+
+    fill_value(value, key, i);
+    if (!kv_put(KEY(key), value, sizeof(value)))
+      break;
+    rounds[key] = i;
+
+    kv_store_get_stats(&stats);
+    if (stats.generation != generation)
+      break;
+  }
+
+  return i;
+}
+
+static void
+check_rounds(const uint32_t* rounds)
+{
+  uint8_t value[VALUE_SIZE];
+  uint32_t key;
+
+  for (key = 0; key < NUM_KEYS; ++key) {
+    fill_value(value, key, rounds[key]);
+    CHECK(value_is(KEY(key), value, sizeof(value)));
+  }
+}
+
+static void
+test_compaction(void)
+{
+  uint32_t rounds[NUM_KEYS];
+  kv_store_stats_t stats;
+
+  format();
+
+  uint32_t puts = fill_until_compaction(1000, rounds);
+  CHECK(puts < 1000);
+
+  kv_store_get_stats(&stats);
+  CHECK(stats.generation == 2);
+  CHECK(stats.num_keys == NUM_KEYS);
+  CHECK(stats.used_bytes < (NUM_KEYS + 1) * 2 * VALUE_SIZE);
+  check_rounds(rounds);
+
+  reboot();
+  kv_store_get_stats(&stats);
+  CHECK(stats.generation == 2);
+  check_rounds(rounds);
+}
+
+static void
+test_torn_compaction(void)
+{
+  uint32_t rounds[NUM_KEYS];
+  uint32_t expected[NUM_KEYS];
+  uint8_t value[VALUE_SIZE];
+  uint32_t compaction_size;
+  uint32_t budget;
+
+  /* Dry run to find the put that compacts, and how much it writes */
+  format();
+  uint32_t puts = fill_until_compaction(1000, rounds);
+  format();
+  fill_until_compaction(puts, rounds);
+  compaction_size = sxfs_sim_bytes_written();
+  fill_value(value, puts % NUM_KEYS, puts);
+  kv_put(KEY(puts % NUM_KEYS), value, sizeof(value));
+  compaction_size = sxfs_sim_bytes_written() - compaction_size;
+
+  for (budget = 0; budget <= compaction_size; budget += 7) {
+    int failures = test_failures;
+    uint32_t key = puts % NUM_KEYS;
+
+    format();
+    fill_until_compaction(puts, rounds);
+    memcpy(expected, rounds, sizeof(expected));
+
+    fill_value(value, key, puts);
+    sxfs_sim_set_write_budget(budget);
+    if (kv_put(KEY(key), value, sizeof(value)))
+      expected[key] = puts;
+
+    reboot();
+    check_rounds(expected);
+
+    /* Keeps working, and a second reboot agrees */
+    fill_value(value, key, puts + 1);
+    CHECK(kv_put(KEY(key), value, sizeof(value)));
+    expected[key] = puts + 1;
+    reboot();
+    check_rounds(expected);
+
+    if (test_failures != failures)
+      printf("  torn compaction after %u of %u bytes\n", (unsigned)budget, (unsigned)compaction_size);
+  }
+}
+
+int
+main(void)
+{
+  test_round_trip();
+  test_unchanged_put();
+  test_torn_commit();
+  test_compaction();
+  test_torn_compaction();
+
+  return test_result("kv_store_test");
+}
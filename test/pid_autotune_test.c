@@ -0,0 +1,152 @@
+/* Runs the relay feedback autotune from pid.c against simulated first order
+ * plus dead time plants, then checks the gains it finds against the models
+ * and closes the loop with them.
+ */
+#include "test.h"
+#include "fopdt_plant.h"
+#include "pid.h"
+#include "common.h"
+
+
+/* Seconds between probe samples */
+#define SAMPLE_PERIOD 1
+
+/* PID output span used by temp_control, where 0..OUT_MAX is the duty cycle */
+#define OUT_MAX 20
+
+#define NOISE_BAND 0.2f
+
+typedef struct {
+  const char* name;
+  float gain;
+  float tau;
+  float dead_time;
+  float ambient;
+  float setpoint;
+  uint8_t direction;
+} plant_case_t;
+
+
+static const plant_case_t cases[] = {
+  /* Heat wrapped fermenter in a cool room */
+  { "heating", 30, 1800, 120, 60, 68, POSITIVE },
+  /* Fermentation chamber in a fridge, with a short compressor lag */
+  { "cooling", -40, 900, 60, 70, 50, NEGATIVE },
+  /* Small, fast plant where the dead time dominates less */
+  { "fast", 20, 300, 20, 65, 75, POSITIVE },
+};
+
+
+static float
+drive_from_output(float out)
+{
+  return LIMIT(out, 0, OUT_MAX) / OUT_MAX;
+}
+
+static void
+run_case(const plant_case_t* c)
+{
+  fopdt_plant_t plant;
+  pid_autotune_t at;
+  pid_gains_t gains;
+  float model_ku;
+  float model_tu;
+  float cycle_period;
+  float cycle_amplitude;
+  float temp = c->setpoint;
+  uint32_t t;
+
+  printf("  %s plant: gain %.0f tau %.0f s dead time %.0f s\n",
+      c->name, c->gain, c->tau, c->dead_time);
+
+  fopdt_init(&plant, c->gain, c->tau, c->dead_time, c->ambient, SAMPLE_PERIOD);
+  fopdt_ultimate(&plant, &model_ku, &model_tu);
+  model_ku = fabsf(model_ku) * OUT_MAX;
+
+  if (c->direction == POSITIVE)
+    fopdt_relay_cycle(&plant, c->setpoint - NOISE_BAND, c->setpoint + NOISE_BAND,
+        &cycle_period, &cycle_amplitude);
+  else
+    fopdt_relay_cycle(&plant, c->setpoint + NOISE_BAND, c->setpoint - NOISE_BAND,
+        &cycle_period, &cycle_amplitude);
+
+  /* Settle the plant at the setpoint before the test starts */
+  float hold = (c->setpoint - c->ambient) / c->gain;
+  for (t = 0; t < 10 * c->tau; ++t)
+    temp = fopdt_step(&plant, hold);
+
+  test_time = 0;
+  pid_autotune_start(&at, c->setpoint, NOISE_BAND, OUT_MAX / 2, c->direction);
+
+  for (t = 0; t < 48 * 60 * 60 && at.state == AUTOTUNE_RUNNING; t += SAMPLE_PERIOD) {
+    bool relay_on = pid_autotune_exec(&at, temp);
+    temp = fopdt_step(&plant, relay_on ? 1 : 0);
+    test_time += S2ST(SAMPLE_PERIOD);
+  }
+
+  CHECK(at.state == AUTOTUNE_DONE);
+  CHECK(pid_autotune_get_gains(&at, &gains));
+
+  printf("    Ku %.2f Tu %.0f s after %u s, model Ku %.2f Tu %.0f s\n",
+      at.ku, at.tu, (unsigned)t, model_ku, model_tu);
+
+  /* The measured oscillation has to match the limit cycle the relay drives
+   * the plant into, give or take a sample at each switch.
+   */
+  float cycle_ku = (4 * (OUT_MAX / 2)) /
+      (M_PI * sqrtf((cycle_amplitude * cycle_amplitude) - (NOISE_BAND * NOISE_BAND)));
+  CHECK_NEAR(at.tu, cycle_period, 2 * SAMPLE_PERIOD + 0.01 * cycle_period);
+  CHECK_NEAR(at.ku, cycle_ku, 0.03 * cycle_ku);
+
+  /* The describing function reads the ultimate point off that cycle. On lag
+   * dominant plants it lands on the safe side, with a lower gain and longer
+   * period than the model's.
+   */
+  CHECK(at.ku > 0.4f * model_ku && at.ku < 1.1f * model_ku);
+  CHECK(at.tu > 0.9f * model_tu && at.tu < 2.2f * model_tu);
+
+  /* Close the loop with the tuned gains from a few degrees off setpoint */
+  pid_controller_t pid;
+  float start = c->setpoint - (c->direction == POSITIVE ? 4 : -4);
+  float overshoot = 0;
+  float settled_err = 0;
+  uint32_t duration = 20 * c->tau;
+
+  plant.temp = start;
+  test_time = 0;
+  pid_init(&pid);
+  pid_set_output_limits(&pid, -OUT_MAX, OUT_MAX);
+  pid_set_output_sign(&pid, c->direction);
+  pid_set_gains(&pid, gains.kp, gains.ki, gains.kd);
+  pid_enable(&pid, start, true);
+
+  temp = start;
+  for (t = 0; t < duration; t += SAMPLE_PERIOD) {
+    pid_exec(&pid, c->setpoint, temp);
+    temp = fopdt_step(&plant, drive_from_output(pid.out));
+    test_time += S2ST(SAMPLE_PERIOD);
+
+    float past = (c->direction == POSITIVE) ? temp - c->setpoint : c->setpoint - temp;
+    overshoot = MAX(overshoot, past);
+    if (t >= duration - c->tau)
+      settled_err = MAX(settled_err, fabsf(temp - c->setpoint));
+  }
+
+  printf("    closed loop overshoot %.3f settled error %.3f\n", overshoot, settled_err);
+
+  CHECK(overshoot < 2.0f);
+  CHECK(settled_err < 0.25f);
+
+  fopdt_free(&plant);
+}
+
+int
+main(void)
+{
+  uint32_t i;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    run_case(&cases[i]);
+
+  return test_result("pid_autotune_test");
+}
@@ -0,0 +1,253 @@
+/* One suite run against both PID kernels. The Makefile builds it once with
+ * PID_FIXED_POINT=FALSE and once with TRUE, so the Q16.16 kernel is held to
+ * the same expectations as the float one.
+ */
+#include "test.h"
+#include "pid.h"
+#include "common.h"
+
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+#if PID_FIXED_POINT
+#define KERNEL "fixed"
+/* A few Q16.16 LSBs of rounding on each term */
+#define TOL 0.001
+#else
+#define KERNEL "float"
+#define TOL 0.00001
+#endif
+
+/* pid_init() runs the loop every 2 s */
+#define PERIOD S2ST(2)
+
+#define BENCH_CALLS 1000000
+
+
+static void
+setup(pid_controller_t* pid, float kp, float ki, float kd, float sample)
+{
+  test_time = 0;
+  pid_init(pid);
+  pid_set_output_limits(pid, -20, 20);
+  pid_set_gains(pid, kp, ki, kd);
+  pid_enable(pid, sample, true);
+}
+
+static void
+step(pid_controller_t* pid, float setpoint, float sample)
+{
+  test_time += PERIOD;
+  pid_exec(pid, setpoint, sample);
+}
+
+static void
+test_proportional(void)
+{
+  pid_controller_t pid;
+
+  setup(&pid, 2, 0, 0, 60);
+  step(&pid, 65, 60);
+  CHECK_NEAR(pid.out, 10, TOL);
+
+  step(&pid, 65, 66.5);
+  CHECK_NEAR(pid.out, -3, TOL);
+
+  /* Saturates at the output limits */
+  step(&pid, 65, 40);
+  CHECK_NEAR(pid.out, 20, TOL);
+  step(&pid, 65, 90);
+  CHECK_NEAR(pid.out, -20, TOL);
+}
+
+static void
+test_integral(void)
+{
+  pid_controller_t pid;
+  int i;
+
+  /* Ki is per second, so each 2 s step adds 2 * 0.25 * err */
+  setup(&pid, 0, 0.25, 0, 60);
+  for (i = 1; i <= 4; ++i) {
+    step(&pid, 61, 60);
+    CHECK_NEAR(pid.out, 0.5 * i, TOL);
+  }
+
+  /* The integral winds up no further than the output limit */
+  for (i = 0; i < 100; ++i)
+    step(&pid, 80, 60);
+  CHECK_NEAR(pid.out, 20, TOL);
+  step(&pid, 60, 61);
+  CHECK_NEAR(pid.out, 19.5, TOL);
+
+  /* Reinit clears it */
+  pid_reinit(&pid, 60);
+  step(&pid, 60, 60);
+  CHECK_NEAR(pid.out, 0, TOL);
+}
+
+static void
+test_derivative(void)
+{
+  pid_controller_t pid;
+
+  /* Derivative on measurement, Kd is in seconds */
+  setup(&pid, 0, 0, 4, 60);
+  step(&pid, 60, 60.5);
+  CHECK_NEAR(pid.out, -1, TOL);
+
+  /* A setpoint change alone does not kick the output */
+  step(&pid, 70, 60.5);
+  CHECK_NEAR(pid.out, 0, TOL);
+}
+
+static void
+test_negative(void)
+{
+  pid_controller_t pid;
+
+  setup(&pid, 2, 0.25, 0, 60);
+  pid_set_output_sign(&pid, NEGATIVE);
+  step(&pid, 60, 61);
+  CHECK_NEAR(pid.out, 2 + 0.5, TOL);
+
+  /* Setting the same sign again leaves the gains alone */
+  pid_set_output_sign(&pid, NEGATIVE);
+  step(&pid, 60, 61);
+  CHECK_NEAR(pid.out, 2 + 1.0, TOL);
+}
+
+static void
+test_sample_time(void)
+{
+  pid_controller_t pid;
+
+  setup(&pid, 2, 0, 0, 60);
+  step(&pid, 65, 60);
+  CHECK_NEAR(pid.out, 10, TOL);
+
+  /* Calls between periods leave the output alone */
+  test_time += PERIOD / 2;
+  pid_exec(&pid, 65, 64);
+  CHECK_NEAR(pid.out, 10, TOL);
+
+  test_time += PERIOD / 2;
+  pid_exec(&pid, 65, 64);
+  CHECK_NEAR(pid.out, 2, TOL);
+
+  /* Disabled controllers do nothing */
+  pid_enable(&pid, 64, false);
+  step(&pid, 65, 50);
+  CHECK_NEAR(pid.out, 2, TOL);
+}
+
+static void
+test_limits(void)
+{
+  pid_controller_t pid;
+  int i;
+
+  setup(&pid, 0, 1, 0, 60);
+  for (i = 0; i < 20; ++i)
+    step(&pid, 70, 60);
+  CHECK_NEAR(pid.out, 20, TOL);
+
+  /* Tightening the limits clamps both the output and the integral */
+  pid_set_output_limits(&pid, -5, 5);
+  CHECK_NEAR(pid.out, 5, TOL);
+  step(&pid, 60, 61);
+  CHECK_NEAR(pid.out, 3, TOL);
+}
+
+/* Reference loop worked in double precision */
+typedef struct {
+  double kp, ki, kd;
+  double err_i;
+  double last_sample;
+} ref_pid_t;
+
+static double
+ref_exec(ref_pid_t* ref, double setpoint, double sample)
+{
+  double err_p = setpoint - sample;
+
+  ref->err_i = LIMIT(ref->err_i + (ref->ki * err_p), -20.0, 20.0);
+
+  double out = (ref->kp * err_p) + ref->err_i - (ref->kd * (sample - ref->last_sample));
+  ref->last_sample = sample;
+
+  return LIMIT(out, -20.0, 20.0);
+}
+
+static void
+test_against_reference(void)
+{
+  pid_controller_t pid;
+  ref_pid_t ref = { 4, 0.02 * 2, 30.0 / 2, 0, 62 };
+  double max_err = 0;
+  int i;
+
+  /* A noisy, drifting sample train that crosses the setpoint */
+  srand(1234);
+  setup(&pid, 4, 0.02, 30, 62);
+  for (i = 0; i < 5000; ++i) {
+    double sample = 65 + 4 * sin(i / 300.0) + ((rand() % 1000) - 500) / 2000.0;
+    double setpoint = (i < 2500) ? 65 : 66.25;
+
+    step(&pid, setpoint, sample);
+    double expected = ref_exec(&ref, (float)setpoint, (float)sample);
+    max_err = MAX(max_err, fabs(pid.out - expected));
+  }
+
+  printf("  %s kernel max error against reference: %g\n", KERNEL, max_err);
+  CHECK(max_err < 20 * TOL);
+}
+
+static void
+bench(void)
+{
+  pid_controller_t pid;
+  struct timespec start, end;
+  int i;
+
+  setup(&pid, 4, 0.02, 30, 62);
+
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t cycles = __rdtsc();
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < BENCH_CALLS; ++i) {
+    test_time += PERIOD;
+    pid_exec(&pid, 65, 62 + (i & 0xFF) / 64.0f);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_CALLS;
+#if defined(__x86_64__) || defined(__i386__)
+  printf("  %s kernel on host: %.1f ns, %.0f TSC cycles per call\n",
+      KERNEL, ns, (double)(__rdtsc() - cycles) / BENCH_CALLS);
+#else
+  printf("  %s kernel on host: %.1f ns per call\n", KERNEL, ns);
+#endif
+}
+
+int
+main(void)
+{
+  test_proportional();
+  test_integral();
+  test_derivative();
+  test_negative();
+  test_sample_time();
+  test_limits();
+  test_against_reference();
+  bench();
+
+  return test_result("pid_kernel_test (" KERNEL ")");
+}
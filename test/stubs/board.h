@@ -0,0 +1,19 @@
+/* Host stand-in for the II-MT-CONTROLLER board definition */
+#ifndef BOARD_H
+#define BOARD_H
+
+#define BOARD_NUM_SENSOR_CHANNELS 2
+#define BOARD_NUM_RELAY_CHANNELS  2
+
+#define PORT_WIFI_EN   GPIOC
+#define PAD_WIFI_EN    8
+
+#define PORT_WIFI_IRQ  GPIOD
+#define PAD_WIFI_IRQ   12
+
+#define PORT_WIFI_CS   GPIOB
+#define PAD_WIFI_CS    12
+
+#define SPI_WLAN  (&SPID2)
+
+#endif
@@ -0,0 +1,139 @@
+/* Host stand-in for the parts of the ChibiOS kernel API used by the modules
+ * under test. Time only moves when a test advances test_time.
+ */
+#ifndef CH_H
+#define CH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define TRUE  1
+#define FALSE 0
+
+#define CH_FREQUENCY 1000
+
+#define S2ST(sec)   ((systime_t)((sec) * CH_FREQUENCY))
+#define MS2ST(msec) ((systime_t)((((msec) * CH_FREQUENCY) + 999) / 1000))
+
+#define RDY_OK      0
+#define RDY_TIMEOUT -1
+#define RDY_RESET   -2
+
+#define NORMALPRIO 64
+
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef bool bool_t;
+
+typedef struct {
+  int owner;
+} Mutex;
+
+typedef struct {
+  int32_t cnt;
+} Semaphore;
+
+typedef struct Thread Thread;
+
+typedef msg_t (*tfunc_t)(void*);
+
+
+extern systime_t test_time;
+
+static inline systime_t
+chTimeNow(void)
+{
+  return test_time;
+}
+
+static inline void
+chMtxInit(Mutex* mp)
+{
+  mp->owner = 0;
+}
+
+static inline void
+chMtxLock(Mutex* mp)
+{
+  mp->owner = 1;
+}
+
+static inline Mutex*
+chMtxUnlock(void)
+{
+  return NULL;
+}
+
+static inline void
+chThdSleepMilliseconds(uint32_t msec)
+{
+  test_time += MS2ST(msec);
+}
+
+static inline void
+chThdSleepMicroseconds(uint32_t usec)
+{
+  (void)usec;
+}
+
+static inline void
+chRegSetThreadName(const char* name)
+{
+  (void)name;
+}
+
+static inline void
+chSysLockFromIsr(void)
+{
+}
+
+static inline void
+chSysUnlockFromIsr(void)
+{
+}
+
+static inline void
+chSemInit(Semaphore* sp, int32_t n)
+{
+  sp->cnt = n;
+}
+
+static inline void
+chSemSignal(Semaphore* sp)
+{
+  sp->cnt++;
+}
+
+static inline void
+chSemSignalI(Semaphore* sp)
+{
+  sp->cnt++;
+}
+
+/* Blocking calls and threads have no host equivalent. Tests that need them
+ * supply these along with whatever stands in for the other side.
+ */
+msg_t
+chSemWait(Semaphore* sp);
+
+msg_t
+chSemWaitTimeout(Semaphore* sp, systime_t time);
+
+msg_t
+chSemSignalWait(Semaphore* sps, Semaphore* spw);
+
+Thread*
+chThdCreateFromHeap(void* heapp, size_t size, int prio, tfunc_t pf, void* arg);
+
+void
+chThdTerminate(Thread* tp);
+
+msg_t
+chThdWait(Thread* tp);
+
+bool
+chThdShouldTerminate(void);
+
+#endif
@@ -0,0 +1,89 @@
+/* Host stand-in for the HAL types pulled in through shared headers */
+#ifndef HAL_H
+#define HAL_H
+
+#include "ch.h"
+#include "board.h"
+
+
+typedef struct {
+  int unused;
+} SerialDriver;
+
+typedef void* ioportid_t;
+
+#define GPIOB ((ioportid_t)2)
+#define GPIOC ((ioportid_t)3)
+#define GPIOD ((ioportid_t)4)
+
+typedef uint32_t halrtcnt_t;
+
+#define US2RTT(usec) ((halrtcnt_t)(usec))
+
+#define SPI_CR1_CPHA 0x0001
+
+typedef struct SPIDriver SPIDriver;
+
+typedef struct {
+  void (*end_cb)(SPIDriver* spip);
+  ioportid_t ssport;
+  uint16_t sspad;
+  uint16_t cr1;
+} SPIConfig;
+
+struct SPIDriver {
+  const SPIConfig* config;
+};
+
+#define EXT_STOP   1
+#define EXT_ACTIVE 2
+
+#define EXT_MAX_CHANNELS         23
+#define EXT_CH_MODE_FALLING_EDGE 0x02
+#define EXT_MODE_GPIOD           0x30
+
+typedef uint32_t expchannel_t;
+
+typedef struct EXTDriver EXTDriver;
+
+typedef void (*extcallback_t)(EXTDriver* extp, expchannel_t channel);
+
+typedef struct {
+  uint32_t mode;
+  extcallback_t cb;
+} EXTChannelConfig;
+
+typedef struct {
+  EXTChannelConfig channels[EXT_MAX_CHANNELS];
+} EXTConfig;
+
+struct EXTDriver {
+  int state;
+  const EXTConfig* config;
+};
+
+extern SPIDriver SPID2;
+extern EXTDriver EXTD1;
+
+/* Like the kernel calls in ch.h, these are supplied by the tests that use
+ * them, usually by a simulation of the device on the other end.
+ */
+void spiStart(SPIDriver* spip, const SPIConfig* config);
+void spiSelect(SPIDriver* spip);
+void spiUnselect(SPIDriver* spip);
+void spiExchange(SPIDriver* spip, size_t n, const void* txbuf, void* rxbuf);
+void spiSend(SPIDriver* spip, size_t n, const void* txbuf);
+void spiReceive(SPIDriver* spip, size_t n, void* rxbuf);
+void spiIgnore(SPIDriver* spip, size_t n);
+
+void extStart(EXTDriver* extp, const EXTConfig* config);
+void extChannelEnable(EXTDriver* extp, expchannel_t channel);
+void extChannelDisable(EXTDriver* extp, expchannel_t channel);
+
+uint8_t palReadPad(ioportid_t port, uint16_t pad);
+void palSetPad(ioportid_t port, uint16_t pad);
+void palClearPad(ioportid_t port, uint16_t pad);
+
+halrtcnt_t halGetCounterValue(void);
+
+#endif
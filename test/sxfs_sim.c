@@ -0,0 +1,152 @@
+#include "sxfs_sim.h"
+#include "crc/crc32.h"
+
+#include <string.h>
+
+
+static uint8_t flash[NUM_SXFS_PARTS][SXFS_SIM_PART_SIZE];
+static int32_t write_budget = SXFS_SIM_UNLIMITED;
+static uint32_t bytes_written;
+
+
+void
+sxfs_sim_reset()
+{
+  memset(flash, 0xFF, sizeof(flash));
+  write_budget = SXFS_SIM_UNLIMITED;
+  bytes_written = 0;
+}
+
+void
+sxfs_sim_set_write_budget(int32_t bytes)
+{
+  write_budget = bytes;
+}
+
+uint32_t
+sxfs_sim_bytes_written()
+{
+  return bytes_written;
+}
+
+static bool
+valid_range(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  return (part_id < NUM_SXFS_PARTS) && ((offset + len) <= SXFS_SIM_PART_SIZE);
+}
+
+bool
+sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  uint32_t i;
+
+  if (!valid_range(part_id, offset, data_len))
+    return false;
+
+  for (i = 0; i < data_len; ++i) {
+    if (write_budget == 0)
+      return false;
+
+    if (write_budget > 0)
+      write_budget--;
+
+    flash[part_id][offset + i] &= data[i];
+    bytes_written++;
+  }
+
+  return true;
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (!valid_range(part_id, offset, data_len))
+    return false;
+
+  memcpy(data, &flash[part_id][offset], data_len);
+  return true;
+}
+
+bool
+sxfs_read_stream(sxfs_part_id_t part_id, uint32_t offset, uint32_t len,
+    xflash_read_cb_t cb, void* arg)
+{
+  /* Small chunks so callers see a value split across callbacks */
+  const uint32_t chunk_size = 64;
+
+  if (!valid_range(part_id, offset, len))
+    return false;
+
+  while (len > 0) {
+    uint32_t chunk_len = (len < chunk_size) ? len : chunk_size;
+
+    if (!cb(&flash[part_id][offset], chunk_len, arg))
+      return false;
+
+    offset += chunk_len;
+    len -= chunk_len;
+  }
+
+  return true;
+}
+
+uint32_t
+sxfs_erase_size(sxfs_part_id_t part_id, uint32_t offset)
+{
+  return XFLASH_PARAM_SECTOR_SIZE;
+}
+
+bool
+sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  if (!valid_range(part_id, offset, len))
+    return false;
+
+  memset(&flash[part_id][offset], 0xFF, len);
+  return true;
+}
+
+bool
+sxfs_erase_all(sxfs_part_id_t part_id)
+{
+  return sxfs_erase(part_id, 0, SXFS_SIM_PART_SIZE);
+}
+
+bool
+sxfs_erase_async(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  return sxfs_erase(part_id, offset, len);
+}
+
+bool
+sxfs_erase_all_async(sxfs_part_id_t part_id)
+{
+  return sxfs_erase_all(part_id);
+}
+
+bool
+sxfs_is_erased(sxfs_part_id_t part_id, uint32_t offset, uint32_t data_len)
+{
+  uint32_t i;
+
+  if (!valid_range(part_id, offset, data_len))
+    return false;
+
+  for (i = 0; i < data_len; ++i) {
+    if (flash[part_id][offset + i] != 0xFF)
+      return false;
+  }
+
+  return true;
+}
+
+bool
+sxfs_crc(sxfs_part_id_t part_id, uint32_t offset, uint32_t size, uint32_t* crc)
+{
+  if (crc == NULL || !valid_range(part_id, offset, size))
+    return false;
+
+  /* Seeded the same way as xflash_crc() */
+  *crc = crc32_block(0xFFFFFFFF, &flash[part_id][offset], size);
+  return true;
+}
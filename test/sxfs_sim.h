@@ -0,0 +1,30 @@
+/* In-memory stand-in for sxfs with NOR flash semantics. Programming can
+ * only clear bits, and a write budget cuts writes short to model power
+ * being lost part way through.
+ */
+#ifndef SXFS_SIM_H
+#define SXFS_SIM_H
+
+#include "sxfs.h"
+
+
+/* Every simulated partition is this big, which covers the ones under test */
+#define SXFS_SIM_PART_SIZE 0x20000
+
+#define SXFS_SIM_UNLIMITED (-1)
+
+
+/* Erases every partition and clears the budget and counters */
+void
+sxfs_sim_reset(void);
+
+/* Allows this many more bytes to be programmed. The write that runs out is
+ * applied up to the limit and fails, as does every write after it.
+ */
+void
+sxfs_sim_set_write_budget(int32_t bytes);
+
+uint32_t
+sxfs_sim_bytes_written(void);
+
+#endif
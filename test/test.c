@@ -0,0 +1,26 @@
+#include "test.h"
+#include "ch.h"
+
+
+systime_t test_time;
+int test_failures;
+
+
+int
+test_result(const char* name)
+{
+  if (test_failures > 0) {
+    printf("%s: %d check(s) failed\n", name, test_failures);
+    return 1;
+  }
+
+  printf("%s: passed\n", name);
+  return 0;
+}
+
+int
+test_quiet_printf(const char* fmt, ...)
+{
+  (void)fmt;
+  return 0;
+}
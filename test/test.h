@@ -0,0 +1,37 @@
+/* Minimal assertion helpers shared by the host tests */
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <math.h>
+
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_NEAR(actual, expected, tol) \
+  do { \
+    double a_ = (actual); \
+    double e_ = (expected); \
+    if (fabs(a_ - e_) > (tol)) { \
+      printf("%s:%d: %s = %f, expected %f +/- %f\n", \
+          __FILE__, __LINE__, #actual, a_, e_, (double)(tol)); \
+      test_failures++; \
+    } \
+  } while (0)
+
+extern int test_failures;
+
+int
+test_result(const char* name);
+
+/* Swallows the console output of modules built with -Dprintf=test_quiet_printf */
+int
+test_quiet_printf(const char* fmt, ...);
+
+#endif